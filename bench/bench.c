@@ -0,0 +1,82 @@
+/*
+ * drbd-bench: userspace microbenchmarks for DRBD's core data structures.
+ *
+ * usage: drbd-bench [-q] [-b <name>]...
+ *   -q		quick run with fewer iterations
+ *   -b <name>	only run benchmarks whose name starts with <name>
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+bool bench_quick;
+
+static const struct bench benches[] = {
+	{ "lru", bench_lru },
+	{ "interval", bench_interval },
+	{ "vli", bench_vli },
+};
+
+void bench_report(const char *name, uint64_t ops, uint64_t ns,
+		  const char *extra_fmt, ...)
+{
+	va_list ap;
+
+	printf("{\"bench\":\"%s\",\"ops\":%llu,\"ns\":%llu,\"ns_per_op\":%.2f",
+	       name, (unsigned long long)ops, (unsigned long long)ns,
+	       ops ? (double)ns / ops : 0.0);
+	if (extra_fmt) {
+		putchar(',');
+		va_start(ap, extra_fmt);
+		vprintf(extra_fmt, ap);
+		va_end(ap);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-q] [-b <name>]...\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *filter[16];
+	int nr_filters = 0;
+	unsigned int i;
+	int c, f;
+
+	while ((c = getopt(argc, argv, "qb:")) != -1) {
+		switch (c) {
+		case 'q':
+			bench_quick = true;
+			break;
+		case 'b':
+			if (nr_filters == (int)(sizeof(filter) / sizeof(filter[0])))
+				usage(argv[0]);
+			filter[nr_filters++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		bool run = !nr_filters;
+
+		for (f = 0; f < nr_filters; f++)
+			if (!strncmp(benches[i].name, filter[f], strlen(filter[f])))
+				run = true;
+		if (run)
+			benches[i].run();
+	}
+	return 0;
+}
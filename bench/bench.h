@@ -0,0 +1,55 @@
+#ifndef DRBD_BENCH_H
+#define DRBD_BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Each benchmark reports one JSON object per line on stdout:
+ *
+ *   {"bench":"<name>","ops":<n>,"ns":<total>,"ns_per_op":<x>,...}
+ *
+ * followed by benchmark specific fields, so results can be collected and
+ * compared across commits with any JSON tooling.
+ */
+
+struct bench {
+	const char *name;
+	void (*run)(void);
+};
+
+/* set by -q: fewer iterations, for a quick smoke test */
+extern bool bench_quick;
+
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, good enough for access patterns and cheap enough not to
+ * show up in the numbers */
+static inline uint64_t bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* print one result line; @extra_fmt adds fields, without leading comma */
+extern void bench_report(const char *name, uint64_t ops, uint64_t ns,
+			 const char *extra_fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+extern void bench_lru(void);
+extern void bench_interval(void);
+extern void bench_vli(void);
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * drbd_interval.c: insert/remove and overlap queries on trees holding
+ * 16 to 65536 intervals, i.e. from a handful of requests in flight to a
+ * deep queue of requests and resync requests.
+ */
+#include "drbd_interval.h"
+
+#include "bench.h"
+
+#define DEVICE_SECTORS		(1ULL << 26)	/* 32 GiB */
+
+static void random_interval(struct drbd_interval *i, uint64_t *rnd)
+{
+	uint64_t r = bench_rand(rnd);
+
+	/* 4 KiB aligned, 4 KiB to 128 KiB */
+	i->sector = (r % DEVICE_SECTORS) & ~7ULL;
+	i->size = (1 + (r >> 59)) << 12;
+}
+
+static void run_one(unsigned int depth)
+{
+	unsigned long ops = bench_quick ? 20000 : 2000000;
+	struct drbd_interval_tree tree;
+	struct drbd_interval *intervals, *i;
+	unsigned long found = 0;
+	uint64_t rnd = 0x5eed ^ depth;
+	uint64_t start, ns;
+	char name[64];
+	unsigned long n;
+
+	intervals = calloc(depth, sizeof(*intervals));
+	if (!intervals) {
+		fprintf(stderr, "interval: out of memory\n");
+		exit(1);
+	}
+	drbd_init_interval_tree(&tree);
+	for (n = 0; n < depth; n++) {
+		drbd_clear_interval(&intervals[n]);
+		random_interval(&intervals[n], &rnd);
+		drbd_insert_interval(&tree, &intervals[n]);
+	}
+
+	/* completion of one request, submission of the next */
+	start = bench_now_ns();
+	for (n = 0; n < ops; n++) {
+		i = &intervals[bench_rand(&rnd) % depth];
+		drbd_remove_interval(&tree, i);
+		drbd_clear_interval(i);
+		random_interval(i, &rnd);
+		drbd_insert_interval(&tree, i);
+	}
+	ns = bench_now_ns() - start;
+	snprintf(name, sizeof(name), "interval/insert_remove/%u", depth);
+	bench_report(name, ops, ns, "\"depth\":%u", depth);
+
+	/* conflict detection for a new request */
+	start = bench_now_ns();
+	for (n = 0; n < ops; n++) {
+		struct drbd_interval q;
+
+		random_interval(&q, &rnd);
+		drbd_for_each_overlap(i, &tree, q.sector, q.size)
+			found++;
+	}
+	ns = bench_now_ns() - start;
+	snprintf(name, sizeof(name), "interval/overlap/%u", depth);
+	bench_report(name, ops, ns, "\"depth\":%u,\"overlaps_per_op\":%.4f",
+		     depth, (double)found / ops);
+
+	free(intervals);
+}
+
+void bench_interval(void)
+{
+	static const unsigned int depths[] = { 16, 256, 4096, 65536 };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(depths); i++)
+		run_one(depths[i]);
+}
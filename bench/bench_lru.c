@@ -0,0 +1,133 @@
+/*
+ * Activity log style get/put on lru_cache.c, from several threads.
+ *
+ * Like the activity log, all lru_cache calls are serialized by one lock
+ * (device->al_lock in the kernel), and a miss is committed as a transaction
+ * with lc_try_lock_for_transaction() / lc_committed() / lc_unlock().  The
+ * meta data write of the transaction is not simulated, so this measures the
+ * lock hold times and the lru_cache bookkeeping only.
+ *
+ * Accesses go to a hot set of extents that fits into the cache most of the
+ * time, and to a streaming scan over a large range otherwise.
+ */
+#include <pthread.h>
+#include <linux/lru_cache.h>
+
+#include "bench.h"
+
+#define AL_EXTENTS		1237	/* DRBD_AL_EXTENTS_DEF */
+#define AL_UPDATES		64	/* AL_UPDATES_PER_TRANSACTION */
+#define HOT_EXTENTS		1024
+#define HOT_PERCENT		90
+#define ALL_EXTENTS		(1 << 20)
+
+struct lru_bench {
+	struct lru_cache *lc;
+	pthread_spinlock_t lock;
+	unsigned long ops_per_thread;
+	unsigned long transactions;
+};
+
+static struct lc_element *al_get(struct lru_bench *b, unsigned int enr)
+{
+	struct lc_element *e;
+
+	for (;;) {
+		pthread_spin_lock(&b->lock);
+		e = lc_get(b->lc, enr);
+		if (e && e->lc_number == enr) {
+			pthread_spin_unlock(&b->lock);
+			return e;
+		}
+		/* a change is pending, or no element was available while the
+		 * set is locked or dirty: commit what is pending */
+		if (lc_try_lock_for_transaction(b->lc)) {
+			b->transactions++;
+			lc_committed(b->lc);
+			lc_unlock(b->lc);
+		}
+		pthread_spin_unlock(&b->lock);
+		if (e)
+			return e;
+	}
+}
+
+static void al_put(struct lru_bench *b, struct lc_element *e)
+{
+	pthread_spin_lock(&b->lock);
+	lc_put(b->lc, e);
+	pthread_spin_unlock(&b->lock);
+}
+
+static void *lru_thread(void *arg)
+{
+	struct lru_bench *b = arg;
+	uint64_t rnd = (uintptr_t)&rnd | 1;
+	unsigned int scan = (unsigned int)bench_rand(&rnd) % ALL_EXTENTS;
+	unsigned long i;
+
+	for (i = 0; i < b->ops_per_thread; i++) {
+		uint64_t r = bench_rand(&rnd);
+		unsigned int enr;
+
+		if (r % 100 < HOT_PERCENT)
+			enr = (r >> 32) % HOT_EXTENTS;
+		else
+			enr = HOT_EXTENTS + scan++ % (ALL_EXTENTS - HOT_EXTENTS);
+
+		al_put(b, al_get(b, enr));
+	}
+	return NULL;
+}
+
+static void run_one(enum lc_policy policy, int nr_threads)
+{
+	struct kmem_cache *cache;
+	struct lru_bench b = {
+		.ops_per_thread = bench_quick ? 20000 : 1000000,
+	};
+	pthread_t threads[nr_threads];
+	uint64_t start, ns;
+	char name[64];
+	int i;
+
+	cache = kmem_cache_create("bench_al", sizeof(struct lc_element), 0, 0, NULL);
+	b.lc = lc_create("bench_al", cache, AL_UPDATES, AL_EXTENTS,
+			 sizeof(struct lc_element), 0);
+	if (!cache || !b.lc) {
+		fprintf(stderr, "lru: out of memory\n");
+		exit(1);
+	}
+	lc_set_policy(b.lc, policy);
+	pthread_spin_init(&b.lock, PTHREAD_PROCESS_PRIVATE);
+
+	start = bench_now_ns();
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i], NULL, lru_thread, &b);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	ns = bench_now_ns() - start;
+
+	snprintf(name, sizeof(name), "lru/al_get_put/%s/%dt",
+		 policy == LC_LRU ? "lru" : "slru", nr_threads);
+	bench_report(name, b.ops_per_thread * nr_threads, ns,
+		     "\"threads\":%d,\"hit_ratio\":%.4f,\"transactions\":%lu,\"changed\":%lu",
+		     nr_threads,
+		     (double)b.lc->hits / (b.lc->hits + b.lc->misses),
+		     b.transactions, b.lc->changed);
+
+	pthread_spin_destroy(&b.lock);
+	lc_destroy(b.lc);
+	kmem_cache_destroy(cache);
+}
+
+void bench_lru(void)
+{
+	static const int nr_threads[] = { 1, 2, 4, 8 };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(nr_threads); i++) {
+		run_one(LC_LRU, nr_threads[i]);
+		run_one(LC_SEGMENTED_LRU, nr_threads[i]);
+	}
+}
@@ -0,0 +1,125 @@
+/*
+ * drbd_vli.h: run length encoding of the bitmap, as done by
+ * fill_bitmap_rle_bits() and recv_bm_rle_bits() for the bitmap exchange.
+ *
+ * The run lengths of sparse, dense and clustered bitmaps are generated up
+ * front, so only the VLI code and the bitstream are measured, not the scan
+ * of the bitmap itself.
+ */
+#include "kernel.h"
+#include "drbd_vli.h"
+
+#include "bench.h"
+
+#define PACKET_BYTES	4096
+
+struct rle_pattern {
+	const char *name;
+	/* run lengths of clear and set bits, uniform in [1, max] */
+	unsigned int max_clear, max_set;
+};
+
+static const struct rle_pattern patterns[] = {
+	{ "sparse", 20000, 8 },
+	{ "dense", 4, 4 },
+	{ "clustered", 4096, 4096 },
+};
+
+static void run_one(const struct rle_pattern *pat)
+{
+	unsigned long nr_runs = bench_quick ? 20000 : 4000000;
+	unsigned char packet[PACKET_BYTES];
+	uint64_t rnd = 0x71e;
+	uint64_t plain_bits = 0, decoded_bits = 0;
+	unsigned long packets = 1, n;
+	size_t stream_len;
+	unsigned char *stream;
+	struct bitstream bs;
+	uint64_t start, ns;
+	u64 look_ahead, rl, tmp;
+	int bits, have;
+	u64 *runs;
+	char name[64];
+
+	runs = malloc(nr_runs * sizeof(*runs));
+	stream_len = nr_runs * sizeof(u64);
+	stream = calloc(1, stream_len);
+	if (!runs || !stream) {
+		fprintf(stderr, "vli: out of memory\n");
+		exit(1);
+	}
+	for (n = 0; n < nr_runs; n++) {
+		unsigned int max = n & 1 ? pat->max_set : pat->max_clear;
+
+		runs[n] = 1 + bench_rand(&rnd) % max;
+		plain_bits += runs[n];
+	}
+
+	/* encode into packets, like fill_bitmap_rle_bits() */
+	bitstream_init(&bs, packet, sizeof(packet), 0);
+	memset(packet, 0, sizeof(packet));
+	start = bench_now_ns();
+	for (n = 0; n < nr_runs; n++) {
+		bits = vli_encode_bits(&bs, runs[n]);
+		if (bits == -ENOBUFS) {
+			packets++;
+			bitstream_rewind(&bs);
+			bits = vli_encode_bits(&bs, runs[n]);
+		}
+		BUG_ON(bits <= 0);
+	}
+	ns = bench_now_ns() - start;
+	snprintf(name, sizeof(name), "vli/encode/%s", pat->name);
+	bench_report(name, nr_runs, ns,
+		     "\"plain_bits\":%llu,\"packets\":%lu,\"plain_mbit_per_s\":%.1f",
+		     (unsigned long long)plain_bits, packets, plain_bits * 1e3 / ns);
+
+	/* one long stream to decode from */
+	bitstream_init(&bs, stream, stream_len, 0);
+	for (n = 0; n < nr_runs; n++)
+		BUG_ON(vli_encode_bits(&bs, runs[n]) <= 0);
+	stream_len = bs.cur.b - stream + !!bs.cur.bit;
+	bitstream_init(&bs, stream, stream_len, bs.cur.bit ? 8 - bs.cur.bit : 0);
+
+	/* decode, like recv_bm_rle_bits() */
+	n = 0;
+	start = bench_now_ns();
+	bits = bitstream_get_bits(&bs, &look_ahead, 64);
+	for (have = bits; have > 0; n++) {
+		bits = vli_decode_bits(&rl, look_ahead);
+		BUG_ON(bits <= 0 || have < bits);
+		decoded_bits += rl;
+
+		if (likely(bits < 64))
+			look_ahead >>= bits;
+		else
+			look_ahead = 0;
+		have -= bits;
+
+		bits = bitstream_get_bits(&bs, &tmp, 64 - have);
+		look_ahead |= tmp << have;
+		have += bits;
+	}
+	ns = bench_now_ns() - start;
+	if (n != nr_runs || decoded_bits != plain_bits) {
+		fprintf(stderr, "vli: decoded %lu runs, %llu bits; expected %lu runs, %llu bits\n",
+			n, (unsigned long long)decoded_bits,
+			nr_runs, (unsigned long long)plain_bits);
+		exit(1);
+	}
+	snprintf(name, sizeof(name), "vli/decode/%s", pat->name);
+	bench_report(name, nr_runs, ns,
+		     "\"plain_bits\":%llu,\"code_bytes\":%zu,\"plain_mbit_per_s\":%.1f",
+		     (unsigned long long)plain_bits, stream_len, plain_bits * 1e3 / ns);
+
+	free(stream);
+	free(runs);
+}
+
+void bench_vli(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(patterns); i++)
+		run_one(&patterns[i]);
+}
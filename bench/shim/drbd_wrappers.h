@@ -0,0 +1,3 @@
+/* Userspace stand-in: the compat wrappers of the kernel build are not
+ * needed here, ../kernel.h has all the benchmarked files use. */
+#include "kernel.h"
@@ -0,0 +1,262 @@
+/*
+ * Just enough of the kernel API, in userspace, to build lru_cache.c,
+ * drbd_interval.c and drbd_vli.h unmodified for the benchmarks.
+ *
+ * Single threaded semantics where the kernel has atomics would do, except
+ * for the bit operations on lru_cache->flags, which the AL benchmark drives
+ * from several threads (under a lock, as the activity log does).
+ */
+#ifndef BENCH_SHIM_KERNEL_H
+#define BENCH_SHIM_KERNEL_H
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/types.h>
+
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#ifndef __always_inline
+#define __always_inline		inline __attribute__((__always_inline__))
+#endif
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define IS_ALIGNED(x, a)	(((x) & ((typeof(x))(a) - 1)) == 0)
+
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		min((t)(a), (t)(b))
+#define max_t(t, a, b)		max((t)(a), (t)(b))
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+#define clamp_t(t, v, lo, hi)	clamp((t)(v), (t)(lo), (t)(hi))
+
+#define BUG() do {							\
+	fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__);		\
+	abort();							\
+} while (0)
+#define BUG_ON(c)		do { if (unlikely(c)) BUG(); } while (0)
+#define WARN_ON(c) ({							\
+	int __c = !!(c);						\
+	if (unlikely(__c))						\
+		fprintf(stderr, "WARNING at %s:%d\n", __FILE__, __LINE__); \
+	unlikely(__c);							\
+})
+
+#define EXPORT_SYMBOL(sym)
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+
+#define le64_to_cpu(x)		le64toh(x)
+#define cpu_to_le64(x)		htole64(x)
+#define le32_to_cpu(x)		le32toh(x)
+#define cpu_to_le32(x)		htole32(x)
+
+/* memory */
+
+typedef unsigned int gfp_t;
+#define GFP_KERNEL		0
+#define GFP_NOIO		0
+#define GFP_ATOMIC		0
+
+static inline void *kmalloc(size_t size, gfp_t gfp) { return malloc(size); }
+static inline void *kzalloc(size_t size, gfp_t gfp) { return calloc(1, size); }
+static inline void *kcalloc(size_t n, size_t size, gfp_t gfp) { return calloc(n, size); }
+static inline void kfree(const void *p) { free((void *)p); }
+
+struct kmem_cache {
+	size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+						   size_t align, unsigned long flags,
+						   void (*ctor)(void *))
+{
+	struct kmem_cache *cache = malloc(sizeof(*cache));
+
+	if (cache)
+		cache->size = size;
+	return cache;
+}
+static inline void kmem_cache_destroy(struct kmem_cache *cache) { free(cache); }
+static inline unsigned int kmem_cache_size(struct kmem_cache *cache) { return cache->size; }
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t gfp) { return malloc(cache->size); }
+static inline void kmem_cache_free(struct kmem_cache *cache, void *p) { free(p); }
+
+/* bit operations, on unsigned long words as in the kernel */
+
+#define BITS_PER_LONG		(8 * sizeof(long))
+#define BIT_WORD(nr)		((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)		(1UL << ((nr) % BITS_PER_LONG))
+
+static inline void set_bit(long nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_or(addr + BIT_WORD(nr), BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+static inline void clear_bit(long nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_and(addr + BIT_WORD(nr), ~BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+static inline void clear_bit_unlock(long nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_and(addr + BIT_WORD(nr), ~BIT_MASK(nr), __ATOMIC_RELEASE);
+}
+static inline int test_bit(long nr, const volatile unsigned long *addr)
+{
+	return (__atomic_load_n(addr + BIT_WORD(nr), __ATOMIC_RELAXED) & BIT_MASK(nr)) != 0;
+}
+static inline int test_and_set_bit(long nr, volatile unsigned long *addr)
+{
+	return (__atomic_fetch_or(addr + BIT_WORD(nr), BIT_MASK(nr), __ATOMIC_SEQ_CST) &
+		BIT_MASK(nr)) != 0;
+}
+#define cmpxchg(ptr, old, new) ({					\
+	typeof(*(ptr)) __old = (old);					\
+	__atomic_compare_exchange_n(ptr, &__old, new, false,		\
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);\
+	__old;								\
+})
+
+static inline int fls(unsigned int x) { return x ? 32 - __builtin_clz(x) : 0; }
+static inline unsigned int hweight32(u32 w) { return __builtin_popcount(w); }
+static inline unsigned int hweight64(u64 w) { return __builtin_popcountll(w); }
+
+/* lists */
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name)	{ &(name), &(name) }
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+			      struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+static inline void __list_del_entry(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+}
+static inline void list_del(struct list_head *entry)
+{
+	__list_del_entry(entry);
+	entry->next = entry->prev = NULL;
+}
+static inline void list_del_init(struct list_head *entry)
+{
+	__list_del_entry(entry);
+	INIT_LIST_HEAD(entry);
+}
+static inline void list_move(struct list_head *list, struct list_head *head)
+{
+	__list_del_entry(list);
+	list_add(list, head);
+}
+static inline void list_move_tail(struct list_head *list, struct list_head *head)
+{
+	__list_del_entry(list);
+	list_add_tail(list, head);
+}
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+#define list_entry(ptr, type, member)	container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_last_entry(ptr, type, member) list_entry((ptr)->prev, type, member)
+#define list_next_entry(pos, member)	list_entry((pos)->member.next, typeof(*(pos)), member)
+#define list_for_each_entry(pos, head, member)				\
+	for (pos = list_first_entry(head, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member)			\
+	for (pos = list_first_entry(head, typeof(*pos), member),	\
+	     n = list_next_entry(pos, member);				\
+	     &pos->member != (head);					\
+	     pos = n, n = list_next_entry(n, member))
+
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+static inline void INIT_HLIST_NODE(struct hlist_node *h)
+{
+	h->next = NULL;
+	h->pprev = NULL;
+}
+static inline int hlist_unhashed(const struct hlist_node *h)
+{
+	return !h->pprev;
+}
+static inline void __hlist_del(struct hlist_node *n)
+{
+	struct hlist_node *next = n->next;
+	struct hlist_node **pprev = n->pprev;
+
+	*pprev = next;
+	if (next)
+		next->pprev = pprev;
+}
+static inline void hlist_del_init(struct hlist_node *n)
+{
+	if (!hlist_unhashed(n)) {
+		__hlist_del(n);
+		INIT_HLIST_NODE(n);
+	}
+}
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	if (first)
+		first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+
+#define hlist_entry_safe(ptr, type, member) \
+	({ typeof(ptr) ____ptr = (ptr); ____ptr ? hlist_entry(____ptr, type, member) : NULL; })
+#define hlist_entry(ptr, type, member)	container_of(ptr, type, member)
+#define hlist_for_each_entry(pos, head, member)				\
+	for (pos = hlist_entry_safe((head)->first, typeof(*(pos)), member); \
+	     pos;							\
+	     pos = hlist_entry_safe((pos)->member.next, typeof(*(pos)), member))
+
+/* seq_file, straight to a stdio stream */
+
+struct seq_file {
+	FILE *file;
+};
+
+#define seq_printf(m, fmt, ...)	fprintf((m)->file, fmt, ##__VA_ARGS__)
+#define seq_putc(m, c)		fputc(c, (m)->file)
+
+#endif
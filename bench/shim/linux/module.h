@@ -0,0 +1,2 @@
+/* Userspace stand-in, see ../kernel.h */
+#include "../kernel.h"
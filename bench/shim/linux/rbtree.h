@@ -0,0 +1,45 @@
+/* Userspace stand-in for the kernel's rbtree, see ../rbtree.c */
+#ifndef BENCH_SHIM_LINUX_RBTREE_H
+#define BENCH_SHIM_LINUX_RBTREE_H
+
+#include "../kernel.h"
+
+struct rb_node {
+	struct rb_node *rb_parent;
+	struct rb_node *rb_right;
+	struct rb_node *rb_left;
+	int rb_red;
+};
+
+struct rb_root {
+	struct rb_node *rb_node;
+};
+
+#define RB_ROOT			((struct rb_root) { NULL, })
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+#define RB_EMPTY_ROOT(root)	((root)->rb_node == NULL)
+#define RB_EMPTY_NODE(node)	((node)->rb_parent == (node))
+#define RB_CLEAR_NODE(node)	((node)->rb_parent = (node))
+#define rb_parent(node)		((node)->rb_parent)
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+				struct rb_node **link)
+{
+	node->rb_parent = parent;
+	node->rb_left = node->rb_right = NULL;
+	node->rb_red = 1;
+	*link = node;
+}
+
+extern void rb_insert_color(struct rb_node *, struct rb_root *);
+extern void rb_erase(struct rb_node *, struct rb_root *);
+extern struct rb_node *rb_next(const struct rb_node *);
+extern struct rb_node *rb_first(const struct rb_root *);
+
+/* The augmented rbtree interface drbd_interval.c is written against */
+typedef void (*rb_augment_f)(struct rb_node *node, void *data);
+extern void rb_augment_insert(struct rb_node *node, rb_augment_f func, void *data);
+extern struct rb_node *rb_augment_erase_begin(struct rb_node *node);
+extern void rb_augment_erase_end(struct rb_node *node, rb_augment_f func, void *data);
+
+#endif
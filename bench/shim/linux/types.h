@@ -0,0 +1,20 @@
+/* Userspace stand-in for the kernel's linux/types.h, see ../kernel.h.
+ * libc headers include <linux/types.h> as well, so this extends the uapi
+ * header rather than replacing it. */
+#ifndef BENCH_SHIM_LINUX_TYPES_H
+#define BENCH_SHIM_LINUX_TYPES_H
+
+#include_next <linux/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef u64 sector_t;
+
+#endif
@@ -0,0 +1,298 @@
+/*
+ * Userspace red-black tree for the benchmarks: a plain textbook
+ * implementation with parent pointers, plus the (pre 3.5 kernel) augment
+ * callbacks drbd_interval.c uses to keep its subtree "end" up to date.
+ */
+#include <linux/rbtree.h>
+
+static void rb_replace_child(struct rb_node *parent, struct rb_node *old,
+			     struct rb_node *new, struct rb_root *root)
+{
+	if (!parent)
+		root->rb_node = new;
+	else if (parent->rb_left == old)
+		parent->rb_left = new;
+	else
+		parent->rb_right = new;
+}
+
+static void rb_rotate_left(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *right = node->rb_right;
+
+	node->rb_right = right->rb_left;
+	if (right->rb_left)
+		right->rb_left->rb_parent = node;
+	right->rb_parent = node->rb_parent;
+	rb_replace_child(node->rb_parent, node, right, root);
+	right->rb_left = node;
+	node->rb_parent = right;
+}
+
+static void rb_rotate_right(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *left = node->rb_left;
+
+	node->rb_left = left->rb_right;
+	if (left->rb_right)
+		left->rb_right->rb_parent = node;
+	left->rb_parent = node->rb_parent;
+	rb_replace_child(node->rb_parent, node, left, root);
+	left->rb_right = node;
+	node->rb_parent = left;
+}
+
+static inline int rb_is_red(const struct rb_node *node)
+{
+	return node && node->rb_red;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *parent, *gparent, *uncle;
+
+	while ((parent = node->rb_parent) && parent->rb_red) {
+		gparent = parent->rb_parent;
+
+		if (parent == gparent->rb_left) {
+			uncle = gparent->rb_right;
+			if (rb_is_red(uncle)) {
+				uncle->rb_red = 0;
+				parent->rb_red = 0;
+				gparent->rb_red = 1;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->rb_right) {
+				rb_rotate_left(parent, root);
+				node = parent;
+				parent = node->rb_parent;
+			}
+			parent->rb_red = 0;
+			gparent->rb_red = 1;
+			rb_rotate_right(gparent, root);
+		} else {
+			uncle = gparent->rb_left;
+			if (rb_is_red(uncle)) {
+				uncle->rb_red = 0;
+				parent->rb_red = 0;
+				gparent->rb_red = 1;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->rb_left) {
+				rb_rotate_right(parent, root);
+				node = parent;
+				parent = node->rb_parent;
+			}
+			parent->rb_red = 0;
+			gparent->rb_red = 1;
+			rb_rotate_left(gparent, root);
+		}
+	}
+	root->rb_node->rb_red = 0;
+}
+
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent,
+			   struct rb_root *root)
+{
+	struct rb_node *other;
+
+	while (!rb_is_red(node) && node != root->rb_node) {
+		if (parent->rb_left == node) {
+			other = parent->rb_right;
+			if (other->rb_red) {
+				other->rb_red = 0;
+				parent->rb_red = 1;
+				rb_rotate_left(parent, root);
+				other = parent->rb_right;
+			}
+			if (!rb_is_red(other->rb_left) && !rb_is_red(other->rb_right)) {
+				other->rb_red = 1;
+				node = parent;
+				parent = node->rb_parent;
+				continue;
+			}
+			if (!rb_is_red(other->rb_right)) {
+				other->rb_left->rb_red = 0;
+				other->rb_red = 1;
+				rb_rotate_right(other, root);
+				other = parent->rb_right;
+			}
+			other->rb_red = parent->rb_red;
+			parent->rb_red = 0;
+			other->rb_right->rb_red = 0;
+			rb_rotate_left(parent, root);
+		} else {
+			other = parent->rb_left;
+			if (other->rb_red) {
+				other->rb_red = 0;
+				parent->rb_red = 1;
+				rb_rotate_right(parent, root);
+				other = parent->rb_left;
+			}
+			if (!rb_is_red(other->rb_left) && !rb_is_red(other->rb_right)) {
+				other->rb_red = 1;
+				node = parent;
+				parent = node->rb_parent;
+				continue;
+			}
+			if (!rb_is_red(other->rb_left)) {
+				other->rb_right->rb_red = 0;
+				other->rb_red = 1;
+				rb_rotate_left(other, root);
+				other = parent->rb_left;
+			}
+			other->rb_red = parent->rb_red;
+			parent->rb_red = 0;
+			other->rb_left->rb_red = 0;
+			rb_rotate_right(parent, root);
+		}
+		node = root->rb_node;
+		break;
+	}
+	if (node)
+		node->rb_red = 0;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *child, *parent;
+	int red;
+
+	if (node->rb_left && node->rb_right) {
+		struct rb_node *old = node;
+
+		/* replace @old by its successor, which has no left child */
+		node = node->rb_right;
+		while (node->rb_left)
+			node = node->rb_left;
+
+		child = node->rb_right;
+		parent = node->rb_parent;
+		red = node->rb_red;
+
+		if (child)
+			child->rb_parent = parent;
+		if (parent == old) {
+			parent->rb_right = child;
+			parent = node;
+		} else {
+			parent->rb_left = child;
+		}
+
+		node->rb_parent = old->rb_parent;
+		node->rb_red = old->rb_red;
+		node->rb_right = old->rb_right;
+		node->rb_left = old->rb_left;
+		rb_replace_child(old->rb_parent, old, node, root);
+		old->rb_left->rb_parent = node;
+		if (old->rb_right)
+			old->rb_right->rb_parent = node;
+	} else {
+		child = node->rb_left ? node->rb_left : node->rb_right;
+		parent = node->rb_parent;
+		red = node->rb_red;
+
+		if (child)
+			child->rb_parent = parent;
+		rb_replace_child(parent, node, child, root);
+	}
+
+	if (!red)
+		rb_erase_color(child, parent, root);
+}
+
+struct rb_node *rb_first(const struct rb_root *root)
+{
+	struct rb_node *node = root->rb_node;
+
+	if (!node)
+		return NULL;
+	while (node->rb_left)
+		node = node->rb_left;
+	return node;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (RB_EMPTY_NODE(node))
+		return NULL;
+
+	if (node->rb_right) {
+		node = node->rb_right;
+		while (node->rb_left)
+			node = node->rb_left;
+		return (struct rb_node *)node;
+	}
+
+	while ((parent = node->rb_parent) && node == parent->rb_right)
+		node = parent;
+	return parent;
+}
+
+/*
+ * Update @node and everything above it, together with the siblings along
+ * the way: rotations only ever move subtrees between a node on the path and
+ * its sibling.
+ */
+static void rb_augment_path(struct rb_node *node, rb_augment_f func, void *data)
+{
+	struct rb_node *parent;
+
+	for (;;) {
+		func(node, data);
+		parent = node->rb_parent;
+		if (!parent)
+			return;
+
+		if (node == parent->rb_left && parent->rb_right)
+			func(parent->rb_right, data);
+		else if (parent->rb_left)
+			func(parent->rb_left, data);
+
+		node = parent;
+	}
+}
+
+void rb_augment_insert(struct rb_node *node, rb_augment_f func, void *data)
+{
+	if (node->rb_left)
+		node = node->rb_left;
+	else if (node->rb_right)
+		node = node->rb_right;
+
+	rb_augment_path(node, func, data);
+}
+
+/*
+ * The deepest node whose subtree changes when @node is erased, to be passed
+ * to rb_augment_erase_end() after rb_erase().
+ */
+struct rb_node *rb_augment_erase_begin(struct rb_node *node)
+{
+	struct rb_node *deepest;
+
+	if (!node->rb_right && !node->rb_left) {
+		deepest = node->rb_parent;
+	} else if (!node->rb_right) {
+		deepest = node->rb_left;
+	} else if (!node->rb_left) {
+		deepest = node->rb_right;
+	} else {
+		deepest = rb_next(node);
+		if (deepest->rb_right)
+			deepest = deepest->rb_right;
+		else if (deepest->rb_parent != node)
+			deepest = deepest->rb_parent;
+	}
+	return deepest;
+}
+
+void rb_augment_erase_end(struct rb_node *node, rb_augment_f func, void *data)
+{
+	if (node)
+		rb_augment_path(node, func, data);
+}
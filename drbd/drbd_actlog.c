@@ -27,6 +27,16 @@ struct update_peers_work {
        unsigned int enr;
 };
 
+static void *__drbd_md_get_buffer(struct drbd_md_io *md_io, const char *intent)
+{
+	md_io->current_use = intent;
+	md_io->start_jif = jiffies;
+	md_io->submit_jif = md_io->start_jif - 1;
+	return page_address(md_io->page);
+}
+
+/* Takes the super block buffer.  Activity log transactions use their own,
+ * and are not held up by this. */
 void *drbd_md_get_buffer(struct drbd_device *device, const char *intent)
 {
 	int r;
@@ -43,16 +53,74 @@ void *drbd_md_get_buffer(struct drbd_device *device, const char *intent)
 	if (r)
 		return NULL;
 
-	device->md_io.current_use = intent;
-	device->md_io.start_jif = jiffies;
-	device->md_io.submit_jif = device->md_io.start_jif - 1;
-	return page_address(device->md_io.page);
+	return __drbd_md_get_buffer(&device->md_io, intent);
+}
+
+/* Takes the super block buffer and locks out all other meta data IO, for
+ * attach, resize and CS_INHIBIT_MD_IO: activity log transactions back off
+ * in al_io_trylock() while MD_IO_EXCLUSIVE is set, and we wait for the one
+ * that may still be in flight.  Released with drbd_md_put_buffer(). */
+void *drbd_md_get_buffer_exclusive(struct drbd_device *device, const char *intent)
+{
+	void *buffer;
+
+	buffer = drbd_md_get_buffer(device, intent);
+	if (!buffer)
+		return NULL;
+
+	set_bit(MD_IO_EXCLUSIVE, &device->flags);
+	smp_mb__after_atomic();
+	while (!wait_event_timeout(device->misc_wait,
+			atomic_read(&device->al_io.in_use) == 0 ||
+			device->disk_state[NOW] <= D_FAILED,
+			HZ * 10))
+		drbd_err(device, "Waited 10 Seconds for al_buffer! BUG?\n");
+
+	return buffer;
+}
+
+void __drbd_md_put_buffer(struct drbd_md_io *md_io)
+{
+	if (atomic_dec_and_test(&md_io->in_use))
+		wake_up(&md_io->device->misc_wait);
 }
 
 void drbd_md_put_buffer(struct drbd_device *device)
 {
-	if (atomic_dec_and_test(&device->md_io.in_use))
-		wake_up(&device->misc_wait);
+	clear_bit(MD_IO_EXCLUSIVE, &device->flags);
+	__drbd_md_put_buffer(&device->md_io);
+}
+
+/* Pairs with drbd_md_get_buffer_exclusive(): we claim our buffer with a
+ * fully ordered cmpxchg before we look at MD_IO_EXCLUSIVE, it sets that
+ * before it looks at our buffer. */
+static bool al_io_trylock(struct drbd_device *device)
+{
+	if (atomic_cmpxchg(&device->al_io.in_use, 0, 1) != 0)
+		return false;
+	if (!test_bit(MD_IO_EXCLUSIVE, &device->flags))
+		return true;
+	__drbd_md_put_buffer(&device->al_io);
+	return false;
+}
+
+static void *drbd_al_get_buffer(struct drbd_device *device, const char *intent)
+{
+	bool locked = false;
+	long t;
+
+	t = wait_event_timeout(device->misc_wait,
+			(locked = al_io_trylock(device)) ||
+			device->disk_state[NOW] <= D_FAILED,
+			HZ * 10);
+
+	if (t == 0)
+		drbd_err(device, "Waited 10 Seconds for al_buffer! BUG?\n");
+
+	if (!locked)
+		return NULL;
+
+	return __drbd_md_get_buffer(&device->al_io, intent);
 }
 
 void wait_until_done_or_force_detached(struct drbd_device *device, struct drbd_backing_dev *bdev,
@@ -75,29 +143,60 @@ void wait_until_done_or_force_detached(struct drbd_device *device, struct drbd_b
 	}
 }
 
-static int _drbd_md_sync_page_io(struct drbd_device *device,
-				 struct drbd_backing_dev *bdev,
-				 sector_t sector, int op)
+/**
+ * drbd_md_submit_page_io() - Submit one 4k meta data IO from or into the page of @md_io
+ * @device:	DRBD device.
+ * @bdev:	backing device, the IO goes to its meta data device.
+ * @md_io:	a buffer the caller holds, see drbd_md_get_buffer().
+ * @sector:	first sector on the meta data device.
+ * @op:		REQ_OP_READ or REQ_OP_WRITE.
+ * @end_io:	called from drbd_md_endio(), possibly in irq context; may be NULL.
+ *
+ * Does not wait.  Once md_io->done is set, md_io->error holds the outcome.
+ * The caller's reference on @md_io is left alone; an @end_io callback that
+ * owns the buffer releases it with __drbd_md_put_buffer().
+ */
+int drbd_md_submit_page_io(struct drbd_device *device, struct drbd_backing_dev *bdev,
+			   struct drbd_md_io *md_io, sector_t sector, int op,
+			   void (*end_io)(struct drbd_md_io *))
 {
 	struct bio *bio;
 	/* we do all our meta data IO in aligned 4k blocks. */
 	const int size = 4096;
-	int err, op_flags = 0;
+	int op_flags = 0;
+
+	D_ASSERT(device, atomic_read(&md_io->in_use) == 1);
+
+	if (!bdev->md_bdev) {
+		if (drbd_ratelimit())
+			drbd_err(device, "bdev->md_bdev==NULL\n");
+		return -EIO;
+	}
+
+	drbd_dbg(device, "meta_data io: %s [%d]:%s(,%llus,%s) %pS\n",
+	     current->comm, current->pid, __func__,
+	     (unsigned long long)sector, (op == REQ_OP_WRITE) ? "WRITE" : "READ",
+	     (void*)_RET_IP_ );
+
+	if (sector < drbd_md_first_sector(bdev) ||
+	    sector + 7 > drbd_md_last_sector(bdev))
+		drbd_alert(device, "%s [%d]:%s(,%llus,%s) out of range md access!\n",
+		     current->comm, current->pid, __func__,
+		     (unsigned long long)sector,
+		     (op == REQ_OP_WRITE) ? "WRITE" : "READ");
 
 	if ((op == REQ_OP_WRITE) && !test_bit(MD_NO_FUA, &device->flags))
 		op_flags |= REQ_FUA | REQ_PREFLUSH;
 	op_flags |= REQ_META | REQ_SYNC | REQ_PRIO;
 
-	device->md_io.done = 0;
-	device->md_io.error = -ENODEV;
-
 	bio = bio_alloc_drbd(GFP_NOIO);
 	bio_set_dev(bio, bdev->md_bdev);
 	bio->bi_iter.bi_sector = sector;
-	err = -EIO;
-	if (bio_add_page(bio, device->md_io.page, size, 0) != size)
-		goto out;
-	bio->bi_private = device;
+	if (bio_add_page(bio, md_io->page, size, 0) != size) {
+		bio_put(bio);
+		return -EIO;
+	}
+	bio->bi_private = md_io;
 	bio->bi_end_io = drbd_md_endio;
 
 	bio->bi_opf = op | op_flags;
@@ -107,52 +206,35 @@ static int _drbd_md_sync_page_io(struct drbd_device *device,
 		;
 	else if (!get_ldev_if_state(device, D_ATTACHING)) {
 		/* Corresponding put_ldev in drbd_md_endio() */
-		drbd_err(device, "ASSERT FAILED: get_ldev_if_state() == 1 in _drbd_md_sync_page_io()\n");
-		err = -ENODEV;
-		goto out;
+		drbd_err(device, "ASSERT FAILED: get_ldev_if_state() == 1 in drbd_md_submit_page_io()\n");
+		bio_put(bio);
+		return -ENODEV;
 	}
 
-	bio_get(bio); /* one bio_put() is in the completion handler */
-	atomic_inc(&device->md_io.in_use); /* drbd_md_put_buffer() is in the completion handler */
-	device->md_io.submit_jif = jiffies;
+	md_io->done = 0;
+	md_io->error = -ENODEV;
+	md_io->end_io = end_io;
+	atomic_inc(&md_io->in_use); /* __drbd_md_put_buffer() is in the completion handler */
+	md_io->submit_jif = jiffies;
 	if (drbd_insert_fault(device, (op == REQ_OP_WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD)) {
 		bio->bi_status = BLK_STS_IOERR;
 		bio_endio(bio);
 	} else {
 		submit_bio(bio);
 	}
-	wait_until_done_or_force_detached(device, bdev, &device->md_io.done);
-	err = device->md_io.error;
- out:
-	bio_put(bio);
-	return err;
+	return 0;
 }
 
-int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bdev,
-			 sector_t sector, int op)
+static int __drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bdev,
+				  struct drbd_md_io *md_io, sector_t sector, int op)
 {
 	int err;
-	D_ASSERT(device, atomic_read(&device->md_io.in_use) == 1);
 
-	if (!bdev->md_bdev) {
-		if (drbd_ratelimit())
-			drbd_err(device, "bdev->md_bdev==NULL\n");
-		return -EIO;
+	err = drbd_md_submit_page_io(device, bdev, md_io, sector, op, NULL);
+	if (!err) {
+		wait_until_done_or_force_detached(device, bdev, &md_io->done);
+		err = md_io->error;
 	}
-
-	drbd_dbg(device, "meta_data io: %s [%d]:%s(,%llus,%s) %pS\n",
-	     current->comm, current->pid, __func__,
-	     (unsigned long long)sector, (op == REQ_OP_WRITE) ? "WRITE" : "READ",
-	     (void*)_RET_IP_ );
-
-	if (sector < drbd_md_first_sector(bdev) ||
-	    sector + 7 > drbd_md_last_sector(bdev))
-		drbd_alert(device, "%s [%d]:%s(,%llus,%s) out of range md access!\n",
-		     current->comm, current->pid, __func__,
-		     (unsigned long long)sector,
-		     (op == REQ_OP_WRITE) ? "WRITE" : "READ");
-
-	err = _drbd_md_sync_page_io(device, bdev, sector, op);
 	if (err) {
 		drbd_err(device, "drbd_md_sync_page_io(,%llus,%s) failed with error %d\n",
 		    (unsigned long long)sector,
@@ -161,6 +243,12 @@ int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bd
 	return err;
 }
 
+int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bdev,
+			 sector_t sector, int op)
+{
+	return __drbd_md_sync_page_io(device, bdev, &device->md_io, sector, op);
+}
+
 struct get_activity_log_ref_ctx {
 	/* in: which extent on which device? */
 	struct drbd_device *device;
@@ -278,6 +366,7 @@ drbd_dax_begin_io_fp(struct drbd_device *device, unsigned int first, unsigned in
 		if (al_ext->lc_number != enr) {
 			spin_lock_irqsave(&device->al_lock, flags);
 			drbd_dax_al_update(device, al_ext);
+			drbd_dax_fence();
 			lc_committed(device->act_log);
 			spin_unlock_irqrestore(&device->al_lock, flags);
 		}
@@ -355,8 +444,34 @@ static sector_t al_tr_number_to_on_disk_sector(struct drbd_device *device)
 	return device->ldev->md.md_offset + device->ldev->md.al_offset + t;
 }
 
-static int __al_write_transaction(struct drbd_device *device, struct al_transaction_on_disk *buffer)
+/* Start writing out the bitmap pages of the extents the next transaction
+ * most likely evicts, the least recently used ones.  By the time it does,
+ * their pages are on disk already, and the AL transaction is the only
+ * meta data write on its way. */
+static void al_write_behind(struct drbd_device *device, unsigned int n)
+{
+	unsigned int enr[AL_UPDATES_PER_TRANSACTION];
+	struct lc_element *e;
+	unsigned int i = 0;
+
+	n = min_t(unsigned int, n, AL_UPDATES_PER_TRANSACTION);
+	spin_lock_irq(&device->al_lock);
+	list_for_each_entry_reverse(e, &device->act_log->lru, list) {
+		if (i == n)
+			break;
+		if (e->lc_number != LC_FREE)
+			enr[i++] = e->lc_number;
+	}
+	spin_unlock_irq(&device->al_lock);
+
+	while (i--)
+		drbd_bm_write_behind(device, al_extent_to_bm_bit(enr[i]),
+				     al_extent_to_bm_bit(enr[i] + 1) - 1);
+}
+
+static int __al_write_transaction(struct drbd_device *device, struct drbd_md_io *md_io)
 {
+	struct al_transaction_on_disk *buffer = page_address(md_io->page);
 	struct lc_element *e;
 	sector_t sector;
 	int i, mx;
@@ -435,7 +550,7 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 		rcu_read_unlock();
 		if (write_al_updates) {
 			ktime_aggregate_delta(device, start_kt, al_mid_kt);
-			if (drbd_md_sync_page_io(device, device->ldev, sector, REQ_OP_WRITE)) {
+			if (__drbd_md_sync_page_io(device, device->ldev, md_io, sector, REQ_OP_WRITE)) {
 				err = -EIO;
 				drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
 			} else {
@@ -446,6 +561,8 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 						AL_UPDATES_PER_TRANSACTION)]++;
 			}
 			ktime_aggregate_delta(device, start_kt, al_after_sync_page_kt);
+			if (!err)
+				al_write_behind(device, be16_to_cpu(buffer->n_updates));
 		}
 	}
 
@@ -454,7 +571,6 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 
 static int al_write_transaction(struct drbd_device *device)
 {
-	struct al_transaction_on_disk *buffer;
 	int err;
 
 	if (!get_ldev(device)) {
@@ -472,17 +588,16 @@ static int al_write_transaction(struct drbd_device *device)
 		return -EIO;
 	}
 
-	/* protects md_io_buffer, al_tr_cycle, ... */
-	buffer = drbd_md_get_buffer(device, __func__);
-	if (!buffer) {
-		drbd_err(device, "disk failed while waiting for md_io buffer\n");
+	/* protects al_io buffer, al_tr_cycle, ... */
+	if (!drbd_al_get_buffer(device, __func__)) {
+		drbd_err(device, "disk failed while waiting for al_io buffer\n");
 		put_ldev(device);
 		return -ENODEV;
 	}
 
-	err = __al_write_transaction(device, buffer);
+	err = __al_write_transaction(device, &device->al_io);
 
-	drbd_md_put_buffer(device);
+	__drbd_md_put_buffer(&device->al_io);
 	put_ldev(device);
 
 	return err;
@@ -512,6 +627,49 @@ bool drbd_al_try_lock_for_transaction(struct drbd_device *device)
 	return locked;
 }
 
+/* Adjust the soft limit of the activity log from the observed hit/change
+ * ratio and transaction rate, at most once per second.  Grow if a notable
+ * fraction of references needed an AL transaction while transactions are
+ * frequent, shrink back towards al-extents once the hot set fits well.
+ * Never below al-extents, never beyond the on-disk capacity (nr_elements).
+ * Called with al_lock held. */
+static void drbd_al_adjust_active_limit(struct drbd_device *device)
+{
+	struct lru_cache *al = device->act_log;
+	unsigned long now = jiffies;
+	unsigned long hits, changed, elapsed;
+	unsigned int transactions, limit, floor;
+
+	elapsed = now - device->al_autosize_jif;
+	if (elapsed < HZ)
+		return;
+
+	hits = al->hits - device->al_autosize_hits;
+	changed = al->changed - device->al_autosize_changed;
+	transactions = device->al_writ_cnt - device->al_autosize_writ_cnt;
+	device->al_autosize_jif = now;
+	device->al_autosize_hits = al->hits;
+	device->al_autosize_changed = al->changed;
+	device->al_autosize_writ_cnt = device->al_writ_cnt;
+
+	rcu_read_lock();
+	floor = rcu_dereference(device->ldev->disk_conf)->al_extents;
+	rcu_read_unlock();
+
+	limit = al->active_limit;
+	if (!drbd_al_autosize)
+		limit = floor;
+	else if (changed * 16 > hits + changed &&
+		 (unsigned long)transactions * HZ >= 8 * elapsed)
+		limit += limit / 8 + 1;
+	else if (changed * 64 < hits + changed)
+		limit -= limit / 16;
+	limit = max(limit, floor);
+
+	if (limit != al->active_limit)
+		lc_set_active_limit(al, limit);
+}
+
 void drbd_al_begin_io_commit(struct drbd_device *device)
 {
 	bool locked = false;
@@ -530,12 +688,21 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 		/* Double check: it may have been committed by someone else
 		 * while we were waiting for the lock. */
 		if (device->act_log->pending_changes) {
+			struct lru_cache *al = device->act_log;
 			bool write_al_updates;
 
 			rcu_read_lock();
 			write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
 			rcu_read_unlock();
 
+			/* Piggyback shrinking the active set on a transaction
+			 * we have to write anyways. */
+			spin_lock_irq(&device->al_lock);
+			drbd_al_adjust_active_limit(device);
+			if (al->active > al->active_limit)
+				lc_trim(al, al->active - al->active_limit);
+			spin_unlock_irq(&device->al_lock);
+
 			if (write_al_updates)
 				al_write_transaction(device);
 			spin_lock_irq(&device->al_lock);
@@ -816,9 +983,9 @@ consider_sending_peers_in_sync(struct drbd_peer_device *peer_device, unsigned in
 	drbd_rs_complete_io(peer_device, BM_EXT_TO_SECT(rs_enr));
 }
 
+/* Called with the md_io buffer held, which locks out al_write_transaction(). */
 int drbd_al_initialize(struct drbd_device *device, void *buffer)
 {
-	struct al_transaction_on_disk *al = buffer;
 	struct drbd_md *md = &device->ldev->md;
 	int al_size_4k = md->al_stripes * md->al_stripe_size_4k;
 	int i;
@@ -826,7 +993,7 @@ int drbd_al_initialize(struct drbd_device *device, void *buffer)
 	if (drbd_md_dax_active(device->ldev))
 		return drbd_dax_al_initialize(device);
 
-	__al_write_transaction(device, al);
+	__al_write_transaction(device, &device->md_io);
 	/* There may or may not have been a pending transaction. */
 	spin_lock_irq(&device->al_lock);
 	lc_committed(device->act_log);
@@ -836,7 +1003,7 @@ int drbd_al_initialize(struct drbd_device *device, void *buffer)
 	 * are written out only to provide the context, and to initialize the
 	 * on-disk ring buffer. */
 	for (i = 1; i < al_size_4k; i++) {
-		int err = __al_write_transaction(device, al);
+		int err = __al_write_transaction(device, &device->md_io);
 		if (err)
 			return err;
 	}
@@ -66,17 +66,31 @@
  * and still incomplete, on 32bit we still "only" support 16 TiB (minus some),
  * (1 << 32) bits * 4k storage.
  *
+ * The granularity of the bitmap may be chosen coarser at create-md time
+ * (bm_bytes_per_bit in the super block, up to 1 << BM_BLOCK_SHIFT_MAX),
+ * which divides all of the above.  Bit numbers in the interface of this file
+ * are still in units of BM_BLOCK_SIZE, as is the bitmap exchange with our
+ * peers; we translate on the way in and out, see bm_shift().
+ *
 
  * bitmap storage and IO:
  *	Bitmap is stored little endian on disk, and is kept little endian in
- *	core memory. Currently we still hold the full bitmap in core as long
- *	as we are "attached" to a local disk, which at 32 GiB for 1PiB storage
- *	seems excessive.
+ *	core memory.  We hold the bitmap in core as long as we are "attached"
+ *	to a local disk, but only those pages that are neither all zero nor
+ *	all one have memory of their own.  The others point to one of two
+ *	shared, read-only sentinel pages, see bm_zero_page.  A sentinel is
+ *	replaced by a private copy on the first modification (GFP_ATOMIC, we
+ *	hold bm_lock), pages read from disk and pages that became uniform
+ *	again are dropped back to the sentinel, see drbd_bm_compact().
+ *	As the pages may be shared, the per page flags are kept in
+ *	bm_page_flags[], not in page->private.
  *
- *	We plan to reduce the amount of in-core bitmap pages by paging them in
- *	and out against their on-disk location as necessary, but need to make
- *	sure we don't cause too much meta data IO, and must not deadlock in
- *	tight memory situations. This needs some more work.
+ *	On disk, the peer slots are interleaved word by word.  In core, each
+ *	slot has pages of its own, so that a slot without bits set takes no
+ *	memory, and scanning one slot does not walk the words of all the
+ *	others.  bm_page_io_async() converts between the two, pages are
+ *	always written from, and read into, a temporary page.  A bitmap on
+ *	pmem is the on-disk bitmap, and stays interleaved.
  */
 
 /*
@@ -207,7 +221,8 @@ void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device)
 	drbd_bm_unlock(peer_device->device);
 }
 
-/* we store some "meta" info about our pages in page->private */
+/* we store the page index in page->private of the pages we own,
+ * and of the copies we submit for writeout */
 /* at a granularity of 4k storage per bitmap bit:
  * one peta byte storage: 1<<50 byte, 1<<38 * 4k storage blocks
  *  1<<38 bits,
@@ -217,6 +232,7 @@ void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device)
  * Used to report the failed page idx on io error from the endio handlers.
  */
 #define BM_PAGE_IDX_MASK	((1UL<<24)-1)
+/* "meta" info about our pages, in bm_page_flags[page_nr] */
 /* this page is currently read in, or written back */
 #define BM_PAGE_IO_LOCK		31
 /* if there has been an IO error for this page */
@@ -231,8 +247,45 @@ void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device)
  * on activity log transactions */
 #define BM_PAGE_HINT_WRITEOUT	27
 
+/* pages are read from disk in chunks of this many, so that those that turn
+ * out to be all zero or all one are dropped before we allocate the next ones */
+#define BM_READ_CHUNK_PAGES	1024
+
+/* The sentinel pages are never written to with a different content, see
+ * bm_prepare_page().  Rewriting the same content, as the bit operations
+ * may do, is harmless. */
+static struct page *bm_zero_page;
+static struct page *bm_ones_page;
+
+int drbd_bm_create_sentinels(void)
+{
+	bm_zero_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	bm_ones_page = alloc_page(GFP_KERNEL);
+	if (!bm_zero_page || !bm_ones_page) {
+		drbd_bm_destroy_sentinels();
+		return -ENOMEM;
+	}
+	memset(page_address(bm_ones_page), 0xff, PAGE_SIZE);
+	return 0;
+}
+
+void drbd_bm_destroy_sentinels(void)
+{
+	if (bm_zero_page)
+		__free_page(bm_zero_page);
+	if (bm_ones_page)
+		__free_page(bm_ones_page);
+	bm_zero_page = NULL;
+	bm_ones_page = NULL;
+}
+
+static bool bm_is_sentinel(struct page *page)
+{
+	return page == bm_zero_page || page == bm_ones_page;
+}
+
 /* store_page_idx uses non-atomic assignment. It is only used directly after
- * allocating the page.  All other bm_set_page_* and bm_clear_page_* need to
+ * allocating the page.  All bm_set_page_* and bm_clear_page_* need to
  * use atomic bit manipulation, as set_out_of_sync (and therefore bitmap
  * changes) may happen from various contexts, and wait_on_bit/wake_up_bit
  * requires it all to be atomic as well. */
@@ -253,33 +306,33 @@ static unsigned long bm_page_to_idx(struct page *page)
 static void bm_page_lock_io(struct drbd_device *device, int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	void *addr = &page_private(b->bm_pages[page_nr]);
+	void *addr = &b->bm_page_flags[page_nr];
 	wait_event(b->bm_io_wait, !test_and_set_bit(BM_PAGE_IO_LOCK, addr));
 }
 
 static void bm_page_unlock_io(struct drbd_device *device, int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	void *addr = &page_private(b->bm_pages[page_nr]);
+	void *addr = &b->bm_page_flags[page_nr];
 	clear_bit_unlock(BM_PAGE_IO_LOCK, addr);
 	wake_up(&device->bitmap->bm_io_wait);
 }
 
 /* set _before_ submit_io, so it may be reset due to being changed
  * while this page is in flight... will get submitted later again */
-static void bm_set_page_unchanged(struct page *page)
+static void bm_set_page_unchanged(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
 	/* use cmpxchg? */
-	clear_bit(BM_PAGE_NEED_WRITEOUT, &page_private(page));
-	clear_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
+	clear_bit(BM_PAGE_NEED_WRITEOUT, &bitmap->bm_page_flags[page_nr]);
+	clear_bit(BM_PAGE_LAZY_WRITEOUT, &bitmap->bm_page_flags[page_nr]);
 }
 
 static void bm_set_page_need_writeout(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM)) {
-		struct page *page = bitmap->bm_pages[page_nr];
-		set_bit(BM_PAGE_NEED_WRITEOUT, &page_private(page));
-	}
+	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
+		set_bit(BM_PAGE_NEED_WRITEOUT, &bitmap->bm_page_flags[page_nr]);
+	else if (bitmap->bm_dax_dirty)
+		set_bit(page_nr, bitmap->bm_dax_dirty);
 }
 
 void drbd_bm_reset_al_hints(struct drbd_device *device)
@@ -287,33 +340,33 @@ void drbd_bm_reset_al_hints(struct drbd_device *device)
 	device->bitmap->n_bitmap_hints = 0;
 }
 
-static int bm_test_page_unchanged(struct page *page)
+static int bm_test_page_unchanged(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	volatile const unsigned long *addr = &page_private(page);
+	volatile const unsigned long *addr = &bitmap->bm_page_flags[page_nr];
 	return (*addr & ((1UL<<BM_PAGE_NEED_WRITEOUT)|(1UL<<BM_PAGE_LAZY_WRITEOUT))) == 0;
 }
 
-static void bm_set_page_io_err(struct page *page)
+static void bm_set_page_io_err(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	set_bit(BM_PAGE_IO_ERROR, &page_private(page));
+	set_bit(BM_PAGE_IO_ERROR, &bitmap->bm_page_flags[page_nr]);
 }
 
-static void bm_clear_page_io_err(struct page *page)
+static void bm_clear_page_io_err(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	clear_bit(BM_PAGE_IO_ERROR, &page_private(page));
+	clear_bit(BM_PAGE_IO_ERROR, &bitmap->bm_page_flags[page_nr]);
 }
 
 static void bm_set_page_lazy_writeout(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM)) {
-		struct page *page = bitmap->bm_pages[page_nr];
-		set_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
-	}
+	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
+		set_bit(BM_PAGE_LAZY_WRITEOUT, &bitmap->bm_page_flags[page_nr]);
+	else if (bitmap->bm_dax_dirty)
+		set_bit(page_nr, bitmap->bm_dax_dirty);
 }
 
-static int bm_test_page_lazy_writeout(struct page *page)
+static int bm_test_page_lazy_writeout(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	return test_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
+	return test_bit(BM_PAGE_LAZY_WRITEOUT, &bitmap->bm_page_flags[page_nr]);
 }
 
 /*
@@ -335,25 +388,38 @@ static void bm_free_pages(struct page **pages, unsigned long number)
 				 i, number);
 			continue;
 		}
-		__free_page(pages[i]);
+		if (!bm_is_sentinel(pages[i]))
+			__free_page(pages[i]);
 		pages[i] = NULL;
 	}
 }
 
+static unsigned long bm_in_core_pages(struct drbd_bitmap *b)
+{
+	return b->bm_max_peers * b->bm_slot_pages;
+}
+
 /*
- * "have" and "want" are NUMBER OF PAGES.
+ * "have" and "want" are NUMBER OF PAGES on disk, "slot_pages" is the number
+ * of in-core pages per peer slot.
+ * The array of page pointers is followed by the array of page flags,
+ * those are filled in by drbd_bm_resize() under the spinlock.
+ * New pages are not allocated, but start out as sentinels.
  */
-static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
+static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want,
+				      unsigned long slot_pages, bool set_new_bits)
 {
 	struct page **old_pages = b->bm_pages;
-	struct page **new_pages, *page;
-	unsigned int i, bytes;
+	struct page **new_pages;
+	unsigned long i, bytes;
 	unsigned long have = b->bm_number_of_pages;
+	unsigned long old_slot_pages = b->bm_slot_pages;
+	unsigned int bitmap_index;
 
 	BUG_ON(have == 0 && old_pages != NULL);
 	BUG_ON(have != 0 && old_pages == NULL);
 
-	if (have == want)
+	if (have == want && old_slot_pages == slot_pages)
 		return old_pages;
 
 	/* Trying kmalloc first, falling back to vmalloc.
@@ -361,7 +427,8 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 	 * and during resize or attach on diskless Primary,
 	 * we must not block on IO to ourselves.
 	 * Context is receiver thread or dmsetup. */
-	bytes = sizeof(struct page *)*want;
+	bytes = sizeof(struct page *) * b->bm_max_peers * slot_pages +
+		sizeof(unsigned long) * want;
 	new_pages = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
 	if (!new_pages) {
 		new_pages = __vmalloc(bytes,
@@ -370,31 +437,61 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 			return NULL;
 	}
 
-	if (want >= have) {
-		for (i = 0; i < have; i++)
-			new_pages[i] = old_pages[i];
-		for (; i < want; i++) {
-			page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
-			if (!page) {
-				bm_free_pages(new_pages + have, i - have);
-				kvfree(new_pages);
-				return NULL;
-			}
-			/* we want to know which page it is
-			 * from the endio handlers */
-			bm_store_page_idx(page, i);
-			new_pages[i] = page;
+	/* the pages of each slot move to their new place,
+	 * those of a shrinking slot are freed by drbd_bm_resize(),
+	 * NOT HERE, we are outside the spinlock! */
+	for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+		struct page **to = new_pages + bitmap_index * slot_pages;
+
+		for (i = 0; i < slot_pages; i++) {
+			if (i < old_slot_pages)
+				to[i] = old_pages[bitmap_index * old_slot_pages + i];
+			else
+				to[i] = set_new_bits ? bm_ones_page : bm_zero_page;
 		}
-	} else {
-		for (i = 0; i < want; i++)
-			new_pages[i] = old_pages[i];
-		/* NOT HERE, we are outside the spinlock!
-		bm_free_pages(old_pages + want, have - want);
-		*/
 	}
 	return new_pages;
 }
 
+/* Replace in-core page @page_nr by a sentinel if it is all zero or all one.
+ * The caller keeps raw bitmap operations out, see drbd_bm_compact(). */
+static bool bm_drop_uniform_page(struct drbd_bitmap *b, unsigned int page_nr)
+{
+	struct page *page, *sentinel = NULL;
+	unsigned long irq_flags;
+	void *addr;
+
+	spin_lock_irqsave(&b->bm_lock, irq_flags);
+	page = b->bm_pages[page_nr];
+	if (!bm_is_sentinel(page)) {
+		addr = kmap_atomic(page);
+		if (!memchr_inv(addr, 0, PAGE_SIZE))
+			sentinel = bm_zero_page;
+		else if (!memchr_inv(addr, 0xff, PAGE_SIZE))
+			sentinel = bm_ones_page;
+		kunmap_atomic(addr);
+		if (sentinel)
+			b->bm_pages[page_nr] = sentinel;
+	}
+	spin_unlock_irqrestore(&b->bm_lock, irq_flags);
+
+	if (sentinel)
+		__free_page(page);
+	return sentinel != NULL;
+}
+
+/* see bm_set_page_need_writeout(), same allocation strategy as above */
+static unsigned long *bm_alloc_dax_dirty(unsigned long pages)
+{
+	unsigned int bytes = BITS_TO_LONGS(pages) * sizeof(unsigned long);
+	unsigned long *map;
+
+	map = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!map)
+		map = __vmalloc(bytes, GFP_NOIO | __GFP_ZERO);
+	return map;
+}
+
 struct drbd_bitmap *drbd_bm_alloc(void)
 {
 	struct drbd_bitmap *b;
@@ -408,6 +505,7 @@ struct drbd_bitmap *drbd_bm_alloc(void)
 	init_waitqueue_head(&b->bm_io_wait);
 
 	b->bm_max_peers = 1;
+	b->bm_block_shift = BM_BLOCK_SHIFT;
 
 	return b;
 }
@@ -421,11 +519,12 @@ sector_t drbd_bm_capacity(struct drbd_device *device)
 
 void drbd_bm_free(struct drbd_bitmap *bitmap)
 {
-	if (bitmap->bm_flags & BM_ON_DAX_PMEM)
-		return;
-
-	bm_free_pages(bitmap->bm_pages, bitmap->bm_number_of_pages);
-	kvfree(bitmap->bm_pages);
+	if (bitmap->bm_flags & BM_ON_DAX_PMEM) {
+		kvfree(bitmap->bm_dax_dirty);
+	} else {
+		bm_free_pages(bitmap->bm_pages, bm_in_core_pages(bitmap));
+		kvfree(bitmap->bm_pages);
+	}
 	kfree(bitmap);
 }
 
@@ -446,15 +545,33 @@ static inline unsigned int word32_in_page(unsigned long word)
 	return word & ((1 << (PAGE_SHIFT - 2)) - 1);
 }
 
+/* the word in core, see "bitmap storage and IO" above */
+static inline unsigned long bm_word32(struct drbd_bitmap *bitmap,
+				      unsigned int bitmap_index,
+				      unsigned long bit)
+{
+	if (bitmap->bm_flags & BM_ON_DAX_PMEM)
+		return interleaved_word32(bitmap, bitmap_index, bit);
+	return ((bitmap_index * bitmap->bm_slot_pages) << (PAGE_SHIFT - 2)) + (bit >> 5);
+}
+
+/* distance between consecutive words of one slot in core */
+static inline unsigned int bm_word32_stride(struct drbd_bitmap *bitmap)
+{
+	return bitmap->bm_flags & BM_ON_DAX_PMEM ? bitmap->bm_max_peers : 1;
+}
+
+/* last bit of the slot on the in-core page holding @bit */
 static inline unsigned long last_bit_on_page(struct drbd_bitmap *bitmap,
 					     unsigned int bitmap_index,
 					     unsigned long bit)
 {
-	unsigned long word = interleaved_word32(bitmap, bitmap_index, bit);
+	unsigned long word = bm_word32(bitmap, bitmap_index, bit);
 
-	return (bit | 31) + ((word32_in_page(-(word + 1)) / bitmap->bm_max_peers) << 5);
+	return (bit | 31) + ((word32_in_page(-(word + 1)) / bm_word32_stride(bitmap)) << 5);
 }
 
+/* the on-disk page holding @bit */
 static inline unsigned long bit_to_page_interleaved(struct drbd_bitmap *bitmap,
 						    unsigned int bitmap_index,
 						    unsigned long bit)
@@ -462,6 +579,48 @@ static inline unsigned long bit_to_page_interleaved(struct drbd_bitmap *bitmap,
 	return word32_to_page(interleaved_word32(bitmap, bitmap_index, bit));
 }
 
+/* flag the on-disk pages holding bits [first, last] of the slot */
+static void bm_set_range_writeout(struct drbd_bitmap *bitmap, unsigned int bitmap_index,
+				  unsigned long first, unsigned long last, bool lazy)
+{
+	unsigned long page_nr = bit_to_page_interleaved(bitmap, bitmap_index, first);
+	unsigned long last_page = bit_to_page_interleaved(bitmap, bitmap_index, last);
+
+	for (; page_nr <= last_page; page_nr++) {
+		if (lazy)
+			bm_set_page_lazy_writeout(bitmap, page_nr);
+		else
+			bm_set_page_need_writeout(bitmap, page_nr);
+	}
+}
+
+/* The in-core pages [*first, *last] of each slot that hold words of the
+ * on-disk pages [first_page, last_page]. */
+static void bm_in_core_range(struct drbd_bitmap *bitmap,
+			     unsigned long first_page, unsigned long last_page,
+			     unsigned long *first, unsigned long *last)
+{
+	*first = word32_to_page((first_page << (PAGE_SHIFT - 2)) / bitmap->bm_max_peers);
+	*last = word32_to_page((((last_page + 1) << (PAGE_SHIFT - 2)) - 1) / bitmap->bm_max_peers);
+	if (*last >= bitmap->bm_slot_pages)
+		*last = bitmap->bm_slot_pages - 1;
+}
+
+/* One bit of a coarse bitmap stands for 1 << bm_shift() bits of the
+ * BM_BLOCK_SIZE granularity used by everyone outside of this file. */
+static inline unsigned int bm_shift(struct drbd_bitmap *bitmap)
+{
+	return bitmap->bm_block_shift - BM_BLOCK_SHIFT;
+}
+
+/* number of BM_BLOCK_SIZE bits covered; bm_bits counts bits of the bitmap */
+static unsigned long bm_ext_bits(struct drbd_bitmap *bitmap)
+{
+	if (!bm_shift(bitmap))
+		return bitmap->bm_bits;
+	return BM_SECT_TO_BIT(ALIGN(bitmap->bm_dev_capacity, BM_SECT_PER_BIT));
+}
+
 static void *bm_map(struct drbd_bitmap *bitmap, unsigned int page)
 {
 	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
@@ -476,12 +635,92 @@ static void bm_unmap(struct drbd_bitmap *bitmap, void *addr)
 		kunmap_atomic(addr);
 }
 
+/* Called with bm_lock held, before ____bm_op() modifies a sentinel.  If we
+ * cannot get a page of our own, a page that is all zero becomes all one
+ * instead: a few more bits set than necessary only cost some resync.
+ * Returns the page now in place, still a sentinel on failure.
+ */
+static struct page *bm_materialize_page(struct drbd_device *device, unsigned int page_nr)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	struct page *sentinel = b->bm_pages[page_nr];
+	struct page *page;
+	unsigned long first, last;
+	unsigned int bitmap_index;
+
+	page = alloc_page(GFP_ATOMIC | __GFP_HIGHMEM | __GFP_NOWARN);
+	if (page) {
+		copy_highpage(page, sentinel);
+		bm_store_page_idx(page, page_nr);
+		b->bm_pages[page_nr] = page;
+		return page;
+	}
+	if (sentinel == bm_ones_page)
+		return sentinel;
+
+	b->bm_pages[page_nr] = bm_ones_page;
+	bitmap_index = page_nr / b->bm_slot_pages;
+	first = (page_nr % b->bm_slot_pages) * BITS_PER_PAGE;
+	if (first < b->bm_bits) {
+		last = min(first + BITS_PER_PAGE, b->bm_bits) - 1;
+		b->bm_set[bitmap_index] += last - first + 1;
+		bm_set_range_writeout(b, bitmap_index, first, last, false);
+	}
+	if (drbd_ratelimit())
+		drbd_warn(device, "no memory for bitmap page %u, marked it all out of sync\n", page_nr);
+	return bm_ones_page;
+}
+
+/* Returns false if ____bm_op() skips the page: there is nothing to find in,
+ * or to count on, bm_zero_page, no zero bit to find in bm_ones_page, and a
+ * CLEAR leaves the bits of a page it cannot get memory for set.  The
+ * sentinels never change, so SET on bm_ones_page and CLEAR on bm_zero_page
+ * work on them directly, as does a MERGE that would not set any bit. */
+static __always_inline bool
+bm_prepare_page(struct drbd_device *device, unsigned int bitmap_index, unsigned int page_nr,
+		unsigned long start, unsigned long end, enum bitmap_operations op,
+		const __le32 *buffer)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	struct page *page;
+
+	if (b->bm_flags & BM_ON_DAX_PMEM)
+		return true;
+
+	page = b->bm_pages[page_nr];
+	switch (op) {
+	case BM_OP_FIND_BIT:
+	case BM_OP_COUNT:
+		return page != bm_zero_page;
+	case BM_OP_FIND_ZERO_BIT:
+		return page != bm_ones_page;
+	case BM_OP_CLEAR:
+		if (page != bm_ones_page)
+			return true;
+		return !bm_is_sentinel(bm_materialize_page(device, page_nr));
+	case BM_OP_SET:
+	case BM_OP_MERGE:
+		if (page != bm_zero_page)
+			return true;
+		if (op == BM_OP_MERGE) {
+			unsigned long last = min(end, last_bit_on_page(b, bitmap_index, start));
+
+			if (!memchr_inv(buffer, 0, ((last >> 5) - (start >> 5) + 1) * sizeof(*buffer)))
+				return true;
+		}
+		bm_materialize_page(device, page_nr);
+		return true;
+	default:
+		return true;
+	}
+}
+
 static __always_inline unsigned long
 ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
 	 enum bitmap_operations op, __le32 *buffer)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
-	unsigned int word32_skip = 32 * bitmap->bm_max_peers;
+	unsigned int word32_skip = 32 * bm_word32_stride(bitmap);
 	unsigned long total = 0;
 	unsigned long word;
 	unsigned int page, bit_in_page;
@@ -489,14 +728,21 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 	if (end >= bitmap->bm_bits)
 		end = bitmap->bm_bits - 1;
 
-	word = interleaved_word32(bitmap, bitmap_index, start);
+	word = bm_word32(bitmap, bitmap_index, start);
 	page = word32_to_page(word);
 	bit_in_page = (word32_in_page(word) << 5) | (start & 31);
 
 	for (; start <= end; page++) {
+		unsigned long first = start;
 		unsigned int count = 0;
 		void *addr;
 
+		if (!bm_prepare_page(device, bitmap_index, page, start, end, op, buffer)) {
+			start = last_bit_on_page(bitmap, bitmap_index, start) + 1;
+			bit_in_page = word32_in_page(bm_word32(bitmap, bitmap_index, start)) << 5;
+			continue;
+		}
+
 		addr = bm_map(bitmap, page);
 		if (((start & 31) && (start | 31) <= end) || op == BM_OP_TEST) {
 			unsigned int last = bit_in_page | 31;
@@ -666,14 +912,14 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		switch(op) {
 		case BM_OP_CLEAR:
 			if (count) {
-				bm_set_page_lazy_writeout(bitmap, page);
+				bm_set_range_writeout(bitmap, bitmap_index, first, start - 1, true);
 				total += count;
 			}
 			break;
 		case BM_OP_SET:
 		case BM_OP_MERGE:
 			if (count) {
-				bm_set_page_need_writeout(bitmap, page);
+				bm_set_range_writeout(bitmap, bitmap_index, first, start - 1, false);
 				total += count;
 			}
 			break;
@@ -791,6 +1037,100 @@ bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start
 	____bm_op(device, bitmap_index, start, end, op, buffer)
 #endif
 
+/* Translate the BM_BLOCK_SIZE bit range [*start, *end] into bits of a coarse
+ * bitmap.  Setting (and testing) rounds outwards, clearing rounds inwards:
+ * a coarse bit is only cleared if the range covers all of it, or reaches the
+ * end of the device.  Returns false if nothing is left to clear.
+ */
+static bool bm_scale_range(struct drbd_bitmap *bitmap, unsigned long *start, unsigned long *end,
+			   enum bitmap_operations op)
+{
+	unsigned int shift = bm_shift(bitmap);
+	unsigned long mask = (1UL << shift) - 1;
+
+	if (op != BM_OP_CLEAR) {
+		*start >>= shift;
+		*end >>= shift;
+		return true;
+	}
+
+	*start = (*start >> shift) + !!(*start & mask);
+	if (*end >= bm_ext_bits(bitmap) - 1)
+		*end = -1UL;
+	else if ((*end + 1) >> shift == 0)
+		return false;
+	else
+		*end = ((*end + 1) >> shift) - 1;
+	return *start <= *end;
+}
+
+/* Set or clear the coarse bits [start, end], returns the number of
+ * BM_BLOCK_SIZE blocks that changed state.  The last bit of the bitmap may
+ * cover less than 1 << bm_shift() of them.  Called with bm_lock held. */
+static unsigned long bm_scaled_op(struct drbd_device *device, unsigned int bitmap_index,
+				  unsigned long start, unsigned long end, enum bitmap_operations op)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long last = bitmap->bm_bits - 1;
+	unsigned long count = 0;
+
+	if (!bitmap->bm_bits || start > last)
+		return 0;
+
+	if (end >= last) {
+		if (__bm_op(device, bitmap_index, last, last, op, NULL))
+			count = bm_ext_bits(bitmap) - (last << bm_shift(bitmap));
+		if (start == last)
+			return count;
+		end = last - 1;
+	}
+	return count + (__bm_op(device, bitmap_index, start, end, op, NULL) << bm_shift(bitmap));
+}
+
+/* Number of BM_BLOCK_SIZE blocks in [start, end] covered by set coarse bits.
+ * Called with bm_lock held. */
+static unsigned long bm_scaled_count(struct drbd_device *device, unsigned int bitmap_index,
+				     unsigned long start, unsigned long end)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned int shift = bm_shift(bitmap);
+	unsigned long ext_bits = bm_ext_bits(bitmap);
+	unsigned long first, last, count = 0;
+
+	if (end >= ext_bits)
+		end = ext_bits - 1;
+	if (!ext_bits || start > end)
+		return 0;
+
+	first = start >> shift;
+	last = end >> shift;
+	if (first == last)
+		return __bm_op(device, bitmap_index, first, first, BM_OP_TEST, NULL) ? end - start + 1 : 0;
+
+	if (__bm_op(device, bitmap_index, first, first, BM_OP_TEST, NULL))
+		count += ((first + 1) << shift) - start;
+	if (__bm_op(device, bitmap_index, last, last, BM_OP_TEST, NULL))
+		count += end - (last << shift) + 1;
+	if (first + 1 < last)
+		count += __bm_op(device, bitmap_index, first + 1, last - 1, BM_OP_COUNT, NULL) << shift;
+	return count;
+}
+
+static unsigned long bm_scaled_find(struct drbd_device *device, unsigned int bitmap_index,
+				    unsigned long start, enum bitmap_operations op)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long bit;
+
+	if (!bitmap->bm_bits)
+		return DRBD_END_OF_BITMAP;
+	bit = ___bm_op(device, bitmap_index, start >> bm_shift(bitmap), -1UL, op, NULL);
+	if (bit == DRBD_END_OF_BITMAP)
+		return bit;
+	bit = max(bit << bm_shift(bitmap), start);
+	return bit < bm_ext_bits(bitmap) ? bit : DRBD_END_OF_BITMAP;
+}
+
 /* you better not modify the bitmap while this is running,
  * or its results will be stale */
 static void bm_count_bits(struct drbd_device *device)
@@ -844,7 +1184,9 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	struct drbd_bitmap *b = device->bitmap;
 	unsigned long bits, words, obits;
 	unsigned long want, have, onpages; /* number of pages */
+	unsigned long slot_pages, old_slot_pages;
 	struct page **npages = NULL, **opages = NULL;
+	unsigned long *ndirty = NULL, *odirty = NULL;
 	void *bm_on_pmem = NULL;
 	int err = 0;
 	bool growing;
@@ -865,9 +1207,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 
 		spin_lock_irq(&b->bm_lock);
 		opages = b->bm_pages;
-		onpages = b->bm_number_of_pages;
+		onpages = bm_in_core_pages(b);
 		b->bm_pages = NULL;
+		b->bm_page_flags = NULL;
 		b->bm_number_of_pages = 0;
+		b->bm_slot_pages = 0;
 		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
 			b->bm_set[bitmap_index] = 0;
 		b->bm_bits = 0;
@@ -880,7 +1224,7 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		}
 		goto out;
 	}
-	bits  = BM_SECT_TO_BIT(ALIGN(capacity, BM_SECT_PER_BIT));
+	bits  = ALIGN(capacity, BM_SECT_PER_BIT << bm_shift(b)) >> (b->bm_block_shift - 9);
 	words = (ALIGN(bits, 64) * b->bm_max_peers) / BITS_PER_LONG;
 
 	if (get_ldev(device)) {
@@ -896,23 +1240,40 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 
 	want = ALIGN(words*sizeof(long), PAGE_SIZE) >> PAGE_SHIFT;
 	have = b->bm_number_of_pages;
+	slot_pages = ALIGN(ALIGN(bits, 64) / 8, PAGE_SIZE) >> PAGE_SHIFT;
+	old_slot_pages = b->bm_slot_pages;
 	if (drbd_md_dax_active(device->ldev)) {
 		bm_on_pmem = drbd_dax_bitmap(device, want);
+		ndirty = bm_alloc_dax_dirty(want);
+		if (!ndirty) {
+			err = -ENOMEM;
+			goto out;
+		}
 	} else {
-		if (want == have) {
+		if (want == have && slot_pages == old_slot_pages) {
 			D_ASSERT(device, b->bm_pages != NULL);
 			npages = b->bm_pages;
 		} else {
 			if (drbd_insert_fault(device, DRBD_FAULT_BM_ALLOC))
 				npages = NULL;
 			else
-				npages = bm_realloc_pages(b, want);
+				npages = bm_realloc_pages(b, want, slot_pages, set_new_bits);
 		}
 
 		if (!npages) {
 			err = -ENOMEM;
 			goto out;
 		}
+
+		/* the page flags move to the new array,
+		 * no IO on the old pages must be in flight */
+		if (npages != b->bm_pages) {
+			unsigned long i;
+
+			for (i = 0; i < have; i++)
+				wait_event(b->bm_io_wait,
+					   !test_bit(BM_PAGE_IO_LOCK, &b->bm_page_flags[i]));
+		}
 	}
 
 	spin_lock_irq(&b->bm_lock);
@@ -925,6 +1286,7 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 			void *src = b->bm_on_pmem;
 			memmove(bm_on_pmem, src, b->bm_words * sizeof(long));
 			arch_wb_cache_pmem(bm_on_pmem, b->bm_words * sizeof(long));
+			drbd_dax_fence();
 		} else {
 			/* We are attaching a bitmap on PMEM. Since the memory
 			 * is persistent, the bitmap is still valid. Do not
@@ -932,10 +1294,25 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 			growing = false;
 		}
 		b->bm_on_pmem = bm_on_pmem;
+		odirty = b->bm_dax_dirty;
+		b->bm_dax_dirty = ndirty;
 		b->bm_flags |= BM_ON_DAX_PMEM;
 	} else {
 		opages = b->bm_pages;
+		if (npages != opages) {
+			unsigned long *nflags = (unsigned long *)(npages + b->bm_max_peers * slot_pages);
+			unsigned long i;
+
+			for (i = 0; i < want; i++) {
+				if (i < have)
+					nflags[i] = b->bm_page_flags[i];
+				else if (set_new_bits)
+					nflags[i] = 1UL << BM_PAGE_NEED_WRITEOUT;
+			}
+			b->bm_page_flags = nflags;
+		}
 		b->bm_pages = npages;
+		b->bm_slot_pages = slot_pages;
 	}
 	b->bm_number_of_pages = want;
 	b->bm_bits  = bits;
@@ -959,17 +1336,23 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		}
 	}
 
-	if (want < have && !(b->bm_flags & BM_ON_DAX_PMEM)) {
+	if (slot_pages < old_slot_pages && !(b->bm_flags & BM_ON_DAX_PMEM)) {
 		/* implicit: (opages != NULL) && (opages != npages) */
-		bm_free_pages(opages + want, have - want);
+		unsigned int bitmap_index;
+
+		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
+			bm_free_pages(opages + bitmap_index * old_slot_pages + slot_pages,
+				      old_slot_pages - slot_pages);
 	}
 
 	spin_unlock_irq(&b->bm_lock);
 	if (opages != npages)
 		kvfree(opages);
+	kvfree(odirty);
 	if (!growing)
 		bm_count_bits(device);
-	drbd_info(device, "resync bitmap: bits=%lu words=%lu pages=%lu\n", bits, words, want);
+	drbd_info(device, "resync bitmap: bits=%lu words=%lu pages=%lu pages_per_slot=%lu bytes_per_bit=%u\n",
+		  bits, words, want, slot_pages, 1U << b->bm_block_shift);
 
  out:
 	drbd_bm_unlock(device);
@@ -995,6 +1378,13 @@ unsigned long _drbd_bm_total_weight(struct drbd_device *device, int bitmap_index
 
 	spin_lock_irqsave(&b->bm_lock, flags);
 	s = b->bm_set[bitmap_index];
+	if (bm_shift(b) && s) {
+		unsigned long last = b->bm_bits - 1;
+
+		s <<= bm_shift(b);
+		if (___bm_op(device, bitmap_index, last, last, BM_OP_TEST, NULL))
+			s -= ((last + 1) << bm_shift(b)) - bm_ext_bits(b);
+	}
 	spin_unlock_irqrestore(&b->bm_lock, flags);
 
 	return s;
@@ -1025,6 +1415,8 @@ size_t drbd_bm_words(struct drbd_device *device)
 	if (!expect(device, b->bm_pages))
 		return 0;
 
+	if (bm_shift(b))
+		return ALIGN(bm_ext_bits(b), 64) / BITS_PER_LONG;
 	return b->bm_words / b->bm_max_peers;
 }
 
@@ -1034,7 +1426,70 @@ unsigned long drbd_bm_bits(struct drbd_device *device)
 	if (!expect(device, b))
 		return 0;
 
-	return b->bm_bits;
+	return bm_ext_bits(b);
+}
+
+/* set bits [first, last] of a little endian buffer */
+static void bm_set_le_range(unsigned long *buffer, unsigned long first, unsigned long last)
+{
+	while (first <= last) {
+		if (!(first % BITS_PER_LONG) && first + BITS_PER_LONG - 1 <= last) {
+			buffer[first / BITS_PER_LONG] = ~0UL;
+			first += BITS_PER_LONG;
+		} else {
+			__set_bit_le(first, buffer);
+			first++;
+		}
+	}
+}
+
+/* The bitmap exchange is in units of BM_BLOCK_SIZE, whatever our granularity.
+ * A set bit from the peer dirties the whole coarse bit it falls into. */
+static void bm_scaled_merge(struct drbd_device *device, unsigned int bitmap_index,
+			    unsigned long start, unsigned long end, unsigned long *buffer)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned long nbits = end - start + 1;
+	unsigned long i, j, irq_flags;
+
+	spin_lock_irqsave(&b->bm_lock, irq_flags);
+	for (i = find_next_bit_le(buffer, nbits, 0); i < nbits;
+	     i = find_next_bit_le(buffer, nbits, j)) {
+		j = find_next_zero_bit_le(buffer, nbits, i);
+		__bm_op(device, bitmap_index, (start + i) >> bm_shift(b),
+			(start + j - 1) >> bm_shift(b), BM_OP_SET, NULL);
+	}
+	spin_unlock_irqrestore(&b->bm_lock, irq_flags);
+}
+
+static void bm_scaled_extract(struct drbd_device *device, unsigned int bitmap_index,
+			      unsigned long start, unsigned long end, unsigned long *buffer)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned int shift = bm_shift(b);
+	unsigned long ext_bits = bm_ext_bits(b);
+	unsigned long bit, last, irq_flags;
+
+	memset(buffer, 0, (end - start + 1) / BITS_PER_BYTE);
+	if (end >= ext_bits)
+		end = ext_bits - 1;
+	if (!ext_bits || start > end)
+		return;
+
+	spin_lock_irqsave(&b->bm_lock, irq_flags);
+	bit = start >> shift;
+	while (bit <= end >> shift) {
+		bit = ___bm_op(device, bitmap_index, bit, end >> shift, BM_OP_FIND_BIT, NULL);
+		if (bit == DRBD_END_OF_BITMAP)
+			break;
+		last = ___bm_op(device, bitmap_index, bit, end >> shift, BM_OP_FIND_ZERO_BIT, NULL);
+		if (last == DRBD_END_OF_BITMAP)
+			last = (end >> shift) + 1;
+		bm_set_le_range(buffer, max(bit << shift, start) - start,
+				min((last << shift) - 1, end) - start);
+		bit = last;
+	}
+	spin_unlock_irqrestore(&b->bm_lock, irq_flags);
 }
 
 /* merge number words from buffer into the bitmap starting at offset.
@@ -1049,7 +1504,10 @@ void drbd_bm_merge_lel(struct drbd_peer_device *peer_device, size_t offset, size
 
 	start = offset * BITS_PER_LONG;
 	end = start + number * BITS_PER_LONG - 1;
-	bm_op(peer_device->device, peer_device->bitmap_index, start, end, BM_OP_MERGE, (__le32 *)buffer);
+	if (bm_shift(peer_device->device->bitmap))
+		bm_scaled_merge(peer_device->device, peer_device->bitmap_index, start, end, buffer);
+	else
+		bm_op(peer_device->device, peer_device->bitmap_index, start, end, BM_OP_MERGE, (__le32 *)buffer);
 }
 
 /* copy number words from the bitmap starting at offset into the buffer.
@@ -1062,7 +1520,10 @@ void drbd_bm_get_lel(struct drbd_peer_device *peer_device, size_t offset, size_t
 
 	start = offset * BITS_PER_LONG;
 	end = start + number * BITS_PER_LONG - 1;
-	bm_op(peer_device->device, peer_device->bitmap_index, start, end, BM_OP_EXTRACT, (__le32 *)buffer);
+	if (bm_shift(peer_device->device->bitmap))
+		bm_scaled_extract(peer_device->device, peer_device->bitmap_index, start, end, buffer);
+	else
+		bm_op(peer_device->device, peer_device->bitmap_index, start, end, BM_OP_EXTRACT, (__le32 *)buffer);
 }
 
 
@@ -1078,39 +1539,90 @@ static void drbd_bm_aio_ctx_destroy(struct kref *kref)
 	kfree(ctx);
 }
 
-/* bv_page may be a copy, or may be the original */
+/* Copy between the on-disk page @page_nr and the in-core pages of the slots,
+ * @to_disk or from it.  Called with bm_lock held.  When reading, the in-core
+ * pages must not be sentinels, see bm_prepare_page_read(). */
+static void bm_copy_on_disk_page(struct drbd_bitmap *b, unsigned long page_nr,
+				 struct page *page, bool to_disk)
+{
+	unsigned int max_peers = b->bm_max_peers;
+	unsigned long first_word = page_nr << (PAGE_SHIFT - 2);
+	unsigned long end_word = first_word + (PAGE_SIZE / sizeof(u32));
+	unsigned long slot_words = b->bm_slot_pages << (PAGE_SHIFT - 2);
+	unsigned int bitmap_index;
+	u32 *disk;
+
+	disk = kmap_atomic(page);
+	if (to_disk)
+		memset(disk, 0, PAGE_SIZE);
+	for (bitmap_index = 0; bitmap_index < max_peers; bitmap_index++) {
+		unsigned long word = first_word +
+			(bitmap_index + max_peers - first_word % max_peers) % max_peers;
+		unsigned long in_core_page = -1UL;
+		u32 *addr = NULL;
+
+		for (; word < end_word && word / max_peers < slot_words; word += max_peers) {
+			unsigned long in_core = bm_word32(b, bitmap_index, (word / max_peers) << 5);
+
+			if (word32_to_page(in_core) != in_core_page) {
+				if (addr)
+					kunmap_atomic(addr);
+				in_core_page = word32_to_page(in_core);
+				if (WARN_ON_ONCE(!to_disk && bm_is_sentinel(b->bm_pages[in_core_page]))) {
+					addr = NULL;
+					break;
+				}
+				addr = kmap_atomic(b->bm_pages[in_core_page]);
+			}
+			if (to_disk)
+				disk[word32_in_page(word)] = addr[word32_in_page(in_core)];
+			else
+				addr[word32_in_page(in_core)] = disk[word32_in_page(word)];
+		}
+		if (addr)
+			kunmap_atomic(addr);
+	}
+	kunmap_atomic(disk);
+}
+
+/* bv_page is always a copy, see bm_page_io_async() */
 static void drbd_bm_endio(struct bio *bio)
 {
 	struct drbd_bm_aio_ctx *ctx = bio->bi_private;
 	struct drbd_device *device = ctx->device;
 	struct drbd_bitmap *b = device->bitmap;
-	unsigned int idx = bm_page_to_idx(bio->bi_io_vec[0].bv_page);
+	struct page *page = bio->bi_io_vec[0].bv_page;
+	unsigned int idx = bm_page_to_idx(page);
+	unsigned long irq_flags;
 
 	blk_status_t status = bio->bi_status;
 
-	if ((ctx->flags & BM_AIO_COPY_PAGES) == 0 &&
-	    !bm_test_page_unchanged(b->bm_pages[idx]))
-		drbd_warn(device, "bitmap page idx %u changed during IO!\n", idx);
-
 	if (status) {
 		/* ctx error will hold the completed-last non-zero error code,
 		 * in case error codes differ. */
 		ctx->error = blk_status_to_errno(status);
-		bm_set_page_io_err(b->bm_pages[idx]);
+		bm_set_page_io_err(b, idx);
+		/* nobody waits for a write behind, the next hinted write retries */
+		if (ctx->flags & BM_AIO_NO_WAIT)
+			bm_set_page_need_writeout(b, idx);
 		/* Not identical to on disk version of it.
 		 * Is BM_PAGE_IO_ERROR enough? */
 		if (drbd_ratelimit())
 			drbd_err(device, "IO ERROR %d on bitmap page idx %u\n",
 				 status, idx);
 	} else {
-		bm_clear_page_io_err(b->bm_pages[idx]);
+		bm_clear_page_io_err(b, idx);
 		dynamic_drbd_dbg(device, "bitmap page idx %u completed\n", idx);
+		if (ctx->flags & BM_AIO_READ) {
+			spin_lock_irqsave(&b->bm_lock, irq_flags);
+			bm_copy_on_disk_page(b, idx, page, false);
+			spin_unlock_irqrestore(&b->bm_lock, irq_flags);
+		}
 	}
 
 	bm_page_unlock_io(device, idx);
 
-	if (ctx->flags & BM_AIO_COPY_PAGES)
-		mempool_free(bio->bi_io_vec[0].bv_page, &drbd_md_io_page_pool);
+	mempool_free(page, &drbd_md_io_page_pool);
 
 	bio_put(bio);
 
@@ -1121,6 +1633,43 @@ static void drbd_bm_endio(struct bio *bio)
 	}
 }
 
+/* Reads go to in-core pages of our own, drbd_bm_read() drops those that
+ * turn out all zero or all one again.  Context: process. */
+static int bm_prepare_page_read(struct drbd_bitmap *b, unsigned int page_nr)
+{
+	unsigned long first, last, i;
+	unsigned int bitmap_index;
+
+	bm_in_core_range(b, page_nr, page_nr, &first, &last);
+	for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+		for (i = first; i <= last; i++) {
+			unsigned long in_core_page = bitmap_index * b->bm_slot_pages + i;
+			struct page *page;
+
+			if (!bm_is_sentinel(b->bm_pages[in_core_page]))
+				continue;
+
+			page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+			if (!page)
+				return -ENOMEM;
+			bm_store_page_idx(page, in_core_page);
+
+			spin_lock_irq(&b->bm_lock);
+			if (bm_is_sentinel(b->bm_pages[in_core_page])) {
+				/* an earlier chunk may have read part of it */
+				copy_highpage(page, b->bm_pages[in_core_page]);
+				b->bm_pages[in_core_page] = page;
+				page = NULL;
+			}
+			spin_unlock_irq(&b->bm_lock);
+
+			if (page)
+				__free_page(page);
+		}
+	}
+	return 0;
+}
+
 static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_hold(local)
 {
 	struct bio *bio = bio_alloc_drbd(GFP_NOIO);
@@ -1144,15 +1693,22 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 	bm_page_lock_io(device, page_nr);
 	/* before memcpy and submit,
 	 * so it can be redirtied any time */
-	bm_set_page_unchanged(b->bm_pages[page_nr]);
-
-	if (ctx->flags & BM_AIO_COPY_PAGES) {
-		page = mempool_alloc(&drbd_md_io_page_pool,
-				GFP_NOIO | __GFP_HIGHMEM);
-		copy_highpage(page, b->bm_pages[page_nr]);
-		bm_store_page_idx(page, page_nr);
-	} else
-		page = b->bm_pages[page_nr];
+	bm_set_page_unchanged(b, page_nr);
+
+	/* the words of the on-disk page are spread over the in-core pages of
+	 * all slots, collect them into a temporary page, or distribute them
+	 * from there in drbd_bm_endio() */
+	page = mempool_alloc(&drbd_md_io_page_pool,
+			GFP_NOIO | __GFP_HIGHMEM);
+	if (op == REQ_OP_READ) {
+		/* the last page may be read only partially */
+		clear_highpage(page);
+	} else {
+		spin_lock_irq(&b->bm_lock);
+		bm_copy_on_disk_page(b, page_nr, page, true);
+		spin_unlock_irq(&b->bm_lock);
+	}
+	bm_store_page_idx(page, page_nr);
 	bio_set_dev(bio, device->ldev->md_bdev);
 	bio->bi_iter.bi_sector = on_disk_sector;
 	/* bio_add_page of a single page to an empty bio will always succeed,
@@ -1173,6 +1729,32 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 	}
 }
 
+/* The bitmap on pmem is modified in place, "writing" it means writing back
+ * the cache lines of the pages that changed since their last write back. */
+static void bm_dax_write_back(struct drbd_bitmap *b,
+	unsigned int start_page, unsigned int end_page, bool all)
+{
+	unsigned long page = start_page;
+	unsigned long last;
+
+	if (!b->bm_number_of_pages || !b->bm_dax_dirty)
+		return;
+	last = min_t(unsigned long, end_page, b->bm_number_of_pages - 1);
+
+	for (; page <= last; page++) {
+		if (!all) {
+			page = find_next_bit(b->bm_dax_dirty, last + 1, page);
+			if (page > last)
+				break;
+		}
+		/* clear before the write back; concurrent modifications
+		 * set it again, and are written back next time */
+		clear_bit(page, b->bm_dax_dirty);
+		arch_wb_cache_pmem(bm_map(b, page), PAGE_SIZE);
+	}
+	drbd_dax_fence();
+}
+
 /**
  * bm_rw_range() - read/write the specified range of bitmap pages
  * @device: drbd device this bitmap is associated with
@@ -1200,8 +1782,9 @@ static int bm_rw_range(struct drbd_device *device,
 	int err = 0;
 
 	if (b->bm_flags & BM_ON_DAX_PMEM) {
-		if (flags & (BM_AIO_WRITE_HINTED | BM_AIO_WRITE_ALL_PAGES | BM_AIO_WRITE_LAZY))
-			arch_wb_cache_pmem(b->bm_on_pmem, b->bm_words * sizeof(long));
+		if (!(flags & BM_AIO_READ))
+			bm_dax_write_back(b, start_page, end_page,
+					  flags & BM_AIO_WRITE_ALL_PAGES);
 		return 0;
 	}
 	/*
@@ -1257,6 +1840,13 @@ static int bm_rw_range(struct drbd_device *device,
 
 	if (flags & BM_AIO_READ) {
 		for (i = start_page; i <= end_page; i++) {
+			/* No bm_drop_uniform_page() can run concurrently,
+			 * the bitmap is locked by drbd_bm_lock() for reading */
+			err = bm_prepare_page_read(b, i);
+			if (err) {
+				drbd_err(device, "could not allocate bitmap page %u\n", i);
+				break;
+			}
 			atomic_inc(&ctx->in_flight);
 			bm_page_io_async(ctx, i);
 			++count;
@@ -1271,11 +1861,17 @@ static int bm_rw_range(struct drbd_device *device,
 				continue;
 			/* Several AL-extents may point to the same page. */
 			if (!test_and_clear_bit(BM_PAGE_HINT_WRITEOUT,
-			    &page_private(b->bm_pages[i])))
+			    &b->bm_page_flags[i]))
 				continue;
 			/* Has it even changed? */
-			if (bm_test_page_unchanged(b->bm_pages[i]))
-				continue;
+			if (bm_test_page_unchanged(b, i)) {
+				/* A write behind may still be in flight.
+				 * The AL transaction must not overtake it. */
+				wait_event(b->bm_io_wait, !test_bit(BM_PAGE_IO_LOCK,
+							&b->bm_page_flags[i]));
+				if (bm_test_page_unchanged(b, i))
+					continue;
+			}
 			atomic_inc(&ctx->in_flight);
 			bm_page_io_async(ctx, i);
 			++count;
@@ -1285,14 +1881,14 @@ static int bm_rw_range(struct drbd_device *device,
 			/* ignore completely unchanged pages,
 			 * unless specifically requested to write ALL pages */
 			if (!(flags & BM_AIO_WRITE_ALL_PAGES) &&
-			    bm_test_page_unchanged(b->bm_pages[i])) {
+			    bm_test_page_unchanged(b, i)) {
 				dynamic_drbd_dbg(device, "skipped bm write for idx %u\n", i);
 				continue;
 			}
 			/* during lazy writeout,
 			 * ignore those pages not marked for lazy writeout. */
 			if ((flags & BM_AIO_WRITE_LAZY) &&
-			    !bm_test_page_lazy_writeout(b->bm_pages[i])) {
+			    !bm_test_page_lazy_writeout(b, i)) {
 				dynamic_drbd_dbg(device, "skipped bm lazy write for idx %u\n", i);
 				continue;
 			}
@@ -1312,10 +1908,16 @@ static int bm_rw_range(struct drbd_device *device,
 	 * "in_flight reached zero, all done" event.
 	 */
 	if (!atomic_dec_and_test(&ctx->in_flight)) {
-		wait_until_done_or_force_detached(device, device->ldev, &ctx->done);
+		if (!(flags & BM_AIO_NO_WAIT))
+			wait_until_done_or_force_detached(device, device->ldev, &ctx->done);
 	} else
 		kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
 
+	if (flags & BM_AIO_NO_WAIT) {
+		kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
+		return 0;
+	}
+
 	/* summary for global bitmap IO */
 	if (flags == 0 && count) {
 		unsigned int ms = jiffies_to_msecs(jiffies - now);
@@ -1335,13 +1937,6 @@ static int bm_rw_range(struct drbd_device *device,
 	if (atomic_read(&ctx->in_flight))
 		err = -EIO; /* Disk timeout/force-detach during IO... */
 
-	if (flags & BM_AIO_READ) {
-		now = jiffies;
-		bm_count_bits(device);
-		drbd_info(device, "recounting of set bits took additional %ums\n",
-		     jiffies_to_msecs(jiffies - now));
-	}
-
 	kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
 	return err;
 }
@@ -1351,6 +1946,25 @@ static int bm_rw(struct drbd_device *device, unsigned flags)
 	return bm_rw_range(device, 0, -1U, flags);
 }
 
+/* Drop the in-core pages of all slots behind on-disk pages
+ * @first_page..@last_page that are uniform.  The last of them may be
+ * read only partially, bm_prepare_page_read() gives it back. */
+static void bm_drop_uniform_range(struct drbd_bitmap *b,
+				  unsigned long first_page, unsigned long last_page)
+{
+	unsigned long first, last, i;
+	unsigned int bitmap_index;
+
+	if (last_page >= b->bm_number_of_pages)
+		last_page = b->bm_number_of_pages - 1;
+	bm_in_core_range(b, first_page, last_page, &first, &last);
+	for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+		for (i = first; i <= last; i++)
+			bm_drop_uniform_page(b, bitmap_index * b->bm_slot_pages + i);
+		cond_resched();
+	}
+}
+
 /**
  * drbd_bm_read() - Read the whole bitmap from its on disk location.
  * @device:	DRBD device.
@@ -1358,15 +1972,34 @@ static int bm_rw(struct drbd_device *device, unsigned flags)
 int drbd_bm_read(struct drbd_device *device,
 		 struct drbd_peer_device *peer_device) __must_hold(local)
 {
-	return bm_rw(device, BM_AIO_READ);
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned int page_nr = 0;
+	unsigned long now;
+	int err;
+
+	if (b->bm_flags & BM_ON_DAX_PMEM)
+		return bm_rw(device, BM_AIO_READ);
+
+	do {
+		err = bm_rw_range(device, page_nr, page_nr + BM_READ_CHUNK_PAGES - 1, BM_AIO_READ);
+		if (err)
+			return err;
+		bm_drop_uniform_range(b, page_nr, page_nr + BM_READ_CHUNK_PAGES - 1);
+		page_nr += BM_READ_CHUNK_PAGES;
+	} while (page_nr < b->bm_number_of_pages);
+
+	now = jiffies;
+	bm_count_bits(device);
+	drbd_info(device, "recounting of set bits took additional %ums\n",
+	     jiffies_to_msecs(jiffies - now));
+	return 0;
 }
 
 static void push_al_bitmap_hint(struct drbd_device *device, unsigned int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	struct page *page = b->bm_pages[page_nr];
 	BUG_ON(b->n_bitmap_hints >= ARRAY_SIZE(b->al_bitmap_hints));
-	if (!test_and_set_bit(BM_PAGE_HINT_WRITEOUT, &page_private(page)))
+	if (!test_and_set_bit(BM_PAGE_HINT_WRITEOUT, &b->bm_page_flags[page_nr]))
 		b->al_bitmap_hints[b->n_bitmap_hints++] = page_nr;
 }
 
@@ -1386,6 +2019,8 @@ void drbd_bm_mark_range_for_writeout(struct drbd_device *device, unsigned long s
 	if (bitmap->bm_flags & BM_ON_DAX_PMEM)
 		return;
 
+	start >>= bm_shift(bitmap);
+	end >>= bm_shift(bitmap);
 	if (end >= bitmap->bm_bits)
 		end = bitmap->bm_bits - 1;
 
@@ -1437,8 +2072,9 @@ int drbd_bm_write_lazy(struct drbd_device *device, unsigned upper_idx) __must_ho
  * @device:	DRBD device.
  *
  * Will only write pages that have changed since last IO.
- * In contrast to drbd_bm_write(), this will copy the bitmap pages
- * to temporary writeout pages. It is intended to trigger a full write-out
+ * In contrast to drbd_bm_write(), this does not expect the bitmap to be
+ * locked; like any write, it goes out through temporary writeout pages
+ * gathered from the in-core bitmap. It is intended to trigger a full write-out
  * while still allowing the bitmap to change, for example if a resync or online
  * verify is aborted due to a failed peer disk, while local IO continues, or
  * pending resync acks are still being processed.
@@ -1458,10 +2094,52 @@ int drbd_bm_write_hinted(struct drbd_device *device) __must_hold(local)
 	return bm_rw(device, BM_AIO_WRITE_HINTED | BM_AIO_COPY_PAGES);
 }
 
+/**
+ * drbd_bm_write_behind() - Start writing the changed bitmap pages of a bit range
+ * @device:	DRBD device.
+ * @start:	first bit
+ * @end:	last bit, inclusive
+ *
+ * Does not wait for the IO to complete.  Used for activity log extents about
+ * to be evicted, so that the transaction evicting them finds their pages
+ * unchanged, and does not need a bitmap write round trip of its own.
+ */
+void drbd_bm_write_behind(struct drbd_device *device, unsigned long start, unsigned long end) __must_hold(local)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned int page_nr, last_page;
+
+	if (b->bm_flags & BM_ON_DAX_PMEM || !b->bm_number_of_pages)
+		return;
+
+	start >>= bm_shift(b);
+	end >>= bm_shift(b);
+	if (end >= b->bm_bits)
+		end = b->bm_bits - 1;
+
+	page_nr = bit_to_page_interleaved(b, 0, start);
+	last_page = bit_to_page_interleaved(b, b->bm_max_peers - 1, end);
+	while (page_nr <= last_page && bm_test_page_unchanged(b, page_nr))
+		page_nr++;
+	if (page_nr > last_page)
+		return;
+
+	bm_rw_range(device, page_nr, last_page, BM_AIO_COPY_PAGES | BM_AIO_NO_WAIT);
+}
+
 unsigned long drbd_bm_find_next(struct drbd_peer_device *peer_device, unsigned long start)
 {
-	return bm_op(peer_device->device, peer_device->bitmap_index, start, -1UL,
-		     BM_OP_FIND_BIT, NULL);
+	struct drbd_bitmap *bitmap = peer_device->device->bitmap;
+	unsigned long irq_flags, bit;
+
+	if (!bm_shift(bitmap))
+		return bm_op(peer_device->device, peer_device->bitmap_index, start, -1UL,
+			     BM_OP_FIND_BIT, NULL);
+
+	spin_lock_irqsave(&bitmap->bm_lock, irq_flags);
+	bit = bm_scaled_find(peer_device->device, peer_device->bitmap_index, start, BM_OP_FIND_BIT);
+	spin_unlock_irqrestore(&bitmap->bm_lock, irq_flags);
+	return bit;
 }
 
 /* does not spin_lock_irqsave.
@@ -1470,6 +2148,9 @@ unsigned long _drbd_bm_find_next(struct drbd_peer_device *peer_device, unsigned
 /* kmap compat: KM_USER0 */
 {
 	/* WARN_ON(!(device->b->bm_flags & BM_LOCK_SET)); */
+	if (bm_shift(peer_device->device->bitmap))
+		return bm_scaled_find(peer_device->device, peer_device->bitmap_index, start,
+				      BM_OP_FIND_BIT);
 	return ____bm_op(peer_device->device, peer_device->bitmap_index, start, -1UL,
 		    BM_OP_FIND_BIT, NULL);
 }
@@ -1478,13 +2159,32 @@ unsigned long _drbd_bm_find_next_zero(struct drbd_peer_device *peer_device, unsi
 /* kmap compat: KM_USER0 */
 {
 	/* WARN_ON(!(device->b->bm_flags & BM_LOCK_SET)); */
+	if (bm_shift(peer_device->device->bitmap))
+		return bm_scaled_find(peer_device->device, peer_device->bitmap_index, start,
+				      BM_OP_FIND_ZERO_BIT);
 	return ____bm_op(peer_device->device, peer_device->bitmap_index, start, -1UL,
 		    BM_OP_FIND_ZERO_BIT, NULL);
 }
 
+static unsigned int bm_scaled_bits_op(struct drbd_device *device, unsigned int bitmap_index,
+				      unsigned long start, unsigned long end,
+				      enum bitmap_operations op)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long irq_flags, count = 0;
+
+	spin_lock_irqsave(&bitmap->bm_lock, irq_flags);
+	if (bm_scale_range(bitmap, &start, &end, op))
+		count = bm_scaled_op(device, bitmap_index, start, end, op);
+	spin_unlock_irqrestore(&bitmap->bm_lock, irq_flags);
+	return count;
+}
+
 unsigned int drbd_bm_set_bits(struct drbd_device *device, unsigned int bitmap_index,
 			      unsigned long start, unsigned long end)
 {
+	if (bm_shift(device->bitmap))
+		return bm_scaled_bits_op(device, bitmap_index, start, end, BM_OP_SET);
 	return bm_op(device, bitmap_index, start, end, BM_OP_SET, NULL);
 }
 
@@ -1497,6 +2197,11 @@ __bm_many_bits_op(struct drbd_device *device, unsigned int bitmap_index, unsigne
 
 	spin_lock_irq(&bitmap->bm_lock);
 
+	if (bm_shift(bitmap)) {
+		if (!bm_scale_range(bitmap, &start, &end, op))
+			goto out;
+		bit = start;
+	}
 	if (end >= bitmap->bm_bits)
 		end = bitmap->bm_bits - 1;
 
@@ -1514,6 +2219,7 @@ __bm_many_bits_op(struct drbd_device *device, unsigned int bitmap_index, unsigne
 			spin_lock_irq(&bitmap->bm_lock);
 		}
 	}
+out:
 	spin_unlock_irq(&bitmap->bm_lock);
 }
 
@@ -1543,12 +2249,47 @@ _drbd_bm_set_many_bits(struct drbd_device *device, int bitmap_index, unsigned lo
 	__bm_many_bits_op(device, bitmap_index, start, end, BM_OP_SET);
 }
 
+/* Point all pages to @sentinel, for all peer slots at once.
+ * The bitmap must be locked by drbd_bm_lock().  The in-core pages are
+ * never submitted themselves, no need to wait for IO on them. */
+static void bm_fill_all(struct drbd_device *device, struct page *sentinel, int page_flag)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long page_nr;
+	unsigned int bitmap_index;
+
+	for (page_nr = 0; page_nr < bm_in_core_pages(bitmap); page_nr++) {
+		struct page *page;
+
+		spin_lock_irq(&bitmap->bm_lock);
+		page = bitmap->bm_pages[page_nr];
+		bitmap->bm_pages[page_nr] = sentinel;
+		spin_unlock_irq(&bitmap->bm_lock);
+
+		if (!bm_is_sentinel(page))
+			__free_page(page);
+		cond_resched();
+	}
+
+	spin_lock_irq(&bitmap->bm_lock);
+	for (page_nr = 0; page_nr < bitmap->bm_number_of_pages; page_nr++)
+		set_bit(page_flag, &bitmap->bm_page_flags[page_nr]);
+	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
+		bitmap->bm_set[bitmap_index] = sentinel == bm_ones_page ? bitmap->bm_bits : 0;
+	spin_unlock_irq(&bitmap->bm_lock);
+}
+
 /* set all bits in the bitmap */
 void drbd_bm_set_all(struct drbd_device *device)
 {
        struct drbd_bitmap *bitmap = device->bitmap;
        unsigned int bitmap_index;
 
+       if (!(bitmap->bm_flags & BM_ON_DAX_PMEM) && bitmap->bm_pages) {
+	       bm_fill_all(device, bm_ones_page, BM_PAGE_NEED_WRITEOUT);
+	       return;
+       }
+
        for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
 	       __bm_many_bits_op(device, bitmap_index, 0, -1, BM_OP_SET);
 }
@@ -1559,6 +2300,11 @@ void drbd_bm_clear_all(struct drbd_device *device)
 	struct drbd_bitmap *bitmap = device->bitmap;
 	unsigned int bitmap_index;
 
+	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM) && bitmap->bm_pages) {
+		bm_fill_all(device, bm_zero_page, BM_PAGE_LAZY_WRITEOUT);
+		return;
+	}
+
 	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
 		__bm_many_bits_op(device, bitmap_index, 0, -1, BM_OP_CLEAR);
 }
@@ -1566,6 +2312,8 @@ void drbd_bm_clear_all(struct drbd_device *device)
 unsigned int drbd_bm_clear_bits(struct drbd_device *device, unsigned int bitmap_index,
 				unsigned long start, unsigned long end)
 {
+	if (bm_shift(device->bitmap))
+		return bm_scaled_bits_op(device, bitmap_index, start, end, BM_OP_CLEAR);
 	return bm_op(device, bitmap_index, start, end, BM_OP_CLEAR, NULL);
 }
 
@@ -1583,10 +2331,11 @@ int drbd_bm_test_bit(struct drbd_peer_device *peer_device, const unsigned long b
 	int ret;
 
 	spin_lock_irqsave(&bitmap->bm_lock, irq_flags);
-	if (bitnr >= bitmap->bm_bits)
+	if (bitnr >= bm_ext_bits(bitmap))
 		ret = -1;
 	else
-		ret = __bm_op(peer_device->device, peer_device->bitmap_index, bitnr, bitnr,
+		ret = __bm_op(peer_device->device, peer_device->bitmap_index,
+			      bitnr >> bm_shift(bitmap), bitnr >> bm_shift(bitmap),
 			      BM_OP_COUNT, NULL);
 	spin_unlock_irqrestore(&bitmap->bm_lock, irq_flags);
 	return ret;
@@ -1595,7 +2344,72 @@ int drbd_bm_test_bit(struct drbd_peer_device *peer_device, const unsigned long b
 /* returns number of bits set in the range [s, e] */
 int drbd_bm_count_bits(struct drbd_device *device, unsigned int bitmap_index, unsigned long s, unsigned long e)
 {
-	return bm_op(device, bitmap_index, s, e, BM_OP_COUNT, NULL);
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long irq_flags;
+	int count;
+
+	if (!bm_shift(bitmap))
+		return bm_op(device, bitmap_index, s, e, BM_OP_COUNT, NULL);
+
+	spin_lock_irqsave(&bitmap->bm_lock, irq_flags);
+	count = bm_scaled_count(device, bitmap_index, s, e);
+	spin_unlock_irqrestore(&bitmap->bm_lock, irq_flags);
+	return count;
+}
+
+/* With the in-core bitmap kept per slot, copying a slot is copying its pages.
+ * Sentinels are shared rather than copied. */
+static void bm_copy_slot_pages(struct drbd_device *device, unsigned int from_index, unsigned int to_index)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long slot_pages = bitmap->bm_slot_pages;
+	bool recount = false;
+	unsigned long i;
+
+	for (i = 0; i < slot_pages; i++) {
+		unsigned long from_nr = from_index * slot_pages + i;
+		unsigned long to_nr = to_index * slot_pages + i;
+		unsigned long first = i * BITS_PER_PAGE;
+		struct page *new_page = NULL, *old_page;
+
+		/* only the bitmap lock holder changes a page into a real one */
+		if (!bm_is_sentinel(bitmap->bm_pages[from_nr])) {
+			new_page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+			if (new_page)
+				bm_store_page_idx(new_page, to_nr);
+		}
+
+		spin_lock_irq(&bitmap->bm_lock);
+		old_page = bitmap->bm_pages[to_nr];
+		if (bm_is_sentinel(bitmap->bm_pages[from_nr])) {
+			bitmap->bm_pages[to_nr] = bitmap->bm_pages[from_nr];
+		} else if (new_page) {
+			copy_highpage(new_page, bitmap->bm_pages[from_nr]);
+			bitmap->bm_pages[to_nr] = new_page;
+			new_page = NULL;
+		} else {
+			/* over-, never under-report out-of-sync blocks */
+			bitmap->bm_pages[to_nr] = bm_ones_page;
+			recount = true;
+		}
+		if (first < bitmap->bm_bits)
+			bm_set_range_writeout(bitmap, to_index, first,
+					      min(first + BITS_PER_PAGE, bitmap->bm_bits) - 1, false);
+		spin_unlock_irq(&bitmap->bm_lock);
+
+		if (new_page)
+			__free_page(new_page);
+		if (!bm_is_sentinel(old_page))
+			__free_page(old_page);
+		cond_resched();
+	}
+
+	spin_lock_irq(&bitmap->bm_lock);
+	bitmap->bm_set[to_index] = bitmap->bm_set[from_index];
+	spin_unlock_irq(&bitmap->bm_lock);
+
+	if (recount)
+		bm_count_bits(device);
 }
 
 void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsigned int to_index)
@@ -1606,6 +2420,11 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 	unsigned int from_page_nr, to_page_nr, current_page_nr;
 	u32 data_word, *addr;
 
+	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM)) {
+		bm_copy_slot_pages(device, from_index, to_index);
+		return;
+	}
+
 	words32_total = bitmap->bm_words * sizeof(unsigned long) / sizeof(u32);
 	spin_lock_irq(&bitmap->bm_lock);
 
@@ -1645,9 +2464,40 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 		if (addr[word32_in_page(to_word_nr)] != data_word)
 			bm_set_page_need_writeout(bitmap, current_page_nr);
 		addr[word32_in_page(to_word_nr)] = data_word;
-		bitmap->bm_set[to_index] += hweight32(data_word);
+		bitmap->bm_set[to_index] += hweight32(addr[word32_in_page(to_word_nr)]);
 	}
 	bm_unmap(bitmap, addr);
 
 	spin_unlock_irq(&bitmap->bm_lock);
 }
+
+/**
+ * drbd_bm_compact() - Give back the memory of bitmap pages that are all zero or all one
+ * @device:	DRBD device.
+ *
+ * Pages that became uniform again, typically once a resync cleared them,
+ * are replaced by the shared sentinels.  Their page flags stay, a pending
+ * writeout writes the sentinel.  Skipped if the bitmap is locked, whoever
+ * holds the lock may rely on the pages not changing underneath.
+ */
+void drbd_bm_compact(struct drbd_device *device)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned long page_nr;
+	unsigned int dropped = 0;
+
+	if (!b || b->bm_flags & BM_ON_DAX_PMEM)
+		return;
+	if (!mutex_trylock(&b->bm_change))
+		return;
+
+	for (page_nr = 0; page_nr < bm_in_core_pages(b); page_nr++) {
+		if (bm_drop_uniform_page(b, page_nr))
+			dropped++;
+		cond_resched();
+	}
+	mutex_unlock(&b->bm_change);
+
+	if (dropped)
+		dynamic_drbd_dbg(device, "bitmap: dropped %u uniform pages\n", dropped);
+}
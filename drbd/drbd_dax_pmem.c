@@ -17,6 +17,13 @@
      write it back from DRAM.
    2 Use a better fitting format for the on-disk activity log. Instead of
      writing transactions, the unmangled LRU-cache hash table is there.
+   3 Meta-data updates are stores to the mapped area, followed by cache line
+     write-backs and a fence, instead of synchronous 4k bios. The superblock
+     only writes back the cache lines that changed, the bitmap only the
+     pages that were modified since they were last written back.
+
+   An emulated pmem region (memmap=nn!ss, or brd with DAX) is sufficient to
+   exercise all of this.
 */
 
 #include <linux/vmalloc.h>
@@ -25,6 +32,7 @@
 #include <linux/pfn_t.h>
 #include <linux/libnvdimm.h>
 #include <linux/blkdev.h>
+#include <linux/cache.h>
 #include "drbd_int.h"
 #include "drbd_dax_pmem.h"
 #include "drbd_meta_data.h"
@@ -130,6 +138,7 @@ void drbd_dax_al_begin_io_commit(struct drbd_device *device)
 
 	list_for_each_entry(e, &device->act_log->to_be_changed, list)
 		drbd_dax_al_update(device, e);
+	drbd_dax_fence();
 
 	lc_committed(device->act_log);
 
@@ -151,6 +160,8 @@ int drbd_dax_al_initialize(struct drbd_device *device)
 			LC_FREE;
 		slots[i] = cpu_to_be32(extent_nr);
 	}
+	arch_wb_cache_pmem(al_on_pmem, sizeof(*al_on_pmem) + al_slots * sizeof(*slots));
+	drbd_dax_fence();
 
 	return 0;
 }
@@ -162,3 +173,28 @@ void *drbd_dax_bitmap(struct drbd_device *device, unsigned long want)
 
 	return md_on_pmem + (long)bdev->md.bm_offset * SECTOR_SIZE;
 }
+
+/**
+ * drbd_dax_md_update() - Write the encoded superblock to pmem
+ * @bdev: backing device with its meta-data on pmem
+ * @buffer: the encoded superblock, see drbd_md_encode()
+ *
+ * Only the cache lines that actually changed are stored and written back.
+ * A UUID rotation or a flag change of one peer slot costs a few cache line
+ * flushes and one fence.
+ */
+void drbd_dax_md_update(struct drbd_backing_dev *bdev, struct meta_data_on_disk_9 *buffer)
+{
+	unsigned char *dst = (unsigned char *)drbd_dax_md_addr(bdev);
+	unsigned char *src = (unsigned char *)buffer;
+	size_t off, len;
+
+	for (off = 0; off < sizeof(*buffer); off += L1_CACHE_BYTES) {
+		len = min_t(size_t, L1_CACHE_BYTES, sizeof(*buffer) - off);
+		if (!memcmp(dst + off, src + off, len))
+			continue;
+		memcpy(dst + off, src + off, len);
+		arch_wb_cache_pmem(dst + off, len);
+	}
+	drbd_dax_fence();
+}
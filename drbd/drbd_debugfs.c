@@ -87,6 +87,7 @@ static void seq_print_request_state(struct seq_file *m, struct drbd_request *req
 		seq_print_rq_state_bit(m, s & RQ_NET_SENT, &sep, "sent");
 		seq_print_rq_state_bit(m, s & RQ_NET_DONE, &sep, "done");
 		seq_print_rq_state_bit(m, s & RQ_NET_SIS, &sep, "sis");
+		seq_print_rq_state_bit(m, s & RQ_NET_JOURNALED, &sep, "journaled");
 		seq_print_rq_state_bit(m, s & RQ_NET_OK, &sep, "ok");
 		if (sep == ' ')
 			seq_puts(m, " -");
@@ -162,6 +163,28 @@ static void seq_print_minor_vnr_req(struct seq_file *m, struct drbd_request *req
 	seq_print_one_request(m, req, now, jif);
 }
 
+static void seq_print_pending_md_io(struct seq_file *m, struct drbd_device *device,
+				    struct drbd_md_io *md_io, unsigned long jif)
+{
+	struct drbd_md_io tmp;
+
+	/* In theory this is racy,
+	 * in the sense that there could have been a
+	 * drbd_md_put_buffer(); drbd_md_get_buffer();
+	 * between accessing these members here.  */
+	tmp = *md_io;
+	if (atomic_read(&tmp.in_use)) {
+		seq_printf(m, "%u\t%u\t%d\t",
+			device->minor, device->vnr,
+			jiffies_to_msecs(jif - tmp.start_jif));
+		if (time_before(tmp.submit_jif, tmp.start_jif))
+			seq_puts(m, "-\t");
+		else
+			seq_printf(m, "%d\t", jiffies_to_msecs(jif - tmp.submit_jif));
+		seq_printf(m, "%s\n", tmp.current_use);
+	}
+}
+
 static void seq_print_resource_pending_meta_io(struct seq_file *m, struct drbd_resource *resource, unsigned long jif)
 {
 	struct drbd_device *device;
@@ -170,22 +193,8 @@ static void seq_print_resource_pending_meta_io(struct seq_file *m, struct drbd_r
 	seq_puts(m, "minor\tvnr\tstart\tsubmit\tintent\n");
 	rcu_read_lock();
 	idr_for_each_entry(&resource->devices, device, i) {
-		struct drbd_md_io tmp;
-		/* In theory this is racy,
-		 * in the sense that there could have been a
-		 * drbd_md_put_buffer(); drbd_md_get_buffer();
-		 * between accessing these members here.  */
-		tmp = device->md_io;
-		if (atomic_read(&tmp.in_use)) {
-			seq_printf(m, "%u\t%u\t%d\t",
-				device->minor, device->vnr,
-				jiffies_to_msecs(jif - tmp.start_jif));
-			if (time_before(tmp.submit_jif, tmp.start_jif))
-				seq_puts(m, "-\t");
-			else
-				seq_printf(m, "%d\t", jiffies_to_msecs(jif - tmp.submit_jif));
-			seq_printf(m, "%s\n", tmp.current_use);
-		}
+		seq_print_pending_md_io(m, device, &device->md_io, jif);
+		seq_print_pending_md_io(m, device, &device->al_io, jif);
 	}
 	rcu_read_unlock();
 }
@@ -280,6 +289,7 @@ static void seq_print_peer_request_flags(struct seq_file *m, struct drbd_peer_re
 	seq_print_rq_state_bit(m, f & EE_TRIM, &sep, "trim");
 	seq_print_rq_state_bit(m, f & EE_ZEROOUT, &sep, "zero-out");
 	seq_print_rq_state_bit(m, f & EE_WRITE_SAME, &sep, "write-same");
+	seq_print_rq_state_bit(m, f & EE_MERGED, &sep, "merged");
 	seq_putc(m, '\n');
 }
 
@@ -860,6 +870,57 @@ static int connection_debug_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+/* wire size in percent of raw size */
+static unsigned int compress_ratio(u64 wire, u64 raw)
+{
+	return raw ? div64_u64(wire * 100, raw) : 100;
+}
+
+static int connection_compression_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+	struct drbd_compress *c = &connection->compress;
+	static const char * const alg_names[__DRBD_COMPRESS_NR] = {
+		[DRBD_COMPRESS_NONE] = "none",
+		[DRBD_COMPRESS_LZ4] = "lz4",
+		[DRBD_COMPRESS_ZSTD] = "zstd",
+	};
+	u64 raw, wire;
+
+	/* statistics only, read without locks */
+	raw = READ_ONCE(c->tx_raw_bytes);
+	wire = READ_ONCE(c->tx_wire_bytes);
+	seq_printf(m, "send: %s%s\n", c->tx_tfm ? alg_names[c->tx_alg] : "none",
+		   c->skip ? " (bypassed)" : "");
+	seq_printf(m, "  raw bytes:      %llu\n", raw);
+	seq_printf(m, "  wire bytes:     %llu (%u%%)\n", wire, compress_ratio(wire, raw));
+	seq_printf(m, "  bypassed bytes: %llu\n", READ_ONCE(c->tx_bypassed_bytes));
+	seq_printf(m, "  cpu ms:         %llu\n", div_u64(READ_ONCE(c->tx_ns), NSEC_PER_MSEC));
+
+	raw = READ_ONCE(c->rx_raw_bytes);
+	wire = READ_ONCE(c->rx_wire_bytes);
+	seq_puts(m, "receive:\n");
+	seq_printf(m, "  raw bytes:      %llu\n", raw);
+	seq_printf(m, "  wire bytes:     %llu (%u%%)\n", wire, compress_ratio(wire, raw));
+	seq_printf(m, "  cpu ms:         %llu\n", div_u64(READ_ONCE(c->rx_ns), NSEC_PER_MSEC));
+	return 0;
+}
+
+static int connection_journal_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+	u64 used, size;
+
+	drbd_journal_usage(&used, &size);
+	seq_printf(m, "journal used:    %llu of %llu KiB\n", used >> 10, size >> 10);
+	seq_printf(m, "journaling:      %s\n",
+		   test_bit(CONN_JOURNALING, &connection->flags) ? "yes" : "no");
+	/* statistics only, read without locks */
+	seq_printf(m, "  spilled bytes: %llu\n", READ_ONCE(connection->journal_spilled));
+	seq_printf(m, "  drained bytes: %llu\n", READ_ONCE(connection->journal_drained));
+	return 0;
+}
+
 static int connection_attr_release(struct inode *inode, struct file *file)
 {
 	struct drbd_connection *connection = inode->i_private;
@@ -887,6 +948,8 @@ drbd_debugfs_connection_attr(oldest_requests)
 drbd_debugfs_connection_attr(callback_history)
 drbd_debugfs_connection_attr(transport)
 drbd_debugfs_connection_attr(debug)
+drbd_debugfs_connection_attr(compression)
+drbd_debugfs_connection_attr(journal)
 
 void drbd_debugfs_connection_add(struct drbd_connection *connection)
 {
@@ -908,6 +971,8 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 	conn_dcf(oldest_requests);
 	conn_dcf(transport);
 	conn_dcf(debug);
+	conn_dcf(compression);
+	conn_dcf(journal);
 
 	idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
 		if (!peer_device->debugfs_peer_dev)
@@ -917,6 +982,8 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 
 void drbd_debugfs_connection_cleanup(struct drbd_connection *connection)
 {
+	drbd_debugfs_remove(&connection->debugfs_conn_journal);
+	drbd_debugfs_remove(&connection->debugfs_conn_compression);
 	drbd_debugfs_remove(&connection->debugfs_conn_debug);
 	drbd_debugfs_remove(&connection->debugfs_conn_transport);
 	drbd_debugfs_remove(&connection->debugfs_conn_callback_history);
@@ -1096,6 +1163,44 @@ static int device_ed_gen_id_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static void seq_print_rb_estimate(struct seq_file *m, const char *name,
+				  const struct drbd_rb_estimate *e)
+{
+	seq_printf(m, "%-16s %10lu %10llu %3u.%02u %8u %10llu\n", name, e->nr_reads,
+		   div_u64(e->lat_ns, NSEC_PER_USEC), e->depth >> 4, (e->depth & 15) * 100 / 16,
+		   e->inflight, div_u64(drbd_rb_expected_ns(e), NSEC_PER_USEC));
+}
+
+static int device_read_balancing_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_resource *resource = device->resource;
+	struct drbd_peer_device *peer_device;
+	struct drbd_rb_estimate e;
+
+	seq_printf(m, "adaptive: %s\n", drbd_read_balancing_adaptive ? "yes" : "no");
+	seq_puts(m, "source                reads     lat_us  depth inflight expected_us\n");
+
+	spin_lock_irq(&resource->req_lock);
+	e = device->rb_local;
+	spin_unlock_irq(&resource->req_lock);
+	seq_print_rb_estimate(m, "local", &e);
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		struct net_conf *nc;
+
+		spin_lock_irq(&resource->req_lock);
+		e = peer_device->rb;
+		spin_unlock_irq(&resource->req_lock);
+		nc = rcu_dereference(peer_device->connection->transport.net_conf);
+		seq_print_rb_estimate(m, nc ? nc->name : "-", &e);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
 #define show_per_peer(M)						\
 	seq_printf(m, "%-16s", #M ":");					\
 	for_each_peer_device(peer_device, device)			\
@@ -1214,6 +1319,7 @@ drbd_debugfs_device_attr(io_frozen)
 drbd_debugfs_device_attr(ed_gen_id)
 drbd_debugfs_device_attr(openers)
 drbd_debugfs_device_attr(md_io)
+drbd_debugfs_device_attr(read_balancing)
 #ifdef CONFIG_DRBD_TIMING_STATS
 __drbd_debugfs_device_attr(req_timing, device_req_timing_write)
 #endif
@@ -1253,6 +1359,7 @@ void drbd_debugfs_device_add(struct drbd_device *device)
 	vol_dcf(ed_gen_id);
 	vol_dcf(openers);
 	vol_dcf(md_io);
+	vol_dcf(read_balancing);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_dcf(device->debugfs_vol, device, req_timing, 0600);
 #endif
@@ -1281,6 +1388,7 @@ void drbd_debugfs_device_cleanup(struct drbd_device *device)
 	drbd_debugfs_remove(&device->debugfs_vol_ed_gen_id);
 	drbd_debugfs_remove(&device->debugfs_vol_openers);
 	drbd_debugfs_remove(&device->debugfs_vol_md_io);
+	drbd_debugfs_remove(&device->debugfs_vol_read_balancing);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_debugfs_remove(&device->debugfs_vol_req_timing);
 #endif
@@ -1621,6 +1729,16 @@ static int peer_device_proc_drbd_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int peer_device_zero_elision_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_peer_device *peer_device = m->private;
+
+	/* statistics only, read without locks */
+	seq_printf(m, "sent bytes saved:     %llu\n", READ_ONCE(peer_device->zero_elided_sent));
+	seq_printf(m, "received bytes saved: %llu\n", READ_ONCE(peer_device->zero_elided_recv));
+	return 0;
+}
+
 #define drbd_debugfs_peer_device_attr(name)					\
 static int peer_device_ ## name ## _open(struct inode *inode, struct file *file)\
 {										\
@@ -1646,6 +1764,7 @@ static const struct file_operations peer_device_ ## name ## _fops = {		\
 
 drbd_debugfs_peer_device_attr(resync_extents)
 drbd_debugfs_peer_device_attr(proc_drbd)
+drbd_debugfs_peer_device_attr(zero_elision)
 
 void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 {
@@ -1660,10 +1779,12 @@ void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 	/* debugfs create file */
 	peer_dev_dcf(resync_extents);
 	peer_dev_dcf(proc_drbd);
+	peer_dev_dcf(zero_elision);
 }
 
 void drbd_debugfs_peer_device_cleanup(struct drbd_peer_device *peer_device)
 {
+	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_zero_elision);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_proc_drbd);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_extents);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev);
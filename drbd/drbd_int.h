@@ -44,6 +44,29 @@
 #include "drbd_transport.h"
 #include "drbd_polymorph_printk.h"
 
+/* Protocol extensions not (yet) known to drbd_protocol.h */
+#ifndef DRBD_FF_BM_WORD_RLE
+#define DRBD_FF_BM_WORD_RLE (1U << 16)	/* P_COMPRESSED_BITMAP with DRBD_BM_CODE_WORD_RLE */
+#endif
+#ifndef DRBD_FF_ACK_BATCH
+#define DRBD_FF_ACK_BATCH (1U << 17)	/* P_BLOCK_ACKS */
+#define P_BLOCK_ACKS 0x60
+#endif
+#ifndef DRBD_FF_COMPRESS_LZ4
+#define DRBD_FF_COMPRESS_LZ4 (1U << 18)	/* DP_COMPRESSED payload, lz4 */
+#define DRBD_FF_COMPRESS_ZSTD (1U << 19)	/* DP_COMPRESSED payload, zstd */
+#define DP_COMPRESSED (1 << 11)
+#endif
+#ifndef DRBD_FF_ZERO_ELISION
+/* all-zero P_DATA as P_ZEROES; P_DATA_REPLY and P_RS_DATA_REPLY with
+ * DP_ZEROES carry a __be32 size instead of the payload */
+#define DRBD_FF_ZERO_ELISION (1U << 20)
+#endif
+#ifndef DRBD_FF_MERGED_DATA
+#define DRBD_FF_MERGED_DATA (1U << 21)	/* P_DATA_MERGED */
+#define P_DATA_MERGED 0x61
+#endif
+
 #ifdef __CHECKER__
 # define __protected_by(x)       __attribute__((require_context(x,1,999,"rdwr")))
 # define __protected_read_by(x)  __attribute__((require_context(x,1,999,"read")))
@@ -59,6 +82,19 @@
 /* module parameter, defined in drbd_main.c */
 extern unsigned int drbd_minor_count;
 extern unsigned int drbd_protocol_version_min;
+extern unsigned int drbd_statistics_push_interval;
+extern bool drbd_al_segmented_lru;
+extern bool drbd_al_autosize;
+extern unsigned int drbd_ack_batch;
+extern unsigned int drbd_ack_batch_usecs;
+extern bool drbd_read_balancing_adaptive;
+extern unsigned int drbd_read_balancing_split_kb;
+extern unsigned int drbd_read_stripe_kb;
+extern unsigned int drbd_data_compress;
+extern bool drbd_zero_elision;
+extern unsigned int drbd_merge_writes;
+extern char drbd_repl_journal[];
+extern unsigned int drbd_resume_window_ms;
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int drbd_enable_faults;
@@ -182,6 +218,142 @@ static inline void bm_xfer_ctx_bit_to_word_offset(struct bm_xfer_ctx *c)
 
 extern unsigned int drbd_header_size(struct drbd_connection *connection);
 
+/* P_COMPRESSED_BITMAP encoding negotiated with DRBD_FF_BM_WORD_RLE.
+ * The little endian byte stream of the bitmap, as 64 bit words, is coded as
+ * a sequence of tokens.  Each token is a LEB128 encoded (count << 2 | type).
+ * A literal token is followed by count little endian 64 bit words, at most
+ * BM_WRLE_LITERAL_MAX of them.  Tokens are never split across packets. */
+#define DRBD_BM_CODE_WORD_RLE	3
+#define BM_WRLE_LITERAL_MAX	64
+enum bm_wrle_token {
+	BM_WRLE_ZEROES,
+	BM_WRLE_ONES,
+	BM_WRLE_LITERAL,
+};
+
+static inline unsigned int bm_wrle_put_token(u8 *out, enum bm_wrle_token type, u64 count)
+{
+	u64 v = count << 2 | type;
+	unsigned int n = 0;
+
+	do {
+		out[n] = v & 0x7f;
+		v >>= 7;
+		if (v)
+			out[n] |= 0x80;
+		n++;
+	} while (v);
+	return n;
+}
+
+/* Returns the size of the token at *pos, including literal words, or -EINVAL */
+static inline int bm_wrle_get_token(const u8 *pos, const u8 *end,
+				    enum bm_wrle_token *type, u64 *count)
+{
+	const u8 *p = pos;
+	unsigned int shift = 0;
+	u64 v = 0;
+
+	do {
+		if (p >= end || shift > 63)
+			return -EINVAL;
+		v |= (u64)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+
+	*type = v & 3;
+	*count = v >> 2;
+	if (*type > BM_WRLE_LITERAL || *count == 0)
+		return -EINVAL;
+	if (*type == BM_WRLE_LITERAL) {
+		if (*count > BM_WRLE_LITERAL_MAX || end - p < *count * 8)
+			return -EINVAL;
+		p += *count * 8;
+	}
+	return p - pos;
+}
+
+/* P_BLOCK_ACKS, negotiated with DRBD_FF_ACK_BATCH.
+ * Carries up to DRBD_ACK_BATCH_MAX acks of the same type (P_WRITE_ACK,
+ * P_RS_WRITE_ACK or P_RECV_ACK) for one volume.  seq_num is the one of
+ * the last ack in the batch. */
+#define DRBD_ACK_BATCH_MAX 64
+struct p_block_ack_entry {
+	u64 sector;
+	u64 block_id;
+	u32 blksize;
+	u32 pad;
+} __packed;
+
+struct p_block_acks {
+	u32 seq_num;
+	u16 cmd;
+	u16 count;
+	struct p_block_ack_entry acks[];
+} __packed;
+
+/* Payload compression of P_DATA, P_DATA_REPLY and P_RS_DATA_REPLY,
+ * negotiated per algorithm with DRBD_FF_COMPRESS_*.  With DP_COMPRESSED
+ * set, struct p_data is followed by struct p_data_compressed, then the
+ * integrity digest (of the uncompressed data), then the compressed data. */
+enum drbd_compress_alg {
+	DRBD_COMPRESS_NONE,
+	DRBD_COMPRESS_LZ4,
+	DRBD_COMPRESS_ZSTD,
+	__DRBD_COMPRESS_NR
+};
+
+struct p_data_compressed {
+	u8 alg;
+	u8 pad[3];
+	__be32 raw_size;
+} __packed;
+
+struct drbd_compress {
+	/* sender side, protected by mutex[DATA_STREAM] */
+	struct crypto_comp *tx_tfm;
+	enum drbd_compress_alg tx_alg;
+	void *tx_raw;		/* the payload made linear */
+	void *tx_buf;		/* compressed */
+	unsigned int skip;	/* adaptive bypass: send that many raw, then try again */
+	unsigned int backoff;
+	u64 tx_raw_bytes, tx_wire_bytes, tx_bypassed_bytes, tx_ns;
+
+	/* receiver side, receiver thread only */
+	struct crypto_comp *rx_tfm[__DRBD_COMPRESS_NR];
+	void *rx_buf;		/* compressed, as received */
+	void *rx_raw;		/* decompressed */
+	u64 rx_raw_bytes, rx_wire_bytes, rx_ns;
+};
+
+/* Several adjacent application writes of the same epoch in one packet.
+ * struct p_data carries the first sector and block_id, and the common
+ * dp_flags.  It is followed by struct p_data_merged and count extents,
+ * then the payload of all of them.  The receiver writes them as one peer
+ * request, but acks each extent as if it had come in its own P_DATA. */
+#define DRBD_MERGE_MAX 32
+
+struct p_merged_extent {
+	u64 block_id;
+	__be32 size;
+	__be32 pad;
+} __packed;
+
+struct p_data_merged {
+	__be32 count;
+	__be32 pad;
+	struct p_merged_extent ext[];
+} __packed;
+
+/* Read completion estimates of one read source, the local disk or a peer.
+ * Protected by req_lock. */
+struct drbd_rb_estimate {
+	u64 lat_ns;		/* EWMA of read latency, issue to completion */
+	unsigned int depth;	/* EWMA of reads in flight at issue, in 1/16 */
+	unsigned int inflight;	/* reads currently in flight */
+	unsigned long nr_reads;
+};
+
 /**********************************************************************/
 enum drbd_thread_state {
 	NONE,
@@ -283,6 +455,9 @@ struct drbd_request {
 	struct list_head tl_requests; /* ring list in the transfer log */
 	struct bio *master_bio;       /* master bio pointer */
 
+	/* The block_id our peers know this request by, see drbd_req_id_alloc() */
+	u64 id;
+
 	/* see struct drbd_device */
 	struct list_head req_pending_master_completion;
 	struct list_head req_pending_local;
@@ -290,6 +465,9 @@ struct drbd_request {
 	/* for generic IO accounting */
 	unsigned long start_jif;
 
+	/* reads: when handed to the local disk or a peer, for adaptive read balancing */
+	ktime_t rb_issue_kt;
+
 	/* for request_timer_fn() */
 	unsigned long pre_submit_jif;
 	unsigned long pre_send_jif[DRBD_PEERS_MAX];
@@ -401,7 +579,9 @@ struct drbd_peer_request {
 				struct digest_info *digest;
 			};
 			u64 dagtag_sector;
-
+			/* with EE_MERGED, the extents of a P_DATA_MERGED */
+			struct p_merged_extent *merged;
+			unsigned int merged_count;
 		};
 		struct { /* reused object to queue send OOS to other nodes */
 			u64 sent_oos_nodes; /* Used to notify L_SYNC_TARGETs about new out_of_sync bits */
@@ -482,6 +662,9 @@ enum {
 
 	/* Hold reference in activity log */
 	__EE_IN_ACTLOG,
+
+	/* received as P_DATA_MERGED, needs one ack per merged extent */
+	__EE_MERGED,
 };
 #define EE_MAY_SET_IN_SYNC     (1<<__EE_MAY_SET_IN_SYNC)
 #define EE_SET_OUT_OF_SYNC     (1<<__EE_SET_OUT_OF_SYNC)
@@ -500,12 +683,22 @@ enum {
 #define EE_APPLICATION		(1<<__EE_APPLICATION)
 #define EE_RS_THIN_REQ		(1<<__EE_RS_THIN_REQ)
 #define EE_IN_ACTLOG		(1<<__EE_IN_ACTLOG)
+#define EE_MERGED		(1<<__EE_MERGED)
+
+/* The number of the peer's writes a peer request stands for,
+ * as counted in epochs and confirmed to the peer */
+static inline unsigned int peer_req_nr_writes(struct drbd_peer_request *peer_req)
+{
+	return peer_req->flags & EE_MERGED ? peer_req->merged_count : 1;
+}
 
 /* flag bits per device */
 enum device_flag {
 	UNPLUG_QUEUED,		/* only relevant with kernel 2.4 */
 	UNPLUG_REMOTE,		/* sending a "UnplugRemote" could help */
 	MD_DIRTY,		/* current uuids and flags not yet on disk */
+	MD_WRITE_IN_FLIGHT,	/* drbd_md_sync_async() write not completed yet */
+	MD_IO_EXCLUSIVE,	/* drbd_md_get_buffer_exclusive(), no AL transactions */
 	CRASHED_PRIMARY,	/* This node was a crashed primary.
 				 * Gets cleared when the state.conn
 				 * goes into L_ESTABLISHED state. */
@@ -614,12 +807,19 @@ struct drbd_bitmap {
 		struct page **bm_pages;
 		void *bm_on_pmem;
 	};
+	/* BM_PAGE_* flags, one word per on-disk page, the in-core pages may
+	 * be shared sentinels; allocated together with bm_pages */
+	unsigned long *bm_page_flags;
+	/* BM_ON_DAX_PMEM: one bit per page with modifications that were not
+	 * yet written back from the CPU caches, see bm_dax_write_back() */
+	unsigned long *bm_dax_dirty;
 	spinlock_t bm_lock;
 
 	unsigned long bm_set[DRBD_PEERS_MAX]; /* number of bits set */
 	unsigned long bm_bits;  /* bits per peer */
 	size_t   bm_words; /* platform specitif word size; not 32bit!! */
-	size_t   bm_number_of_pages;
+	size_t   bm_number_of_pages; /* on disk */
+	size_t   bm_slot_pages; /* in core, per peer slot */
 	sector_t bm_dev_capacity;
 	struct mutex bm_change; /* serializes resize operations */
 
@@ -627,6 +827,9 @@ struct drbd_bitmap {
 
 	enum bm_flag bm_flags;
 	unsigned int bm_max_peers;
+	/* log2 of the bytes of storage per bit, BM_BLOCK_SHIFT..BM_BLOCK_SHIFT_MAX,
+	 * from bm_bytes_per_bit of the meta data super block */
+	unsigned int bm_block_shift;
 
 	/* exclusively to be used by __al_write_transaction(),
 	 * and drbd_bm_write_hinted() -> bm_rw() called from there.
@@ -698,14 +901,21 @@ struct drbd_backing_dev {
 #endif
 };
 
+/* One meta data IO buffer. device->md_io is used for the super block,
+ * device->al_io carries activity log transactions, so neither queues behind
+ * the other.  See drbd_md_get_buffer(), drbd_md_get_buffer_exclusive() and
+ * drbd_al_get_buffer(). */
 struct drbd_md_io {
+	struct drbd_device *device;
 	struct page *page;
 	unsigned long start_jif;	/* last call to drbd_md_get_buffer */
-	unsigned long submit_jif;	/* last _drbd_md_sync_page_io() submit */
+	unsigned long submit_jif;	/* last drbd_md_submit_page_io() submit */
 	const char *current_use;
 	atomic_t in_use;
 	unsigned int done;
 	int error;
+	/* if set, called from drbd_md_endio(), possibly in irq context */
+	void (*end_io)(struct drbd_md_io *md_io);
 };
 
 struct bm_io_work {
@@ -752,6 +962,8 @@ enum connection_flag {
 	NOTIFY_PEERS_LOST_PRIMARY,
 	CHECKING_PEER,		/* used by make_new_urrent_uuid() to check liveliness */
 	CONN_CONGESTED,
+	CONN_JOURNALING,	/* spilling protocol A writes into the replication journal */
+	CONN_JOURNAL_READ_WAIT,	/* the sender waits for a payload read back from the journal */
 	CONN_HANDSHAKE_DISCONNECT,
 	CONN_HANDSHAKE_RETRY,
 	CONN_HANDSHAKE_READY,
@@ -774,6 +986,7 @@ enum resource_flag {
 
         /* to be used in drbd_post_work() */
 	TRY_BECOME_UP_TO_DATE,  /* try to become D_UP_TO_DATE */
+	PUSH_STATISTICS,	/* broadcast changed statistics as events2 */
 	R_UNREGISTERED,
 	DOWN_IN_PROGRESS,
 	CHECKING_PEERS,
@@ -859,6 +1072,12 @@ struct drbd_resource {
 	unsigned long flags;
 
 	struct list_head transfer_log;	/* all requests not yet fully processed */
+	struct list_head journal_entries; /* spilled writes, see drbd_journal.c */
+
+	/* requests by their block_id, lookups under req_lock or RCU */
+	struct idr req_ids;
+	spinlock_t req_ids_lock;	/* serializes modifications of req_ids */
+	u32 req_id_gen;
 
 	struct list_head peer_ack_list;  /* requests to send peer acks for */
 	u64 last_peer_acked_dagtag;  /* dagtag of last PEER_ACK'ed request */
@@ -910,6 +1129,7 @@ struct drbd_resource {
 
 	struct timer_list peer_ack_timer; /* send a P_PEER_ACK after last completion */
 	struct timer_list repost_up_to_date_timer;
+	struct timer_list statistics_timer; /* see drbd_push_statistics() */
 
 	unsigned int w_cb_nr; /* keeps counting up */
 	struct drbd_thread_timing_details w_timing_details[DRBD_THREAD_DETAILS_HIST];
@@ -949,6 +1169,8 @@ struct drbd_connection {
 	struct dentry *debugfs_conn_oldest_requests;
 	struct dentry *debugfs_conn_transport;
 	struct dentry *debugfs_conn_debug;
+	struct dentry *debugfs_conn_compression;
+	struct dentry *debugfs_conn_journal;
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -975,6 +1197,7 @@ struct drbd_connection {
 
 	int agreed_pro_version;		/* actually used protocol version */
 	u32 agreed_features;
+	u32 pushed_statistics_hash;	/* see drbd_push_statistics() */
 	unsigned long last_received;	/* in jiffies, either socket */
 	atomic_t ap_in_flight; /* App sectors in flight (waiting for ack) */
 	atomic_t rs_in_flight; /* Resync sectors in flight */
@@ -982,6 +1205,11 @@ struct drbd_connection {
 	struct drbd_work connect_timer_work;
 	struct timer_list connect_timer;
 
+	/* IO held for a quick reconnect, see drbd_resume_window_ms */
+	struct drbd_work resume_window_work;
+	struct timer_list resume_window_timer;
+	unsigned long resume_window_end; /* in jiffies */
+
 	struct crypto_shash *cram_hmac_tfm;
 	struct crypto_shash *integrity_tfm;  /* checksums we compute, updates protected by connection->mutex[DATA_STREAM] */
 	struct crypto_shash *peer_integrity_tfm;  /* checksums we verify, only accessed from receiver thread  */
@@ -991,6 +1219,12 @@ struct drbd_connection {
 	void *int_dig_in;
 	void *int_dig_vv;
 
+	struct drbd_compress compress; /* allocated on first use, freed with the crypto */
+
+	/* writes spilled into the replication journal, see drbd_journal.c */
+	struct drbd_journal_entry *journal_next;	/* oldest one still to send */
+	u64 journal_spilled, journal_drained;
+
 	/* receiver side */
 	struct drbd_epoch *current_epoch;
 	spinlock_t epoch_lock;
@@ -1016,6 +1250,14 @@ struct drbd_connection {
 	struct list_head done_ee;   /* need to send P_WRITE_ACK */
 	atomic_t done_ee_cnt;
 	struct work_struct send_acks_work;
+	struct {
+		struct p_block_ack_entry acks[DRBD_ACK_BATCH_MAX];
+		unsigned int count;
+		int vnr;
+		enum drbd_packet cmd;
+		u32 seq_num;
+		ktime_t start;
+	} ack_batch; /* protected by mutex[CONTROL_STREAM] */
 	wait_queue_head_t ee_wait;
 
 	atomic_t pp_in_use;		/* allocated from page pool */
@@ -1164,6 +1406,10 @@ struct drbd_peer_device {
 	atomic_t ap_pending_cnt; /* AP data packets on the wire, ack expected */
 	atomic_t unacked_cnt;	 /* Need to send replies for */
 	atomic_t rs_pending_cnt; /* RS request/data packets on the wire */
+	struct drbd_rb_estimate rb; /* reads served by this peer */
+	unsigned long read_err_jif; /* last P_NEG_DREPLY, 0 if none */
+	u64 zero_elided_sent; /* payload bytes not sent, they were all zero; under mutex[DATA_STREAM] */
+	u64 zero_elided_recv; /* receiver thread only */
 
 	/* use checksums for *this* resync */
 	bool use_csums;
@@ -1225,11 +1471,13 @@ struct drbd_peer_device {
 	u64 comm_uuid_flags; /* communicated UUID flags */
 	u64 comm_bitmap_uuid;
 	union drbd_state comm_state;
+	u32 pushed_statistics_hash; /* see drbd_push_statistics() */
 
 #ifdef CONFIG_DEBUG_FS
 	struct dentry *debugfs_peer_dev;
 	struct dentry *debugfs_peer_dev_resync_extents;
 	struct dentry *debugfs_peer_dev_proc_drbd;
+	struct dentry *debugfs_peer_dev_zero_elision;
 #endif
 	ktime_t pre_send_kt;
 	ktime_t acked_kt;
@@ -1279,6 +1527,7 @@ struct drbd_device {
 	struct dentry *debugfs_vol_ed_gen_id;
 	struct dentry *debugfs_vol_openers;
 	struct dentry *debugfs_vol_md_io;
+	struct dentry *debugfs_vol_read_balancing;
 #ifdef CONFIG_DRBD_TIMING_STATS
 	struct dentry *debugfs_vol_req_timing;
 #endif
@@ -1309,6 +1558,7 @@ struct drbd_device {
 	unsigned int writ_cnt;
 	unsigned int al_writ_cnt;
 	unsigned int bm_writ_cnt;
+	u32 pushed_statistics_hash; /* see drbd_push_statistics() */
 	atomic_t ap_bio_cnt[2];	 /* Requests we need to complete. [READ] and [WRITE] */
 	atomic_t local_cnt;	 /* Waiting for local completion */
 	atomic_t ap_actlog_cnt;  /* Requests waiting for activity log */
@@ -1320,8 +1570,8 @@ struct drbd_device {
 	atomic_t suspend_cnt;	/* recursive suspend counter, if non-zero, IO will be blocked. */
 
 	/* Interval trees of pending local requests */
-	struct rb_root read_requests;
-	struct rb_root write_requests;
+	struct drbd_interval_tree read_requests;
+	struct drbd_interval_tree write_requests;
 
 	/* for statistics and timeouts */
 	/* [0] read, [1] write */
@@ -1336,12 +1586,18 @@ struct drbd_device {
 
 	int next_barrier_nr;
 	struct drbd_md_io md_io;
+	struct drbd_md_io al_io;
 	spinlock_t al_lock;
 	wait_queue_head_t al_wait;
 	struct lru_cache *act_log;	/* activity log */
 	unsigned al_histogram[AL_UPDATES_PER_TRANSACTION+1];
 	unsigned int al_tr_number;
 	int al_tr_cycle;
+	/* activity log auto-sizing, see drbd_al_adjust_active_limit() */
+	unsigned long al_autosize_jif;
+	unsigned long al_autosize_hits;
+	unsigned long al_autosize_changed;
+	unsigned int al_autosize_writ_cnt;
 	wait_queue_head_t seq_wait;
 	u64 exposed_data_uuid; /* UUID of the exposed data */
 	u64 next_exposed_data_uuid;
@@ -1358,6 +1614,8 @@ struct drbd_device {
 	 * are deferred to this single-threaded work queue */
 	struct submit_worker submit;
 	u64 read_nodes; /* used for balancing read requests among peers */
+	struct drbd_rb_estimate rb_local; /* reads served by the local disk */
+	unsigned int rb_probe; /* adaptive read balancing: count to the next probe */
 	bool have_quorum[2];	/* no quorum -> suspend IO or error IO */
 	bool cached_state_unstable; /* updates with each state change */
 	bool cached_err_io; /* complete all IOs with error */
@@ -1392,6 +1650,7 @@ struct drbd_bm_aio_ctx {
 #define BM_AIO_WRITE_ALL_PAGES	4
 #define BM_AIO_READ	        8
 #define BM_AIO_WRITE_LAZY      16
+#define BM_AIO_NO_WAIT         32
 	int error;
 	struct kref kref;
 };
@@ -1537,6 +1796,8 @@ extern int drbd_send_out_of_sync(struct drbd_peer_device *, sector_t, unsigned i
 extern int drbd_send_block(struct drbd_peer_device *, enum drbd_packet,
 			   struct drbd_peer_request *);
 extern int drbd_send_dblock(struct drbd_peer_device *, struct drbd_request *req);
+extern int drbd_send_dblock_bio(struct drbd_peer_device *, struct drbd_request *req, struct bio *bio);
+extern int drbd_send_dblock_merged(struct drbd_peer_device *, struct drbd_request **reqs, unsigned int n);
 extern int drbd_send_drequest(struct drbd_peer_device *, int cmd,
 			      sector_t sector, int size, u64 block_id);
 extern void *drbd_prepare_drequest_csum(struct drbd_peer_request *peer_req, int digest_size);
@@ -1547,6 +1808,7 @@ extern int drbd_send_dagtag(struct drbd_connection *connection, u64 dagtag);
 extern void drbd_send_sr_reply(struct drbd_connection *connection, int vnr,
 			       enum drbd_state_rv retcode);
 extern int drbd_send_rs_deallocated(struct drbd_peer_device *, struct drbd_peer_request *);
+extern bool drbd_pages_all_zero(struct page *page, unsigned int size);
 extern void drbd_send_twopc_reply(struct drbd_connection *connection,
 				  enum drbd_packet, struct twopc_reply *);
 extern void drbd_send_peers_in_sync(struct drbd_peer_device *, u64, sector_t, int);
@@ -1557,12 +1819,14 @@ extern void drbd_cleanup_device(struct drbd_device *device);
 extern void drbd_print_uuids(struct drbd_peer_device *peer_device, const char *text);
 extern void drbd_queue_unplug(struct drbd_device *device);
 
-extern u64 drbd_capacity_to_on_disk_bm_sect(u64 capacity_sect, unsigned int max_peers);
+extern u64 drbd_capacity_to_on_disk_bm_sect(u64 capacity_sect, unsigned int max_peers,
+					     unsigned int bm_block_shift);
 extern void drbd_md_set_sector_offsets(struct drbd_device *device,
 				       struct drbd_backing_dev *bdev);
 extern int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer);
 extern int drbd_md_sync(struct drbd_device *device);
 extern int drbd_md_sync_if_dirty(struct drbd_device *device);
+extern void drbd_md_sync_async(struct drbd_device *device);
 extern void drbd_uuid_received_new_current(struct drbd_peer_device *, u64 , u64) __must_hold(local);
 extern void drbd_uuid_set_bitmap(struct drbd_peer_device *peer_device, u64 val) __must_hold(local);
 extern void _drbd_uuid_set_bitmap(struct drbd_peer_device *peer_device, u64 val) __must_hold(local);
@@ -1662,9 +1926,12 @@ extern sector_t drbd_get_max_capacity(
 #define RS_MAKE_REQS_INTV_NS (NSEC_PER_SEC/10)
 
 /* We do bitmap IO in units of 4k blocks.
- * We also still have a hardcoded 4k per bit relation. */
+ * Bit numbers outside of drbd_bitmap.c, resync accounting and the bitmap
+ * exchange with peers are always at 4k per bit.  The bitmap itself may be
+ * coarser, up to one resync request (1 MiB) per bit, see bm_block_shift. */
 #define BM_BLOCK_SHIFT	12			 /* 4k per bit */
 #define BM_BLOCK_SIZE	 (1<<BM_BLOCK_SHIFT)
+#define BM_BLOCK_SHIFT_MAX	20		 /* 1M per bit */
 /* mostly arbitrarily set the represented size of one bitmap extent,
  * aka resync extent, to 128 MiB (which is also 4096 Byte worth of bitmap
  * at 4k per bit resolution) */
@@ -1771,6 +2038,7 @@ extern void drbd_bm_reset_al_hints(struct drbd_device *device) __must_hold(local
 extern void drbd_bm_mark_range_for_writeout(struct drbd_device *, unsigned long, unsigned long);
 extern int  drbd_bm_write(struct drbd_device *, struct drbd_peer_device *) __must_hold(local);
 extern int  drbd_bm_write_hinted(struct drbd_device *device) __must_hold(local);
+extern void drbd_bm_write_behind(struct drbd_device *device, unsigned long start, unsigned long end) __must_hold(local);
 extern int  drbd_bm_write_lazy(struct drbd_device *device, unsigned upper_idx) __must_hold(local);
 extern int drbd_bm_write_all(struct drbd_device *, struct drbd_peer_device *) __must_hold(local);
 extern int drbd_bm_write_copy_pages(struct drbd_device *, struct drbd_peer_device *) __must_hold(local);
@@ -1797,6 +2065,9 @@ extern void drbd_bm_unlock(struct drbd_device *device);
 extern void drbd_bm_slot_lock(struct drbd_peer_device *peer_device, char *why, enum bm_flag flags);
 extern void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device);
 extern void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsigned int to_index);
+extern void drbd_bm_compact(struct drbd_device *device);
+extern int drbd_bm_create_sentinels(void);
+extern void drbd_bm_destroy_sentinels(void);
 /* drbd_main.c */
 
 extern struct kmem_cache *drbd_request_cache;
@@ -1823,6 +2094,9 @@ extern struct bio *bio_alloc_drbd(gfp_t gfp_mask);
 /* And a bio_set for cloning */
 extern struct bio_set drbd_io_bio_set;
 
+/* For splitting large reads among several read sources */
+extern struct bio_set drbd_split_bio_set;
+
 extern struct drbd_peer_device *create_peer_device(struct drbd_device *, struct drbd_connection *);
 extern enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsigned int minor,
 					     struct device_conf *device_conf, struct drbd_device **p_device);
@@ -1845,6 +2119,8 @@ extern struct drbd_connection *drbd_create_connection(struct drbd_resource *reso
 extern void drbd_transport_shutdown(struct drbd_connection *connection, enum drbd_tr_free_op op);
 extern void drbd_destroy_connection(struct kref *kref);
 extern void conn_free_crypto(struct drbd_connection *connection);
+extern u32 drbd_compress_features(void);
+extern int drbd_compress_setup(struct drbd_connection *connection);
 
 /* drbd_req */
 extern void do_submit(struct work_struct *ws);
@@ -1904,7 +2180,12 @@ extern void verify_progress(struct drbd_peer_device *peer_device,
 		const sector_t sector, const unsigned int size);
 /* maybe rather drbd_main.c ? */
 extern void *drbd_md_get_buffer(struct drbd_device *device, const char *intent);
+extern void *drbd_md_get_buffer_exclusive(struct drbd_device *device, const char *intent);
 extern void drbd_md_put_buffer(struct drbd_device *device);
+extern void __drbd_md_put_buffer(struct drbd_md_io *md_io);
+extern int drbd_md_submit_page_io(struct drbd_device *device,
+		struct drbd_backing_dev *bdev, struct drbd_md_io *md_io,
+		sector_t sector, int op, void (*end_io)(struct drbd_md_io *));
 extern int drbd_md_sync_page_io(struct drbd_device *device,
 		struct drbd_backing_dev *bdev, sector_t sector, int op);
 extern void drbd_ov_out_of_sync_found(struct drbd_peer_device *, sector_t, int);
@@ -2001,6 +2282,9 @@ struct drbd_peer_request_details {
 	uint32_t bi_size;	/* resulting bio size */
 	/* for non-discards: bi_size = length - digest_size */
 	uint32_t digest_size;
+	uint32_t compress_alg;	/* with DP_COMPRESSED, bi_size is from p_data_compressed */
+	struct p_merged_extent *merged;	/* P_DATA_MERGED, kmalloc()ed */
+	uint32_t merged_count;
 };
 
 struct queued_twopc {
@@ -2080,6 +2364,21 @@ void drbd_bump_write_ordering(struct drbd_resource *resource, struct drbd_backin
 
 extern void twopc_timer_fn(struct timer_list *t);
 extern void connect_timer_fn(struct timer_list *t);
+extern void resume_window_timer_fn(struct timer_list *t);
+extern int w_resume_window_expired(struct drbd_work *w, int cancel);
+
+/* drbd_journal.c */
+struct drbd_journal_entry;
+extern int drbd_journal_init(void);
+extern void drbd_journal_exit(void);
+extern bool drbd_journal_may_start(struct drbd_connection *);
+extern void drbd_journal_queue(struct drbd_request *);
+extern void drbd_journal_submit(void);
+extern struct drbd_journal_entry *drbd_journal_claim(struct drbd_peer_device *, struct drbd_request *);
+extern struct bio *drbd_journal_bio(struct drbd_journal_entry *);
+extern void drbd_journal_done(struct drbd_journal_entry *);
+extern void drbd_journal_drop(struct drbd_connection *);
+extern void drbd_journal_usage(u64 *used, u64 *size);
 
 /* drbd_proc.c */
 extern struct proc_dir_entry *drbd_proc;
@@ -2145,6 +2444,7 @@ extern void notify_helper(enum drbd_notification_type, struct drbd_device *,
 extern void notify_path(struct drbd_connection *, struct drbd_path *,
 			enum drbd_notification_type);
 extern void drbd_broadcast_peer_device_state(struct drbd_peer_device *);
+extern void drbd_push_statistics(struct drbd_resource *);
 
 extern sector_t drbd_local_max_size(struct drbd_device *device) __must_hold(local);
 extern int drbd_open_ro_count(struct drbd_resource *resource);
@@ -2388,6 +2688,9 @@ extern void *__conn_prepare_command(struct drbd_connection *, int, enum drbd_str
 extern void *conn_prepare_command(struct drbd_connection *, int, enum drbd_stream);
 extern void *drbd_prepare_command(struct drbd_peer_device *, int, enum drbd_stream);
 extern int __send_command(struct drbd_connection *, int, enum drbd_packet, enum drbd_stream);
+extern int drbd_queue_ack(struct drbd_peer_device *, enum drbd_packet,
+			  u64 sector, u32 blksize, u64 block_id, unsigned int max);
+extern int drbd_flush_ack_batch(struct drbd_connection *connection);
 extern int send_command(struct drbd_connection *, int, enum drbd_packet, enum drbd_stream);
 extern int drbd_send_command(struct drbd_peer_device *, enum drbd_packet, enum drbd_stream);
 
@@ -1,3 +1,4 @@
+#include <linux/bitops.h>
 #include "drbd_interval.h"
 #include "drbd_wrappers.h"
 
@@ -38,12 +39,77 @@ update_interval_end(struct rb_node *node, void *__unused)
 	this->end = end;
 }
 
+static inline
+struct rb_root *interval_shard(struct drbd_interval_tree *tree, sector_t sector)
+{
+	return &tree->shard[(sector >> DRBD_INTERVAL_SHARD_SHIFT) & (DRBD_INTERVAL_SHARDS - 1)];
+}
+
+/**
+ * next_shard  -  next shard to visit for an overlap query
+ * @shard:	shard visited last, or -1 to start
+ *
+ * An interval overlapping with [sector, sector + size) starts at most
+ * max_size bytes before @sector.  Visit the shards of the regions in between,
+ * each shard only once.
+ */
+static int
+next_shard(struct drbd_interval_tree *tree, int shard, sector_t sector, unsigned int size)
+{
+	sector_t max_sectors = tree->max_size >> 9;
+	sector_t first, last, region;
+
+	first = (sector > max_sectors ? sector - max_sectors : 0) >> DRBD_INTERVAL_SHARD_SHIFT;
+	last = (sector + (size >> 9)) >> DRBD_INTERVAL_SHARD_SHIFT;
+
+	if (last - first >= DRBD_INTERVAL_SHARDS - 1) {
+		/* range covers all shards anyways */
+		shard++;
+		return shard < DRBD_INTERVAL_SHARDS ? shard : -1;
+	}
+
+	if (shard < 0)
+		return first & (DRBD_INTERVAL_SHARDS - 1);
+
+	region = first + (((unsigned int)shard - first) & (DRBD_INTERVAL_SHARDS - 1));
+	if (region >= last)
+		return -1;
+	return (region + 1) & (DRBD_INTERVAL_SHARDS - 1);
+}
+
+/**
+ * account_size  -  add @this to or remove it from the size orders of @tree
+ * @delta:	1 on insert, -1 on remove
+ *
+ * Intervals of size order n are 2^n to 2^(n+1) - 1 sectors long.  max_size
+ * follows the largest order with intervals in the tree.
+ */
+static void
+account_size(struct drbd_interval_tree *tree, struct drbd_interval *this, int delta)
+{
+	unsigned int sectors = this->size >> 9;
+	int order;
+
+	if (!sectors)
+		return;
+	order = fls(sectors) - 1;
+	tree->size_count[order] += delta;
+	if (tree->size_count[order])
+		tree->size_orders |= 1U << order;
+	else
+		tree->size_orders &= ~(1U << order);
+
+	order = fls(tree->size_orders);
+	tree->max_size = order ? ((1U << order) - 1) << 9 : 0;
+}
+
 /**
  * drbd_insert_interval  -  insert a new interval into a tree
  */
 bool
-drbd_insert_interval(struct rb_root *root, struct drbd_interval *this)
+drbd_insert_interval(struct drbd_interval_tree *tree, struct drbd_interval *this)
 {
+	struct rb_root *root = interval_shard(tree, this->sector);
 	struct rb_node **new = &root->rb_node, *parent = NULL;
 
 	BUG_ON(!IS_ALIGNED(this->size, 512));
@@ -68,6 +134,8 @@ drbd_insert_interval(struct rb_root *root, struct drbd_interval *this)
 	rb_link_node(&this->rb, parent, new);
 	rb_insert_color(&this->rb, root);
 	rb_augment_insert(&this->rb, update_interval_end, NULL);
+	tree->count++;
+	account_size(tree, this, 1);
 	return true;
 }
 
@@ -82,10 +150,10 @@ drbd_insert_interval(struct rb_root *root, struct drbd_interval *this)
  * sector number.
  */
 bool
-drbd_contains_interval(struct rb_root *root, sector_t sector,
+drbd_contains_interval(struct drbd_interval_tree *tree, sector_t sector,
 		       struct drbd_interval *interval)
 {
-	struct rb_node *node = root->rb_node;
+	struct rb_node *node = interval_shard(tree, sector)->rb_node;
 
 	while (node) {
 		struct drbd_interval *here =
@@ -109,7 +177,7 @@ drbd_contains_interval(struct rb_root *root, sector_t sector,
  * drbd_remove_interval  -  remove an interval from a tree
  */
 void
-drbd_remove_interval(struct rb_root *root, struct drbd_interval *this)
+drbd_remove_interval(struct drbd_interval_tree *tree, struct drbd_interval *this)
 {
 	struct rb_node *deepest;
 
@@ -118,30 +186,19 @@ drbd_remove_interval(struct rb_root *root, struct drbd_interval *this)
 		return;
 
 	deepest = rb_augment_erase_begin(&this->rb);
-	rb_erase(&this->rb, root);
+	rb_erase(&this->rb, interval_shard(tree, this->sector));
 	rb_augment_erase_end(deepest, update_interval_end, NULL);
+	tree->count--;
+	account_size(tree, this, -1);
 }
 
-/**
- * drbd_find_overlap  - search for an interval overlapping with [sector, sector + size)
- * @sector:	start sector
- * @size:	size, aligned to 512 bytes
- *
- * Returns an interval overlapping with [sector, sector + size), or NULL if
- * there is none.  When there is more than one overlapping interval in the
- * tree, the interval with the lowest start sector is returned, and all other
- * overlapping intervals will be on the right side of the tree, reachable with
- * rb_next().
- */
-struct drbd_interval *
-drbd_find_overlap(struct rb_root *root, sector_t sector, unsigned int size)
+static struct drbd_interval *
+__find_overlap(struct rb_root *root, sector_t sector, unsigned int size)
 {
 	struct rb_node *node = root->rb_node;
 	struct drbd_interval *overlap = NULL;
 	sector_t end = sector + (size >> 9);
 
-	BUG_ON(!IS_ALIGNED(size, 512));
-
 	while (node) {
 		struct drbd_interval *here =
 			rb_entry(node, struct drbd_interval, rb);
@@ -163,20 +220,59 @@ drbd_find_overlap(struct rb_root *root, sector_t sector, unsigned int size)
 	return overlap;
 }
 
+static struct drbd_interval *
+find_overlap_from(struct drbd_interval_tree *tree, int shard,
+		  sector_t sector, unsigned int size)
+{
+	struct drbd_interval *overlap;
+
+	for (; shard >= 0; shard = next_shard(tree, shard, sector, size)) {
+		if (RB_EMPTY_ROOT(&tree->shard[shard]))
+			continue;
+		overlap = __find_overlap(&tree->shard[shard], sector, size);
+		if (overlap)
+			return overlap;
+	}
+	return NULL;
+}
+
+/**
+ * drbd_find_overlap  - search for an interval overlapping with [sector, sector + size)
+ * @sector:	start sector
+ * @size:	size, aligned to 512 bytes
+ *
+ * Returns an interval overlapping with [sector, sector + size), or NULL if
+ * there is none.  All other overlapping intervals are reachable with
+ * drbd_next_overlap().  Within one shard, they are returned in order of
+ * their start sector, there is no order across shards.
+ */
+struct drbd_interval *
+drbd_find_overlap(struct drbd_interval_tree *tree, sector_t sector, unsigned int size)
+{
+	BUG_ON(!IS_ALIGNED(size, 512));
+
+	if (!tree->count)
+		return NULL;
+	return find_overlap_from(tree, next_shard(tree, -1, sector, size), sector, size);
+}
+
 struct drbd_interval *
-drbd_next_overlap(struct drbd_interval *i, sector_t sector, unsigned int size)
+drbd_next_overlap(struct drbd_interval_tree *tree, struct drbd_interval *i,
+		  sector_t sector, unsigned int size)
 {
+	int shard = interval_shard(tree, i->sector) - tree->shard;
 	sector_t end = sector + (size >> 9);
 	struct rb_node *node;
 
 	for (;;) {
 		node = rb_next(&i->rb);
 		if (!node)
-			return NULL;
+			break;
 		i = rb_entry(node, struct drbd_interval, rb);
 		if (i->sector >= end)
-			return NULL;
+			break;
 		if (sector < i->sector + (i->size >> 9))
 			return i;
 	}
+	return find_overlap_from(tree, next_shard(tree, shard, sector, size), sector, size);
 }
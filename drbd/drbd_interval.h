@@ -15,6 +15,41 @@ struct drbd_interval {
 					 * ignore for conflict detection */
 };
 
+/*
+ * Intervals are sharded by the 4 MiB region (one activity log extent) their
+ * start sector lies in, modulo DRBD_INTERVAL_SHARDS.  Each shard is an
+ * augmented rb-tree of its own, so lookups and updates of unrelated regions
+ * walk small trees.  Overlap queries visit the shards of all regions an
+ * overlapping interval could start in, bounded by max_size.  max_size is
+ * the upper end of the largest power of two size order with intervals in
+ * the tree, so it is less than twice the largest interval, and shrinks again
+ * when the largest intervals are removed.
+ */
+#define DRBD_INTERVAL_SHARD_SHIFT	13	/* 4 MiB in sectors */
+#define DRBD_INTERVAL_SHARDS		16
+#define DRBD_INTERVAL_SIZE_ORDERS	23	/* sizes in sectors, below 4 GiB */
+
+struct drbd_interval_tree {
+	struct rb_root shard[DRBD_INTERVAL_SHARDS];
+	unsigned int count;		/* number of intervals in all shards */
+	unsigned int max_size;		/* bound of the largest size in the tree */
+	u32 size_orders;		/* size orders with intervals in the tree */
+	unsigned int size_count[DRBD_INTERVAL_SIZE_ORDERS];
+};
+
+static inline void drbd_init_interval_tree(struct drbd_interval_tree *tree)
+{
+	int i;
+
+	for (i = 0; i < DRBD_INTERVAL_SHARDS; i++)
+		tree->shard[i] = RB_ROOT;
+	for (i = 0; i < DRBD_INTERVAL_SIZE_ORDERS; i++)
+		tree->size_count[i] = 0;
+	tree->count = 0;
+	tree->max_size = 0;
+	tree->size_orders = 0;
+}
+
 static inline void drbd_clear_interval(struct drbd_interval *i)
 {
 	RB_CLEAR_NODE(&i->rb);
@@ -25,18 +60,19 @@ static inline bool drbd_interval_empty(struct drbd_interval *i)
 	return RB_EMPTY_NODE(&i->rb);
 }
 
-extern bool drbd_insert_interval(struct rb_root *, struct drbd_interval *);
-extern bool drbd_contains_interval(struct rb_root *, sector_t,
+extern bool drbd_insert_interval(struct drbd_interval_tree *, struct drbd_interval *);
+extern bool drbd_contains_interval(struct drbd_interval_tree *, sector_t,
 				   struct drbd_interval *);
-extern void drbd_remove_interval(struct rb_root *, struct drbd_interval *);
-extern struct drbd_interval *drbd_find_overlap(struct rb_root *, sector_t,
+extern void drbd_remove_interval(struct drbd_interval_tree *, struct drbd_interval *);
+extern struct drbd_interval *drbd_find_overlap(struct drbd_interval_tree *, sector_t,
 					unsigned int);
-extern struct drbd_interval *drbd_next_overlap(struct drbd_interval *, sector_t,
+extern struct drbd_interval *drbd_next_overlap(struct drbd_interval_tree *,
+					struct drbd_interval *, sector_t,
 					unsigned int);
 
-#define drbd_for_each_overlap(i, root, sector, size)		\
-	for (i = drbd_find_overlap(root, sector, size);		\
+#define drbd_for_each_overlap(i, tree, sector, size)		\
+	for (i = drbd_find_overlap(tree, sector, size);		\
 	     i;							\
-	     i = drbd_next_overlap(i, sector, size))
+	     i = drbd_next_overlap(tree, i, sector, size))
 
 #endif  /* __DRBD_INTERVAL_H */
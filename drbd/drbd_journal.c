@@ -0,0 +1,633 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_journal.c
+
+   This file is part of DRBD.
+
+   Replication journal: while a connection is congested, protocol A writes
+   are spilled into a ring buffer on a fast local block device, so their
+   master bios can complete without waiting for the socket.  They stay
+   queued in the transfer log, and the sender drains them from the journal
+   in transfer log order, barriers and all, instead of going Ahead.
+
+   The journal is a spill area, not a recovery log.  What was not sent when
+   the connection is lost, or the primary crashes, is resynced as before.
+ */
+
+#include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/drbd.h>
+#include "drbd_int.h"
+#include "drbd_req.h"
+
+/* entries start at this alignment in the journal */
+#define JOURNAL_ALIGN 4096
+
+/* entries a connection reads back ahead of the one it sends */
+#define JOURNAL_READAHEAD 8
+
+enum journal_entry_state {
+	JE_QUEUED,	/* on journal.submit */
+	JE_WRITING,	/* journal write in flight */
+	JE_WRITTEN,	/* payload is in the journal, request is RQ_NET_JOURNALED */
+	JE_FAILED,	/* journal write failed, request is sent from its master bio */
+};
+
+enum journal_read_state {
+	JR_NONE,	/* not read back, or already let go again */
+	JR_READING,	/* read in flight */
+	JR_DONE,	/* payload is in rbio */
+	JR_FAILED,
+};
+
+/* One entry per spilled write, shared by all peers it was spilled for */
+struct drbd_journal_entry {
+	struct list_head ring;		/* journal.ring, in the order of their space */
+	struct list_head submit;	/* journal.submit, while JE_QUEUED */
+	struct list_head tl;		/* resource->journal_entries, in transfer log order */
+	struct list_head rlist;		/* reads to start, see journal_start_reads() */
+	struct drbd_request *req;	/* holds a kref, see journal_release() */
+	struct bio *bio;		/* the journal write, while JE_QUEUED */
+	struct bio *rbio;		/* the payload read back, while JR_DONE */
+	struct bvec_iter riter;		/* of rbio, as submitted */
+	unsigned int opf;		/* of the master bio */
+	u64 pos;			/* byte offset in the journal */
+	unsigned int len;		/* payload */
+	unsigned int space;		/* ring space, including what was skipped to wrap */
+	u64 peers;			/* NODE_MASK()s of the peers still to send it */
+	u64 read_waiters;		/* peers whose sender waits for the read */
+	enum journal_entry_state state;
+	enum journal_read_state rstate;
+	int readers;			/* senders still sending from rbio */
+};
+
+static struct {
+	struct block_device *bdev;
+	spinlock_t lock;
+	u64 size;
+	u64 head;			/* where the next entry goes */
+	u64 used;			/* bytes, oldest entry up to head */
+	struct list_head ring;
+	struct list_head submit;
+	struct work_struct submit_work;
+} journal;
+
+#define JOURNAL_MODE (FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+static void journal_endio(struct bio *bio);
+
+static void journal_submit_work(struct work_struct *ws)
+{
+	drbd_journal_submit();
+}
+
+int drbd_journal_init(void)
+{
+	struct block_device *bdev;
+
+	spin_lock_init(&journal.lock);
+	INIT_LIST_HEAD(&journal.ring);
+	INIT_LIST_HEAD(&journal.submit);
+	INIT_WORK(&journal.submit_work, journal_submit_work);
+
+	if (!drbd_repl_journal[0])
+		return 0;
+
+	bdev = blkdev_get_by_path(drbd_repl_journal, JOURNAL_MODE, &journal);
+	if (IS_ERR(bdev)) {
+		pr_err("open(\"%s\") for the replication journal failed with %ld\n",
+		       drbd_repl_journal, PTR_ERR(bdev));
+		return PTR_ERR(bdev);
+	}
+	journal.size = round_down(i_size_read(bdev->bd_inode), JOURNAL_ALIGN);
+	if (journal.size < DRBD_MAX_BIO_SIZE * 4) {
+		pr_err("replication journal \"%s\" too small\n", drbd_repl_journal);
+		blkdev_put(bdev, JOURNAL_MODE);
+		return -EINVAL;
+	}
+	journal.bdev = bdev;
+	pr_info("replication journal on \"%s\", %llu KiB\n",
+		drbd_repl_journal, (unsigned long long)journal.size >> 10);
+	return 0;
+}
+
+void drbd_journal_exit(void)
+{
+	if (!journal.bdev)
+		return;
+	cancel_work_sync(&journal.submit_work);
+	blkdev_put(journal.bdev, JOURNAL_MODE);
+	journal.bdev = NULL;
+}
+
+/* Whether to spill into the journal instead of pulling ahead of a
+ * congested peer.  Called with req_lock held. */
+bool drbd_journal_may_start(struct drbd_connection *connection)
+{
+	bool room;
+
+	if (!journal.bdev)
+		return false;
+
+	spin_lock(&journal.lock);
+	room = journal.used < journal.size - journal.size / 8;
+	spin_unlock(&journal.lock);
+	if (room && !test_and_set_bit(CONN_JOURNALING, &connection->flags))
+		drbd_info(connection, "Congested, spilling writes into the replication journal\n");
+	return room;
+}
+
+/* Reserves ring space, with journal.lock held */
+static bool journal_alloc(struct drbd_journal_entry *e)
+{
+	unsigned int need = round_up(e->len, JOURNAL_ALIGN);
+	unsigned int skip = 0;
+	u64 start = journal.head;
+
+	if (start + need > journal.size) {
+		skip = journal.size - start;
+		start = 0;
+	}
+	if (journal.used + skip + need > journal.size)
+		return false;
+
+	journal.used += skip + need;
+	journal.head = start + need;
+	e->pos = start;
+	e->space = skip + need;
+	return true;
+}
+
+static void journal_put_bio(struct bio *bio)
+{
+	struct bio_vec *bvec;
+	struct bvec_iter_all iter_all;
+
+	bio_for_each_segment_all(bvec, bio, iter_all)
+		put_page(bvec->bv_page);
+	bio_put(bio);
+}
+
+/* Frees entries no peer needs any more from the tail of the ring */
+static void journal_reclaim(void)
+{
+	struct drbd_journal_entry *e, *tmp;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&journal.lock, flags);
+	list_for_each_entry_safe(e, tmp, &journal.ring, ring) {
+		if (e->req || e->readers || e->rstate == JR_READING || e->state == JE_WRITING)
+			break;
+		journal.used -= e->space;
+		list_del(&e->submit);
+		list_move_tail(&e->ring, &done);
+	}
+	if (list_empty(&journal.ring))
+		journal.head = 0;
+	spin_unlock_irqrestore(&journal.lock, flags);
+
+	list_for_each_entry_safe(e, tmp, &done, ring) {
+		if (e->bio)
+			journal_put_bio(e->bio);
+		if (e->rbio)
+			journal_put_bio(e->rbio);
+		kfree(e);
+	}
+}
+
+/* Drops the request once no peer is going to send it from the entry, and
+ * its journal write finished.  With req_lock and journal.lock held. */
+static void journal_release(struct drbd_journal_entry *e)
+{
+	if (!e->req || e->peers || e->state == JE_WRITING)
+		return;
+	kref_put(&e->req->kref, drbd_req_destroy);
+	e->req = NULL;
+}
+
+/* The peer of @connection is done with @e, its oldest entry: advance its
+ * position to the next entry it still has to send.  With req_lock and
+ * journal.lock held. */
+static void journal_consume(struct drbd_connection *connection, struct drbd_journal_entry *e)
+{
+	struct list_head *head = &connection->resource->journal_entries;
+	u64 mask = NODE_MASK(connection->peer_node_id);
+	struct drbd_journal_entry *next = e;
+
+	list_for_each_entry_continue(next, head, tl) {
+		if (next->peers & mask)
+			break;
+	}
+	connection->journal_next = &next->tl == head ? NULL : next;
+
+	e->peers &= ~mask;
+	e->read_waiters &= ~mask;
+	if (!e->peers) {
+		list_del_init(&e->tl);
+		journal_release(e);
+	}
+}
+
+/* The journal write of the master bio's payload.  Built right away, with
+ * references on the pages: the sender may send the request and complete
+ * the master bio before the journal write is even submitted. */
+static struct bio *journal_bio(struct drbd_journal_entry *e, struct bio *master)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_ATOMIC, bio_segments(master));
+	if (!bio)
+		return NULL;
+	bio_set_dev(bio, journal.bdev);
+	bio->bi_opf = REQ_OP_WRITE;
+	bio->bi_private = e;
+	bio->bi_end_io = journal_endio;
+
+	bio_for_each_segment(bvec, master, iter) {
+		if (bio_add_page(bio, bvec.bv_page, bvec.bv_len, bvec.bv_offset) != bvec.bv_len) {
+			journal_put_bio(bio);
+			return NULL;
+		}
+		get_page(bvec.bv_page);
+	}
+	return bio;
+}
+
+/**
+ * drbd_journal_queue() - Spill a write for its congested connections
+ * @req:	a write, just queued for its peers
+ *
+ * Only plain protocol A writes, those that complete on handing them over to
+ * the network anyways.  The payload is journaled once, for all peers that
+ * are journaling.  The journal write itself is submitted by
+ * drbd_journal_submit(), after the caller dropped the req_lock, or from a
+ * work item.  Called with req_lock held.
+ */
+void drbd_journal_queue(struct drbd_request *req)
+{
+	struct drbd_resource *resource = req->device->resource;
+	struct bio *bio = req->master_bio;
+	struct drbd_peer_device *peer_device;
+	struct drbd_journal_entry *e;
+	u64 peers = 0;
+	bool kick;
+
+	if (!journal.bdev ||
+	    bio_op(bio) != REQ_OP_WRITE || bio->bi_opf & (REQ_FUA | REQ_PREFLUSH) ||
+	    !IS_ALIGNED(req->i.size, bdev_logical_block_size(journal.bdev)))
+		return;
+
+	for_each_peer_device(peer_device, req->device) {
+		unsigned s = drbd_req_state_by_peer_device(req, peer_device);
+
+		if (test_bit(CONN_JOURNALING, &peer_device->connection->flags) &&
+		    (s & (RQ_NET_QUEUED | RQ_EXP_BARR_ACK | RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) ==
+		    (RQ_NET_QUEUED | RQ_EXP_BARR_ACK))
+			peers |= NODE_MASK(peer_device->node_id);
+	}
+	if (!peers)
+		return;
+
+	e = kzalloc(sizeof(*e), GFP_ATOMIC);
+	if (!e)
+		return;
+	e->bio = journal_bio(e, bio);
+	if (!e->bio) {
+		kfree(e);
+		return;
+	}
+	e->req = req;
+	e->opf = bio->bi_opf;
+	e->len = req->i.size;
+	e->peers = peers;
+	e->state = JE_QUEUED;
+	INIT_LIST_HEAD(&e->rlist);
+
+	spin_lock(&journal.lock);
+	if (!journal_alloc(e)) {
+		spin_unlock(&journal.lock);
+		journal_put_bio(e->bio);
+		kfree(e);
+		return;
+	}
+	e->bio->bi_iter.bi_sector = e->pos >> 9;
+	kick = list_empty(&journal.submit);
+	list_add_tail(&e->ring, &journal.ring);
+	list_add_tail(&e->submit, &journal.submit);
+	list_add_tail(&e->tl, &resource->journal_entries);
+	for_each_peer_device(peer_device, req->device) {
+		struct drbd_connection *connection = peer_device->connection;
+
+		if (!(peers & NODE_MASK(peer_device->node_id)))
+			continue;
+		if (!connection->journal_next)
+			connection->journal_next = e;
+		connection->journal_spilled += e->len;
+	}
+	spin_unlock(&journal.lock);
+
+	kref_get(&req->kref);
+
+	/* Not every path that queues writes submits them right after */
+	if (kick)
+		schedule_work(&journal.submit_work);
+}
+
+static void journal_endio(struct bio *bio)
+{
+	struct drbd_journal_entry *e = bio->bi_private;
+	struct drbd_request *req = e->req;
+	struct drbd_device *device = req->device;
+	struct drbd_peer_device *peer_device;
+	struct bio_and_error m = { NULL, };
+	bool ok = !bio->bi_status;
+	unsigned long flags;
+	u64 journaled;
+
+	journal_put_bio(bio);
+
+	spin_lock_irqsave(&device->resource->req_lock, flags);
+	spin_lock(&journal.lock);
+	e->state = ok ? JE_WRITTEN : JE_FAILED;
+	/* those that sent it meanwhile are no longer in e->peers */
+	journaled = ok ? e->peers : 0;
+	spin_unlock(&journal.lock);
+
+	/* The master bio may complete now, sending it stays queued */
+	for_each_peer_device(peer_device, device) {
+		struct bio_and_error tmp;
+
+		if (!(journaled & NODE_MASK(peer_device->node_id)))
+			continue;
+		__req_mod(req, JOURNALED, peer_device, &tmp);
+		if (tmp.bio)
+			m = tmp;
+	}
+
+	spin_lock(&journal.lock);
+	journal_release(e);
+	spin_unlock(&journal.lock);
+	spin_unlock_irqrestore(&device->resource->req_lock, flags);
+
+	if (m.bio)
+		complete_master_bio(device, &m);
+
+	journal_reclaim();
+}
+
+/* Submits the journal writes queued by drbd_journal_queue() */
+void drbd_journal_submit(void)
+{
+	struct drbd_journal_entry *e;
+
+	if (list_empty_careful(&journal.submit))
+		return;
+
+	spin_lock_irq(&journal.lock);
+	while ((e = list_first_entry_or_null(&journal.submit, struct drbd_journal_entry, submit))) {
+		struct bio *bio = e->bio;
+
+		list_del_init(&e->submit);
+		e->bio = NULL;
+		if (!e->peers) {
+			/* sent or canceled for all of them already */
+			spin_unlock_irq(&journal.lock);
+			journal_put_bio(bio);
+			spin_lock_irq(&journal.lock);
+			continue;
+		}
+		e->state = JE_WRITING;
+		spin_unlock_irq(&journal.lock);
+
+		submit_bio(bio);
+
+		spin_lock_irq(&journal.lock);
+	}
+	spin_unlock_irq(&journal.lock);
+}
+
+static void journal_read_done(struct drbd_journal_entry *e, bool ok)
+{
+	struct drbd_peer_device *peer_device;
+	struct bio *bio = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&journal.lock, flags);
+	if (ok) {
+		/* as the master bio was, for drbd_send_dblock_bio() */
+		e->rbio->bi_iter = e->riter;
+		e->rbio->bi_opf = e->opf;
+		e->rstate = JR_DONE;
+	} else {
+		bio = e->rbio;
+		e->rbio = NULL;
+		e->rstate = JR_FAILED;
+	}
+	/* the peers in read_waiters still hold e->req */
+	if (e->read_waiters) {
+		rcu_read_lock();
+		for_each_peer_device_rcu(peer_device, e->req->device) {
+			struct drbd_connection *connection = peer_device->connection;
+
+			if (!(e->read_waiters & NODE_MASK(peer_device->node_id)))
+				continue;
+			clear_bit(CONN_JOURNAL_READ_WAIT, &connection->flags);
+			wake_up(&connection->sender_work.q_wait);
+		}
+		rcu_read_unlock();
+	}
+	spin_unlock_irqrestore(&journal.lock, flags);
+
+	if (bio)
+		journal_put_bio(bio);
+	journal_reclaim();
+}
+
+static void journal_read_endio(struct bio *bio)
+{
+	journal_read_done(bio->bi_private, !bio->bi_status);
+}
+
+/* Submits the reads of entries marked JR_READING on @reads */
+static void journal_start_reads(struct list_head *reads)
+{
+	struct drbd_journal_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, reads, rlist) {
+		unsigned int len = e->len;
+		struct bio *bio;
+
+		list_del_init(&e->rlist);
+		bio = bio_alloc(GFP_NOIO, DIV_ROUND_UP(len, PAGE_SIZE));
+		bio_set_dev(bio, journal.bdev);
+		bio->bi_iter.bi_sector = e->pos >> 9;
+		bio->bi_opf = REQ_OP_READ;
+		bio->bi_private = e;
+		bio->bi_end_io = journal_read_endio;
+		while (len) {
+			unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
+			struct page *page = alloc_page(GFP_NOIO);
+
+			if (!page)
+				break;
+			bio_add_page(bio, page, l, 0);
+			len -= l;
+		}
+		e->rbio = bio;
+		e->riter = bio->bi_iter;
+		if (len)
+			journal_read_done(e, false);
+		else
+			submit_bio(bio);
+	}
+}
+
+/**
+ * drbd_journal_claim() - The sender is about to send a write
+ * @peer_device:	to this peer
+ * @req:		the write
+ *
+ * Returns the journal entry to send the payload from, with
+ * drbd_journal_bio(), if @req was spilled and its master bio may be gone.
+ * Returns NULL if @req is sent as usual, also when its journal write did not
+ * finish (yet).  Returns ERR_PTR(-EAGAIN) while the payload is still read
+ * back; CONN_JOURNAL_READ_WAIT is set then, and cleared again with a wake up
+ * of the sender once the read completed.
+ *
+ * Also reads back the next few entries of this peer ahead of time.
+ */
+struct drbd_journal_entry *drbd_journal_claim(struct drbd_peer_device *peer_device,
+					      struct drbd_request *req)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	u64 mask = NODE_MASK(peer_device->node_id);
+	struct drbd_journal_entry *e, *claimed = NULL;
+	LIST_HEAD(reads);
+	int n = 0;
+
+	if (!READ_ONCE(connection->journal_next))
+		return NULL;
+
+	spin_lock_irq(&connection->resource->req_lock);
+	spin_lock(&journal.lock);
+	while ((e = connection->journal_next)) {
+		/* Entries are in transfer log order.  Older ones were not
+		 * sent at all, their requests were canceled meanwhile. */
+		if (e->req->dagtag_sector < req->dagtag_sector) {
+			journal_consume(connection, e);
+			continue;
+		}
+		if (e->req != req)
+			break;
+
+		if (e->state != JE_WRITTEN) {
+			journal_consume(connection, e);
+			break;
+		}
+		switch (e->rstate) {
+		case JR_NONE:
+			e->rstate = JR_READING;
+			list_add_tail(&e->rlist, &reads);
+			fallthrough;
+		case JR_READING:
+			e->read_waiters |= mask;
+			set_bit(CONN_JOURNAL_READ_WAIT, &connection->flags);
+			claimed = ERR_PTR(-EAGAIN);
+			break;
+		case JR_DONE:
+			journal_consume(connection, e);
+			e->readers++;
+			connection->journal_drained += e->len;
+			claimed = e;
+			break;
+		case JR_FAILED:
+			journal_consume(connection, e);
+			claimed = ERR_PTR(-EIO);
+			break;
+		}
+		break;
+	}
+
+	e = connection->journal_next;
+	if (e) {
+		list_for_each_entry_from(e, &connection->resource->journal_entries, tl) {
+			if (!(e->peers & mask))
+				continue;
+			if (n++ == JOURNAL_READAHEAD)
+				break;
+			if (e->state != JE_WRITTEN || e->rstate != JR_NONE)
+				continue;
+			e->rstate = JR_READING;
+			list_add_tail(&e->rlist, &reads);
+		}
+	} else {
+		clear_bit(CONN_JOURNALING, &connection->flags);
+	}
+	spin_unlock(&journal.lock);
+	spin_unlock_irq(&connection->resource->req_lock);
+
+	journal_start_reads(&reads);
+	if (!claimed)
+		journal_reclaim();
+	return claimed;
+}
+
+/* The payload of a claimed entry, as the master bio was */
+struct bio *drbd_journal_bio(struct drbd_journal_entry *e)
+{
+	return e->rbio;
+}
+
+/* The sender is done sending from a claimed entry */
+void drbd_journal_done(struct drbd_journal_entry *e)
+{
+	struct bio *bio = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&journal.lock, flags);
+	e->readers--;
+	/* Nobody else waits for it right now.  A peer lagging behind
+	 * reads it again, instead of pinning the pages meanwhile. */
+	if (!e->readers && !e->read_waiters) {
+		bio = e->rbio;
+		e->rbio = NULL;
+		e->rstate = JR_NONE;
+	}
+	spin_unlock_irqrestore(&journal.lock, flags);
+
+	if (bio)
+		journal_put_bio(bio);
+	journal_reclaim();
+}
+
+/* After connection loss, forget what was spilled for this connection.
+ * The requests are not RQ_NET_OK, they get marked out of sync. */
+void drbd_journal_drop(struct drbd_connection *connection)
+{
+	struct drbd_journal_entry *e;
+
+	clear_bit(CONN_JOURNALING, &connection->flags);
+	clear_bit(CONN_JOURNAL_READ_WAIT, &connection->flags);
+	if (!journal.bdev)
+		return;
+
+	spin_lock_irq(&connection->resource->req_lock);
+	spin_lock(&journal.lock);
+	while ((e = connection->journal_next))
+		journal_consume(connection, e);
+	spin_unlock(&journal.lock);
+	spin_unlock_irq(&connection->resource->req_lock);
+
+	journal_reclaim();
+}
+
+void drbd_journal_usage(u64 *used, u64 *size)
+{
+	spin_lock_irq(&journal.lock);
+	*used = journal.used;
+	*size = journal.size;
+	spin_unlock_irq(&journal.lock);
+}
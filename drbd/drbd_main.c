@@ -128,12 +128,96 @@ const struct kernel_param_ops param_ops_drbd_protocol_version = {
 unsigned int drbd_protocol_version_min = PRO_VERSION_MIN;
 module_param_named(protocol_version_min, drbd_protocol_version_min, drbd_protocol_version, 0644);
 
+/* Seconds between pushing changed statistics to events2 listeners, 0 disables */
+static int param_set_drbd_statistics_push_interval(const char *s, const struct kernel_param *kp)
+{
+	struct drbd_resource *resource;
+	unsigned int interval;
+	int rv;
+
+	rv = param_set_uint(s, kp);
+	if (rv < 0)
+		return rv;
+	interval = READ_ONCE(drbd_statistics_push_interval);
+	if (!interval)
+		return 0;
+
+	/* the timers stop re-arming themselves while disabled */
+	mutex_lock(&resources_mutex);
+	for_each_resource(resource, &drbd_resources) {
+		if (!test_bit(R_UNREGISTERED, &resource->flags))
+			mod_timer(&resource->statistics_timer, jiffies + interval * HZ);
+	}
+	mutex_unlock(&resources_mutex);
+	return 0;
+}
+
+#define param_check_drbd_statistics_push_interval	param_check_uint
+#define param_get_drbd_statistics_push_interval		param_get_uint
+
+const struct kernel_param_ops param_ops_drbd_statistics_push_interval = {
+	.set = param_set_drbd_statistics_push_interval,
+	.get = param_get_drbd_statistics_push_interval,
+};
+
+unsigned int drbd_statistics_push_interval;
+MODULE_PARM_DESC(statistics_push_interval, "Seconds between statistics events (0 = off)");
+module_param_named(statistics_push_interval, drbd_statistics_push_interval,
+		   drbd_statistics_push_interval, 0644);
+
+/* Activity log replacement policy and sizing, applied when the AL is (re)created */
+bool drbd_al_segmented_lru;
+MODULE_PARM_DESC(al_segmented_lru, "Scan resistant activity log replacement policy");
+module_param_named(al_segmented_lru, drbd_al_segmented_lru, bool, 0644);
+bool drbd_al_autosize;
+MODULE_PARM_DESC(al_autosize, "Grow the activity log beyond al-extents under AL pressure");
+module_param_named(al_autosize, drbd_al_autosize, bool, 0644);
+
+/* Write acks coalesced into one P_BLOCK_ACKS, and the longest an ack may wait */
+unsigned int drbd_ack_batch = 32;
+MODULE_PARM_DESC(ack_batch, "Max acks per P_BLOCK_ACKS packet (0 or 1 = off)");
+module_param_named(ack_batch, drbd_ack_batch, uint, 0644);
+unsigned int drbd_ack_batch_usecs = 100;
+MODULE_PARM_DESC(ack_batch_usecs, "Max microseconds an ack is held back for batching");
+module_param_named(ack_batch_usecs, drbd_ack_batch_usecs, uint, 0644);
+
+/* Route reads to the source with the lowest expected completion time,
+ * overrides the read-balancing disk option */
+bool drbd_read_balancing_adaptive;
+MODULE_PARM_DESC(read_balancing_adaptive, "Latency aware read balancing");
+module_param_named(read_balancing_adaptive, drbd_read_balancing_adaptive, bool, 0644);
+unsigned int drbd_read_balancing_split_kb = 256;
+MODULE_PARM_DESC(read_balancing_split_kb, "Split larger reads among read sources (0 = off)");
+module_param_named(read_balancing_split_kb, drbd_read_balancing_split_kb, uint, 0644);
+unsigned int drbd_read_stripe_kb;
+MODULE_PARM_DESC(read_stripe_kb, "Diskless nodes stripe larger reads across peers in pieces of this size (0 = off)");
+module_param_named(read_stripe_kb, drbd_read_stripe_kb, uint, 0644);
+unsigned int drbd_data_compress;
+MODULE_PARM_DESC(data_compress, "Compress replicated data, if the peer supports it: 0 = off, 1 = lz4, 2 = zstd");
+module_param_named(data_compress, drbd_data_compress, uint, 0644);
+bool drbd_zero_elision = true;
+MODULE_PARM_DESC(zero_elision, "Replicate all-zero blocks as zero-out commands, if the peer supports it");
+module_param_named(zero_elision, drbd_zero_elision, bool, 0644);
+unsigned int drbd_merge_writes = 16;
+MODULE_PARM_DESC(merge_writes, "Max adjacent queued writes sent as one P_DATA_MERGED packet (0 or 1 = off)");
+module_param_named(merge_writes, drbd_merge_writes, uint, 0644);
+
+char drbd_repl_journal[256];
+MODULE_PARM_DESC(repl_journal, "Block device absorbing protocol A bursts instead of going Ahead");
+module_param_string(repl_journal, drbd_repl_journal, sizeof(drbd_repl_journal), 0444);
+
+/* A primary holds IO this long after a network failure to an UpToDate peer,
+ * so that a quick reconnect resends the transfer log instead of resyncing */
+unsigned int drbd_resume_window_ms;
+MODULE_PARM_DESC(resume_window_ms, "Hold IO this long for a lost peer to come back without resync (0 = off)");
+module_param_named(resume_window_ms, drbd_resume_window_ms, uint, 0644);
+
 
 /* in 2.6.x, our device mapping and config info contains our virtual gendisks
  * as member "struct gendisk *vdisk;"
  */
 struct idr drbd_devices;
-struct list_head drbd_resources;
+LIST_HEAD(drbd_resources);
 
 struct kmem_cache *drbd_request_cache;
 struct kmem_cache *drbd_ee_cache;	/* peer requests */
@@ -144,6 +228,7 @@ mempool_t drbd_ee_mempool;
 mempool_t drbd_md_io_page_pool;
 struct bio_set drbd_md_io_bio_set;
 struct bio_set drbd_io_bio_set;
+struct bio_set drbd_split_bio_set;
 
 static const struct block_device_operations drbd_ops = {
 	.owner		= THIS_MODULE,
@@ -410,7 +495,7 @@ void tl_release(struct drbd_connection *connection,
 			}
 			expect_size++;
 		}
-		if (y_block_id && (struct drbd_request*)(unsigned long)y_block_id == r) {
+		if (y_block_id && r->id == y_block_id) {
 			req_y = r;
 			break;
 		}
@@ -418,14 +503,15 @@ void tl_release(struct drbd_connection *connection,
 
 	/* first some paranoia code */
 	if (o_block_id) {
-		if ((struct drbd_request*)(unsigned long)o_block_id != req) {
-			drbd_err(connection, "BAD! ConfirmedStable: expected %p, found %p\n",
-				(struct drbd_request*)(unsigned long)o_block_id, req);
+		if (!req || req->id != o_block_id) {
+			drbd_err(connection, "BAD! ConfirmedStable: expected 0x%llx, found 0x%llx\n",
+				(unsigned long long)o_block_id,
+				req ? (unsigned long long)req->id : 0ULL);
 			goto bail;
 		}
 		if (!req_y) {
-			drbd_err(connection, "BAD! ConfirmedStable: expected youngest request %p NOT found\n",
-				(struct drbd_req*)(unsigned long)y_block_id);
+			drbd_err(connection, "BAD! ConfirmedStable: expected youngest request 0x%llx NOT found\n",
+				(unsigned long long)y_block_id);
 			goto bail;
 		}
 		/* A P_CONFIRM_STABLE cannot tell me the to-be-expected barrier nr,
@@ -959,6 +1045,8 @@ static void additional_size_command(struct drbd_connection *connection,
 	connection->send_buffer[drbd_stream].additional_size = additional_size;
 }
 
+static int __drbd_flush_ack_batch(struct drbd_connection *connection);
+
 void *__conn_prepare_command(struct drbd_connection *connection, int size,
 				    enum drbd_stream drbd_stream)
 {
@@ -971,6 +1059,11 @@ void *__conn_prepare_command(struct drbd_connection *connection, int size,
 	if (!transport->ops->stream_ok(transport, drbd_stream))
 		return NULL;
 
+	/* batched acks must not be overtaken, e.g. by a P_BARRIER_ACK */
+	if (drbd_stream == CONTROL_STREAM && connection->ack_batch.count &&
+	    __drbd_flush_ack_batch(connection))
+		return NULL;
+
 	header_size = drbd_header_size(connection);
 	return alloc_send_buffer(connection, header_size + size, drbd_stream) + header_size;
 }
@@ -1113,6 +1206,97 @@ void drbd_uncork(struct drbd_connection *connection, enum drbd_stream stream)
 	mutex_unlock(&connection->mutex[stream]);
 }
 
+/* Call with mutex[CONTROL_STREAM] held */
+static int __drbd_flush_ack_batch(struct drbd_connection *connection)
+{
+	unsigned int header_size = drbd_header_size(connection);
+	typeof(connection->ack_batch) *batch = &connection->ack_batch;
+	struct p_block_acks *p;
+	unsigned int size;
+
+	if (!batch->count)
+		return 0;
+
+	size = sizeof(*p) + batch->count * sizeof(p->acks[0]);
+	p = (struct p_block_acks *)
+		(alloc_send_buffer(connection, header_size + size, CONTROL_STREAM) + header_size);
+	p->seq_num = cpu_to_be32(batch->seq_num);
+	p->cmd = cpu_to_be16(batch->cmd);
+	p->count = cpu_to_be16(batch->count);
+	memcpy(p->acks, batch->acks, batch->count * sizeof(p->acks[0]));
+	batch->count = 0;
+
+	return __send_command(connection, batch->vnr, P_BLOCK_ACKS, CONTROL_STREAM);
+}
+
+int drbd_flush_ack_batch(struct drbd_connection *connection)
+{
+	int err;
+
+	mutex_lock(&connection->mutex[CONTROL_STREAM]);
+	err = __drbd_flush_ack_batch(connection);
+	mutex_unlock(&connection->mutex[CONTROL_STREAM]);
+
+	return err;
+}
+
+/**
+ * drbd_queue_ack() - Add an ack to the connection's P_BLOCK_ACKS batch
+ * @peer_device:	DRBD peer device
+ * @cmd:		P_WRITE_ACK, P_RS_WRITE_ACK or P_RECV_ACK
+ * @sector:		sector, in big endian byte order
+ * @blksize:		size in bytes, in big endian byte order
+ * @block_id:		id, big endian byte order
+ * @max:		send the batch when it reaches this many acks
+ *
+ * The batch is sent when it is full, when its oldest ack waited for
+ * drbd_ack_batch_usecs, before any other packet on the control stream,
+ * and by drbd_flush_ack_batch().
+ */
+int drbd_queue_ack(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
+		   u64 sector, u32 blksize, u64 block_id, unsigned int max)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_transport *transport = &connection->transport;
+	typeof(connection->ack_batch) *batch = &connection->ack_batch;
+	struct p_block_ack_entry *e;
+	int err = 0;
+
+	mutex_lock(&connection->mutex[CONTROL_STREAM]);
+	if (connection->cstate[NOW] < C_CONNECTING ||
+	    !transport->ops->stream_ok(transport, CONTROL_STREAM)) {
+		batch->count = 0;
+		err = -EIO;
+		goto out;
+	}
+
+	if (batch->count && (batch->vnr != peer_device->device->vnr || batch->cmd != cmd))
+		err = __drbd_flush_ack_batch(connection);
+	if (!batch->count) {
+		batch->vnr = peer_device->device->vnr;
+		batch->cmd = cmd;
+		batch->start = ktime_get();
+	}
+
+	e = &batch->acks[batch->count++];
+	e->sector = sector;
+	e->block_id = block_id;
+	e->blksize = blksize;
+	e->pad = 0;
+	batch->seq_num = atomic_inc_return(&peer_device->packet_seq);
+
+	if (batch->count >= min_t(unsigned int, max, DRBD_ACK_BATCH_MAX) ||
+	    ktime_us_delta(ktime_get(), batch->start) >= READ_ONCE(drbd_ack_batch_usecs)) {
+		int err2 = __drbd_flush_ack_batch(connection);
+
+		if (!err)
+			err = err2;
+	}
+out:
+	mutex_unlock(&connection->mutex[CONTROL_STREAM]);
+	return err;
+}
+
 int send_command(struct drbd_connection *connection, int vnr,
 		 enum drbd_packet cmd, enum drbd_stream drbd_stream)
 {
@@ -1981,6 +2165,201 @@ send_bitmap_rle_or_plain(struct drbd_peer_device *peer_device, struct bm_xfer_ct
 	return -EIO;
 }
 
+/* Word RLE bitmap transfer (DRBD_FF_BM_WORD_RLE).
+ * The bitmap is cut into chunks that get extracted and encoded in parallel on
+ * system_unbound_wq, the sender thread only copies the finished tokens into
+ * packets, in order. */
+#define BM_WRLE_CHUNK_BYTES	(32 << 10)
+#define BM_WRLE_MAX_WORKERS	8
+
+struct bm_wrle_chunk {
+	struct work_struct work;
+	struct completion done;
+	struct drbd_peer_device *peer_device;
+	unsigned long word_offset;	/* in unsigned longs */
+	unsigned long num_words;	/* in unsigned longs */
+	unsigned long *raw;		/* BM_WRLE_CHUNK_BYTES */
+	u8 *code;			/* raw words plus a token header per literal */
+	unsigned int len;
+};
+
+#define BM_WRLE_CODE_BYTES \
+	(BM_WRLE_CHUNK_BYTES + BM_WRLE_CHUNK_BYTES / 8 / BM_WRLE_LITERAL_MAX * 10)
+
+static unsigned int bm_wrle_encode(const __le64 *w, unsigned int n, u8 *out)
+{
+	unsigned int i = 0, len = 0, cnt;
+	u64 v;
+
+	while (i < n) {
+		v = le64_to_cpu(w[i]);
+		if (v == 0 || v == ~0ULL) {
+			for (cnt = 1; i + cnt < n && le64_to_cpu(w[i + cnt]) == v; cnt++)
+				;
+			len += bm_wrle_put_token(out + len, v ? BM_WRLE_ONES : BM_WRLE_ZEROES, cnt);
+		} else {
+			for (cnt = 1; i + cnt < n && cnt < BM_WRLE_LITERAL_MAX; cnt++) {
+				v = le64_to_cpu(w[i + cnt]);
+				if (v == 0 || v == ~0ULL)
+					break;
+			}
+			len += bm_wrle_put_token(out + len, BM_WRLE_LITERAL, cnt);
+			memcpy(out + len, &w[i], cnt * sizeof(*w));
+			len += cnt * sizeof(*w);
+		}
+		i += cnt;
+	}
+	return len;
+}
+
+static void bm_wrle_encode_work(struct work_struct *ws)
+{
+	struct bm_wrle_chunk *ch = container_of(ws, struct bm_wrle_chunk, work);
+	unsigned int n = DIV_ROUND_UP(ch->num_words * sizeof(long), sizeof(u64));
+
+	/* on 32 bit the last 64 bit word might be only half filled */
+	((u64 *)ch->raw)[n - 1] = 0;
+	drbd_bm_get_lel(ch->peer_device, ch->word_offset, ch->num_words, ch->raw);
+	ch->len = bm_wrle_encode((__le64 *)ch->raw, n, ch->code);
+	complete(&ch->done);
+}
+
+static void bm_wrle_queue_chunk(struct bm_wrle_chunk *ch, struct bm_xfer_ctx *c,
+				unsigned long nr)
+{
+	const unsigned long chunk_words = BM_WRLE_CHUNK_BYTES / sizeof(long);
+
+	ch->word_offset = nr * chunk_words;
+	ch->num_words = min(chunk_words, c->bm_words - ch->word_offset);
+	reinit_completion(&ch->done);
+	queue_work(system_unbound_wq, &ch->work);
+}
+
+static int bm_wrle_send_packet(struct drbd_peer_device *peer_device,
+			       struct bm_xfer_ctx *c, unsigned int len)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	unsigned int header_size = drbd_header_size(connection);
+	int err;
+
+	resize_prepared_command(connection, DATA_STREAM, sizeof(struct p_compressed_bm) + len);
+	err = __send_command(connection, peer_device->device->vnr,
+			     P_COMPRESSED_BITMAP, DATA_STREAM);
+	c->packets[0]++;
+	c->bytes[0] += header_size + sizeof(struct p_compressed_bm) + len;
+	return err;
+}
+
+static bool drbd_bm_use_word_rle(struct drbd_connection *connection)
+{
+	bool use_rle;
+
+	rcu_read_lock();
+	use_rle = rcu_dereference(connection->transport.net_conf)->use_rle;
+	rcu_read_unlock();
+
+	return use_rle && (connection->agreed_features & DRBD_FF_BM_WORD_RLE);
+}
+
+/**
+ * send_bitmap_word_rle
+ *
+ * Sends the whole bitmap.  Returns 0 when done, -ENOMEM if the buffers could
+ * not be allocated (the caller falls back to the classic encoding), and a
+ * negative error code upon failure.
+ */
+static int send_bitmap_word_rle(struct drbd_peer_device *peer_device, struct bm_xfer_ctx *c)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	unsigned int header_size = drbd_header_size(connection);
+	unsigned int max_len = DRBD_SOCKET_BUFFER_SIZE - header_size - sizeof(struct p_compressed_bm);
+	const unsigned long chunk_words = BM_WRLE_CHUNK_BYTES / sizeof(long);
+	unsigned long nr_chunks = DIV_ROUND_UP(c->bm_words, chunk_words);
+	unsigned long next, k;
+	unsigned int nr_workers, i, len = 0;
+	struct bm_wrle_chunk *chunks;
+	struct p_compressed_bm *pc = NULL;
+	int err = 0;
+
+	nr_workers = min_t(unsigned long, nr_chunks,
+			   clamp_t(unsigned int, num_online_cpus(), 1, BM_WRLE_MAX_WORKERS));
+	chunks = kcalloc(nr_workers, sizeof(*chunks), GFP_NOIO);
+	if (!chunks)
+		return -ENOMEM;
+	for (i = 0; i < nr_workers; i++) {
+		struct bm_wrle_chunk *ch = &chunks[i];
+
+		INIT_WORK(&ch->work, bm_wrle_encode_work);
+		init_completion(&ch->done);
+		ch->peer_device = peer_device;
+		ch->raw = __vmalloc(BM_WRLE_CHUNK_BYTES, GFP_NOIO);
+		ch->code = __vmalloc(BM_WRLE_CODE_BYTES, GFP_NOIO);
+		if (!ch->raw || !ch->code) {
+			err = -ENOMEM;
+			goto out_free;
+		}
+	}
+
+	for (next = 0; next < nr_workers; next++)
+		bm_wrle_queue_chunk(&chunks[next], c, next);
+
+	for (k = 0; k < nr_chunks; k++) {
+		struct bm_wrle_chunk *ch = &chunks[k % nr_workers];
+		unsigned int pos = 0;
+
+		wait_for_completion(&ch->done);
+		while (pos < ch->len) {
+			enum bm_wrle_token type;
+			u64 count;
+			int tlen;
+
+			tlen = bm_wrle_get_token(ch->code + pos, ch->code + ch->len, &type, &count);
+			if (tlen < 0) {
+				drbd_err(peer_device, "error while encoding bitmap: %d\n", tlen);
+				err = -EIO;
+				goto out_flush;
+			}
+			if (pc && len + tlen > max_len) {
+				if (bm_wrle_send_packet(peer_device, c, len)) {
+					err = -EIO;
+					goto out_flush;
+				}
+				pc = NULL;
+			}
+			if (!pc) {
+				pc = (struct p_compressed_bm *)
+					(alloc_send_buffer(connection, DRBD_SOCKET_BUFFER_SIZE, DATA_STREAM) + header_size);
+				pc->encoding = 0;
+				dcbp_set_code(pc, DRBD_BM_CODE_WORD_RLE);
+				len = 0;
+			}
+			memcpy(pc->code + len, ch->code + pos, tlen);
+			len += tlen;
+			pos += tlen;
+		}
+		if (next < nr_chunks)
+			bm_wrle_queue_chunk(ch, c, next++);
+	}
+	if (pc && bm_wrle_send_packet(peer_device, c, len))
+		err = -EIO;
+
+	c->word_offset = c->bm_words;
+	c->bit_offset = c->bm_bits;
+	if (!err)
+		INFO_bm_xfer_stats(peer_device, "send", c);
+
+out_flush:
+	for (i = 0; i < nr_workers; i++)
+		flush_work(&chunks[i].work);
+out_free:
+	for (i = 0; i < nr_workers; i++) {
+		vfree(chunks[i].raw);
+		vfree(chunks[i].code);
+	}
+	kfree(chunks);
+	return err;
+}
+
 /* See the comment at receive_bitmap() */
 static int _drbd_send_bitmap(struct drbd_device *device,
 			     struct drbd_peer_device *peer_device)
@@ -2013,6 +2392,12 @@ static int _drbd_send_bitmap(struct drbd_device *device,
 		.bm_words = drbd_bm_words(device),
 	};
 
+	if (drbd_bm_use_word_rle(peer_device->connection) && c.bm_words) {
+		err = send_bitmap_word_rle(peer_device, &c);
+		if (err != -ENOMEM)
+			return err == 0;
+	}
+
 	do {
 		err = send_bitmap_rle_or_plain(peer_device, &c);
 	} while (err > 0);
@@ -2252,6 +2637,276 @@ static int _drbd_send_zc_ee(struct drbd_peer_device *peer_device,
 	return 0;
 }
 
+static const struct {
+	const char *name;
+	u32 feature;
+} drbd_compress_algs[__DRBD_COMPRESS_NR] = {
+	[DRBD_COMPRESS_LZ4] = { "lz4", DRBD_FF_COMPRESS_LZ4 },
+	[DRBD_COMPRESS_ZSTD] = { "zstd", DRBD_FF_COMPRESS_ZSTD },
+};
+
+/* The compression algorithms we can offer to peers */
+u32 drbd_compress_features(void)
+{
+	u32 features = 0;
+	int alg;
+
+	for (alg = DRBD_COMPRESS_LZ4; alg < __DRBD_COMPRESS_NR; alg++)
+		if (crypto_has_comp(drbd_compress_algs[alg].name, 0, 0))
+			features |= drbd_compress_algs[alg].feature;
+	return features;
+}
+
+/* Called from the handshake, before data packets flow.  Decompressors
+ * for everything agreed on are mandatory, the peer may use any of them.
+ * Compressing ourselves is optional, we just do not if it fails. */
+int drbd_compress_setup(struct drbd_connection *connection)
+{
+	struct drbd_compress *c = &connection->compress;
+	unsigned int tx_alg = READ_ONCE(drbd_data_compress);
+	struct crypto_comp *tfm, *old;
+	bool any = false;
+	int alg;
+
+	for (alg = DRBD_COMPRESS_LZ4; alg < __DRBD_COMPRESS_NR; alg++) {
+		if (!(connection->agreed_features & drbd_compress_algs[alg].feature))
+			continue;
+		any = true;
+		if (c->rx_tfm[alg])
+			continue;
+		tfm = crypto_alloc_comp(drbd_compress_algs[alg].name, 0, 0);
+		if (IS_ERR(tfm)) {
+			drbd_err(connection, "Cannot allocate \"%s\" decompressor\n",
+				 drbd_compress_algs[alg].name);
+			return PTR_ERR(tfm);
+		}
+		c->rx_tfm[alg] = tfm;
+	}
+	if (!any)
+		return 0;
+	if (!c->rx_buf)
+		c->rx_buf = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	if (!c->rx_raw)
+		c->rx_raw = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	if (!c->rx_buf || !c->rx_raw)
+		return -ENOMEM;
+
+	if (tx_alg == DRBD_COMPRESS_NONE || tx_alg >= __DRBD_COMPRESS_NR ||
+	    !(connection->agreed_features & drbd_compress_algs[tx_alg].feature) ||
+	    (c->tx_tfm && c->tx_alg == tx_alg))
+		return 0;
+
+	if (!c->tx_raw)
+		c->tx_raw = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	if (!c->tx_buf)
+		c->tx_buf = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	tfm = crypto_alloc_comp(drbd_compress_algs[tx_alg].name, 0, 0);
+	if (IS_ERR(tfm) || !c->tx_raw || !c->tx_buf) {
+		drbd_warn(connection, "Cannot set up \"%s\" compression, sending data uncompressed\n",
+			  drbd_compress_algs[tx_alg].name);
+		if (!IS_ERR(tfm))
+			crypto_free_comp(tfm);
+		return 0;
+	}
+
+	mutex_lock(&connection->mutex[DATA_STREAM]);
+	old = c->tx_tfm;
+	c->tx_tfm = tfm;
+	c->tx_alg = tx_alg;
+	c->skip = 0;
+	c->backoff = 0;
+	mutex_unlock(&connection->mutex[DATA_STREAM]);
+	if (old)
+		crypto_free_comp(old);
+
+	return 0;
+}
+
+static void drbd_compress_free(struct drbd_connection *connection)
+{
+	struct drbd_compress *c = &connection->compress;
+	int alg;
+
+	if (c->tx_tfm)
+		crypto_free_comp(c->tx_tfm);
+	for (alg = DRBD_COMPRESS_LZ4; alg < __DRBD_COMPRESS_NR; alg++)
+		if (c->rx_tfm[alg])
+			crypto_free_comp(c->rx_tfm[alg]);
+	kvfree(c->tx_raw);
+	kvfree(c->tx_buf);
+	kvfree(c->rx_buf);
+	kvfree(c->rx_raw);
+	memset(c, 0, sizeof(*c));
+}
+
+/* Whether to try compressing a payload of size bytes.  Compression is
+ * bypassed while the link keeps up anyways, i.e. while little is queued
+ * in the socket, and for a while after the data turned out not to
+ * compress.  Called with mutex[DATA_STREAM] held. */
+static bool drbd_compress_wanted(struct drbd_connection *connection, unsigned int size)
+{
+	struct drbd_compress *c = &connection->compress;
+	struct drbd_transport *transport = &connection->transport;
+	struct drbd_transport_stats stats = {};
+
+	if (!c->tx_tfm || c->tx_alg != READ_ONCE(drbd_data_compress) || size < 1024 ||
+	    !(connection->agreed_features & drbd_compress_algs[c->tx_alg].feature))
+		return false;
+
+	if (c->skip) {
+		c->skip--;
+		goto bypass;
+	}
+
+	transport->ops->stats(transport, &stats);
+	if (stats.send_buffer_used < stats.send_buffer_size / 4)
+		goto bypass;
+
+	return true;
+
+bypass:
+	c->tx_bypassed_bytes += size;
+	return false;
+}
+
+/* Compresses c->tx_raw into c->tx_buf.  Returns the compressed size, or
+ * 0 if it would not save at least 1/8; then compression is bypassed for
+ * the next packets, the more consecutive misses, the longer. */
+static unsigned int drbd_compress_tx(struct drbd_connection *connection, unsigned int size)
+{
+	struct drbd_compress *c = &connection->compress;
+	unsigned int dlen = size - size / 8;
+	ktime_t start = ktime_get();
+	int err;
+
+	err = crypto_comp_compress(c->tx_tfm, c->tx_raw, size, c->tx_buf, &dlen);
+	c->tx_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	c->tx_raw_bytes += size;
+
+	if (err || dlen + sizeof(struct p_data_compressed) >= size - size / 8) {
+		c->tx_wire_bytes += size;
+		c->backoff = clamp(c->backoff * 2, 16U, 1024U);
+		c->skip = c->backoff;
+		return 0;
+	}
+
+	c->tx_wire_bytes += dlen + sizeof(struct p_data_compressed);
+	c->backoff = 0;
+	return dlen;
+}
+
+static unsigned int drbd_compress_bio(struct drbd_connection *connection, struct bio *bio)
+{
+	char *raw = connection->compress.tx_raw;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		void *from = kmap_atomic(bvec.bv_page);
+
+		memcpy(raw, from + bvec.bv_offset, bvec.bv_len);
+		kunmap_atomic(from);
+		raw += bvec.bv_len;
+	}
+	return drbd_compress_tx(connection, bio->bi_iter.bi_size);
+}
+
+static unsigned int drbd_compress_pages(struct drbd_connection *connection,
+					struct page *page, unsigned int size)
+{
+	char *raw = connection->compress.tx_raw;
+	unsigned int len = size;
+
+	page_chain_for_each(page) {
+		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
+		void *from = kmap_atomic(page);
+
+		memcpy(raw, from, l);
+		kunmap_atomic(from);
+		raw += l;
+		len -= l;
+	}
+	return drbd_compress_tx(connection, size);
+}
+
+/* Sends the compressed payload from c->tx_buf */
+static int _drbd_send_compressed(struct drbd_peer_device *peer_device, unsigned int len,
+				 unsigned int raw_size)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	char *buf = connection->compress.tx_buf;
+	int err;
+
+	/* Flush send buffer and make sure PAGE_SIZE is available... */
+	alloc_send_buffer(connection, PAGE_SIZE, DATA_STREAM);
+	connection->send_buffer[DATA_STREAM].allocated_size = 0;
+
+	while (len) {
+		unsigned int l = min_t(unsigned int, len, PAGE_SIZE - offset_in_page(buf));
+
+		struct page *page = is_vmalloc_addr(buf) ? vmalloc_to_page(buf) : virt_to_page(buf);
+
+		err = _drbd_no_send_page(peer_device, page, offset_in_page(buf),
+					 l, len > l ? MSG_MORE : 0);
+		if (err)
+			return err;
+		buf += l;
+		len -= l;
+	}
+	peer_device->send_cnt += raw_size >> 9;
+	return 0;
+}
+
+/* memchr_inv() compares a machine word at a time */
+bool drbd_pages_all_zero(struct page *page, unsigned int size)
+{
+	page_chain_for_each(page) {
+		unsigned int l = min_t(unsigned int, size, PAGE_SIZE);
+		void *d = kmap_atomic(page);
+		bool zero = !memchr_inv(d, 0, l);
+
+		kunmap_atomic(d);
+		if (!zero)
+			return false;
+		size -= l;
+	}
+	return true;
+}
+
+static bool drbd_bio_all_zero(struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		void *d = kmap_atomic(bvec.bv_page);
+		bool zero = !memchr_inv(d + bvec.bv_offset, 0, bvec.bv_len);
+
+		kunmap_atomic(d);
+		if (!zero)
+			return false;
+	}
+	return true;
+}
+
+static bool drbd_zero_elision_ok(struct drbd_connection *connection, unsigned int size)
+{
+	return size && READ_ONCE(drbd_zero_elision) &&
+		connection->agreed_features & DRBD_FF_ZERO_ELISION;
+}
+
+/* An all-zero write goes out as P_ZEROES.  Not with FUA or a flush,
+ * the peer zeroes out without those semantics. */
+static bool drbd_elide_zero_write(struct drbd_peer_device *peer_device, struct drbd_request *req,
+				  struct bio *bio)
+{
+	if (bio_op(bio) != REQ_OP_WRITE || bio->bi_opf & (REQ_FUA | REQ_PREFLUSH) ||
+	    !drbd_zero_elision_ok(peer_device->connection, req->i.size))
+		return false;
+
+	return drbd_bio_all_zero(bio);
+}
+
 /* see also wire_flags_to_bio() */
 static u32 bio_flags_to_wire(struct drbd_connection *connection, struct bio *bio)
 {
@@ -2273,8 +2928,11 @@ static u32 bio_flags_to_wire(struct drbd_connection *connection, struct bio *bio
 
 /* Used to send write or TRIM aka REQ_OP_DISCARD requests
  * R_PRIMARY -> Peer	(P_DATA, P_TRIM)
+ * The payload comes from @bio, usually the master bio, or its copy read
+ * back from the replication journal.
  */
-int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req)
+int drbd_send_dblock_bio(struct drbd_peer_device *peer_device, struct drbd_request *req,
+			 struct bio *bio)
 {
 	struct drbd_device *device = peer_device->device;
 	char *const before = peer_device->connection->scratch_buffer.d.before;
@@ -2282,14 +2940,17 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 	struct p_trim *trim = NULL;
 	struct p_data *p;
 	struct p_wsame *wsame = NULL;
+	struct p_data_compressed *pc = NULL;
 	void *digest_out = NULL;
 	unsigned int dp_flags = 0;
+	unsigned int compressed = 0;
 	int digest_size = 0;
 	int err;
 	const unsigned s = drbd_req_state_by_peer_device(req, peer_device);
-	const int op = bio_op(req->master_bio);
+	const int op = bio_op(bio);
+	const bool zeroes = drbd_elide_zero_write(peer_device, req, bio);
 
-	if (op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES) {
+	if (op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES || zeroes) {
 		trim = drbd_prepare_command(peer_device, sizeof(*trim), DATA_STREAM);
 		if (!trim)
 			return -EIO;
@@ -2307,17 +2968,34 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 			wsame->size = cpu_to_be32(req->i.size);
 			digest_out = wsame + 1;
 		} else {
-			p = drbd_prepare_command(peer_device, sizeof(*p) + digest_size, DATA_STREAM);
+			/* room for p_data_compressed, given back if unused */
+			int pc_size = peer_device->connection->compress.tx_tfm ? sizeof(*pc) : 0;
+
+			p = drbd_prepare_command(peer_device, sizeof(*p) + pc_size + digest_size, DATA_STREAM);
 			if (!p)
 				return -EIO;
-			digest_out = p + 1;
+			if (pc_size && drbd_compress_wanted(peer_device->connection, req->i.size))
+				compressed = drbd_compress_bio(peer_device->connection, bio);
+			if (compressed) {
+				pc = (struct p_data_compressed *)(p + 1);
+				digest_out = pc + 1;
+			} else {
+				if (pc_size)
+					resize_prepared_command(peer_device->connection, DATA_STREAM,
+								sizeof(*p) + digest_size);
+				digest_out = p + 1;
+			}
 		}
 	}
 
 	p->sector = cpu_to_be64(req->i.sector);
-	p->block_id = (unsigned long)req;
+	p->block_id = req->id;
 	p->seq_num = cpu_to_be32(atomic_inc_return(&peer_device->packet_seq));
-	dp_flags = bio_flags_to_wire(peer_device->connection, req->master_bio);
+	dp_flags = bio_flags_to_wire(peer_device->connection, bio);
+	if (zeroes) {
+		dp_flags |= DP_ZEROES;
+		peer_device->zero_elided_sent += req->i.size;
+	}
 	if (peer_device->repl_state[NOW] >= L_SYNC_SOURCE && peer_device->repl_state[NOW] <= L_PAUSED_SYNC_T)
 		dp_flags |= DP_MAY_SET_IN_SYNC;
 	if (peer_device->connection->agreed_pro_version >= 100) {
@@ -2326,6 +3004,12 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		if (s & RQ_EXP_WRITE_ACK || dp_flags & DP_MAY_SET_IN_SYNC)
 			dp_flags |= DP_SEND_WRITE_ACK;
 	}
+	if (pc) {
+		dp_flags |= DP_COMPRESSED;
+		pc->alg = peer_device->connection->compress.tx_alg;
+		memset(pc->pad, 0, sizeof(pc->pad));
+		pc->raw_size = cpu_to_be32(req->i.size);
+	}
 	p->dp_flags = cpu_to_be32(dp_flags);
 
 	if (trim) {
@@ -2336,19 +3020,22 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 
 	if (digest_size && digest_out) {
 		BUG_ON(digest_size > sizeof(peer_device->connection->scratch_buffer.d.before));
-		drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, before);
+		drbd_csum_bio(peer_device->connection->integrity_tfm, bio, before);
 		memcpy(digest_out, before, digest_size);
 	}
 
 	if (wsame) {
 		additional_size_command(peer_device->connection, DATA_STREAM,
-					bio_iovec(req->master_bio).bv_len);
+					bio_iovec(bio).bv_len);
 		err = __send_command(peer_device->connection, device->vnr, P_WSAME, DATA_STREAM);
 	} else {
-		additional_size_command(peer_device->connection, DATA_STREAM, req->i.size);
+		additional_size_command(peer_device->connection, DATA_STREAM, compressed ?: req->i.size);
 		err = __send_command(peer_device->connection, device->vnr, P_DATA, DATA_STREAM);
 	}
-	if (!err) {
+	if (!err && compressed) {
+		/* the compressed copy is ours, no matter the protocol */
+		err = _drbd_send_compressed(peer_device, compressed, req->i.size);
+	} else if (!err) {
 		/* For protocol A, we have to memcpy the payload into
 		 * socket buffers, as we may complete right away
 		 * as soon as we handed it over to tcp, at which point the data
@@ -2361,13 +3048,13 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		 * receiving side, we sure have detected corruption elsewhere.
 		 */
 		if (!(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) || digest_size)
-			err = _drbd_send_bio(peer_device, req->master_bio);
+			err = _drbd_send_bio(peer_device, bio);
 		else
-			err = _drbd_send_zc_bio(peer_device, req->master_bio);
+			err = _drbd_send_zc_bio(peer_device, bio);
 
 		/* double check digest, sometimes buffers have been modified in flight. */
 		if (digest_size > 0) {
-			drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, after);
+			drbd_csum_bio(peer_device->connection->integrity_tfm, bio, after);
 			if (memcmp(before, after, digest_size)) {
 				drbd_warn(device,
 					"Digest mismatch, buffer modified by upper layers during write: %llus +%u\n",
@@ -2381,6 +3068,86 @@ out:
 	return err;
 }
 
+int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req)
+{
+	return drbd_send_dblock_bio(peer_device, req, req->master_bio);
+}
+
+/* Sends n adjacent writes as one P_DATA_MERGED, see struct p_data_merged.
+ * The sender made sure they share the epoch, the op flags and the acks
+ * they expect.  No integrity digest, no compression and no zero elision
+ * for merged writes, they are only merged where none of those apply.
+ */
+int drbd_send_dblock_merged(struct drbd_peer_device *peer_device, struct drbd_request **reqs,
+			    unsigned int n)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_request *req = reqs[0];
+	const unsigned s = drbd_req_state_by_peer_device(req, peer_device);
+	struct p_data_merged *pm;
+	struct p_data *p;
+	unsigned int dp_flags, size = 0, i;
+	int err;
+
+	p = drbd_prepare_command(peer_device, sizeof(*p) + struct_size(pm, ext, n), DATA_STREAM);
+	if (!p)
+		return -EIO;
+	pm = (struct p_data_merged *)(p + 1);
+	pm->count = cpu_to_be32(n);
+	pm->pad = 0;
+	for (i = 0; i < n; i++) {
+		pm->ext[i].block_id = reqs[i]->id;
+		pm->ext[i].size = cpu_to_be32(reqs[i]->i.size);
+		pm->ext[i].pad = 0;
+		size += reqs[i]->i.size;
+	}
+
+	p->sector = cpu_to_be64(req->i.sector);
+	p->block_id = req->id;
+	p->seq_num = cpu_to_be32(atomic_inc_return(&peer_device->packet_seq));
+	dp_flags = bio_flags_to_wire(connection, req->master_bio);
+	if (peer_device->repl_state[NOW] >= L_SYNC_SOURCE && peer_device->repl_state[NOW] <= L_PAUSED_SYNC_T)
+		dp_flags |= DP_MAY_SET_IN_SYNC;
+	if (s & RQ_EXP_RECEIVE_ACK)
+		dp_flags |= DP_SEND_RECEIVE_ACK;
+	if (s & RQ_EXP_WRITE_ACK || dp_flags & DP_MAY_SET_IN_SYNC)
+		dp_flags |= DP_SEND_WRITE_ACK;
+	p->dp_flags = cpu_to_be32(dp_flags);
+
+	additional_size_command(connection, DATA_STREAM, size);
+	err = __send_command(connection, peer_device->device->vnr, P_DATA_MERGED, DATA_STREAM);
+
+	/* see drbd_send_dblock() for when we need to copy */
+	for (i = 0; !err && i < n; i++) {
+		if (!(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)))
+			err = _drbd_send_bio(peer_device, reqs[i]->master_bio);
+		else
+			err = _drbd_send_zc_bio(peer_device, reqs[i]->master_bio);
+	}
+	mutex_unlock(&connection->mutex[DATA_STREAM]);
+
+	return err;
+}
+
+/* All-zero P_DATA_REPLY or P_RS_DATA_REPLY: DP_ZEROES, and the size
+ * instead of the payload */
+static int drbd_send_zeroes_reply(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
+				  struct drbd_peer_request *peer_req)
+{
+	struct p_trim *p;
+
+	p = drbd_prepare_command(peer_device, sizeof(*p), DATA_STREAM);
+	if (!p)
+		return -EIO;
+	p->p_data.sector = cpu_to_be64(peer_req->i.sector);
+	p->p_data.block_id = peer_req->block_id;
+	p->p_data.seq_num = 0;  /* unused */
+	p->p_data.dp_flags = cpu_to_be32(DP_ZEROES);
+	p->size = cpu_to_be32(peer_req->i.size);
+	peer_device->zero_elided_sent += peer_req->i.size;
+	return drbd_send_command(peer_device, cmd, DATA_STREAM);
+}
+
 /* answer packet, used to send data back for read requests:
  *  Peer       -> (diskless) R_PRIMARY   (P_DATA_REPLY)
  *  L_SYNC_SOURCE -> L_SYNC_TARGET         (P_RS_DATA_REPLY)
@@ -2388,14 +3155,23 @@ out:
 int drbd_send_block(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 		    struct drbd_peer_request *peer_req)
 {
+	struct drbd_connection *connection = peer_device->connection;
+	struct p_data_compressed *pc = NULL;
 	struct p_data *p;
+	unsigned int compressed = 0;
+	void *digest_out;
 	int err;
-	int digest_size;
+	int digest_size, pc_size;
+
+	if (drbd_zero_elision_ok(connection, peer_req->i.size) &&
+	    drbd_pages_all_zero(peer_req->page_chain.head, peer_req->i.size))
+		return drbd_send_zeroes_reply(peer_device, cmd, peer_req);
 
 	digest_size = peer_device->connection->integrity_tfm ?
 		      crypto_shash_digestsize(peer_device->connection->integrity_tfm) : 0;
+	pc_size = connection->compress.tx_tfm ? sizeof(*pc) : 0;
 
-	p = drbd_prepare_command(peer_device, sizeof(*p) + digest_size, DATA_STREAM);
+	p = drbd_prepare_command(peer_device, sizeof(*p) + pc_size + digest_size, DATA_STREAM);
 
 	if (!p)
 		return -EIO;
@@ -2403,12 +3179,29 @@ int drbd_send_block(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 	p->block_id = peer_req->block_id;
 	p->seq_num = 0;  /* unused */
 	p->dp_flags = 0;
+	if (pc_size && drbd_compress_wanted(connection, peer_req->i.size))
+		compressed = drbd_compress_pages(connection, peer_req->page_chain.head,
+						 peer_req->i.size);
+	if (compressed) {
+		pc = (struct p_data_compressed *)(p + 1);
+		pc->alg = connection->compress.tx_alg;
+		memset(pc->pad, 0, sizeof(pc->pad));
+		pc->raw_size = cpu_to_be32(peer_req->i.size);
+		p->dp_flags = cpu_to_be32(DP_COMPRESSED);
+		digest_out = pc + 1;
+	} else {
+		if (pc_size)
+			resize_prepared_command(connection, DATA_STREAM, sizeof(*p) + digest_size);
+		digest_out = p + 1;
+	}
 	if (digest_size)
-		drbd_csum_pages(peer_device->connection->integrity_tfm, peer_req->page_chain.head, p + 1);
-	additional_size_command(peer_device->connection, DATA_STREAM, peer_req->i.size);
+		drbd_csum_pages(peer_device->connection->integrity_tfm, peer_req->page_chain.head, digest_out);
+	additional_size_command(peer_device->connection, DATA_STREAM, compressed ?: peer_req->i.size);
 	err = __send_command(peer_device->connection,
 			     peer_device->device->vnr, cmd, DATA_STREAM);
-	if (!err)
+	if (!err && compressed)
+		err = _drbd_send_compressed(peer_device, compressed, peer_req->i.size);
+	else if (!err)
 		err = _drbd_send_zc_ee(peer_device, peer_req);
 	mutex_unlock(&peer_device->connection->mutex[DATA_STREAM]);
 
@@ -2803,7 +3596,9 @@ static void drbd_destroy_mempools(void)
 {
 	bioset_exit(&drbd_io_bio_set);
 	bioset_exit(&drbd_md_io_bio_set);
+	bioset_exit(&drbd_split_bio_set);
 	mempool_exit(&drbd_md_io_page_pool);
+	drbd_bm_destroy_sentinels();
 	mempool_exit(&drbd_ee_mempool);
 	mempool_exit(&drbd_request_mempool);
 	if (drbd_ee_cache)
@@ -2859,10 +3654,18 @@ static int drbd_create_mempools(void)
 	if (ret)
 		goto Enomem;
 
+	ret = bioset_init(&drbd_split_bio_set, BIO_POOL_SIZE, 0, 0);
+	if (ret)
+		goto Enomem;
+
 	ret = mempool_init_page_pool(&drbd_md_io_page_pool, DRBD_MIN_POOL_PAGES, 0);
 	if (ret)
 		goto Enomem;
 
+	ret = drbd_bm_create_sentinels();
+	if (ret)
+		goto Enomem;
+
 	ret = mempool_init_slab_pool(&drbd_request_mempool, number,
 				     drbd_request_cache);
 	if (ret)
@@ -2927,6 +3730,7 @@ void drbd_destroy_device(struct kref *kref)
 		free_peer_device(peer_device);
 	}
 
+	__free_page(device->al_io.page);
 	__free_page(device->md_io.page);
 	kref_debug_destroy(&device->kref_debug);
 
@@ -2952,6 +3756,7 @@ void drbd_destroy_resource(struct kref *kref)
 
 	free_page_pool(resource);
 	idr_destroy(&resource->devices);
+	idr_destroy(&resource->req_ids);
 	free_cpumask_var(resource->cpu_mask);
 	kfree(resource->name);
 	kref_debug_destroy(&resource->kref_debug);
@@ -3095,6 +3900,7 @@ static void drbd_cleanup(void)
 	drbd_genl_unregister();
 	drbd_debugfs_cleanup();
 
+	drbd_journal_exit();
 	drbd_destroy_mempools();
 	unregister_blkdev(DRBD_MAJOR, "drbd");
 
@@ -3214,6 +4020,18 @@ static void peer_ack_timer_fn(struct timer_list *t)
 	drbd_flush_peer_acks(resource);
 }
 
+static void statistics_timer_fn(struct timer_list *t)
+{
+	struct drbd_resource *resource = from_timer(resource, t, statistics_timer);
+	unsigned int interval = READ_ONCE(drbd_statistics_push_interval);
+
+	/* re-armed by param_set_drbd_statistics_push_interval() when enabled again */
+	if (!interval)
+		return;
+	drbd_post_work(resource, PUSH_STATISTICS);
+	mod_timer(&resource->statistics_timer, jiffies + interval * HZ);
+}
+
 void conn_free_crypto(struct drbd_connection *connection)
 {
 	crypto_free_shash(connection->csums_tfm);
@@ -3223,6 +4041,7 @@ void conn_free_crypto(struct drbd_connection *connection)
 	crypto_free_shash(connection->peer_integrity_tfm);
 	kfree(connection->int_dig_in);
 	kfree(connection->int_dig_vv);
+	drbd_compress_free(connection);
 
 	connection->csums_tfm = NULL;
 	connection->verify_tfm = NULL;
@@ -3348,9 +4167,13 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	idr_init(&resource->devices);
 	INIT_LIST_HEAD(&resource->connections);
 	INIT_LIST_HEAD(&resource->transfer_log);
+	INIT_LIST_HEAD(&resource->journal_entries);
+	idr_init(&resource->req_ids);
+	spin_lock_init(&resource->req_ids_lock);
 	INIT_LIST_HEAD(&resource->peer_ack_list);
 	timer_setup(&resource->peer_ack_timer, peer_ack_timer_fn, 0);
 	timer_setup(&resource->repost_up_to_date_timer, repost_up_to_date_fn, 0);
+	timer_setup(&resource->statistics_timer, statistics_timer_fn, 0);
 	sema_init(&resource->state_sem, 1);
 	resource->role[NOW] = R_SECONDARY;
 	if (set_resource_options(resource, res_opts))
@@ -3393,6 +4216,9 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	resource->pp_vacant = page_pool_count;
 
 	list_add_tail_rcu(&resource->resources, &drbd_resources);
+	/* see param_set_drbd_statistics_push_interval() */
+	if (drbd_statistics_push_interval)
+		mod_timer(&resource->statistics_timer, jiffies + drbd_statistics_push_interval * HZ);
 
 	return resource;
 
@@ -3449,6 +4275,9 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 
 	INIT_LIST_HEAD(&connection->connect_timer_work.list);
 	timer_setup(&connection->connect_timer, connect_timer_fn, 0);
+	INIT_LIST_HEAD(&connection->resume_window_work.list);
+	connection->resume_window_work.cb = w_resume_window_expired;
+	timer_setup(&connection->resume_window_timer, resume_window_timer_fn, 0);
 
 	drbd_thread_init(resource, &connection->receiver, drbd_receiver, "receiver");
 	connection->receiver.connection = connection;
@@ -3646,6 +4475,9 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	atomic_set(&device->local_cnt, 0);
 	atomic_set(&device->rs_sect_ev, 0);
 	atomic_set(&device->md_io.in_use, 0);
+	atomic_set(&device->al_io.in_use, 0);
+	device->md_io.device = device;
+	device->al_io.device = device;
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 	spin_lock_init(&device->timing_lock);
@@ -3696,11 +4528,15 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	if (!device->md_io.page)
 		goto out_no_io_page;
 
+	device->al_io.page = alloc_page(GFP_KERNEL);
+	if (!device->al_io.page)
+		goto out_no_al_io_page;
+
 	device->bitmap = drbd_bm_alloc();
 	if (!device->bitmap)
 		goto out_no_bitmap;
-	device->read_requests = RB_ROOT;
-	device->write_requests = RB_ROOT;
+	drbd_init_interval_tree(&device->read_requests);
+	drbd_init_interval_tree(&device->write_requests);
 
 	BUG_ON(!mutex_is_locked(&resource->conf_update));
 	for_each_connection(connection, resource) {
@@ -3813,6 +4649,8 @@ out_no_peer_device:
 
 	drbd_bm_free(device->bitmap);
 out_no_bitmap:
+	__free_page(device->al_io.page);
+out_no_al_io_page:
 	__free_page(device->md_io.page);
 out_no_io_page:
 	put_disk(disk);
@@ -3904,6 +4742,10 @@ void drbd_unregister_connection(struct drbd_connection *connection)
 	drbd_debugfs_connection_cleanup(connection);
 
 	del_connect_timer(connection);
+	if (del_timer_sync(&connection->resume_window_timer)) {
+		kref_debug_put(&connection->kref_debug, 17);
+		kref_put(&connection->kref, drbd_destroy_connection);
+	}
 
 	rr = drbd_free_peer_reqs(connection->resource, &connection->done_ee, false);
 	if (rr)
@@ -3970,9 +4812,6 @@ static int __init drbd_init(void)
 	drbd_proc = NULL; /* play safe for drbd_cleanup */
 	idr_init(&drbd_devices);
 
-	mutex_init(&resources_mutex);
-	INIT_LIST_HEAD(&drbd_resources);
-
 	err = drbd_genl_register();
 	if (err) {
 		pr_err("unable to register generic netlink family\n");
@@ -3983,6 +4822,10 @@ static int __init drbd_init(void)
 	if (err)
 		goto fail;
 
+	err = drbd_journal_init();
+	if (err)
+		goto fail;
+
 	err = -ENOMEM;
 	drbd_proc = proc_create_single("drbd", S_IFREG | 0444 , NULL,
 			drbd_seq_show);
@@ -4034,7 +4877,7 @@ void drbd_md_encode(struct drbd_device *device, struct meta_data_on_disk_9 *buff
 	buffer->md_size_sect  = cpu_to_be32(device->ldev->md.md_size_sect);
 	buffer->al_offset     = cpu_to_be32(device->ldev->md.al_offset);
 	buffer->al_nr_extents = cpu_to_be32(device->act_log->nr_elements);
-	buffer->bm_bytes_per_bit = cpu_to_be32(BM_BLOCK_SIZE);
+	buffer->bm_bytes_per_bit = cpu_to_be32(1U << device->bitmap->bm_block_shift);
 	buffer->device_uuid = cpu_to_be64(device->ldev->md.device_uuid);
 
 	buffer->bm_offset = cpu_to_be32(device->ldev->md.bm_offset);
@@ -4057,25 +4900,31 @@ void drbd_md_encode(struct drbd_device *device, struct meta_data_on_disk_9 *buff
 	buffer->al_stripe_size_4k = cpu_to_be32(device->ldev->md.al_stripe_size_4k);
 }
 
-int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer)
+/* Encodes the super block into @buffer and writes it.  Without @end_io this
+ * waits for the write, with it the write is only submitted, and @end_io
+ * gets the outcome. */
+static int __drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer,
+			   void (*end_io)(struct drbd_md_io *))
 {
 	sector_t sector;
 	int err;
 
-	if (drbd_md_dax_active(device->ldev)) {
-		drbd_md_encode(device, drbd_dax_md_addr(device->ldev));
-		arch_wb_cache_pmem(drbd_dax_md_addr(device->ldev),
-				   sizeof(struct meta_data_on_disk_9));
-		return 0;
-	}
-
 	memset(buffer, 0, sizeof(*buffer));
 
 	drbd_md_encode(device, buffer);
 
+	if (drbd_md_dax_active(device->ldev)) {
+		drbd_dax_md_update(device->ldev, buffer);
+		return 0;
+	}
+
 	D_ASSERT(device, drbd_md_ss(device->ldev) == device->ldev->md.md_offset);
 	sector = device->ldev->md.md_offset;
 
+	if (end_io)
+		return drbd_md_submit_page_io(device, device->ldev, &device->md_io,
+					      sector, REQ_OP_WRITE, end_io);
+
 	err = drbd_md_sync_page_io(device, device->ldev, sector, REQ_OP_WRITE);
 	if (err) {
 		drbd_err(device, "meta data update failed!\n");
@@ -4085,6 +4934,11 @@ int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer
 	return err;
 }
 
+int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer)
+{
+	return __drbd_md_write(device, buffer, NULL);
+}
+
 /**
  * __drbd_md_sync() - Writes the meta data super block (conditionally) if the MD_DIRTY flag bit is set
  * @device:	DRBD device.
@@ -4101,6 +4955,12 @@ static int __drbd_md_sync(struct drbd_device *device, bool maybe)
 	BUILD_BUG_ON(sizeof(struct meta_data_on_disk_9) != 4096);
 
 	del_timer(&device->md_sync_timer);
+	/* A write from drbd_md_sync_async() may still be in flight.  It is
+	 * clean only once that completed; on failure it sets MD_DIRTY again. */
+	if (maybe)
+		wait_event(device->misc_wait,
+			   !test_bit(MD_WRITE_IN_FLIGHT, &device->flags) ||
+			   device->disk_state[NOW] <= D_FAILED);
 	/* timer may be rearmed by drbd_md_mark_dirty() now. */
 	if (!test_and_clear_bit(MD_DIRTY, &device->flags) && maybe)
 		return 0;
@@ -4133,6 +4993,65 @@ int drbd_md_sync_if_dirty(struct drbd_device *device)
 	return __drbd_md_sync(device, true);
 }
 
+static void drbd_md_write_endio(struct drbd_md_io *md_io)
+{
+	struct drbd_device *device = md_io->device;
+
+	if (md_io->error) {
+		drbd_err(device, "meta data update failed!\n");
+		drbd_chk_io_error(device, md_io->error, DRBD_META_IO_ERROR);
+		drbd_md_mark_dirty(device);
+	}
+	clear_bit(MD_WRITE_IN_FLIGHT, &device->flags);
+	__drbd_md_put_buffer(md_io);
+}
+
+/**
+ * drbd_md_sync_async() - Start writing the meta data super block if the MD_DIRTY flag bit is set
+ * @device:	DRBD device.
+ *
+ * For the md_sync_timer, nobody waits for that write. The buffer is released
+ * in the completion handler, so any later drbd_md_sync() still queues behind it,
+ * and drbd_md_sync_if_dirty() waits for it while MD_WRITE_IN_FLIGHT is set.
+ */
+void drbd_md_sync_async(struct drbd_device *device)
+{
+	struct meta_data_on_disk_9 *buffer;
+	int err;
+
+	del_timer(&device->md_sync_timer);
+	if (!test_bit(MD_DIRTY, &device->flags))
+		return;
+
+	if (!get_ldev_if_state(device, D_DETACHING))
+		return;
+
+	buffer = drbd_md_get_buffer(device, __func__);
+	if (!buffer)
+		goto out;
+
+	/* may have been written while we waited for the buffer */
+	if (!test_and_clear_bit(MD_DIRTY, &device->flags)) {
+		drbd_md_put_buffer(device);
+		goto out;
+	}
+
+	if (drbd_md_dax_active(device->ldev)) {
+		drbd_md_write(device, buffer);
+		drbd_md_put_buffer(device);
+		goto out;
+	}
+
+	set_bit(MD_WRITE_IN_FLIGHT, &device->flags);
+	err = __drbd_md_write(device, buffer, drbd_md_write_endio);
+	if (err) {
+		device->md_io.error = err;
+		drbd_md_write_endio(&device->md_io);
+	}
+out:
+	put_ldev(device);
+}
+
 /**
  * drbd_md_mark_dirty() - Mark meta data super block as dirty
  * @device:	DRBD device.
@@ -5360,13 +6279,14 @@ u64 directly_connected_nodes(struct drbd_resource *resource, enum which_state wh
 	return directly_connected;
 }
 
-static sector_t bm_sect_to_max_capacity(unsigned int bm_max_peers, sector_t bm_sect)
+static sector_t bm_sect_to_max_capacity(unsigned int bm_max_peers, unsigned int bm_block_shift,
+					 sector_t bm_sect)
 {
 	u64 bm_pages = bm_sect >> (PAGE_SHIFT - SECTOR_SHIFT);
 	u64 bm_bytes = bm_pages << PAGE_SHIFT;
 	u64 bm_bytes_per_peer = div_u64(bm_bytes, bm_max_peers);
 	u64 bm_bits_per_peer = bm_bytes_per_peer * BITS_PER_BYTE;
-	return BM_BIT_TO_SECT(bm_bits_per_peer);
+	return (sector_t)bm_bits_per_peer << (bm_block_shift - SECTOR_SHIFT);
 }
 
 /**
@@ -5404,7 +6324,7 @@ sector_t drbd_get_max_capacity(
 		backing_capacity_remaining = backing_bdev_capacity;
 	}
 
-	metadata_limit = bm_sect_to_max_capacity(bm_max_peers, bm_sect);
+	metadata_limit = bm_sect_to_max_capacity(bm_max_peers, device->bitmap->bm_block_shift, bm_sect);
 
 	dynamic_drbd_dbg(device,
 			"Backing device capacity: %llus, remaining: %llus, bitmap sectors: %llus\n",
@@ -22,6 +22,7 @@
 #include <linux/blkpg.h>
 #include <linux/cpumask.h>
 #include <linux/random.h>
+#include <linux/jhash.h>
 #include "drbd_int.h"
 #include "drbd_protocol.h"
 #include "drbd_req.h"
@@ -1353,7 +1354,8 @@ out:
 	return 0;
 }
 
-u64 drbd_capacity_to_on_disk_bm_sect(u64 capacity_sect, unsigned int max_peers)
+u64 drbd_capacity_to_on_disk_bm_sect(u64 capacity_sect, unsigned int max_peers,
+				     unsigned int bm_block_shift)
 {
 	u64 bits, bytes;
 
@@ -1361,7 +1363,7 @@ u64 drbd_capacity_to_on_disk_bm_sect(u64 capacity_sect, unsigned int max_peers)
 	 * convert to number of bits needed, and round that up to 64bit words
 	 * to ease interoperability between 32bit and 64bit architectures.
 	 */
-	bits = ALIGN(BM_SECT_TO_BIT(ALIGN(capacity_sect, BM_SECT_PER_BIT)), 64);
+	bits = ALIGN(ALIGN(capacity_sect, 1ULL << (bm_block_shift - 9)) >> (bm_block_shift - 9), 64);
 
 	/* convert to bytes, multiply by number of peers,
 	 * and, because we do all our meta data IO in 4k blocks,
@@ -1399,12 +1401,15 @@ void drbd_md_set_sector_offsets(struct drbd_device *device,
 {
 	sector_t md_size_sect = 0;
 	unsigned int al_size_sect = bdev->md.al_size_4k * 8;
+	unsigned int bm_block_shift = BM_BLOCK_SHIFT;
 	int max_peers;
 
-	if (device->bitmap)
+	if (device->bitmap) {
 		max_peers = device->bitmap->bm_max_peers;
-	else
+		bm_block_shift = device->bitmap->bm_block_shift;
+	} else {
 		max_peers = 1;
+	}
 
 	bdev->md.md_offset = drbd_md_ss(bdev);
 
@@ -1431,7 +1436,7 @@ void drbd_md_set_sector_offsets(struct drbd_device *device,
 		 * and the activity log; */
 		md_size_sect = drbd_capacity_to_on_disk_bm_sect(
 				drbd_get_capacity(bdev->backing_bdev),
-				max_peers)
+				max_peers, bm_block_shift)
 			+ (4096 >> 9) + al_size_sect;
 
 		bdev->md.md_size_sect = md_size_sect;
@@ -1571,7 +1576,7 @@ drbd_determine_dev_size(struct drbd_device *device, sector_t peer_current_size,
 	 * data in core memory, to "move" it we just write it all out, there
 	 * are no reads. */
 	drbd_suspend_io(device, READ_AND_WRITE);
-	buffer = drbd_md_get_buffer(device, __func__); /* Lock meta-data IO */
+	buffer = drbd_md_get_buffer_exclusive(device, __func__); /* Lock meta-data IO */
 	if (!buffer) {
 		drbd_resume_io(device);
 		return DS_ERROR;
@@ -1873,34 +1878,48 @@ drbd_new_dev_size(struct drbd_device *device,
 	return size;
 }
 
+static unsigned int drbd_al_nr_elements(struct drbd_backing_dev *bdev, struct disk_conf *dc);
+
 /**
  * drbd_check_al_size() - Ensures that the AL is of the right size
  * @device:	DRBD device.
+ * @dc:		disk configuration to apply
+ * @bdev:	backing device the activity log lives on
  *
  * Returns -EBUSY if current al lru is still used, -ENOMEM when allocation
  * failed, and 0 on success. You should call drbd_md_sync() after you called
  * this function.
  */
-static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc)
+static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc,
+			      struct drbd_backing_dev *bdev)
 {
+	unsigned int nr_elements = drbd_al_nr_elements(bdev, dc);
 	struct lru_cache *n, *t;
 	struct lc_element *e;
 	unsigned int in_use;
 	int i;
 
 	if (device->act_log &&
-	    device->act_log->nr_elements == dc->al_extents)
+	    device->act_log->nr_elements == nr_elements) {
+		/* Only the soft limit changed, no need to re-create it.
+		 * A lowered limit is trimmed with the next transactions. */
+		spin_lock_irq(&device->al_lock);
+		lc_set_active_limit(device->act_log, dc->al_extents);
+		spin_unlock_irq(&device->al_lock);
 		return 0;
+	}
 
 	in_use = 0;
 	t = device->act_log;
 	n = lc_create("act_log", drbd_al_ext_cache, AL_UPDATES_PER_TRANSACTION,
-		dc->al_extents, sizeof(struct lc_element), 0);
+		nr_elements, sizeof(struct lc_element), 0);
 
 	if (n == NULL) {
 		drbd_err(device, "Cannot allocate act_log lru!\n");
 		return -ENOMEM;
 	}
+	lc_set_policy(n, drbd_al_segmented_lru ? LC_SEGMENTED_LRU : LC_LRU);
+	lc_set_active_limit(n, dc->al_extents);
 	spin_lock_irq(&device->al_lock);
 	if (t) {
 		for (i = 0; i < t->nr_elements; i++) {
@@ -2222,6 +2241,16 @@ static unsigned int drbd_al_extents_max(struct drbd_backing_dev *bdev)
 	return (al_size_4k - 1) * AL_CONTEXT_PER_TRANSACTION;
 }
 
+/* With al_autosize, the activity log is allocated to the full on-disk
+ * capacity, al-extents only is the soft limit it starts from, and shrinks
+ * back to.  See drbd_al_adjust_active_limit(). */
+static unsigned int drbd_al_nr_elements(struct drbd_backing_dev *bdev, struct disk_conf *dc)
+{
+	if (drbd_al_autosize)
+		return max(dc->al_extents, drbd_al_extents_max(bdev));
+	return dc->al_extents;
+}
+
 static bool write_ordering_changed(struct disk_conf *a, struct disk_conf *b)
 {
 	return	a->disk_barrier != b->disk_barrier ||
@@ -2292,8 +2321,8 @@ static int disk_opts_check_al_size(struct drbd_device *device, struct disk_conf
 	int err = -EBUSY;
 
 	if (device->act_log &&
-	    device->act_log->nr_elements == dc->al_extents)
-		return 0;
+	    device->act_log->nr_elements == drbd_al_nr_elements(device->ldev, dc))
+		return drbd_check_al_size(device, dc, device->ldev);
 
 	drbd_suspend_io(device, READ_AND_WRITE);
 	/* If IO completion is currently blocked, we would likely wait
@@ -2303,7 +2332,7 @@ static int disk_opts_check_al_size(struct drbd_device *device, struct disk_conf
 
 	wait_event(device->al_wait, drbd_al_try_lock(device));
 	drbd_al_shrink(device);
-	err = drbd_check_al_size(device, dc);
+	err = drbd_check_al_size(device, dc, device->ldev);
 	lc_unlock(device->act_log);
 	wake_up(&device->al_wait);
 out:
@@ -2810,7 +2839,8 @@ static int check_offsets_and_sizes(struct drbd_device *device,
 
 	/* can the available bitmap space cover the last agreed device size? */
 	if (on_disk_bm_sect < drbd_capacity_to_on_disk_bm_sect(
-				in_core->effective_size, max_peers))
+				in_core->effective_size, max_peers,
+				device->bitmap->bm_block_shift))
 		goto err;
 
 	return 0;
@@ -2858,7 +2888,7 @@ int drbd_md_decode(struct drbd_config_context *adm_ctx,
 	u32 magic, flags;
 	int i, rv = NO_ERROR;
 	int my_node_id = device->resource->res_opts.node_id;
-	u32 max_peers;
+	u32 max_peers, bm_bytes_per_bit;
 
 	magic = be32_to_cpu(buffer->magic);
 	flags = be32_to_cpu(buffer->flags);
@@ -2879,11 +2909,15 @@ int drbd_md_decode(struct drbd_config_context *adm_ctx,
 		goto err;
 	}
 
-	if (be32_to_cpu(buffer->bm_bytes_per_bit) != BM_BLOCK_SIZE) {
-		drbd_err_and_skb_info(adm_ctx, "unexpected bm_bytes_per_bit: %u (expected %u)\n",
-		    be32_to_cpu(buffer->bm_bytes_per_bit), BM_BLOCK_SIZE);
+	bm_bytes_per_bit = be32_to_cpu(buffer->bm_bytes_per_bit);
+	if (!is_power_of_2(bm_bytes_per_bit) ||
+	    bm_bytes_per_bit < BM_BLOCK_SIZE || bm_bytes_per_bit > 1U << BM_BLOCK_SHIFT_MAX) {
+		drbd_err_and_skb_info(adm_ctx, "unexpected bm_bytes_per_bit: %u (expected %u to %u)\n",
+		    bm_bytes_per_bit, BM_BLOCK_SIZE, 1U << BM_BLOCK_SHIFT_MAX);
 		goto err;
 	}
+	/* We are diskless, the bitmap is empty. */
+	device->bitmap->bm_block_shift = ilog2(bm_bytes_per_bit);
 
 	if (check_activity_log_stripe_size(device, buffer, &bdev->md))
 		goto err;
@@ -2980,7 +3014,7 @@ int drbd_md_read(struct drbd_config_context *adm_ctx, struct drbd_backing_dev *b
 	}
 	drbd_info(device, "meta-data IO uses: blk-bio\n");
 
-	buffer = drbd_md_get_buffer(device, __func__);
+	buffer = drbd_md_get_buffer_exclusive(device, __func__);
 	if (!buffer)
 		return ERR_NOMEM;
 
@@ -3258,7 +3292,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	/* Since we are diskless, fix the activity log first... */
-	if (drbd_check_al_size(device, new_disk_conf)) {
+	if (drbd_check_al_size(device, new_disk_conf, nbc)) {
 		retcode = ERR_NOMEM;
 		goto force_diskless_dec;
 	}
@@ -5334,10 +5368,36 @@ static struct nlattr *find_cfg_context_attr(const struct nlmsghdr *nlh, int attr
 	return drbd_nla_find_nested(maxtype, nla, __nla_type(attr));
 }
 
+/* Dumps may be narrowed down to a single volume or peer, by passing
+ * T_ctx_volume or T_ctx_peer_node_id along with T_ctx_resource_name. */
+static unsigned int find_cfg_context_u32(struct netlink_callback *cb, int attr,
+					 unsigned int unspecified)
+{
+	struct nlattr *nla = find_cfg_context_attr(cb->nlh, attr);
+
+	return nla ? nla_get_u32(nla) : unspecified;
+}
+
+/* Not (yet) part of linux/drbd.h. With this flag set in the request header,
+ * the dumps only report the statistics of each object, and leave out the
+ * configuration and state info.  That avoids taking conf_update, which
+ * makes frequent polling by monitoring agents cheap. */
+#ifndef DRBD_GENL_F_STATISTICS_ONLY
+#define DRBD_GENL_F_STATISTICS_ONLY 2
+#endif
+
+static bool dump_statistics_only(struct netlink_callback *cb)
+{
+	struct drbd_genlmsghdr *dh = nlmsg_data(cb->nlh) + GENL_HDRLEN;
+
+	return dh->flags & DRBD_GENL_F_STATISTICS_ONLY;
+}
+
 static void resource_to_info(struct resource_info *, struct drbd_resource *);
 
 int drbd_adm_dump_resources(struct sk_buff *skb, struct netlink_callback *cb)
 {
+	struct nlattr *resource_filter;
 	struct drbd_genlmsghdr *dh;
 	struct drbd_resource *resource;
 	struct resource_info resource_info;
@@ -5356,7 +5416,10 @@ int drbd_adm_dump_resources(struct sk_buff *skb, struct netlink_callback *cb)
 			      struct drbd_resource, resources);
 
 found_resource:
+	resource_filter = find_cfg_context_attr(cb->nlh, T_ctx_resource_name);
 	list_for_each_entry_continue_rcu(resource, &drbd_resources, resources) {
+		if (resource_filter && strcmp(resource->name, nla_data(resource_filter)))
+			continue;
 		goto put_result;
 	}
 	err = 0;
@@ -5374,13 +5437,15 @@ put_result:
 	err = nla_put_drbd_cfg_context(skb, resource, NULL, NULL, NULL);
 	if (err)
 		goto out;
-	err = res_opts_to_skb(skb, &resource->res_opts, !capable(CAP_SYS_ADMIN));
-	if (err)
-		goto out;
-	resource_to_info(&resource_info, resource);
-	err = resource_info_to_skb(skb, &resource_info, !capable(CAP_SYS_ADMIN));
-	if (err)
-		goto out;
+	if (!dump_statistics_only(cb)) {
+		err = res_opts_to_skb(skb, &resource->res_opts, !capable(CAP_SYS_ADMIN));
+		if (err)
+			goto out;
+		resource_to_info(&resource_info, resource);
+		err = resource_info_to_skb(skb, &resource_info, !capable(CAP_SYS_ADMIN));
+		if (err)
+			goto out;
+	}
 	resource_statistics.res_stat_write_ordering = resource->write_ordering;
 	err = resource_statistics_to_skb(skb, &resource_statistics, !capable(CAP_SYS_ADMIN));
 	if (err)
@@ -5463,8 +5528,10 @@ int drbd_adm_dump_devices(struct sk_buff *skb, struct netlink_callback *cb)
 	struct device_info device_info;
 	struct device_statistics device_statistics;
 	struct idr *idr_to_search;
+	unsigned int volume;
 
 	resource = (struct drbd_resource *)cb->args[0];
+	volume = find_cfg_context_u32(cb, T_ctx_volume, VOLUME_UNSPECIFIED);
 
 	rcu_read_lock();
 	if (!cb->args[0] && !cb->args[1]) {
@@ -5487,6 +5554,8 @@ int drbd_adm_dump_devices(struct sk_buff *skb, struct netlink_callback *cb)
 		goto out;
 	}
 	idr_for_each_entry_continue(idr_to_search, device, minor) {
+		if (volume != VOLUME_UNSPECIFIED && device->vnr != volume)
+			continue;
 		retcode = NO_ERROR;
 		goto put_result;  /* only one iteration */
 	}
@@ -5507,6 +5576,8 @@ put_result:
 		err = nla_put_drbd_cfg_context(skb, device->resource, NULL, device, NULL);
 		if (err)
 			goto out;
+		if (dump_statistics_only(cb))
+			goto put_statistics;
 		if (get_ldev(device)) {
 			struct disk_conf *disk_conf =
 				rcu_dereference(device->ldev->disk_conf);
@@ -5523,6 +5594,7 @@ put_result:
 		err = device_info_to_skb(skb, &device_info, !capable(CAP_SYS_ADMIN));
 		if (err)
 			goto out;
+put_statistics:
 
 		device_to_statistics(&device_statistics, device);
 		err = device_statistics_to_skb(skb, &device_statistics, !capable(CAP_SYS_ADMIN));
@@ -5586,7 +5658,10 @@ int drbd_adm_dump_connections(struct sk_buff *skb, struct netlink_callback *cb)
 	struct drbd_genlmsghdr *dh;
 	struct connection_info connection_info;
 	struct connection_statistics connection_statistics;
+	bool statistics_only = dump_statistics_only(cb);
+	unsigned int peer_node_id;
 
+	peer_node_id = find_cfg_context_u32(cb, T_ctx_peer_node_id, PEER_NODE_ID_UNSPECIFIED);
 	rcu_read_lock();
 	resource = (struct drbd_resource *)cb->args[0];
 	if (!cb->args[0]) {
@@ -5612,9 +5687,12 @@ int drbd_adm_dump_connections(struct sk_buff *skb, struct netlink_callback *cb)
 	}
 
     next_resource:
-	rcu_read_unlock();
-	mutex_lock(&resource->conf_update);
-	rcu_read_lock();
+	/* Only the paths and the net_conf need conf_update */
+	if (!statistics_only) {
+		rcu_read_unlock();
+		mutex_lock(&resource->conf_update);
+		rcu_read_lock();
+	}
 	if (cb->args[2]) {
 		for_each_connection_rcu(connection, resource)
 			if (connection == (struct drbd_connection *)cb->args[2])
@@ -5626,6 +5704,9 @@ int drbd_adm_dump_connections(struct sk_buff *skb, struct netlink_callback *cb)
 
 found_connection:
 	list_for_each_entry_continue_rcu(connection, &resource->connections, connections) {
+		if (peer_node_id != PEER_NODE_ID_UNSPECIFIED &&
+		    connection->peer_node_id != peer_node_id)
+			continue;
 		retcode = NO_ERROR;
 		goto put_result;  /* only one iteration */
 	}
@@ -5642,7 +5723,8 @@ no_more_connections:
 
 found_resource:
 	list_for_each_entry_continue_rcu(next_resource, &drbd_resources, resources) {
-		mutex_unlock(&resource->conf_update);
+		if (!statistics_only)
+			mutex_unlock(&resource->conf_update);
 		kref_debug_put(&resource->kref_debug, 6);
 		kref_put(&resource->kref, drbd_destroy_resource);
 		resource = next_resource;
@@ -5669,6 +5751,8 @@ put_result:
 		err = nla_put_drbd_cfg_context(skb, resource, connection, NULL, NULL);
 		if (err)
 			goto out;
+		if (statistics_only)
+			goto put_statistics;
 		net_conf = rcu_dereference(connection->transport.net_conf);
 		if (net_conf) {
 			err = net_conf_to_skb(skb, net_conf, !capable(CAP_SYS_ADMIN));
@@ -5680,6 +5764,7 @@ put_result:
 		err = connection_info_to_skb(skb, &connection_info, !capable(CAP_SYS_ADMIN));
 		if (err)
 			goto out;
+put_statistics:
 		connection_to_statistics(&connection_statistics, connection);
 		err = connection_statistics_to_skb(skb, &connection_statistics, !capable(CAP_SYS_ADMIN));
 		if (err)
@@ -5691,7 +5776,7 @@ put_result:
 
 out:
 	rcu_read_unlock();
-	if (resource)
+	if (resource && !statistics_only)
 		mutex_unlock(&resource->conf_update);
 	if (err)
 		return err;
@@ -5783,8 +5868,11 @@ int drbd_adm_dump_peer_devices(struct sk_buff *skb, struct netlink_callback *cb)
 	int minor, err, retcode;
 	struct drbd_genlmsghdr *dh;
 	struct idr *idr_to_search;
+	unsigned int volume, peer_node_id;
 
 	resource = (struct drbd_resource *)cb->args[0];
+	volume = find_cfg_context_u32(cb, T_ctx_volume, VOLUME_UNSPECIFIED);
+	peer_node_id = find_cfg_context_u32(cb, T_ctx_peer_node_id, PEER_NODE_ID_UNSPECIFIED);
 
 	rcu_read_lock();
 	if (!cb->args[0] && !cb->args[1]) {
@@ -5812,6 +5900,8 @@ next_device:
 			goto out;
 		}
 	}
+	if (volume != VOLUME_UNSPECIFIED && device->vnr != volume)
+		goto next_device;
 	if (cb->args[2]) {
 		for_each_peer_device_rcu(peer_device, device)
 			if (peer_device == (struct drbd_peer_device *)cb->args[2])
@@ -5824,6 +5914,9 @@ next_device:
 
 found_peer_device:
 	list_for_each_entry_continue_rcu(peer_device, &device->peer_devices, peer_devices) {
+		if (peer_node_id != PEER_NODE_ID_UNSPECIFIED &&
+		    peer_device->node_id != peer_node_id)
+			continue;
 		retcode = NO_ERROR;
 		goto put_result;  /* only one iteration */
 	}
@@ -5847,16 +5940,18 @@ put_result:
 		err = nla_put_drbd_cfg_context(skb, device->resource, peer_device->connection, device, NULL);
 		if (err)
 			goto out;
-		peer_device_to_info(&peer_device_info, peer_device);
-		err = peer_device_info_to_skb(skb, &peer_device_info, !capable(CAP_SYS_ADMIN));
-		if (err)
-			goto out;
+		if (!dump_statistics_only(cb)) {
+			peer_device_to_info(&peer_device_info, peer_device);
+			err = peer_device_info_to_skb(skb, &peer_device_info, !capable(CAP_SYS_ADMIN));
+			if (err)
+				goto out;
+		}
 		peer_device_to_statistics(&peer_device_statistics, peer_device);
 		err = peer_device_statistics_to_skb(skb, &peer_device_statistics, !capable(CAP_SYS_ADMIN));
 		if (err)
 			goto out;
 		peer_device_conf = rcu_dereference(peer_device->conf);
-		if (peer_device_conf) {
+		if (peer_device_conf && !dump_statistics_only(cb)) {
 			err = peer_device_conf_to_skb(skb, peer_device_conf, !capable(CAP_SYS_ADMIN));
 			if (err)
 				goto out;
@@ -6336,6 +6431,7 @@ static int adm_del_resource(struct drbd_resource *resource)
 	del_timer_sync(&resource->twopc_timer);
 	del_timer_sync(&resource->peer_ack_timer);
 	del_timer_sync(&resource->repost_up_to_date_timer);
+	del_timer_sync(&resource->statistics_timer);
 	call_rcu(&resource->rcu, drbd_reclaim_resource);
 
 	mutex_lock(&notification_mutex);
@@ -6661,6 +6757,74 @@ void drbd_broadcast_peer_device_state(struct drbd_peer_device *peer_device)
 	mutex_unlock(&notification_mutex);
 }
 
+/* Called from the worker, every statistics_push_interval seconds.
+ * Broadcasts a NOTIFY_CHANGE event for each object whose statistics changed
+ * since the last push, so that events2 listeners get the counters without
+ * polling the full status dumps. */
+void drbd_push_statistics(struct drbd_resource *resource)
+{
+	struct drbd_connection *connection;
+	struct drbd_device *device;
+	u64 im;
+	int vnr;
+
+	if (test_bit(R_UNREGISTERED, &resource->flags))
+		return;
+
+	for_each_connection_ref(connection, im, resource) {
+		struct connection_statistics s;
+		struct connection_info info;
+		u32 hash;
+
+		memset(&s, 0, sizeof(s));
+		connection_to_statistics(&s, connection);
+		hash = jhash(&s, sizeof(s), 0);
+		if (hash == connection->pushed_statistics_hash)
+			continue;
+		connection->pushed_statistics_hash = hash;
+		mutex_lock(&notification_mutex);
+		connection_to_info(&info, connection);
+		notify_connection_state(NULL, 0, connection, &info, NOTIFY_CHANGE);
+		mutex_unlock(&notification_mutex);
+	}
+
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		struct drbd_peer_device *peer_device;
+		struct device_statistics s;
+		struct device_info info;
+		u32 hash;
+
+		kref_get(&device->kref);
+		rcu_read_unlock();
+
+		device_to_statistics(&s, device);
+		hash = jhash(&s, sizeof(s), 0);
+		if (hash != device->pushed_statistics_hash) {
+			device->pushed_statistics_hash = hash;
+			mutex_lock(&notification_mutex);
+			device_to_info(&info, device);
+			notify_device_state(NULL, 0, device, &info, NOTIFY_CHANGE);
+			mutex_unlock(&notification_mutex);
+		}
+
+		for_each_peer_device_ref(peer_device, im, device) {
+			struct peer_device_statistics ps;
+
+			peer_device_to_statistics(&ps, peer_device);
+			hash = jhash(&ps, sizeof(ps), 0);
+			if (hash == peer_device->pushed_statistics_hash)
+				continue;
+			peer_device->pushed_statistics_hash = hash;
+			drbd_broadcast_peer_device_state(peer_device);
+		}
+
+		kref_put(&device->kref, drbd_destroy_device);
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
+}
+
 void notify_path(struct drbd_connection *connection, struct drbd_path *path,
 		 enum drbd_notification_type type)
 {
@@ -6869,6 +7033,7 @@ int drbd_adm_get_initial_state_done(struct netlink_callback *cb)
 
 int drbd_adm_get_initial_state(struct sk_buff *skb, struct netlink_callback *cb)
 {
+	struct nlattr *resource_filter;
 	struct drbd_resource *resource;
 	LIST_HEAD(head);
 
@@ -6878,11 +7043,15 @@ int drbd_adm_get_initial_state(struct sk_buff *skb, struct netlink_callback *cb)
 		return 0;
 	}
 
+	resource_filter = find_cfg_context_attr(cb->nlh, T_ctx_resource_name);
 	cb->args[5] = 2;  /* number of iterations */
 	mutex_lock(&resources_mutex);
 	for_each_resource(resource, &drbd_resources) {
 		struct drbd_state_change *state_change;
 
+		if (resource_filter && strcmp(resource->name, nla_data(resource_filter)))
+			continue;
+
 		state_change = remember_state_change(resource, GFP_KERNEL);
 		if (!state_change) {
 			if (!list_empty(&head))
@@ -39,7 +39,17 @@
 #include "drbd_req.h"
 #include "drbd_vli.h"
 
-#define PRO_FEATURES (DRBD_FF_TRIM|DRBD_FF_THIN_RESYNC|DRBD_FF_WSAME|DRBD_FF_WZEROES)
+#define PRO_FEATURES (DRBD_FF_TRIM|DRBD_FF_THIN_RESYNC|DRBD_FF_WSAME|DRBD_FF_WZEROES|\
+		      DRBD_FF_BM_WORD_RLE|DRBD_FF_ACK_BATCH|\
+		      DRBD_FF_COMPRESS_LZ4|DRBD_FF_COMPRESS_ZSTD|DRBD_FF_ZERO_ELISION|\
+		      DRBD_FF_MERGED_DATA)
+
+/* PRO_FEATURES, less the compression algorithms this kernel lacks */
+static u32 drbd_local_features(void)
+{
+	return (PRO_FEATURES & ~(DRBD_FF_COMPRESS_LZ4|DRBD_FF_COMPRESS_ZSTD)) |
+		drbd_compress_features();
+}
 
 struct flush_work {
 	struct drbd_work w;
@@ -525,6 +535,8 @@ void __drbd_free_peer_req(struct drbd_peer_request *peer_req, int is_net)
 	might_sleep();
 	if (peer_req->flags & EE_HAS_DIGEST)
 		kfree(peer_req->digest);
+	if (peer_req->flags & EE_MERGED)
+		kfree(peer_req->merged);
 	D_ASSERT(peer_device, atomic_read(&peer_req->pending_bios) == 0);
 	D_ASSERT(peer_device, drbd_interval_empty(&peer_req->i));
 	drbd_free_page_chain(&peer_device->connection->transport, &peer_req->page_chain, is_net);
@@ -1304,15 +1316,18 @@ static void drbd_send_confirm_stable(struct drbd_peer_request *peer_req)
 	youngest = list_entry(peer_req->recv_order.prev, struct drbd_peer_request, recv_order);
 	spin_unlock_irq(&resource->req_lock);
 
-	count = atomic_read(&epoch->epoch_size) - atomic_read(&epoch->confirmed) - 1;
+	count = atomic_read(&epoch->epoch_size) - atomic_read(&epoch->confirmed) -
+		peer_req_nr_writes(peer_req);
 	atomic_add(count, &epoch->confirmed);
 	epoch->oldest_unconfirmed_peer_req = peer_req;
 
 	D_ASSERT(connection, oldest->epoch == youngest->epoch);
 	D_ASSERT(connection, count > 0);
 
+	/* the peer counts, and knows by block_id, the merged writes one by one */
 	p->oldest_block_id = oldest->block_id;
-	p->youngest_block_id = youngest->block_id;
+	p->youngest_block_id = youngest->flags & EE_MERGED ?
+		youngest->merged[youngest->merged_count - 1].block_id : youngest->block_id;
 	p->set_size = cpu_to_be32(count);
 	p->pad = 0;
 
@@ -1988,14 +2003,20 @@ static int receive_Barrier(struct drbd_connection *connection, struct packet_inf
 
 /* pi->data points into some recv buffer, which may be
  * re-used/recycled/overwritten by the next receive operation.
- * (read_in_block via recv_resync_read) */
-static void p_req_detail_from_pi(struct drbd_connection *connection,
+ * (read_in_block via recv_resync_read)
+ * With DP_COMPRESSED, this receives the p_data_compressed following the
+ * header, and takes it off pi->size.  Likewise the extents of a
+ * P_DATA_MERGED, which the caller has to kfree(). */
+static int p_req_detail_from_pi(struct drbd_connection *connection,
 		struct drbd_peer_request_details *d, struct packet_info *pi)
 {
 	struct p_trim *p = pi->data;
 	bool is_trim_or_wsame = pi->cmd == P_TRIM || pi->cmd == P_WSAME || pi->cmd == P_ZEROES;
+	bool zeroes_reply = pi->cmd == P_RS_DATA_REPLY &&
+		be32_to_cpu(p->p_data.dp_flags) & DP_ZEROES;
 	unsigned int digest_size =
-		pi->cmd != P_TRIM && connection->peer_integrity_tfm ?
+		pi->cmd != P_TRIM && pi->cmd != P_ZEROES && !zeroes_reply &&
+		connection->peer_integrity_tfm ?
 		crypto_shash_digestsize(connection->peer_integrity_tfm) : 0;
 
 	d->sector = be64_to_cpu(p->p_data.sector);
@@ -2005,6 +2026,135 @@ static void p_req_detail_from_pi(struct drbd_connection *connection,
 	d->length = pi->size;
 	d->bi_size = is_trim_or_wsame ? be32_to_cpu(p->size) : pi->size - digest_size;
 	d->digest_size = digest_size;
+	d->compress_alg = DRBD_COMPRESS_NONE;
+	d->merged = NULL;
+	d->merged_count = 0;
+
+	if (pi->cmd == P_DATA_MERGED) {
+		struct p_data_merged pm;
+		unsigned int count, ext_size, size = 0, i;
+		int err;
+
+		if (digest_size || d->dp_flags & DP_COMPRESSED || pi->size < sizeof(pm))
+			return -EINVAL;
+		err = drbd_recv_into(connection, &pm, sizeof(pm));
+		if (err)
+			return err;
+		count = be32_to_cpu(pm.count);
+		ext_size = count * sizeof(struct p_merged_extent);
+		if (count < 1 || count > DRBD_MERGE_MAX || pi->size < sizeof(pm) + ext_size)
+			return -EINVAL;
+		d->merged = kmalloc(ext_size, GFP_NOIO);
+		if (!d->merged)
+			return -ENOMEM;
+		err = drbd_recv_into(connection, d->merged, ext_size);
+		for (i = 0; i < count; i++)
+			size += be32_to_cpu(d->merged[i].size);
+		pi->size -= sizeof(pm) + ext_size;
+		if (!err && size != pi->size)
+			err = -EINVAL;
+		if (err) {
+			kfree(d->merged);
+			d->merged = NULL;
+			return err;
+		}
+		d->merged_count = count;
+		d->length = pi->size;
+		d->bi_size = pi->size;
+	} else if (zeroes_reply) {
+		__be32 size;
+		int err;
+
+		if (pi->size != sizeof(size))
+			return -EINVAL;
+		err = drbd_recv_into(connection, &size, sizeof(size));
+		if (err)
+			return err;
+		pi->size = 0;
+		d->length = 0;
+		d->bi_size = be32_to_cpu(size);
+	} else if (d->dp_flags & DP_COMPRESSED && !is_trim_or_wsame) {
+		struct p_data_compressed pc;
+		int err;
+
+		if (pi->size < sizeof(pc) + digest_size)
+			return -EINVAL;
+		err = drbd_recv_into(connection, &pc, sizeof(pc));
+		if (err)
+			return err;
+		pi->size -= sizeof(pc);
+		d->length = pi->size;
+		d->bi_size = be32_to_cpu(pc.raw_size);
+		d->compress_alg = pc.alg;
+	}
+	return 0;
+}
+
+/* Receives a compressed payload and decompresses it into compress.rx_raw */
+static void *drbd_recv_decompress(struct drbd_connection *connection, unsigned int alg,
+				  unsigned int wire_size, unsigned int raw_size)
+{
+	struct drbd_compress *c = &connection->compress;
+	unsigned int dlen = raw_size;
+	ktime_t start;
+	int err;
+
+	if (alg >= __DRBD_COMPRESS_NR || !c->rx_tfm[alg] ||
+	    wire_size > DRBD_MAX_BIO_SIZE || raw_size > DRBD_MAX_BIO_SIZE) {
+		drbd_err(connection, "Unexpected compressed payload, alg %u, %u -> %u bytes\n",
+			 alg, wire_size, raw_size);
+		return ERR_PTR(-EINVAL);
+	}
+
+	err = drbd_recv_into(connection, c->rx_buf, wire_size);
+	if (err)
+		return ERR_PTR(err);
+
+	start = ktime_get();
+	err = crypto_comp_decompress(c->rx_tfm[alg], c->rx_buf, wire_size, c->rx_raw, &dlen);
+	c->rx_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (err || dlen != raw_size) {
+		drbd_err(connection, "Decompression failed (%d), %u -> %u of %u bytes\n",
+			 err, wire_size, dlen, raw_size);
+		return ERR_PTR(-EINVAL);
+	}
+	c->rx_wire_bytes += wire_size + sizeof(struct p_data_compressed);
+	c->rx_raw_bytes += raw_size;
+
+	return c->rx_raw;
+}
+
+static int recv_decompress_pages(struct drbd_peer_device *peer_device,
+				 struct drbd_peer_request *peer_req,
+				 struct drbd_peer_request_details *d)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	unsigned int size = d->bi_size;
+	struct page *page;
+	char *raw;
+
+	raw = drbd_recv_decompress(connection, d->compress_alg, d->length - d->digest_size, size);
+	if (IS_ERR(raw))
+		return PTR_ERR(raw);
+
+	drbd_alloc_page_chain(&connection->transport, &peer_req->page_chain,
+			      DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = peer_req->page_chain.head;
+	if (!page)
+		return -ENOMEM;
+
+	page_chain_for_each(page) {
+		unsigned int len = min_t(unsigned int, size, PAGE_SIZE);
+		void *data = kmap_atomic(page);
+
+		memcpy(data, raw, len);
+		kunmap_atomic(data);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		raw += len;
+		size -= len;
+	}
+	return 0;
 }
 
 /* used from receive_RSDataReply (recv_resync_read)
@@ -2062,7 +2212,10 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 	if (d->length == 0)
 		return peer_req;
 
-	err = tr_ops->recv_pages(transport, &peer_req->page_chain, d->length - d->digest_size);
+	if (d->dp_flags & DP_COMPRESSED)
+		err = recv_decompress_pages(peer_device, peer_req, d);
+	else
+		err = tr_ops->recv_pages(transport, &peer_req->page_chain, d->length - d->digest_size);
 	if (err)
 		goto fail;
 
@@ -2109,48 +2262,96 @@ static int ignore_remaining_packet(struct drbd_connection *connection, int size)
 	return 0;
 }
 
-static int recv_dless_read(struct drbd_peer_device *peer_device, struct drbd_request *req,
-			   sector_t sector, int data_size)
+/* Fill the segments of a read reply's bio, from the data stream or from the
+ * decompressed payload in raw.  If desc is given, each segment is fed into
+ * the digest right after it was filled, while it is still mapped and in
+ * cache, instead of in a second pass over the bio. */
+static int recv_dless_read_bio(struct drbd_connection *connection, struct bio *bio,
+			       char *raw, int *data_size, struct shash_desc *desc)
 {
 	struct bio_vec bvec;
 	struct bvec_iter iter;
+	int err, expect;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		void *mapped = kmap(bvec.bv_page) + bvec.bv_offset;
+		expect = min_t(int, *data_size, bvec.bv_len);
+		if (raw) {
+			memcpy(mapped, raw, expect);
+			raw += expect;
+			err = 0;
+		} else {
+			err = drbd_recv_into(connection, mapped, expect);
+		}
+		if (!err && desc)
+			crypto_shash_update(desc, mapped, expect);
+		kunmap(bvec.bv_page);
+		if (err)
+			return err;
+		*data_size -= expect;
+	}
+	return 0;
+}
+
+static int recv_dless_read(struct drbd_peer_device *peer_device, struct drbd_request *req,
+			   sector_t sector, int data_size, struct p_data_compressed *pc)
+{
+	struct crypto_shash *tfm = peer_device->connection->peer_integrity_tfm;
 	struct bio *bio;
-	int digest_size, err, expect;
+	char *raw = NULL;
+	int digest_size, err;
 	void *dig_in = peer_device->connection->int_dig_in;
 	void *dig_vv = peer_device->connection->int_dig_vv;
 
 	digest_size = 0;
-	if (peer_device->connection->peer_integrity_tfm) {
-		digest_size = crypto_shash_digestsize(peer_device->connection->peer_integrity_tfm);
+	if (tfm) {
+		digest_size = crypto_shash_digestsize(tfm);
 		err = drbd_recv_into(peer_device->connection, dig_in, digest_size);
 		if (err)
 			return err;
 		data_size -= digest_size;
 	}
 
+	bio = req->master_bio;
+	if (pc) {
+		unsigned int raw_size = be32_to_cpu(pc->raw_size);
+
+		if (raw_size != bio->bi_iter.bi_size) {
+			drbd_err(peer_device, "Compressed read reply of %u bytes, expected %u\n",
+				 raw_size, bio->bi_iter.bi_size);
+			return -EINVAL;
+		}
+		raw = drbd_recv_decompress(peer_device->connection, pc->alg, data_size, raw_size);
+		if (IS_ERR(raw))
+			return PTR_ERR(raw);
+		data_size = raw_size;
+	}
+
 	/* optimistically update recv_cnt.  if receiving fails below,
 	 * we disconnect anyways, and counters will be reset. */
 	peer_device->recv_cnt += data_size >> 9;
 
-	bio = req->master_bio;
 	D_ASSERT(peer_device->device, sector == bio->bi_iter.bi_sector);
 
-	bio_for_each_segment(bvec, bio, iter) {
-		void *mapped = kmap(bvec.bv_page) + bvec.bv_offset;
-		expect = min_t(int, data_size, bvec.bv_len);
-		err = drbd_recv_into(peer_device->connection, mapped, expect);
-		kunmap(bvec.bv_page);
+	if (digest_size) {
+		SHASH_DESC_ON_STACK(desc, tfm);
+
+		desc->tfm = tfm;
+		crypto_shash_init(desc);
+		err = recv_dless_read_bio(peer_device->connection, bio, raw, &data_size, desc);
+		if (!err)
+			crypto_shash_final(desc, dig_vv);
+		shash_desc_zero(desc);
 		if (err)
 			return err;
-		data_size -= expect;
-	}
-
-	if (digest_size) {
-		drbd_csum_bio(peer_device->connection->peer_integrity_tfm, bio, dig_vv);
 		if (memcmp(dig_in, dig_vv, digest_size)) {
 			drbd_err(peer_device, "Digest integrity check FAILED. Broken NICs?\n");
 			return -EINVAL;
 		}
+	} else {
+		err = recv_dless_read_bio(peer_device->connection, bio, raw, &data_size, NULL);
+		if (err)
+			return err;
 	}
 
 	D_ASSERT(peer_device->device, data_size == 0);
@@ -2212,6 +2413,11 @@ static int recv_resync_read(struct drbd_peer_device *peer_device,
 	peer_req->w.cb = e_end_resync_block;
 	peer_req->opf = REQ_OP_WRITE;
 	peer_req->submit_jif = jiffies;
+	if (d->dp_flags & DP_ZEROES) {
+		peer_req->opf = REQ_OP_WRITE_ZEROES;
+		peer_req->flags |= EE_ZEROOUT;
+		peer_device->zero_elided_recv += d->bi_size;
+	}
 
 	spin_lock_irq(&device->resource->req_lock);
 	list_add_tail(&peer_req->w.list, &peer_device->connection->sync_ee);
@@ -2249,14 +2455,16 @@ out:
 }
 
 static struct drbd_request *
-find_request(struct drbd_device *device, struct rb_root *root, u64 id,
+find_request(struct drbd_device *device, struct drbd_interval_tree *root, u64 id,
 	     sector_t sector, bool missing_ok, const char *func)
 {
 	struct drbd_request *req;
 
 	/* Request object according to our peer */
-	req = (struct drbd_request *)(unsigned long)id;
-	if (drbd_contains_interval(root, sector, &req->i) && req->i.local)
+	req = drbd_req_by_id(device->resource, id);
+	if (req && req->device == device && req->i.sector == sector && req->i.local &&
+	    !drbd_interval_empty(&req->i) &&
+	    drbd_req_is_write(req) == (root == &device->write_requests))
 		return req;
 	if (!missing_ok) {
 		drbd_err(device, "%s: failed to find request 0x%lx, sector %llus\n", func,
@@ -2270,9 +2478,11 @@ static int receive_DataReply(struct drbd_connection *connection, struct packet_i
 	struct drbd_peer_device *peer_device;
 	struct drbd_device *device;
 	struct drbd_request *req;
+	struct p_data_compressed pc;
 	sector_t sector;
 	int err;
 	struct p_data *p = pi->data;
+	u32 dp_flags = be32_to_cpu(p->dp_flags);
 
 	peer_device = conn_peer_device(connection, pi->vnr);
 	if (!peer_device)
@@ -2287,7 +2497,36 @@ static int receive_DataReply(struct drbd_connection *connection, struct packet_i
 	if (unlikely(!req))
 		return -EIO;
 
-	err = recv_dless_read(peer_device, req, sector, pi->size);
+	if (dp_flags & DP_ZEROES) {
+		__be32 size;
+
+		if (pi->size != sizeof(size))
+			return -EINVAL;
+		err = drbd_recv_into(connection, &size, sizeof(size));
+		if (err)
+			return err;
+		if (be32_to_cpu(size) != req->master_bio->bi_iter.bi_size) {
+			drbd_err(peer_device, "Zeroes read reply of %u bytes, expected %u\n",
+				 be32_to_cpu(size), req->master_bio->bi_iter.bi_size);
+			return -EINVAL;
+		}
+		zero_fill_bio(req->master_bio);
+		peer_device->zero_elided_recv += be32_to_cpu(size);
+		req_mod(req, DATA_RECEIVED, peer_device);
+		return 0;
+	}
+
+	if (dp_flags & DP_COMPRESSED) {
+		if (pi->size < sizeof(pc))
+			return -EINVAL;
+		err = drbd_recv_into(connection, &pc, sizeof(pc));
+		if (err)
+			return err;
+		pi->size -= sizeof(pc);
+	}
+
+	err = recv_dless_read(peer_device, req, sector, pi->size,
+			      dp_flags & DP_COMPRESSED ? &pc : NULL);
 	if (!err)
 		req_mod(req, DATA_RECEIVED, peer_device);
 	/* else: nothing. handled from drbd_disconnect...
@@ -2326,10 +2565,24 @@ static int _drbd_send_ack(struct drbd_peer_device *peer_device, enum drbd_packet
 static int drbd_send_ack_dp(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 		  struct drbd_peer_request_details *d)
 {
-	return _drbd_send_ack(peer_device, cmd,
-			      cpu_to_be64(d->sector),
-			      cpu_to_be32(d->bi_size),
-			      d->block_id);
+	sector_t sector = d->sector;
+	unsigned int i;
+	int err;
+
+	if (!d->merged)
+		return _drbd_send_ack(peer_device, cmd,
+				      cpu_to_be64(d->sector),
+				      cpu_to_be32(d->bi_size),
+				      d->block_id);
+
+	for (i = 0; i < d->merged_count; i++) {
+		err = _drbd_send_ack(peer_device, cmd, cpu_to_be64(sector),
+				     d->merged[i].size, d->merged[i].block_id);
+		if (err)
+			return err;
+		sector += be32_to_cpu(d->merged[i].size) >> 9;
+	}
+	return 0;
 }
 
 static void drbd_send_ack_rp(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
@@ -2347,10 +2600,61 @@ static void drbd_send_ack_rp(struct drbd_peer_device *peer_device, enum drbd_pac
 int drbd_send_ack(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 		  struct drbd_peer_request *peer_req)
 {
-	return _drbd_send_ack(peer_device, cmd,
-			      cpu_to_be64(peer_req->i.sector),
-			      cpu_to_be32(peer_req->i.size),
-			      peer_req->block_id);
+	sector_t sector = peer_req->i.sector;
+	unsigned int i;
+	int err;
+
+	if (!(peer_req->flags & EE_MERGED))
+		return _drbd_send_ack(peer_device, cmd,
+				      cpu_to_be64(peer_req->i.sector),
+				      cpu_to_be32(peer_req->i.size),
+				      peer_req->block_id);
+
+	/* one ack for each write the peer merged into this one */
+	for (i = 0; i < peer_req->merged_count; i++) {
+		struct p_merged_extent *ext = &peer_req->merged[i];
+
+		err = _drbd_send_ack(peer_device, cmd, cpu_to_be64(sector), ext->size, ext->block_id);
+		if (err)
+			return err;
+		sector += be32_to_cpu(ext->size) >> 9;
+	}
+	return 0;
+}
+
+/* Like drbd_send_ack(), but successful write acks may be coalesced into a
+ * P_BLOCK_ACKS packet.  Only used from ack_sender context, which flushes
+ * the batch at the end of drbd_send_acks_wf(). */
+static int drbd_send_ack_batched(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
+				 struct drbd_peer_request *peer_req)
+{
+	unsigned int max = READ_ONCE(drbd_ack_batch);
+	sector_t sector = peer_req->i.sector;
+	unsigned int i;
+	int err;
+
+	if (max < 2 || !(peer_device->connection->agreed_features & DRBD_FF_ACK_BATCH))
+		return drbd_send_ack(peer_device, cmd, peer_req);
+
+	if (peer_device->repl_state[NOW] < L_ESTABLISHED)
+		return -EIO;
+
+	if (!(peer_req->flags & EE_MERGED))
+		return drbd_queue_ack(peer_device, cmd,
+				      cpu_to_be64(peer_req->i.sector),
+				      cpu_to_be32(peer_req->i.size),
+				      peer_req->block_id, max);
+
+	for (i = 0; i < peer_req->merged_count; i++) {
+		struct p_merged_extent *ext = &peer_req->merged[i];
+
+		err = drbd_queue_ack(peer_device, cmd, cpu_to_be64(sector), ext->size,
+				     ext->block_id, max);
+		if (err)
+			return err;
+		sector += be32_to_cpu(ext->size) >> 9;
+	}
+	return 0;
 }
 
 /* This function misuses the block_id field to signal if the blocks
@@ -2371,7 +2675,9 @@ static int receive_RSDataReply(struct drbd_connection *connection, struct packet
 	struct drbd_device *device;
 	int err;
 
-	p_req_detail_from_pi(connection, &d, pi);
+	err = p_req_detail_from_pi(connection, &d, pi);
+	if (err)
+		return err;
 	pi->data = NULL;
 
 	peer_device = conn_peer_device(connection, pi->vnr);
@@ -2451,7 +2757,10 @@ static int e_end_block(struct drbd_work *w, int cancel)
 			drbd_set_in_sync(peer_device, sector, peer_req->i.size);
 		} else
 			pcmd = P_WRITE_ACK;
-		err = drbd_send_ack(peer_device, pcmd, peer_req);
+		if (pcmd == P_NEG_ACK)
+			err = drbd_send_ack(peer_device, pcmd, peer_req);
+		else
+			err = drbd_send_ack_batched(peer_device, pcmd, peer_req);
 		dec_unacked(peer_device);
 	}
 
@@ -2900,7 +3209,9 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	if (pi->cmd == P_TRIM)
 		D_ASSERT(peer_device, pi->size == 0);
 
-	p_req_detail_from_pi(connection, &d, pi);
+	err = p_req_detail_from_pi(connection, &d, pi);
+	if (err)
+		return err;
 	pi->data = NULL;
 
 	if (!get_ldev(device)) {
@@ -2908,7 +3219,8 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 
 		err = wait_for_and_update_peer_seq(peer_device, d.peer_seq);
 		drbd_send_ack_dp(peer_device, P_NEG_ACK, &d);
-		atomic_inc(&connection->current_epoch->epoch_size);
+		atomic_add(d.merged ? d.merged_count : 1, &connection->current_epoch->epoch_size);
+		kfree(d.merged);
 		err2 = ignore_remaining_packet(connection, pi->size);
 		if (!err)
 			err = err2;
@@ -2923,9 +3235,15 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 
 	peer_req = read_in_block(peer_device, &d);
 	if (!peer_req) {
+		kfree(d.merged);
 		put_ldev(device);
 		return -EIO;
 	}
+	if (d.merged) {
+		peer_req->merged = d.merged;
+		peer_req->merged_count = d.merged_count;
+		peer_req->flags |= EE_MERGED;
+	}
 	if (pi->cmd == P_TRIM)
 		peer_req->flags |= EE_TRIM;
 	else if (pi->cmd == P_ZEROES)
@@ -2981,7 +3299,7 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 
 	spin_lock(&connection->epoch_lock);
 	peer_req->epoch = connection->current_epoch;
-	atomic_inc(&peer_req->epoch->epoch_size);
+	atomic_add(peer_req_nr_writes(peer_req), &peer_req->epoch->epoch_size);
 	atomic_inc(&peer_req->epoch->active);
 	if (peer_req->epoch->oldest_unconfirmed_peer_req == NULL)
 		peer_req->epoch->oldest_unconfirmed_peer_req = peer_req;
@@ -7447,6 +7765,79 @@ recv_bm_rle_bits(struct drbd_peer_device *peer_device,
 	return (s != c->bm_bits);
 }
 
+/**
+ * recv_bm_word_rle
+ *
+ * Decodes a DRBD_BM_CODE_WORD_RLE packet, see bm_wrle_get_token().
+ * Return 0 when done, 1 when another iteration is needed, and a negative error
+ * code upon failure.
+ */
+static int
+recv_bm_word_rle(struct drbd_peer_device *peer_device,
+		 struct p_compressed_bm *p,
+		 struct bm_xfer_ctx *c,
+		 unsigned int len)
+{
+	/* drbd_bm_merge_lel() wants aligned unsigned longs */
+	unsigned long buf[128 / sizeof(unsigned long)];
+	const u8 *pos = p->code, *end = p->code + len;
+	/* on 32 bit the last 64 bit word may extend beyond bm_words */
+	u64 limit = round_up((u64)c->bm_words * BITS_PER_LONG, 64);
+	u64 s = c->bit_offset;
+
+	while (pos < end) {
+		enum bm_wrle_token type;
+		u64 count;
+		int tlen;
+
+		tlen = bm_wrle_get_token(pos, end, &type, &count);
+		if (tlen < 0) {
+			drbd_err(peer_device, "bitmap decoding error: l:%u/%u\n",
+				 (unsigned int)(pos - p->code), len);
+			return -EIO;
+		}
+		if (count > (limit - s) / 64) {
+			drbd_err(peer_device, "bitmap overflow (s:%llu n:%llu) while decoding bm word RLE packet\n",
+				 s, count);
+			return -EIO;
+		}
+
+		if (type == BM_WRLE_ONES) {
+			u64 e = min_t(u64, s + count * 64, c->bm_bits);
+
+			if (e > s)
+				drbd_bm_set_many_bits(peer_device, s, e - 1);
+		} else if (type == BM_WRLE_LITERAL) {
+			const u8 *lit = pos + tlen - count * 8;
+			unsigned int todo = count * 8;
+
+			while (todo) {
+				unsigned int chunk = min_t(unsigned int, todo, sizeof(buf));
+				unsigned long offset = s / BITS_PER_LONG;
+				unsigned long words = chunk / sizeof(unsigned long);
+
+				words = min_t(unsigned long, words, c->bm_words - offset);
+				if (words) {
+					memcpy(buf, lit, chunk);
+					drbd_bm_merge_lel(peer_device, offset, words, buf);
+				}
+				lit += chunk;
+				todo -= chunk;
+				s += chunk * 8;
+			}
+			pos += tlen;
+			continue;
+		}
+		s += count * 64;
+		pos += tlen;
+	}
+
+	c->bit_offset = min_t(u64, s, c->bm_bits);
+	bm_xfer_ctx_bit_to_word_offset(c);
+
+	return c->bit_offset < c->bm_bits;
+}
+
 /**
  * decode_bitmap_c
  *
@@ -7461,6 +7852,9 @@ decode_bitmap_c(struct drbd_peer_device *peer_device,
 {
 	if (dcbp_get_code(p) == RLE_VLI_Bits)
 		return recv_bm_rle_bits(peer_device, p, c, len - sizeof(*p));
+	if (dcbp_get_code(p) == DRBD_BM_CODE_WORD_RLE &&
+	    peer_device->connection->agreed_features & DRBD_FF_BM_WORD_RLE)
+		return recv_bm_word_rle(peer_device, p, c, len - sizeof(*p));
 
 	/* other variants had been implemented for evaluation,
 	 * but have been dropped as this one turned out to be "best"
@@ -7966,6 +8360,7 @@ struct data_cmd {
 
 static struct data_cmd drbd_cmd_handler[] = {
 	[P_DATA]	    = { 1, sizeof(struct p_data), receive_Data },
+	[P_DATA_MERGED]	    = { 1, sizeof(struct p_data), receive_Data },
 	[P_DATA_REPLY]	    = { 1, sizeof(struct p_data), receive_DataReply },
 	[P_RS_DATA_REPLY]   = { 1, sizeof(struct p_data), receive_RSDataReply } ,
 	[P_BARRIER]	    = { 0, sizeof(struct p_barrier), receive_Barrier } ,
@@ -8253,6 +8648,14 @@ static void conn_disconnect(struct drbd_connection *connection)
 
 	drbd_finish_peer_reqs(connection);
 
+	/* acks batched for this connection mean nothing to the next one */
+	mutex_lock(&connection->mutex[CONTROL_STREAM]);
+	connection->ack_batch.count = 0;
+	mutex_unlock(&connection->mutex[CONTROL_STREAM]);
+
+	/* spilled writes not sent yet are resynced, like all the others */
+	drbd_journal_drop(connection);
+
 	/* This second workqueue flush is necessary, since drbd_finish_peer_reqs()
 	   might have issued a work again. The one before drbd_finish_peer_reqs() is
 	   necessary to reclaim net_ee in drbd_finish_peer_reqs(). */
@@ -8342,7 +8745,7 @@ static int drbd_send_features(struct drbd_connection *connection)
 	p->protocol_max = cpu_to_be32(PRO_VERSION_MAX);
 	p->sender_node_id = cpu_to_be32(connection->resource->res_opts.node_id);
 	p->receiver_node_id = cpu_to_be32(connection->peer_node_id);
-	p->feature_flags = cpu_to_be32(PRO_FEATURES);
+	p->feature_flags = cpu_to_be32(drbd_local_features());
 	return __send_command(connection, -1, P_CONNECTION_FEATURES, DATA_STREAM);
 }
 
@@ -8404,7 +8807,7 @@ int drbd_do_features(struct drbd_connection *connection)
 	}
 
 	connection->agreed_pro_version = min_t(int, PRO_VERSION_MAX, p->protocol_max);
-	connection->agreed_features = PRO_FEATURES & be32_to_cpu(p->feature_flags);
+	connection->agreed_features = drbd_local_features() & be32_to_cpu(p->feature_flags);
 
 	if (connection->agreed_pro_version < 110) {
 		struct drbd_connection *connection2;
@@ -8444,14 +8847,23 @@ int drbd_do_features(struct drbd_connection *connection)
 			connection->peer_node_id,
 			connection->agreed_pro_version);
 
-	drbd_info(connection, "Feature flags enabled on protocol level: 0x%x%s%s%s%s.\n",
+	drbd_info(connection, "Feature flags enabled on protocol level: 0x%x%s%s%s%s%s%s%s%s%s%s.\n",
 		  connection->agreed_features,
 		  connection->agreed_features & DRBD_FF_TRIM ? " TRIM" : "",
 		  connection->agreed_features & DRBD_FF_THIN_RESYNC ? " THIN_RESYNC" : "",
 		  connection->agreed_features & DRBD_FF_WSAME ? " WRITE_SAME" : "",
+		  connection->agreed_features & DRBD_FF_BM_WORD_RLE ? " BM_WORD_RLE" : "",
+		  connection->agreed_features & DRBD_FF_ACK_BATCH ? " ACK_BATCH" : "",
+		  connection->agreed_features & DRBD_FF_COMPRESS_LZ4 ? " COMPRESS_LZ4" : "",
+		  connection->agreed_features & DRBD_FF_COMPRESS_ZSTD ? " COMPRESS_ZSTD" : "",
+		  connection->agreed_features & DRBD_FF_ZERO_ELISION ? " ZERO_ELISION" : "",
+		  connection->agreed_features & DRBD_FF_MERGED_DATA ? " MERGED_DATA" : "",
 		  connection->agreed_features & DRBD_FF_WZEROES ? " WRITE_ZEROES" :
 		  connection->agreed_features ? "" : " none");
 
+	if (drbd_compress_setup(connection))
+		return 0; /* out of memory, try again */
+
 	return 1;
 }
 
@@ -8893,7 +9305,7 @@ static int got_IsInSync(struct drbd_connection *connection, struct packet_info *
 
 static int
 validate_req_change_req_state(struct drbd_peer_device *peer_device, u64 id, sector_t sector,
-			      struct rb_root *root, const char *func,
+			      struct drbd_interval_tree *root, const char *func,
 			      enum drbd_req_event what, bool missing_ok)
 {
 	struct drbd_device *device = peer_device->device;
@@ -8961,6 +9373,72 @@ static int got_BlockAck(struct drbd_connection *connection, struct packet_info *
 					     what, false);
 }
 
+static int got_BlockAcks(struct drbd_connection *connection, struct packet_info *pi)
+{
+	struct drbd_peer_device *peer_device;
+	struct drbd_device *device;
+	struct p_block_acks *p = pi->data;
+	unsigned int count = be16_to_cpu(p->count);
+	struct bio_and_error m[8];
+	enum drbd_req_event what;
+	unsigned int i, nr_bios = 0, j;
+	int err = 0;
+
+	peer_device = conn_peer_device(connection, pi->vnr);
+	if (!peer_device)
+		return -EIO;
+	device = peer_device->device;
+
+	if (!(connection->agreed_features & DRBD_FF_ACK_BATCH) ||
+	    count == 0 || count > DRBD_ACK_BATCH_MAX ||
+	    pi->size != sizeof(*p) + count * sizeof(p->acks[0]))
+		return -EIO;
+
+	switch (be16_to_cpu(p->cmd)) {
+	case P_RS_WRITE_ACK:
+		what = WRITE_ACKED_BY_PEER_AND_SIS;
+		break;
+	case P_WRITE_ACK:
+		what = WRITE_ACKED_BY_PEER;
+		break;
+	case P_RECV_ACK:
+		what = RECV_ACKED_BY_PEER;
+		break;
+	default:
+		return -EIO;
+	}
+
+	update_peer_seq(peer_device, be32_to_cpu(p->seq_num));
+
+	/* One req_lock section for the whole batch, unless too many master
+	 * bios became ready for completion. Those get completed unlocked. */
+	spin_lock_irq(&device->resource->req_lock);
+	for (i = 0; i < count; i++) {
+		struct drbd_request *req;
+
+		req = find_request(device, &device->write_requests, p->acks[i].block_id,
+				   be64_to_cpu(p->acks[i].sector), false, __func__);
+		if (unlikely(!req)) {
+			err = -EIO;
+			break;
+		}
+		__req_mod(req, what, peer_device, &m[nr_bios]);
+		if (m[nr_bios].bio && ++nr_bios == ARRAY_SIZE(m)) {
+			spin_unlock_irq(&device->resource->req_lock);
+			for (j = 0; j < nr_bios; j++)
+				complete_master_bio(device, &m[j]);
+			nr_bios = 0;
+			spin_lock_irq(&device->resource->req_lock);
+		}
+	}
+	spin_unlock_irq(&device->resource->req_lock);
+
+	for (j = 0; j < nr_bios; j++)
+		complete_master_bio(device, &m[j]);
+
+	return err;
+}
+
 static int got_NegAck(struct drbd_connection *connection, struct packet_info *pi)
 {
 	struct drbd_peer_device *peer_device;
@@ -9334,6 +9812,7 @@ static void cleanup_peer_ack_list(struct drbd_connection *connection)
 struct meta_sock_cmd {
 	size_t pkt_size;
 	int (*fn)(struct drbd_connection *connection, struct packet_info *);
+	bool var_size;	/* pkt_size is the minimum, payload follows */
 };
 
 static void set_rcvtimeo(struct drbd_connection *connection, bool ping_timeout)
@@ -9391,6 +9870,7 @@ static struct meta_sock_cmd ack_receiver_tbl[] = {
 	[P_TWOPC_YES]       = { sizeof(struct p_twopc_reply), got_twopc_reply },
 	[P_TWOPC_NO]        = { sizeof(struct p_twopc_reply), got_twopc_reply },
 	[P_TWOPC_RETRY]     = { sizeof(struct p_twopc_reply), got_twopc_reply },
+	[P_BLOCK_ACKS]      = { sizeof(struct p_block_acks), got_BlockAcks, true },
 };
 
 int drbd_ack_receiver(struct drbd_thread *thi)
@@ -9493,6 +9973,9 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 				goto disconnect;
 			}
 			expect = header_size + cmd->pkt_size;
+			if (cmd->var_size && pi.size > cmd->pkt_size &&
+			    header_size + pi.size <= DRBD_SOCKET_BUFFER_SIZE)
+				expect = header_size + pi.size;
 			if (pi.size != expect - header_size) {
 				drbd_err(connection, "Wrong packet size on meta (c: %d, l: %d)\n",
 					pi.cmd, pi.size);
@@ -9556,6 +10039,8 @@ void drbd_send_acks_wf(struct work_struct *ws)
 	if (tcp_cork)
 		drbd_cork(connection, CONTROL_STREAM);
 	err = drbd_finish_peer_reqs(connection);
+	if (!err)
+		err = drbd_flush_ack_batch(connection);
 
 	/* but unconditionally uncork unless disabled */
 	if (tcp_cork)
@@ -22,6 +22,50 @@
 
 static bool drbd_may_do_local_read(struct drbd_device *device, sector_t sector, int size);
 
+/* The block_id of a request, as sent to the peers, is its index in
+ * resource->req_ids in the low 32 bits, and a generation number in the high
+ * 32 bits.  Acks then need no search, stale or bogus block_ids do not match
+ * a recycled slot, and no kernel addresses go onto the wire.  Generations
+ * start at 1 and stay below 2^31, which keeps ids clear of 0, ID_IN_SYNC,
+ * ID_OUT_OF_SYNC and ID_SYNCER. */
+static int drbd_req_id_alloc(struct drbd_resource *resource, struct drbd_request *req)
+{
+	unsigned long flags;
+	u32 gen;
+	int idx;
+
+	idr_preload(GFP_NOIO);
+	spin_lock_irqsave(&resource->req_ids_lock, flags);
+	idx = idr_alloc_cyclic(&resource->req_ids, req, 0, 0, GFP_NOWAIT);
+	gen = ++resource->req_id_gen;
+	if (gen >= 1U << 31) {
+		gen = 1;
+		resource->req_id_gen = 1;
+	}
+	if (idx >= 0)
+		req->id = (u64)gen << 32 | idx;
+	spin_unlock_irqrestore(&resource->req_ids_lock, flags);
+	idr_preload_end();
+
+	if (idx < 0) {
+		drbd_err(resource, "could not allocate a request id (%d)\n", idx);
+		return idx;
+	}
+	return 0;
+}
+
+/* Called with req_lock held */
+static void drbd_req_id_free(struct drbd_resource *resource, struct drbd_request *req)
+{
+	if (!req->id)
+		return;
+
+	spin_lock(&resource->req_ids_lock);
+	idr_remove(&resource->req_ids, (u32)req->id);
+	spin_unlock(&resource->req_ids_lock);
+	req->id = 0;
+}
+
 static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio *bio_src)
 {
 	struct drbd_request *req;
@@ -59,6 +103,13 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 	              | (bio_op(bio_src) == REQ_OP_WRITE_ZEROES ? RQ_ZEROES : 0)
 	              | (bio_op(bio_src) == REQ_OP_DISCARD ? RQ_UNMAP : 0);
 
+	if (drbd_req_id_alloc(device->resource, req)) {
+		kref_debug_put(&device->kref_debug, 6);
+		kref_put(&device->kref, drbd_destroy_device);
+		mempool_free(req, &drbd_request_mempool);
+		return NULL;
+	}
+
 	return req;
 }
 
@@ -115,7 +166,7 @@ static bool peer_ack_window_full(struct drbd_request *req)
 	return dagtag_newer_eq(req->dagtag_sector, last_dagtag);
 }
 
-static void drbd_remove_request_interval(struct rb_root *root,
+static void drbd_remove_request_interval(struct drbd_interval_tree *root,
 					 struct drbd_request *req)
 {
 	struct drbd_device *device = req->device;
@@ -188,11 +239,12 @@ void drbd_req_destroy(struct kref *kref)
 	}
 
 	list_del_init(&req->tl_requests);
+	drbd_req_id_free(device->resource, req);
 
 	/* finally remove the request from the conflict detection
 	 * respective block_id verification interval tree. */
 	if (!drbd_interval_empty(&req->i)) {
-		struct rb_root *root;
+		struct drbd_interval_tree *root;
 
 		if (s & RQ_WRITE)
 			root = &device->write_requests;
@@ -384,6 +436,9 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 			continue;
 		if (!(ns & (RQ_NET_PENDING|RQ_NET_QUEUED)))
 			continue;
+		/* the payload waits in the replication journal */
+		if ((ns & (RQ_NET_PENDING|RQ_NET_JOURNALED)) == RQ_NET_JOURNALED)
+			continue;
 
 		drbd_err(device,
 			"drbd_req_complete: Logic BUG rq_state: (0:%x, %d:%x), completion_ref = %d\n",
@@ -585,6 +640,44 @@ static unsigned int req_payload_sectors(struct drbd_request *req)
 	return req->i.size >> 9;
 }
 
+/* Adaptive read balancing: each read source keeps an EWMA (weight 1/8) of
+ * its read latency, and of the number of reads it had in flight. */
+static void drbd_rb_issue(struct drbd_rb_estimate *e, struct drbd_request *req)
+{
+	unsigned int depth = ++e->inflight << 4;
+
+	e->depth = e->depth - (e->depth >> 3) + (depth >> 3);
+	req->rb_issue_kt = ktime_get();
+}
+
+static void drbd_rb_complete(struct drbd_rb_estimate *e, struct drbd_request *req)
+{
+	u64 lat_ns;
+
+	if (!req->rb_issue_kt)
+		return;
+
+	lat_ns = ktime_to_ns(ktime_sub(ktime_get(), req->rb_issue_kt));
+	req->rb_issue_kt = 0;
+	if (e->inflight)
+		e->inflight--;
+	if (e->nr_reads++)
+		e->lat_ns = e->lat_ns - (e->lat_ns >> 3) + (lat_ns >> 3);
+	else
+		e->lat_ns = lat_ns;
+}
+
+/* Expected completion time of a read issued to this source now.  The
+ * latency was observed with about depth reads in flight, scale it to the
+ * queue the new read would join (Little's law).  Never measured: 0, so
+ * that it gets tried. */
+u64 drbd_rb_expected_ns(const struct drbd_rb_estimate *e)
+{
+	if (!e->nr_reads)
+		return 0;
+	return div_u64(e->lat_ns * ((e->inflight + 1) << 4), max(e->depth, 16U));
+}
+
 /* I'd like this to be the only place that manipulates
  * req->completion_ref and req->kref. */
 static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
@@ -632,12 +725,17 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 
 	kref_get(&req->kref);
 
-	if (!(old_local & RQ_LOCAL_PENDING) && (set_local & RQ_LOCAL_PENDING))
+	if (!(old_local & RQ_LOCAL_PENDING) && (set_local & RQ_LOCAL_PENDING)) {
 		atomic_inc(&req->completion_ref);
+		if (!(old_local & RQ_WRITE))
+			drbd_rb_issue(&req->device->rb_local, req);
+	}
 
 	if (!(old_net & RQ_NET_PENDING) && (set & RQ_NET_PENDING)) {
 		inc_ap_pending(peer_device);
 		atomic_inc(&req->completion_ref);
+		if (!(old_local & RQ_WRITE))
+			drbd_rb_issue(&peer_device->rb, req);
 	}
 
 	if (!(old_net & RQ_NET_QUEUED) && (set & RQ_NET_QUEUED)) {
@@ -672,6 +770,8 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 	}
 
 	if ((old_local & RQ_LOCAL_PENDING) && (clear_local & RQ_LOCAL_PENDING)) {
+		if (!(old_local & RQ_WRITE))
+			drbd_rb_complete(&req->device->rb_local, req);
 		if (req->local_rq_state & RQ_LOCAL_ABORTED)
 			kref_put(&req->kref, drbd_req_destroy);
 		else
@@ -680,14 +780,20 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 	}
 
 	if ((old_net & RQ_NET_PENDING) && (clear & RQ_NET_PENDING)) {
+		if (!(old_local & RQ_WRITE))
+			drbd_rb_complete(&peer_device->rb, req);
 		dec_ap_pending(peer_device);
 		++c_put;
 		ktime_get_accounting(req->acked_kt[peer_device->node_id]);
 		advance_conn_req_ack_pending(peer_device, req);
 	}
 
+	if (!(old_net & RQ_NET_JOURNALED) && (set & RQ_NET_JOURNALED))
+		++c_put; /* that of RQ_NET_QUEUED */
+
 	if ((old_net & RQ_NET_QUEUED) && (clear & RQ_NET_QUEUED)) {
-		++c_put;
+		if (!(old_net & RQ_NET_JOURNALED))
+			++c_put;
 		advance_conn_req_next(peer_device, req);
 	}
 
@@ -945,9 +1051,20 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		mod_rq_state(req, m, peer_device, RQ_NET_QUEUED, 0);
 		break;
 
+	case JOURNALED:
+		/* see drbd_journal_queue(); sent in the meantime, or canceled? */
+		if (!(req->net_rq_state[idx] & RQ_NET_QUEUED))
+			break;
+		D_ASSERT(device, is_pending_write_protocol_A(req, idx));
+		/* like protocol A on handing it over to the network,
+		 * but it is not RQ_NET_OK before it actually is */
+		mod_rq_state(req, m, peer_device, RQ_NET_PENDING, RQ_NET_JOURNALED);
+		break;
+
 	case HANDED_OVER_TO_NETWORK:
 		/* assert something? */
-		if (is_pending_write_protocol_A(req, idx))
+		if (is_pending_write_protocol_A(req, idx) ||
+		    req->net_rq_state[idx] & RQ_NET_JOURNALED)
 			/* this is what is dangerous about protocol A:
 			 * pretend it was successfully written on the peer. */
 			mod_rq_state(req, m, peer_device, RQ_NET_QUEUED|RQ_NET_PENDING,
@@ -1021,6 +1138,13 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		break;
 
 	case NEG_ACKED:
+		if (!(req->local_rq_state & RQ_WRITE)) {
+			peer_device->read_err_jif = jiffies ?: 1;
+			/* Not again in this round of the rotation either, so
+			 * that the retry goes elsewhere.  Later rounds skip it
+			 * while peer_read_failed_recently(). */
+			device->read_nodes &= ~NODE_MASK(peer_device->node_id);
+		}
 		mod_rq_state(req, m, peer_device, RQ_NET_OK|RQ_NET_PENDING,
 			     (req->local_rq_state & RQ_WRITE) ? 0 : RQ_NET_DONE);
 		break;
@@ -1221,6 +1345,7 @@ static void __maybe_pull_ahead(struct drbd_device *device, struct drbd_connectio
 	bool congested = false;
 	enum drbd_on_congestion on_congestion;
 	u32 cong_fill = 0, cong_extents = 0;
+	bool protocol_a = false;
 	struct drbd_peer_device *peer_device = conn_peer_device(connection, device->vnr);
 
 	if (connection->agreed_pro_version < 96)
@@ -1232,6 +1357,7 @@ static void __maybe_pull_ahead(struct drbd_device *device, struct drbd_connectio
 		on_congestion = nc->on_congestion;
 		cong_fill = nc->cong_fill;
 		cong_extents = nc->cong_extents;
+		protocol_a = nc->wire_protocol == DRBD_PROT_A;
 	} else {
 		on_congestion = OC_BLOCK;
 	}
@@ -1256,20 +1382,31 @@ static void __maybe_pull_ahead(struct drbd_device *device, struct drbd_connectio
 		int n = atomic_read(&connection->ap_in_flight) +
 			atomic_read(&connection->rs_in_flight);
 		if (n >= cong_fill) {
-			drbd_info(device, "Congestion-fill threshold reached (%d >= %d)\n", n, cong_fill);
+			if (!test_bit(CONN_JOURNALING, &connection->flags))
+				drbd_info(device, "Congestion-fill threshold reached (%d >= %d)\n", n, cong_fill);
 			congested = true;
 		}
 	}
 
 	if (!congested && device->act_log->used >= cong_extents) {
-		drbd_info(device, "Congestion-extents threshold reached (%d >= %d)\n",
-			device->act_log->used, cong_extents);
+		if (!test_bit(CONN_JOURNALING, &connection->flags))
+			drbd_info(device, "Congestion-extents threshold reached (%d >= %d)\n",
+				device->act_log->used, cong_extents);
 		congested = true;
 	}
 
 	if (congested) {
 		struct drbd_resource *resource = device->resource;
 
+		/* Absorb the burst in the replication journal, while it has
+		 * room.  Only then pull ahead. */
+		if (on_congestion == OC_PULL_AHEAD && protocol_a &&
+		    !test_bit(CONN_CONGESTED, &connection->flags) &&
+		    drbd_journal_may_start(connection)) {
+			put_ldev(device);
+			return;
+		}
+
 		set_bit(CONN_CONGESTED, &connection->flags);
 
 		/* start a new epoch for non-mirrored writes */
@@ -1316,11 +1453,21 @@ static bool drbd_should_send_out_of_sync(struct drbd_peer_device *peer_device)
 	   since we enter state L_AHEAD only if proto >= 96 */
 }
 
+/* A peer that failed a read within the last second is avoided, so that
+ * the retry of the failed read goes elsewhere if possible. */
+static bool peer_read_failed_recently(struct drbd_peer_device *peer_device)
+{
+	unsigned long err_jif = READ_ONCE(peer_device->read_err_jif);
+
+	return err_jif && time_before(jiffies, err_jif + HZ);
+}
+
 /* Prefer to read from protcol C peers, then B, last A */
 static u64 calc_nodes_to_read_from(struct drbd_device *device)
 {
 	struct drbd_peer_device *peer_device;
 	u64 candidates[DRBD_PROT_C] = {};
+	u64 failed = 0;
 	int wp;
 
 	rcu_read_lock();
@@ -1334,9 +1481,15 @@ static u64 calc_nodes_to_read_from(struct drbd_device *device)
 			continue;
 		wp = nc->wire_protocol;
 		candidates[wp - 1] |= NODE_MASK(peer_device->node_id);
+		if (peer_read_failed_recently(peer_device))
+			failed |= NODE_MASK(peer_device->node_id);
 	}
 	rcu_read_unlock();
 
+	for (wp = DRBD_PROT_C; wp >= DRBD_PROT_A; wp--) {
+		if (candidates[wp - 1] & ~failed)
+			return candidates[wp - 1] & ~failed;
+	}
 	for (wp = DRBD_PROT_C; wp >= DRBD_PROT_A; wp--) {
 		if (candidates[wp - 1])
 			return candidates[wp - 1];
@@ -1344,6 +1497,39 @@ static u64 calc_nodes_to_read_from(struct drbd_device *device)
 	return 0;
 }
 
+/* Pick the read source with the lowest expected completion time; NULL
+ * means the local disk.  Every 64th read goes the classic way instead,
+ * to refresh the estimates of sources that lost out. */
+static struct drbd_peer_device *
+find_peer_device_for_read_adaptive(struct drbd_request *req, bool *probe)
+{
+	struct drbd_device *device = req->device;
+	struct drbd_peer_device *peer_device, *best = NULL;
+	u64 nodes, ns, best_ns = U64_MAX;
+
+	*probe = !(++device->rb_probe & 63);
+	if (*probe)
+		return NULL;
+
+	if (req->private_bio)
+		best_ns = drbd_rb_expected_ns(&device->rb_local);
+
+	nodes = calc_nodes_to_read_from(device);
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		if (!(nodes & NODE_MASK(peer_device->node_id)))
+			continue;
+		ns = drbd_rb_expected_ns(&peer_device->rb);
+		if (ns < best_ns) {
+			best_ns = ns;
+			best = peer_device;
+		}
+	}
+	rcu_read_unlock();
+
+	return best;
+}
+
 /* If this returns NULL, and req->private_bio is still set,
  * the request should be submitted locally.
  *
@@ -1358,6 +1544,7 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 	struct drbd_peer_device *peer_device;
 	struct drbd_device *device = req->device;
 	enum drbd_read_balancing rbm = RB_PREFER_REMOTE;
+	bool probe = false;
 
 	if (req->private_bio) {
 		if (!drbd_may_do_local_read(device,
@@ -1368,7 +1555,12 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		}
 	}
 
-	if (device->disk_state[NOW] > D_DISKLESS) {
+	if (READ_ONCE(drbd_read_balancing_adaptive)) {
+		peer_device = find_peer_device_for_read_adaptive(req, &probe);
+		if (!probe)
+			goto out;
+		rbm = RB_ROUND_ROBIN;
+	} else if (device->disk_state[NOW] > D_DISKLESS) {
 		rcu_read_lock();
 		rbm = rcu_dereference(device->ldev->disk_conf)->read_balancing;
 		rcu_read_unlock();
@@ -1398,6 +1590,7 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		break;
 	}
 
+out:
 	if (peer_device && req->private_bio) {
 		bio_put(req->private_bio);
 		req->private_bio = NULL;
@@ -1439,6 +1632,9 @@ static int drbd_process_write_request(struct drbd_request *req)
 			_req_mod(req, QUEUE_FOR_SEND_OOS, peer_device);
 	}
 
+	if (count)
+		drbd_journal_queue(req);
+
 	return count;
 }
 
@@ -1808,6 +2004,9 @@ out:
 	if (submit_private_bio)
 		drbd_submit_req_private_bio(req);
 
+	if (rw == WRITE)
+		drbd_journal_submit();
+
 	/* we need to plug ALWAYS since we possibly need to kick lo_dev.
 	 * we plug after submit, so we won't miss an unplug event */
 	drbd_plug_device(device->vdisk->queue);
@@ -2194,6 +2393,43 @@ static bool drbd_fail_request_early(struct drbd_device *device, struct bio *bio)
 	return false;
 }
 
+/* Large reads are cut into pieces, so that each piece gets its own read
+ * source: stripes of read_stripe_kb on a diskless node, pieces of
+ * read_balancing_split_kb with adaptive read balancing.  The pieces are
+ * chained to the original bio, which completes once all of them did.
+ * Only the first piece is returned, the rest is resubmitted. */
+static struct bio *drbd_split_read(struct drbd_device *device, struct bio *bio)
+{
+	unsigned int split_sectors, min_sectors;
+	int sources;
+	struct bio *split;
+
+	if (device->disk_state[NOW] == D_DISKLESS && READ_ONCE(drbd_read_stripe_kb)) {
+		split_sectors = READ_ONCE(drbd_read_stripe_kb) << 1;
+		min_sectors = split_sectors + 1;
+	} else if (READ_ONCE(drbd_read_balancing_adaptive)) {
+		split_sectors = READ_ONCE(drbd_read_balancing_split_kb) << 1;
+		min_sectors = 2 * split_sectors;
+	} else {
+		return bio;
+	}
+
+	if (!split_sectors || bio_sectors(bio) < min_sectors)
+		return bio;
+
+	sources = hweight64(calc_nodes_to_read_from(device));
+	if (device->disk_state[NOW] == D_UP_TO_DATE)
+		sources++;
+	if (sources < 2)
+		return bio;
+
+	split = bio_split(bio, split_sectors, GFP_NOIO, &drbd_split_bio_set);
+	bio_chain(split, bio);
+	submit_bio_noacct(bio);
+
+	return split;
+}
+
 blk_qc_t drbd_submit_bio(struct bio *bio)
 {
 	struct request_queue *q = bio->bi_disk->queue;
@@ -2211,6 +2447,9 @@ blk_qc_t drbd_submit_bio(struct bio *bio)
 
 	blk_queue_split(&bio);
 
+	if (bio_op(bio) == REQ_OP_READ)
+		bio = drbd_split_read(device, bio);
+
 	if (device->cached_err_io) {
 		bio->bi_status = BLK_STS_IOERR;
 		bio_endio(bio);
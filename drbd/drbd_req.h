@@ -86,6 +86,7 @@ enum drbd_req_event {
 	SEND_CANCELED,
 	SEND_FAILED,
 	HANDED_OVER_TO_NETWORK,
+	JOURNALED,
 	OOS_HANDED_TO_NETWORK,
 	CONNECTION_LOST_WHILE_PENDING,
 	READ_RETRY_REMOTE_CANCELED,
@@ -175,6 +176,11 @@ enum drbd_req_state_bits {
 	/* peer called drbd_set_in_sync() for this write */
 	__RQ_NET_SIS,
 
+	/* protocol A write, still queued, but its payload is in the
+	 * replication journal.  No longer PENDING, and QUEUED holds no
+	 * completion reference: the master bio may be completed. */
+	__RQ_NET_JOURNALED,
+
 	/* keep this last, its for the RQ_NET_MASK */
 	__RQ_NET_MAX,
 
@@ -232,6 +238,7 @@ enum drbd_req_state_bits {
 #define RQ_NET_DONE        (1UL << __RQ_NET_DONE)
 #define RQ_NET_OK          (1UL << __RQ_NET_OK)
 #define RQ_NET_SIS         (1UL << __RQ_NET_SIS)
+#define RQ_NET_JOURNALED   (1UL << __RQ_NET_JOURNALED)
 
 #define RQ_NET_MASK        (((1UL << __RQ_NET_MAX)-1) & ~RQ_LOCAL_MASK)
 
@@ -288,6 +295,18 @@ struct bio_and_error {
 	int error;
 };
 
+/* Returns the request a peer means by block_id, or NULL if there is none
+ * (any more).  Call with req_lock held; the request stays valid as long. */
+static inline struct drbd_request *drbd_req_by_id(struct drbd_resource *resource, u64 id)
+{
+	struct drbd_request *req;
+
+	if (id >> 63)
+		return NULL;
+	req = idr_find(&resource->req_ids, (u32)id);
+	return req && req->id == id ? req : NULL;
+}
+
 extern bool start_new_tl_epoch(struct drbd_resource *resource);
 extern void drbd_req_destroy(struct kref *kref);
 extern void __req_mod(struct drbd_request *req, enum drbd_req_event what,
@@ -303,6 +322,7 @@ extern void __tl_walk(struct drbd_resource *const resource,
 		const enum drbd_req_event what);
 extern void drbd_queue_peer_ack(struct drbd_resource *resource, struct drbd_request *req);
 extern bool drbd_should_do_remote(struct drbd_peer_device *, enum which_state);
+extern u64 drbd_rb_expected_ns(const struct drbd_rb_estimate *e);
 
 /* this is in drbd_main.c */
 extern void drbd_restart_request(struct drbd_request *req);
@@ -50,38 +50,42 @@ static unsigned long get_work_bits(const unsigned long mask, unsigned long *flag
  *
  */
 
-struct mutex resources_mutex;
+DEFINE_MUTEX(resources_mutex);
 
-/* used for synchronous meta data and bitmap IO
- * submitted by drbd_md_sync_page_io()
+/* used for meta data IO
+ * submitted by drbd_md_submit_page_io()
  */
 void drbd_md_endio(struct bio *bio)
 {
-	struct drbd_device *device;
+	struct drbd_md_io *md_io = bio->bi_private;
+	struct drbd_device *device = md_io->device;
+	void (*end_io)(struct drbd_md_io *) = md_io->end_io;
 
 	blk_status_t status = bio->bi_status;
 
-	device = bio->bi_private;
-	device->md_io.error = blk_status_to_errno(status);
+	md_io->error = blk_status_to_errno(status);
 
 	/* special case: drbd_md_read() during drbd_adm_attach() */
 	if (device->ldev)
 		put_ldev(device);
 	bio_put(bio);
 
-	/* We grabbed an extra reference in _drbd_md_sync_page_io() to be able
+	/* We grabbed an extra reference in drbd_md_submit_page_io() to be able
 	 * to timeout on the lower level device, and eventually detach from it.
 	 * If this io completion runs after that timeout expired, this
-	 * drbd_md_put_buffer() may allow us to finally try and re-attach.
+	 * __drbd_md_put_buffer() may allow us to finally try and re-attach.
 	 * During normal operation, this only puts that extra reference
 	 * down to 1 again.
 	 * Make sure we first drop the reference, and only then signal
 	 * completion, or we may (in drbd_al_read_log()) cycle so fast into the
 	 * next drbd_md_sync_page_io(), that we trigger the
-	 * ASSERT(atomic_read(&mdev->md_io_in_use) == 1) there.
+	 * ASSERT(atomic_read(&md_io->in_use) == 1) there.
+	 * end_io was sampled above, a waiter may reuse md_io once done is set.
 	 */
-	drbd_md_put_buffer(device);
-	device->md_io.done = 1;
+	__drbd_md_put_buffer(md_io);
+	md_io->done = 1;
+	if (end_io)
+		end_io(md_io);
 	wake_up(&device->misc_wait);
 }
 
@@ -685,6 +689,8 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 	int align;
 	int i;
 	int discard_granularity = 0;
+	unsigned int bm_block_shift;
+	unsigned long bm_block_bits;
 
 	if (unlikely(cancel))
 		return 0;
@@ -719,7 +725,13 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 		rcu_read_unlock();
 	}
 
+	/* With a coarse bitmap, one bit is only cleared if a single resync
+	 * request covers all of it; so that is our minimum request size. */
+	bm_block_shift = device->bitmap->bm_block_shift;
+	bm_block_bits = 1UL << (bm_block_shift - BM_BLOCK_SHIFT);
+
 	max_bio_size = queue_max_hw_sectors(device->rq_queue) << 9;
+	max_bio_size = max(max_bio_size, 1 << bm_block_shift);
 	number = drbd_rs_number_requests(peer_device);
 	/* don't let rs_sectors_came_in() re-schedule us "early"
 	 * just because the first reply came "fast", ... */
@@ -747,13 +759,14 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 			goto request_done;
 
 next_sector:
-		size = BM_BLOCK_SIZE;
+		size = 1 << bm_block_shift;
 		bit  = drbd_bm_find_next(peer_device, peer_device->resync_next_bit);
 
 		if (bit == DRBD_END_OF_BITMAP) {
 			peer_device->resync_next_bit = drbd_bm_bits(device);
 			goto request_done;
 		}
+		bit &= ~(bm_block_bits - 1);
 
 		sector = BM_BIT_TO_SECT(bit);
 
@@ -763,10 +776,11 @@ next_sector:
 		}
 
 		if (unlikely(drbd_bm_test_bit(peer_device, bit) == 0)) {
-			peer_device->resync_next_bit = bit + 1;
+			peer_device->resync_next_bit = bit + bm_block_bits;
 			drbd_rs_complete_io(peer_device, sector);
 			goto next_sector;
 		}
+		bit += bm_block_bits - 1;
 
 		/* try to find some adjacent bits.
 		 * we stop if we have already the maximum req size.
@@ -774,10 +788,11 @@ next_sector:
 		 * Additionally always align bigger requests, in order to
 		 * be prepared for all stripe sizes of software RAIDs.
 		 */
-		align = 1;
+		align = bm_block_shift - BM_BLOCK_SHIFT + 1;
 		rollback_i = i;
-		while (i + 1 < number) {
-			if (size + BM_BLOCK_SIZE > max_bio_size)
+		i += bm_block_bits - 1;
+		while (i + bm_block_bits < number) {
+			if (size + (1 << bm_block_shift) > max_bio_size)
 				break;
 
 			/* Be always aligned */
@@ -797,11 +812,11 @@ next_sector:
 			 * adjustment below */
 			if (drbd_bm_test_bit(peer_device, bit + 1) != 1)
 				break;
-			bit++;
-			size += BM_BLOCK_SIZE;
+			bit += bm_block_bits;
+			size += 1 << bm_block_shift;
 			if ((BM_BLOCK_SIZE << align) <= size)
 				align++;
-			i++;
+			i += bm_block_bits;
 		}
 		/* set the offset to start the next drbd_bm_find_next from */
 		peer_device->resync_next_bit = bit + 1;
@@ -1400,28 +1415,8 @@ int w_e_end_data_req(struct drbd_work *w, int cancel)
 }
 
 static bool all_zero(struct drbd_peer_request *peer_req)
-/* kmap compat: KM_USER1 */
 {
-	struct page *page = peer_req->page_chain.head;
-	unsigned int len = peer_req->i.size;
-
-	page_chain_for_each(page) {
-		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
-		unsigned int i, words = l / sizeof(long);
-		unsigned long *d;
-
-		d = kmap_atomic(page);
-		for (i = 0; i < words; i++) {
-			if (d[i]) {
-				kunmap_atomic(d);
-				return false;
-			}
-		}
-		kunmap_atomic(d);
-		len -= l;
-	}
-
-	return true;
+	return drbd_pages_all_zero(peer_req->page_chain.head, peer_req->i.size);
 }
 
 /**
@@ -2247,8 +2242,11 @@ static void update_on_disk_bitmap(struct drbd_peer_device *peer_device, bool res
 		} else
 			resync_done = is_sync_state(peer_device, NOW);
 	}
-	if (resync_done)
+	if (resync_done) {
+		/* give back the bitmap pages the resync cleared */
+		drbd_bm_compact(device);
 		drbd_resync_finished(peer_device, D_MASK);
+	}
 
 	/* update timestamp, in case it took a while to write out stuff */
 	peer_device->rs_last_writeout = jiffies;
@@ -2320,8 +2318,8 @@ static void go_diskless(struct drbd_device *device)
 
 static int do_md_sync(struct drbd_device *device)
 {
-	drbd_warn(device, "md_sync_timer expired! Worker calls drbd_md_sync().\n");
-	drbd_md_sync(device);
+	drbd_warn(device, "md_sync_timer expired! Worker writes the super block.\n");
+	drbd_md_sync_async(device);
 	return 0;
 }
 
@@ -2473,7 +2471,9 @@ static void do_peer_device_work(struct drbd_peer_device *peer_device, const unsi
 }
 
 #define DRBD_RESOURCE_WORK_MASK	\
-	(1UL << TRY_BECOME_UP_TO_DATE)
+	((1UL << TRY_BECOME_UP_TO_DATE)	\
+	|(1UL << PUSH_STATISTICS)	\
+	)
 
 #define DRBD_DEVICE_WORK_MASK	\
 	((1UL << GO_DISKLESS)	\
@@ -2555,6 +2555,8 @@ static void do_unqueued_resource_work(struct drbd_resource *resource)
 
 	if (test_bit(TRY_BECOME_UP_TO_DATE, &todo))
 		try_become_up_to_date(resource);
+	if (test_bit(PUSH_STATISTICS, &todo))
+		drbd_push_statistics(resource);
 }
 
 static bool dequeue_work_batch(struct drbd_work_queue *queue, struct list_head *work_list)
@@ -2792,6 +2794,16 @@ static void wait_for_sender_todo(struct drbd_connection *connection)
 		drbd_uncork(connection, DATA_STREAM);
 }
 
+/* The next request waits for its payload from the replication journal,
+ * see drbd_journal_claim() */
+static void wait_for_journal_read(struct drbd_connection *connection)
+{
+	wait_event_interruptible(connection->sender_work.q_wait,
+		!test_bit(CONN_JOURNAL_READ_WAIT, &connection->flags) ||
+		!list_empty_careful(&connection->sender_work.q) ||
+		get_t_state(&connection->sender) != RUNNING);
+}
+
 static void re_init_if_first_write(struct drbd_connection *connection, unsigned int epoch)
 {
 	if (!connection->send.seen_any_write_yet) {
@@ -2857,6 +2869,69 @@ static bool is_write_in_flight(struct drbd_peer_device *peer_device, struct drbd
 	return in_flight;
 }
 
+/* Whether writes to this peer may go out as P_DATA_MERGED at all */
+static bool may_merge_writes(struct drbd_connection *connection)
+{
+	struct net_conf *nc;
+	bool ok;
+
+	if (READ_ONCE(drbd_merge_writes) < 2 ||
+	    !(connection->agreed_features & DRBD_FF_MERGED_DATA) ||
+	    connection->agreed_pro_version < 110 ||
+	    connection->integrity_tfm || READ_ONCE(connection->compress.tx_tfm))
+		return false;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->transport.net_conf);
+	ok = nc && !nc->two_primaries;
+	rcu_read_unlock();
+
+	return ok;
+}
+
+static bool is_mergeable_write(struct drbd_request *req)
+{
+	struct bio *bio = req->master_bio;
+
+	return bio_op(bio) == REQ_OP_WRITE && req->i.size &&
+		!(bio->bi_opf & (REQ_FUA | REQ_PREFLUSH));
+}
+
+/* Collects the writes queued right behind reqs[0] that continue it on disk
+ * and in dagtag order, for one P_DATA_MERGED.  Only takes what is already
+ * queued, merging never delays a write.  Returns the number of requests
+ * in reqs[], reqs[0] included.  Holds req_lock. */
+static unsigned int collect_merge_writes(struct drbd_peer_device *peer_device,
+					 struct drbd_request **reqs)
+{
+	const unsigned mask = RQ_EXP_BARR_ACK | RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK;
+	unsigned int max = min_t(unsigned int, READ_ONCE(drbd_merge_writes), DRBD_MERGE_MAX);
+	struct drbd_request *req = reqs[0], *prev = req, *next;
+	unsigned s = drbd_req_state_by_peer_device(req, peer_device) & mask;
+	unsigned int size = req->i.size;
+	unsigned int n = 1;
+
+	/* journaled payloads are sent one by one, from the journal */
+	if (!is_mergeable_write(req) || READ_ONCE(peer_device->connection->journal_next))
+		return 1;
+
+	while (n < max) {
+		next = __next_request_for_connection(peer_device->connection, prev);
+		if (!next || next->device != req->device || next->epoch != req->epoch ||
+		    !is_mergeable_write(next) ||
+		    (drbd_req_state_by_peer_device(next, peer_device) & mask) != s ||
+		    (next->master_bio->bi_opf & REQ_SYNC) != (req->master_bio->bi_opf & REQ_SYNC) ||
+		    next->i.sector != prev->i.sector + (prev->i.size >> 9) ||
+		    next->dagtag_sector - (next->i.size >> 9) != prev->dagtag_sector ||
+		    size + next->i.size > DRBD_MAX_BIO_SIZE)
+			break;
+		reqs[n++] = next;
+		size += next->i.size;
+		prev = next;
+	}
+	return n;
+}
+
 static int process_one_request(struct drbd_connection *connection)
 {
 	struct bio_and_error m;
@@ -2866,6 +2941,9 @@ static int process_one_request(struct drbd_connection *connection)
 			conn_peer_device(connection, device->vnr);
 	unsigned s = drbd_req_state_by_peer_device(req, peer_device);
 	bool do_send_unplug = req->local_rq_state & RQ_UNPLUG;
+	struct drbd_request *reqs[DRBD_MERGE_MAX] = { req };
+	struct drbd_journal_entry *je = NULL;
+	unsigned int n = 1, i;
 	int err = 0;
 	enum drbd_req_event what;
 
@@ -2879,13 +2957,33 @@ static int process_one_request(struct drbd_connection *connection)
 			u64 current_dagtag_sector =
 				req->dagtag_sector - (req->i.size >> 9);
 
+			je = drbd_journal_claim(peer_device, req);
+			if (je == ERR_PTR(-EAGAIN)) {
+				/* its payload is still read back from the journal;
+				 * process work items meanwhile */
+				spin_lock_irq(&connection->resource->req_lock);
+				check_sender_todo(connection);
+				spin_unlock_irq(&connection->resource->req_lock);
+				return 0;
+			}
+			if (!je && may_merge_writes(connection)) {
+				spin_lock_irq(&connection->resource->req_lock);
+				n = collect_merge_writes(peer_device, reqs);
+				spin_unlock_irq(&connection->resource->req_lock);
+			}
+			for (i = 1; i < n; i++) {
+				reqs[i]->pre_send_jif[peer_device->node_id] = jiffies;
+				ktime_get_accounting(reqs[i]->pre_send_kt[peer_device->node_id]);
+				do_send_unplug |= reqs[i]->local_rq_state & RQ_UNPLUG;
+			}
+
 			re_init_if_first_write(connection, req->epoch);
 			maybe_send_barrier(connection, req->epoch);
 			if (current_dagtag_sector != connection->send.current_dagtag_sector)
 				drbd_send_dagtag(connection, current_dagtag_sector);
 
-			connection->send.current_epoch_writes++;
-			connection->send.current_dagtag_sector = req->dagtag_sector;
+			connection->send.current_epoch_writes += n;
+			connection->send.current_dagtag_sector = reqs[n - 1]->dagtag_sector;
 
 			if (peer_device->todo.was_ahead) {
 				clear_bit(SEND_STATE_AFTER_AHEAD, &peer_device->flags);
@@ -2893,7 +2991,16 @@ static int process_one_request(struct drbd_connection *connection)
 				drbd_send_current_state(peer_device);
 			}
 
-			err = drbd_send_dblock(peer_device, req);
+			if (IS_ERR(je)) {
+				err = PTR_ERR(je);
+			} else if (je) {
+				/* its master bio may be long gone */
+				err = drbd_send_dblock_bio(peer_device, req, drbd_journal_bio(je));
+				drbd_journal_done(je);
+			} else if (n > 1)
+				err = drbd_send_dblock_merged(peer_device, reqs, n);
+			else
+				err = drbd_send_dblock(peer_device, req);
 			what = err ? SEND_FAILED : HANDED_OVER_TO_NETWORK;
 		} else {
 			/* this time, no connection->send.current_epoch_writes++;
@@ -2947,12 +3054,22 @@ static int process_one_request(struct drbd_connection *connection)
 	} else {
 		maybe_send_barrier(connection, req->epoch);
 		err = drbd_send_drequest(peer_device, P_DATA_REQUEST,
-				req->i.sector, req->i.size, (unsigned long)req);
+				req->i.sector, req->i.size, req->id);
 		what = err ? SEND_FAILED : HANDED_OVER_TO_NETWORK;
 	}
 
 	spin_lock_irq(&connection->resource->req_lock);
-	__req_mod(req, what, peer_device, &m);
+	for (i = 0; i < n - 1; i++) {
+		/* merged; the ones not yet modified are still queued,
+		 * so they stay around while we drop the lock */
+		__req_mod(reqs[i], what, peer_device, &m);
+		if (m.bio) {
+			spin_unlock_irq(&connection->resource->req_lock);
+			complete_master_bio(device, &m);
+			spin_lock_irq(&connection->resource->req_lock);
+		}
+	}
+	__req_mod(reqs[n - 1], what, peer_device, &m);
 
 	/* As we hold the request lock anyways here,
 	 * this is a convenient place to check for new things to do. */
@@ -3038,6 +3155,10 @@ int drbd_sender(struct drbd_thread *thi)
 		    connection->todo.req == NULL) {
 			update_sender_timing_details(connection, wait_for_sender_todo);
 			wait_for_sender_todo(connection);
+		} else if (list_empty(&connection->todo.work_list) &&
+			   test_bit(CONN_JOURNAL_READ_WAIT, &connection->flags)) {
+			update_sender_timing_details(connection, wait_for_journal_read);
+			wait_for_journal_read(connection);
 		}
 
 		if (signal_pending(current)) {
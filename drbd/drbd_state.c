@@ -2002,6 +2002,15 @@ static void sanitize_state(struct drbd_resource *resource)
 			     peer_disk_state[OLD] != D_UNKNOWN))
 				connection->susp_fen[NEW] = true;
 
+			/* Hold IO for a while when the network fails, see drbd_resume_window_ms */
+			if (drbd_resume_window_ms && connection->fencing_policy != FP_STONITH &&
+			    role[NEW] == R_PRIMARY && disk_state[NEW] == D_UP_TO_DATE &&
+			    repl_state[OLD] >= L_ESTABLISHED && repl_state[NEW] < L_ESTABLISHED &&
+			    peer_disk_state[OLD] == D_UP_TO_DATE &&
+			    (cstate[NEW] == C_TIMEOUT || cstate[NEW] == C_BROKEN_PIPE ||
+			     cstate[NEW] == C_NETWORK_FAILURE))
+				connection->susp_fen[NEW] = true;
+
 			/* Pause a SyncSource until it finishes resync as target on other connections */
 			if (repl_state[OLD] != L_SYNC_SOURCE && repl_state[NEW] == L_SYNC_SOURCE &&
 			    is_sync_target_other_c(peer_device))
@@ -3168,6 +3177,34 @@ static bool peer_returns_diskless(struct drbd_peer_device *peer_device,
 	return rv;
 }
 
+/* IO was suspended when the connection got lost, and the peer will not see
+ * the requests of the transfer log: complete them as lost, and start a new
+ * current UUID where that was deferred. */
+static void resume_io_without_peer(struct drbd_connection *connection)
+{
+	struct drbd_resource *resource = connection->resource;
+	struct drbd_peer_device *peer_device;
+	unsigned long irq_flags;
+	int vnr;
+
+	rcu_read_lock();
+	idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
+		struct drbd_device *device = peer_device->device;
+		if (test_and_clear_bit(NEW_CUR_UUID, &device->flags)) {
+			kref_get(&device->kref);
+			rcu_read_unlock();
+			drbd_uuid_new_current(device, false);
+			kref_put(&device->kref, drbd_destroy_device);
+			rcu_read_lock();
+		}
+	}
+	rcu_read_unlock();
+	begin_state_change(resource, &irq_flags, CS_VERBOSE);
+	_tl_walk(connection, CONNECTION_LOST_WHILE_PENDING);
+	__change_io_susp_fencing(connection, false);
+	end_state_change(resource, &irq_flags);
+}
+
 static void check_may_resume_io_after_fencing(struct drbd_state_change *state_change, int n_connection)
 {
 	struct drbd_connection_state_change *connection_state_change = &state_change->connections[n_connection];
@@ -3193,24 +3230,8 @@ static void check_may_resume_io_after_fencing(struct drbd_state_change *state_ch
 	}
 
 	/* case1: The outdate peer handler is successful: */
-	if (all_peer_disks_outdated) {
-		rcu_read_lock();
-		idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
-			struct drbd_device *device = peer_device->device;
-			if (test_and_clear_bit(NEW_CUR_UUID, &device->flags)) {
-				kref_get(&device->kref);
-				rcu_read_unlock();
-				drbd_uuid_new_current(device, false);
-				kref_put(&device->kref, drbd_destroy_device);
-				rcu_read_lock();
-			}
-		}
-		rcu_read_unlock();
-		begin_state_change(resource, &irq_flags, CS_VERBOSE);
-		_tl_walk(connection, CONNECTION_LOST_WHILE_PENDING);
-		__change_io_susp_fencing(connection, false);
-		end_state_change(resource, &irq_flags);
-	}
+	if (all_peer_disks_outdated)
+		resume_io_without_peer(connection);
 	/* case2: The connection was established again: */
 	if (all_peer_disks_connected) {
 		rcu_read_lock();
@@ -3226,6 +3247,64 @@ static void check_may_resume_io_after_fencing(struct drbd_state_change *state_ch
 	}
 }
 
+/* Called from the resource worker, as is w_resume_window_expired().  A timer
+ * still pending, or having fired already, keeps its reference and the work
+ * re-arms it for the new end of the window. */
+static void arm_resume_window(struct drbd_connection *connection)
+{
+	connection->resume_window_end = jiffies + msecs_to_jiffies(drbd_resume_window_ms);
+	if (timer_pending(&connection->resume_window_timer) ||
+	    !list_empty(&connection->resume_window_work.list))
+		return;
+
+	kref_get(&connection->kref);
+	kref_debug_get(&connection->kref_debug, 17);
+	mod_timer(&connection->resume_window_timer, connection->resume_window_end);
+}
+
+void resume_window_timer_fn(struct timer_list *t)
+{
+	struct drbd_connection *connection = from_timer(connection, t, resume_window_timer);
+
+	drbd_queue_work(&connection->resource->work, &connection->resume_window_work);
+}
+
+/* The peer did not come back in time.  Do what peer_device_disconnected()
+ * skipped while IO was suspended, as after a successful fence-peer. */
+int w_resume_window_expired(struct drbd_work *w, int cancel)
+{
+	struct drbd_connection *connection =
+		container_of(w, struct drbd_connection, resume_window_work);
+
+	if (cancel)
+		goto out_put;
+
+	if (time_before(jiffies, connection->resume_window_end)) {
+		mod_timer(&connection->resume_window_timer, connection->resume_window_end);
+		return 0; /* Keep the reference */
+	}
+
+	if (!connection->susp_fen[NOW] || connection->fencing_policy == FP_STONITH)
+		goto out_put;
+
+	/* Connected, but the handshake is not done.  Should it fail, there
+	 * will be no new rising edge of susp_fen to arm the window again. */
+	if (connection->cstate[NOW] >= C_CONNECTED) {
+		connection->resume_window_end = jiffies + msecs_to_jiffies(drbd_resume_window_ms);
+		mod_timer(&connection->resume_window_timer, connection->resume_window_end);
+		return 0; /* Keep the reference */
+	}
+
+	drbd_info(connection, "No reconnect within %ums, resuming IO without the peer\n",
+		  drbd_resume_window_ms);
+	resume_io_without_peer(connection);
+
+out_put:
+	kref_debug_put(&connection->kref_debug, 17);
+	kref_put(&connection->kref, drbd_destroy_connection);
+	return 0;
+}
+
 
 /*
  * Perform after state change actions that may sleep.
@@ -3716,6 +3795,10 @@ static int w_after_state_change(struct drbd_work *w, int unused)
 		if (cstate[OLD] == C_STANDALONE && cstate[NEW] == C_UNCONNECTED)
 			drbd_thread_start(&connection->receiver);
 
+		if (!susp_fen[OLD] && susp_fen[NEW] && drbd_resume_window_ms &&
+		    connection->fencing_policy != FP_STONITH)
+			arm_resume_window(connection);
+
 		if (susp_fen[NEW])
 			check_may_resume_io_after_fencing(state_change, n_connection);
 
@@ -4472,7 +4555,7 @@ change_cluster_wide_state(bool (*change)(struct change_context *, enum change_ph
 	if (context->flags & CS_INHIBIT_MD_IO) {
 		struct drbd_device *device =
 			container_of(context, struct change_disk_state_context, context)->device;
-		drbd_md_get_buffer(device, __func__);
+		drbd_md_get_buffer_exclusive(device, __func__);
 	}
 
 	end_remote_state_change(resource, &irq_flags, context->flags | CS_TWOPC);
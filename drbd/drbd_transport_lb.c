@@ -0,0 +1,895 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_transport_lb.c
+
+   This file is part of DRBD.
+
+   Loopback transport: connects DRBD nodes within one kernel, no matter
+   in which network namespace their resources live.  The configured path
+   addresses only serve as rendezvous names, the node with my-addr A and
+   peer-addr B pairs with the one with my-addr B and peer-addr A.
+
+   Each stream and direction is a single producer, single consumer ring
+   of page references, the receiver copies out of the sender's pages.
+   Artificial latency and a bandwidth limit can be set as module
+   parameters, to benchmark the replication engine apart from the
+   network stack on one box.
+*/
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/hrtimer.h>
+#include <linux/sched/signal.h>
+#include <linux/drbd_genl_api.h>
+#include <linux/drbd_config.h>
+#include <drbd_protocol.h>
+#include <drbd_transport.h>
+#include "drbd_wrappers.h"
+
+
+MODULE_AUTHOR("Philipp Reisner <philipp.reisner@linbit.com>");
+MODULE_AUTHOR("Lars Ellenberg <lars.ellenberg@linbit.com>");
+MODULE_DESCRIPTION("Loopback transport layer for DRBD, for single host benchmarks");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(REL_VERSION);
+
+static unsigned int dlb_latency_us;
+MODULE_PARM_DESC(latency_us, "One-way delay added to every message, in microseconds");
+module_param_named(latency_us, dlb_latency_us, uint, 0644);
+
+static unsigned int dlb_bandwidth_kib;
+MODULE_PARM_DESC(bandwidth_kib, "Bandwidth of each direction in KiB/s, 0 = unlimited");
+module_param_named(bandwidth_kib, dlb_bandwidth_kib, uint, 0644);
+
+/* slots per ring, a power of two */
+#define DLB_RING_SIZE 512
+/* queued bytes per ring, unless sndbuf-size says otherwise */
+#define DLB_SNDBUF_DEFAULT (2 << 20)
+
+#define DLB_CONNECTED 1
+
+struct buffer {
+	void *base;
+	void *pos;
+};
+
+struct dlb_seg {
+	struct page *page;	/* holds a reference, until received */
+	unsigned int offset;
+	unsigned int len;
+	u64 deliver_ns;		/* ktime_get_ns(), not before */
+};
+
+struct dlb_pipe {
+	struct dlb_seg ring[DLB_RING_SIZE];
+	unsigned int head;	/* written by the producer only */
+	unsigned int tail;	/* written by the consumer only */
+	unsigned int consumed;	/* of ring[tail], consumer only */
+	atomic_t queued;	/* bytes */
+	bool congested;		/* DATA_STREAM: the sender set NET_CONGESTED */
+	wait_queue_head_t wait;	/* for room, or for data */
+};
+
+struct dlb_link {
+	struct kref kref;
+	bool closed;
+	spinlock_t lock;	/* protects transport[], congested of the pipes */
+	struct drbd_lb_transport *transport[2];	/* per side, while connected */
+	atomic64_t wire_free_ns[2];	/* per side, for the bandwidth limit */
+	struct dlb_pipe pipe[2][2];	/* [sending side][stream] */
+};
+
+struct drbd_lb_transport {
+	struct drbd_transport transport; /* Must be first! */
+	spinlock_t paths_lock;
+	unsigned long flags;
+	struct dlb_link *link;
+	int side;
+	unsigned int sndbuf_size;
+	long sndtimeo;
+	long rcvtimeo[2];
+	wait_queue_head_t connect_wait;
+	struct buffer rbuf[2];
+};
+
+struct dlb_path {
+	struct drbd_path path;
+
+	struct list_head waiting; /* on dlb_waiting, while connecting */
+	struct drbd_lb_transport *lb_transport;
+};
+
+/* paths of all transports in dlb_connect(), looking for their peer */
+static LIST_HEAD(dlb_waiting);
+static DEFINE_SPINLOCK(dlb_lock);
+
+static int dlb_init(struct drbd_transport *transport);
+static void dlb_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op);
+static int dlb_connect(struct drbd_transport *transport);
+static int dlb_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags);
+static int dlb_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size);
+static void dlb_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats);
+static void dlb_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout);
+static long dlb_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream);
+static int dlb_send_page(struct drbd_transport *transport, enum drbd_stream, struct page *page,
+		int offset, size_t size, unsigned msg_flags);
+static int dlb_send_zc_bio(struct drbd_transport *, struct bio *bio);
+static bool dlb_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
+static bool dlb_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
+static void dlb_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
+static int dlb_add_path(struct drbd_transport *, struct drbd_path *path);
+static int dlb_remove_path(struct drbd_transport *, struct drbd_path *);
+
+static struct drbd_transport_class lb_transport_class = {
+	.name = "lb",
+	.instance_size = sizeof(struct drbd_lb_transport),
+	.path_instance_size = sizeof(struct dlb_path),
+	.listener_instance_size = sizeof(struct drbd_listener),
+	.module = THIS_MODULE,
+	.init = dlb_init,
+	.list = LIST_HEAD_INIT(lb_transport_class.list),
+};
+
+static struct drbd_transport_ops dlb_ops = {
+	.free = dlb_free,
+	.connect = dlb_connect,
+	.recv = dlb_recv,
+	.recv_pages = dlb_recv_pages,
+	.stats = dlb_stats,
+	.set_rcvtimeo = dlb_set_rcvtimeo,
+	.get_rcvtimeo = dlb_get_rcvtimeo,
+	.send_page = dlb_send_page,
+	.send_zc_bio = dlb_send_zc_bio,
+	.stream_ok = dlb_stream_ok,
+	.hint = dlb_hint,
+	.debugfs_show = dlb_debugfs_show,
+	.add_path = dlb_add_path,
+	.remove_path = dlb_remove_path,
+};
+
+static int dlb_init(struct drbd_transport *transport)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+	enum drbd_stream i;
+
+	spin_lock_init(&lb_transport->paths_lock);
+	init_waitqueue_head(&lb_transport->connect_wait);
+	lb_transport->transport.ops = &dlb_ops;
+	lb_transport->transport.class = &lb_transport_class;
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		void *buffer = (void *)__get_free_page(GFP_KERNEL);
+		if (!buffer)
+			goto fail;
+		lb_transport->rbuf[i].base = buffer;
+		lb_transport->rbuf[i].pos = buffer;
+		lb_transport->rcvtimeo[i] = MAX_SCHEDULE_TIMEOUT;
+	}
+
+	return 0;
+fail:
+	free_page((unsigned long)lb_transport->rbuf[0].base);
+	return -ENOMEM;
+}
+
+static struct dlb_link *dlb_alloc_link(void)
+{
+	struct dlb_link *link;
+	int side, stream;
+
+	link = kvzalloc(sizeof(*link), GFP_KERNEL);
+	if (!link)
+		return NULL;
+
+	kref_init(&link->kref);
+	spin_lock_init(&link->lock);
+	for (side = 0; side < 2; side++) {
+		atomic64_set(&link->wire_free_ns[side], 0);
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++)
+			init_waitqueue_head(&link->pipe[side][stream].wait);
+	}
+	return link;
+}
+
+static void dlb_destroy_link(struct kref *kref)
+{
+	struct dlb_link *link = container_of(kref, struct dlb_link, kref);
+	int side, stream;
+
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			struct dlb_pipe *pipe = &link->pipe[side][stream];
+
+			for (; pipe->tail != pipe->head; pipe->tail++)
+				put_page(pipe->ring[pipe->tail % DLB_RING_SIZE].page);
+		}
+	}
+	kvfree(link);
+}
+
+/* Either side closing ends both directions, like a shut down socket */
+static void dlb_close_link(struct dlb_link *link)
+{
+	int side, stream;
+
+	spin_lock(&link->lock);
+	WRITE_ONCE(link->closed, true);
+	link->transport[0] = NULL;
+	link->transport[1] = NULL;
+	spin_unlock(&link->lock);
+	for (side = 0; side < 2; side++)
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++)
+			wake_up_all(&link->pipe[side][stream].wait);
+}
+
+static void dlb_put_link(struct drbd_lb_transport *lb_transport)
+{
+	struct dlb_link *link = lb_transport->link;
+
+	if (!link)
+		return;
+	lb_transport->link = NULL;
+	kref_put(&link->kref, dlb_destroy_link);
+}
+
+static struct dlb_pipe *dlb_tx_pipe(struct drbd_lb_transport *lb_transport, enum drbd_stream stream)
+{
+	return &lb_transport->link->pipe[lb_transport->side][stream];
+}
+
+static struct dlb_pipe *dlb_rx_pipe(struct drbd_lb_transport *lb_transport, enum drbd_stream stream)
+{
+	return &lb_transport->link->pipe[!lb_transport->side][stream];
+}
+
+static void dlb_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+	struct drbd_path *drbd_path;
+	enum drbd_stream i;
+
+	/* The link itself stays until the next connect, or until the
+	 * transport is destroyed.  Our receiver may still be waiting on it. */
+	clear_bit(DLB_CONNECTED, &lb_transport->flags);
+	if (lb_transport->link)
+		dlb_close_link(lb_transport->link);
+
+	spin_lock(&lb_transport->paths_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		bool was_established = drbd_path->established;
+
+		drbd_path->established = false;
+		if (was_established)
+			drbd_path_event(transport, drbd_path);
+	}
+	spin_unlock(&lb_transport->paths_lock);
+
+	if (free_op == DESTROY_TRANSPORT) {
+		struct drbd_path *tmp;
+
+		dlb_put_link(lb_transport);
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+			free_page((unsigned long)lb_transport->rbuf[i].base);
+			lb_transport->rbuf[i].base = NULL;
+		}
+		spin_lock(&lb_transport->paths_lock);
+		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
+			list_del_init(&drbd_path->list);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+		}
+		spin_unlock(&lb_transport->paths_lock);
+	}
+}
+
+/* When this message is on the wire completely, with the bandwidth limit.
+ * Both streams of a side share the "wire". */
+static u64 dlb_wire_time(struct dlb_link *link, int side, unsigned int len, u64 now)
+{
+	u64 kib = READ_ONCE(dlb_bandwidth_kib);
+	u64 cost, old, new;
+
+	if (!kib)
+		return now;
+
+	cost = div64_u64((u64)len * NSEC_PER_SEC, kib << 10);
+	do {
+		old = atomic64_read(&link->wire_free_ns[side]);
+		new = max(old, now) + cost;
+	} while (atomic64_cmpxchg(&link->wire_free_ns[side], old, new) != old);
+
+	return new;
+}
+
+static bool dlb_pipe_room(struct drbd_lb_transport *lb_transport, struct dlb_pipe *pipe, size_t size)
+{
+	int queued = atomic_read(&pipe->queued);
+
+	/* one message always fits into an empty pipe */
+	return pipe->head - smp_load_acquire(&pipe->tail) < DLB_RING_SIZE &&
+		(!queued || queued + size <= lb_transport->sndbuf_size);
+}
+
+static unsigned int dlb_congested_mark(struct drbd_lb_transport *lb_transport)
+{
+	return lb_transport->sndbuf_size * 4 / 5;
+}
+
+/* NET_CONGESTED is cleared by the receiving side, in dlb_update_uncongested(),
+ * as the write_space callback of a socket would. */
+static void dlb_update_congested(struct drbd_lb_transport *lb_transport)
+{
+	struct dlb_link *link = lb_transport->link;
+	struct dlb_pipe *pipe = dlb_tx_pipe(lb_transport, DATA_STREAM);
+	unsigned int mark = dlb_congested_mark(lb_transport);
+
+	if (atomic_read(&pipe->queued) <= mark ||
+	    test_bit(NET_CONGESTED, &lb_transport->transport.flags))
+		return;
+
+	spin_lock(&link->lock);
+	WRITE_ONCE(pipe->congested, true);
+	/* pairs with smp_mb__after_atomic() in dlb_update_uncongested():
+	 * either the receiver sees pipe->congested, or we see what it
+	 * consumed meanwhile */
+	smp_mb();
+	if (atomic_read(&pipe->queued) > mark)
+		set_bit(NET_CONGESTED, &lb_transport->transport.flags);
+	else
+		WRITE_ONCE(pipe->congested, false);
+	spin_unlock(&link->lock);
+}
+
+/* Called by the receiver after it consumed from the data stream */
+static void dlb_update_uncongested(struct drbd_lb_transport *lb_transport)
+{
+	struct dlb_link *link = lb_transport->link;
+	struct dlb_pipe *pipe = dlb_rx_pipe(lb_transport, DATA_STREAM);
+	struct drbd_lb_transport *sender;
+
+	smp_mb__after_atomic();
+	if (!READ_ONCE(pipe->congested))
+		return;
+
+	spin_lock(&link->lock);
+	sender = link->transport[!lb_transport->side];
+	if (pipe->congested && sender &&
+	    atomic_read(&pipe->queued) <= dlb_congested_mark(sender)) {
+		WRITE_ONCE(pipe->congested, false);
+		clear_bit(NET_CONGESTED, &sender->transport.flags);
+	}
+	spin_unlock(&link->lock);
+}
+
+static int dlb_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+	struct dlb_link *link = lb_transport->link;
+	struct dlb_pipe *pipe;
+	struct dlb_seg *seg;
+	u64 now;
+
+	if (!test_bit(DLB_CONNECTED, &lb_transport->flags))
+		return -ENOTCONN;
+
+	pipe = dlb_tx_pipe(lb_transport, stream);
+	if (stream == DATA_STREAM)
+		dlb_update_congested(lb_transport);
+	while (!dlb_pipe_room(lb_transport, pipe, size)) {
+		long t;
+
+		t = wait_event_interruptible_timeout(pipe->wait,
+				dlb_pipe_room(lb_transport, pipe, size) || READ_ONCE(link->closed),
+				lb_transport->sndtimeo);
+		if (READ_ONCE(link->closed))
+			break;
+		if (t < 0)
+			return t;
+		if (t == 0 && drbd_stream_send_timed_out(transport, stream))
+			return -EAGAIN;
+	}
+	if (READ_ONCE(link->closed))
+		return -ECONNRESET;
+
+	now = ktime_get_ns();
+	seg = &pipe->ring[pipe->head % DLB_RING_SIZE];
+	get_page(page);
+	seg->page = page;
+	seg->offset = offset;
+	seg->len = size;
+	seg->deliver_ns = dlb_wire_time(link, lb_transport->side, size, now) +
+		(u64)READ_ONCE(dlb_latency_us) * NSEC_PER_USEC;
+	atomic_add(size, &pipe->queued);
+	/* publishes the segment to the consumer */
+	smp_store_release(&pipe->head, pipe->head + 1);
+	wake_up(&pipe->wait);
+
+	return 0;
+}
+
+static int dlb_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		int err;
+
+		err = dlb_send_page(transport, DATA_STREAM, bvec.bv_page,
+				    bvec.bv_offset, bvec.bv_len,
+				    bio_iter_last(bvec, iter) ? 0 : MSG_MORE);
+		if (err)
+			return err;
+
+		if (bio_op(bio) == REQ_OP_WRITE_SAME)
+			break;
+	}
+	return 0;
+}
+
+/* The oldest segment, once it is due */
+static struct dlb_seg *dlb_peek(struct dlb_pipe *pipe, u64 *not_before)
+{
+	struct dlb_seg *seg;
+
+	if (smp_load_acquire(&pipe->head) == pipe->tail)
+		return NULL;
+
+	seg = &pipe->ring[pipe->tail % DLB_RING_SIZE];
+	if (seg->deliver_ns > ktime_get_ns()) {
+		*not_before = seg->deliver_ns;
+		return NULL;
+	}
+	return seg;
+}
+
+static bool dlb_readable(struct dlb_pipe *pipe, struct dlb_link *link)
+{
+	return smp_load_acquire(&pipe->head) != pipe->tail || READ_ONCE(link->closed);
+}
+
+/* Sleeps until the oldest segment is due, or a signal arrives */
+static int dlb_wait_due(u64 not_before)
+{
+	ktime_t expires = ns_to_ktime(not_before);
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+	return signal_pending(current) ? -EINTR : 0;
+}
+
+/* Copies up to size bytes, behaves like recvmsg() on a stream socket:
+ * with MSG_WAITALL semantics, unless MSG_DONTWAIT is given, returns a
+ * short count if interrupted, 0 once the peer closed the link. */
+static int dlb_recv_short(struct drbd_lb_transport *lb_transport, enum drbd_stream stream,
+			  void *buf, size_t size, int flags)
+{
+	struct dlb_link *link = lb_transport->link;
+	struct dlb_pipe *pipe = dlb_rx_pipe(lb_transport, stream);
+	long timeo = lb_transport->rcvtimeo[stream];
+	size_t received = 0;
+	int err = 0;
+
+	while (received < size) {
+		struct dlb_seg *seg;
+		u64 not_before = 0;
+		unsigned int len;
+		void *src;
+
+		seg = dlb_peek(pipe, &not_before);
+		if (!seg) {
+			if (not_before) {
+				err = dlb_wait_due(not_before);
+				if (err)
+					break;
+				continue;
+			}
+			if (READ_ONCE(link->closed))
+				break;
+			if (flags & MSG_DONTWAIT) {
+				err = -EAGAIN;
+				break;
+			}
+			timeo = wait_event_interruptible_timeout(pipe->wait,
+					dlb_readable(pipe, link), timeo);
+			if (timeo < 0) {
+				err = -EINTR;
+				break;
+			}
+			if (timeo == 0) {
+				err = -EAGAIN;
+				break;
+			}
+			continue;
+		}
+
+		len = min_t(size_t, seg->len - pipe->consumed, size - received);
+		src = kmap_atomic(seg->page);
+		memcpy(buf + received, src + seg->offset + pipe->consumed, len);
+		kunmap_atomic(src);
+		received += len;
+		pipe->consumed += len;
+		if (pipe->consumed < seg->len)
+			continue;
+
+		put_page(seg->page);
+		pipe->consumed = 0;
+		atomic_sub(seg->len, &pipe->queued);
+		smp_store_release(&pipe->tail, pipe->tail + 1);
+		if (stream == DATA_STREAM)
+			dlb_update_uncongested(lb_transport);
+		wake_up(&pipe->wait);
+	}
+
+	return received ?: err;
+}
+
+static int dlb_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+	void *buffer;
+	int rv;
+
+	if (!lb_transport->link)
+		return -ENOTCONN;
+
+	if (flags & CALLER_BUFFER) {
+		buffer = *buf;
+		rv = dlb_recv_short(lb_transport, stream, buffer, size, flags & ~CALLER_BUFFER);
+	} else if (flags & GROW_BUFFER) {
+		TR_ASSERT(transport, *buf == lb_transport->rbuf[stream].base);
+		buffer = lb_transport->rbuf[stream].pos;
+		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
+
+		rv = dlb_recv_short(lb_transport, stream, buffer, size, flags & ~GROW_BUFFER);
+	} else {
+		buffer = lb_transport->rbuf[stream].base;
+
+		rv = dlb_recv_short(lb_transport, stream, buffer, size, flags);
+		if (rv > 0)
+			*buf = buffer;
+	}
+
+	if (rv > 0)
+		lb_transport->rbuf[stream].pos = buffer + rv;
+
+	return rv;
+}
+
+static int dlb_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+	struct page *page;
+	int err;
+
+	if (!lb_transport->link)
+		return -ENOTCONN;
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	page_chain_for_each(page) {
+		size_t len = min_t(int, size, PAGE_SIZE);
+		void *data = kmap(page);
+		err = dlb_recv_short(lb_transport, DATA_STREAM, data, len, 0);
+		kunmap(page);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		if (err != (int)len) {
+			if (err >= 0)
+				err = -EIO;
+			goto fail;
+		}
+		size -= len;
+	}
+	return 0;
+fail:
+	drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
+static void dlb_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+
+	if (test_bit(DLB_CONNECTED, &lb_transport->flags)) {
+		stats->unread_received = atomic_read(&dlb_rx_pipe(lb_transport, DATA_STREAM)->queued);
+		stats->unacked_send = atomic_read(&dlb_tx_pipe(lb_transport, DATA_STREAM)->queued);
+		stats->send_buffer_size = lb_transport->sndbuf_size;
+		stats->send_buffer_used = stats->unacked_send;
+	}
+}
+
+static bool dlb_path_match(struct dlb_path *path, struct dlb_path *peer)
+{
+	struct drbd_path *a = &path->path, *b = &peer->path;
+
+	return a->my_addr_len == b->peer_addr_len && a->peer_addr_len == b->my_addr_len &&
+		!memcmp(&a->my_addr, &b->peer_addr, a->my_addr_len) &&
+		!memcmp(&a->peer_addr, &b->my_addr, a->peer_addr_len);
+}
+
+/* Called with dlb_lock held */
+static void dlb_unpublish_paths(struct drbd_lb_transport *lb_transport)
+{
+	struct drbd_path *drbd_path;
+
+	spin_lock(&lb_transport->paths_lock);
+	list_for_each_entry(drbd_path, &lb_transport->transport.paths, list) {
+		struct dlb_path *path = container_of(drbd_path, struct dlb_path, path);
+
+		list_del_init(&path->waiting);
+	}
+	spin_unlock(&lb_transport->paths_lock);
+}
+
+/* Called with dlb_lock held.  Pairs with a waiting peer and wakes it, or
+ * publishes the own paths.  Returns the established path, if paired. */
+static struct dlb_path *dlb_pair_or_publish(struct drbd_lb_transport *lb_transport,
+					    struct dlb_link *link)
+{
+	struct drbd_transport *transport = &lb_transport->transport;
+	struct drbd_lb_transport *peer_transport = NULL;
+	struct drbd_path *drbd_path;
+	struct dlb_path *found = NULL, *peer;
+
+	spin_lock(&lb_transport->paths_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		struct dlb_path *path = container_of(drbd_path, struct dlb_path, path);
+
+		list_for_each_entry(peer, &dlb_waiting, waiting) {
+			if (peer->lb_transport != lb_transport && dlb_path_match(path, peer)) {
+				peer_transport = peer->lb_transport;
+				found = path;
+				break;
+			}
+		}
+		if (found)
+			break;
+	}
+	if (!found) {
+		list_for_each_entry(drbd_path, &transport->paths, list) {
+			struct dlb_path *path = container_of(drbd_path, struct dlb_path, path);
+
+			list_add_tail(&path->waiting, &dlb_waiting);
+		}
+	}
+	spin_unlock(&lb_transport->paths_lock);
+
+	if (found) {
+		/* the waiting side resolves conflicts, as the
+		 * accepting side of the meta socket does with tcp */
+		set_bit(RESOLVE_CONFLICTS, &peer_transport->transport.flags);
+		clear_bit(RESOLVE_CONFLICTS, &transport->flags);
+		dlb_unpublish_paths(peer_transport);
+		peer->path.established = true;
+		kref_get(&link->kref); /* one for each side */
+		lb_transport->side = 0;
+		lb_transport->link = link;
+		peer_transport->side = 1;
+		WRITE_ONCE(peer_transport->link, link);
+		wake_up(&peer_transport->connect_wait);
+	}
+	return found;
+}
+
+static int dlb_connect(struct drbd_transport *transport)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+	struct drbd_path *drbd_path;
+	struct dlb_path *path;
+	struct dlb_link *link;
+	struct net_conf *nc;
+	int connect_int, timeout, sndbuf_size;
+
+	/* whatever the last connection left behind */
+	dlb_put_link(lb_transport);
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -EIO;
+	}
+	connect_int = nc->connect_int;
+	timeout = nc->timeout;
+	sndbuf_size = nc->sndbuf_size;
+	rcu_read_unlock();
+
+	if (list_empty(&transport->paths))
+		return -EDESTADDRREQ;
+
+	link = dlb_alloc_link();
+	if (!link)
+		return -ENOMEM;
+
+	spin_lock(&dlb_lock);
+	path = dlb_pair_or_publish(lb_transport, link);
+	spin_unlock(&dlb_lock);
+
+	if (!path) {
+		/* unused, the peer brings its own */
+		kref_put(&link->kref, dlb_destroy_link);
+
+		wait_event_interruptible_timeout(lb_transport->connect_wait,
+				READ_ONCE(lb_transport->link), connect_int * HZ);
+
+		/* once unpublished, nobody pairs with us any more */
+		spin_lock(&dlb_lock);
+		dlb_unpublish_paths(lb_transport);
+		spin_unlock(&dlb_lock);
+
+		if (!lb_transport->link || drbd_should_abort_listening(transport)) {
+			if (lb_transport->link) {
+				dlb_close_link(lb_transport->link);
+				dlb_put_link(lb_transport);
+			}
+			return -EAGAIN;
+		}
+
+		spin_lock(&lb_transport->paths_lock);
+		list_for_each_entry(drbd_path, &transport->paths, list) {
+			if (drbd_path->established) {
+				path = container_of(drbd_path, struct dlb_path, path);
+				break;
+			}
+		}
+		spin_unlock(&lb_transport->paths_lock);
+		if (!path) {
+			/* the peer paired with a path removed meanwhile */
+			dlb_close_link(lb_transport->link);
+			dlb_put_link(lb_transport);
+			return -EAGAIN;
+		}
+	}
+
+	lb_transport->sndbuf_size = sndbuf_size ?: DLB_SNDBUF_DEFAULT;
+	lb_transport->sndtimeo = timeout * HZ / 10;
+	lb_transport->rcvtimeo[DATA_STREAM] = MAX_SCHEDULE_TIMEOUT;
+	lb_transport->rcvtimeo[CONTROL_STREAM] = MAX_SCHEDULE_TIMEOUT;
+	lb_transport->rbuf[DATA_STREAM].pos = lb_transport->rbuf[DATA_STREAM].base;
+	lb_transport->rbuf[CONTROL_STREAM].pos = lb_transport->rbuf[CONTROL_STREAM].base;
+	clear_bit(NET_CONGESTED, &transport->flags);
+
+	link = lb_transport->link;
+	spin_lock(&link->lock);
+	if (!link->closed)
+		link->transport[lb_transport->side] = lb_transport;
+	spin_unlock(&link->lock);
+	set_bit(DLB_CONNECTED, &lb_transport->flags);
+
+	path->path.established = true;
+	drbd_path_event(transport, &path->path);
+
+	return 0;
+}
+
+static void dlb_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+
+	lb_transport->rcvtimeo[stream] = timeout;
+}
+
+static long dlb_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+
+	if (!test_bit(DLB_CONNECTED, &lb_transport->flags))
+		return -ENOTCONN;
+
+	return lb_transport->rcvtimeo[stream];
+}
+
+static bool dlb_stream_ok(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+
+	return test_bit(DLB_CONNECTED, &lb_transport->flags);
+}
+
+static bool dlb_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+
+	if (!test_bit(DLB_CONNECTED, &lb_transport->flags))
+		return false;
+
+	/* CORK, NODELAY, QUICKACK and friends have no meaning here */
+	return true;
+}
+
+static void dlb_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+	enum drbd_stream i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "latency: %u us\n", READ_ONCE(dlb_latency_us));
+	seq_printf(m, "bandwidth: %u KiB/s\n\n", READ_ONCE(dlb_bandwidth_kib));
+
+	if (!test_bit(DLB_CONNECTED, &lb_transport->flags))
+		return;
+
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		struct dlb_pipe *rx = dlb_rx_pipe(lb_transport, i);
+		struct dlb_pipe *tx = dlb_tx_pipe(lb_transport, i);
+
+		seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
+		seq_printf(m, "unread receive buffer: %u Byte\n", atomic_read(&rx->queued));
+		seq_printf(m, "unread send buffer: %u Byte\n", atomic_read(&tx->queued));
+		seq_printf(m, "send buffer size: %u Byte\n", lb_transport->sndbuf_size);
+		seq_printf(m, "send ring slots used: %u of %u\n",
+			   READ_ONCE(tx->head) - READ_ONCE(tx->tail), DLB_RING_SIZE);
+	}
+}
+
+static int dlb_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+	struct dlb_path *path = container_of(drbd_path, struct dlb_path, path);
+
+	drbd_path->established = false;
+	INIT_LIST_HEAD(&path->waiting);
+	path->lb_transport = lb_transport;
+
+	/* visible to peers with the next dlb_connect() */
+	spin_lock(&lb_transport->paths_lock);
+	list_add_tail(&drbd_path->list, &transport->paths);
+	spin_unlock(&lb_transport->paths_lock);
+
+	return 0;
+}
+
+static int dlb_remove_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_lb_transport *lb_transport =
+		container_of(transport, struct drbd_lb_transport, transport);
+	struct dlb_path *path = container_of(drbd_path, struct dlb_path, path);
+
+	spin_lock(&dlb_lock);
+	if (drbd_path->established) {
+		spin_unlock(&dlb_lock);
+		return -EBUSY;
+	}
+	list_del_init(&path->waiting);
+	spin_lock(&lb_transport->paths_lock);
+	list_del_init(&drbd_path->list);
+	spin_unlock(&lb_transport->paths_lock);
+	spin_unlock(&dlb_lock);
+
+	return 0;
+}
+
+static int __init dlb_initialize(void)
+{
+	return drbd_register_transport_class(&lb_transport_class,
+					     DRBD_TRANSPORT_API_VERSION,
+					     sizeof(struct drbd_transport));
+}
+
+static void __exit dlb_cleanup(void)
+{
+	drbd_unregister_transport_class(&lb_transport_class);
+}
+
+module_init(dlb_initialize)
+module_exit(dlb_cleanup)
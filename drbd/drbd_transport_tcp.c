@@ -16,6 +16,9 @@
 #include <linux/sched/signal.h>
 #include <linux/net.h>
 #include <linux/tcp.h>
+#include <linux/netdevice.h>
+#include <net/dst.h>
+#include <net/tcp.h>
 #include <linux/highmem.h>
 #include <linux/drbd_genl_api.h>
 #include <linux/drbd_config.h>
@@ -31,6 +34,13 @@ MODULE_DESCRIPTION("TCP (SDP, SSOCKS) transport layer for DRBD");
 MODULE_LICENSE("GPL");
 MODULE_VERSION(REL_VERSION);
 
+/* Size the data stream's socket buffers from the measured bandwidth delay
+ * product, up to this limit.  The sndbuf-size and rcvbuf-size of the
+ * connection are the lower limit then. */
+static unsigned int dtt_autotune_max_kb;
+MODULE_PARM_DESC(autotune_max_kb, "Auto-tune data socket buffers up to this size (0 = off)");
+module_param_named(autotune_max_kb, dtt_autotune_max_kb, uint, 0644);
+
 struct buffer {
 	void *base;
 	void *pos;
@@ -44,8 +54,18 @@ struct drbd_tcp_transport {
 	unsigned long flags;
 	struct socket *stream[2];
 	struct buffer rbuf[2];
+	struct list_head established; /* on dtt_established while connected */
+
+	/* see dtt_autotune() */
+	unsigned long autotune_jif;
+	u32 autotune_rtt_us;
+	u64 autotune_rate; /* bytes per second */
 };
 
+/* Connected transports, for dtt_netdev_event() */
+static LIST_HEAD(dtt_established);
+static DEFINE_MUTEX(dtt_established_mutex);
+
 struct dtt_listener {
 	struct drbd_listener listener;
 	void (*original_sk_state_change)(struct sock *sk);
@@ -67,6 +87,22 @@ struct dtt_path {
 	struct drbd_path path;
 
 	struct list_head sockets; /* sockets passed to me by other receiver threads */
+
+	/* connect statistics, shown in debugfs */
+	unsigned int connects, connect_failures;
+	unsigned int connect_ms;	/* last outgoing connect until TCP established */
+	unsigned int handshake_ms;	/* last first socket until both streams were up */
+};
+
+/* Outgoing connects on all paths at once, see dtt_probe_paths() */
+struct dtt_probe {
+	wait_queue_head_t wait; /* woken if one of the sockets changed state */
+	void (*original_sk_state_change)(struct sock *sk);
+	unsigned int nr;
+	struct {
+		struct dtt_path *path; /* holds a reference */
+		struct socket *socket;
+	} s[];
 };
 
 static int dtt_init(struct drbd_transport *transport);
@@ -84,6 +120,7 @@ static bool dtt_stream_ok(struct drbd_transport *transport, enum drbd_stream str
 static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
 static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
 static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport);
+static void dtt_autotune(struct drbd_tcp_transport *tcp_transport);
 static int dtt_add_path(struct drbd_transport *, struct drbd_path *path);
 static int dtt_remove_path(struct drbd_transport *, struct drbd_path *);
 
@@ -159,6 +196,7 @@ static int dtt_init(struct drbd_transport *transport)
 	enum drbd_stream i;
 
 	spin_lock_init(&tcp_transport->paths_lock);
+	INIT_LIST_HEAD(&tcp_transport->established);
 	tcp_transport->transport.ops = &dtt_ops;
 	tcp_transport->transport.class = &tcp_transport_class;
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
@@ -193,6 +231,10 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 	/* free the socket specific stuff,
 	 * mutexes are handled by caller */
 
+	mutex_lock(&dtt_established_mutex);
+	list_del_init(&tcp_transport->established);
+	mutex_unlock(&dtt_established_mutex);
+
 	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
 		if (tcp_transport->stream[i]) {
 			dtt_free_one_sock(tcp_transport->stream[i]);
@@ -329,6 +371,7 @@ static int dtt_recv_pages(struct drbd_transport *transport, struct drbd_page_cha
 	if (!socket)
 		return -ENOTCONN;
 
+	dtt_autotune(tcp_transport);
 	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
 	page = chain->head;
 	if (!page)
@@ -392,7 +435,18 @@ static bool dtt_path_cmp_addr(struct dtt_path *path)
 	return memcmp(&drbd_path->my_addr, &drbd_path->peer_addr, addr_size) > 0;
 }
 
-static int dtt_try_connect(struct drbd_transport *transport, struct dtt_path *path, struct socket **ret_socket)
+static void dtt_probe_state_change(struct sock *sock)
+{
+	struct dtt_probe *probe = sock->sk_user_data;
+
+	probe->original_sk_state_change(sock);
+	wake_up(&probe->wait);
+}
+
+/* With a @probe, the connect does not block, the socket is returned while
+ * still connecting, see dtt_probe_paths(). */
+static int dtt_try_connect(struct drbd_transport *transport, struct dtt_path *path,
+			   struct socket **ret_socket, struct dtt_probe *probe)
 {
 	const char *what;
 	struct socket *socket;
@@ -445,11 +499,21 @@ static int dtt_try_connect(struct drbd_transport *transport, struct dtt_path *pa
 	if (err < 0)
 		goto out;
 
+	if (probe) {
+		write_lock_bh(&socket->sk->sk_callback_lock);
+		probe->original_sk_state_change = socket->sk->sk_state_change;
+		socket->sk->sk_state_change = dtt_probe_state_change;
+		socket->sk->sk_user_data = probe;
+		write_unlock_bh(&socket->sk->sk_callback_lock);
+	}
+
 	/* connect may fail, peer not yet available.
 	 * stay C_CONNECTING, don't go Disconnecting! */
 	what = "connect";
 	err = socket->ops->connect(socket, (struct sockaddr *) &peer_addr,
-				   path->path.peer_addr_len, 0);
+				   path->path.peer_addr_len, probe ? O_NONBLOCK : 0);
+	if (probe && err == -EINPROGRESS)
+		err = 0;
 	if (err < 0) {
 		switch (err) {
 		case -ETIMEDOUT:
@@ -482,6 +546,119 @@ out:
 	return err;
 }
 
+static bool dtt_probe_done(struct dtt_probe *probe)
+{
+	bool connecting = false;
+	unsigned int i;
+
+	for (i = 0; i < probe->nr; i++) {
+		struct socket *socket = probe->s[i].socket;
+
+		if (!socket)
+			continue;
+		if (socket->sk->sk_state == TCP_ESTABLISHED)
+			return true;
+		if (socket->sk->sk_state == TCP_SYN_SENT)
+			connecting = true;
+	}
+	return !connecting;
+}
+
+/**
+ * dtt_probe_paths() - Connect on all paths at once, the first one to succeed wins
+ * @transport:	DRBD transport.
+ * @ret_path:	the winning path.
+ * @ret_socket:	its socket, NULL if no path could be connected.
+ *
+ * One dead path does not hold up the others by the connect timeout.
+ */
+static int dtt_probe_paths(struct drbd_transport *transport, struct dtt_path **ret_path,
+			   struct socket **ret_socket)
+{
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct drbd_path *drbd_path;
+	struct dtt_probe *probe;
+	struct net_conf *nc;
+	unsigned long start;
+	unsigned int i, nr = 0;
+	int err = -EAGAIN, connect_int;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -EIO;
+	}
+	connect_int = nc->connect_int;
+	rcu_read_unlock();
+
+	spin_lock(&tcp_transport->paths_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list)
+		nr++;
+	spin_unlock(&tcp_transport->paths_lock);
+
+	probe = kzalloc(struct_size(probe, s, nr), GFP_KERNEL);
+	if (!probe)
+		return -ENOMEM;
+	init_waitqueue_head(&probe->wait);
+
+	spin_lock(&tcp_transport->paths_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		if (probe->nr == nr)
+			break;
+		kref_get(&drbd_path->kref);
+		probe->s[probe->nr++].path = container_of(drbd_path, struct dtt_path, path);
+	}
+	spin_unlock(&tcp_transport->paths_lock);
+
+	start = jiffies;
+	for (i = 0; i < probe->nr; i++) {
+		int err2 = dtt_try_connect(transport, probe->s[i].path, &probe->s[i].socket, probe);
+
+		/* a path that can not even start connecting does not stop the others */
+		if (err2 < 0 && err2 != -EAGAIN)
+			err = err2;
+	}
+
+	wait_event_interruptible_timeout(probe->wait, dtt_probe_done(probe), connect_int * HZ);
+
+	*ret_socket = NULL;
+	for (i = 0; i < probe->nr; i++) {
+		struct dtt_path *path = probe->s[i].path;
+		struct socket *socket = probe->s[i].socket;
+
+		if (!socket)
+			continue;
+
+		write_lock_bh(&socket->sk->sk_callback_lock);
+		socket->sk->sk_state_change = probe->original_sk_state_change;
+		socket->sk->sk_user_data = NULL;
+		write_unlock_bh(&socket->sk->sk_callback_lock);
+
+		if (!*ret_socket && socket->sk->sk_state == TCP_ESTABLISHED) {
+			path->connect_ms = jiffies_to_msecs(jiffies - start);
+			*ret_path = path;
+			*ret_socket = socket;
+			continue;
+		}
+		if (socket->sk->sk_state != TCP_ESTABLISHED)
+			path->connect_failures++;
+		kernel_sock_shutdown(socket, SHUT_RDWR);
+		sock_release(socket);
+	}
+	if (*ret_socket)
+		err = 0;
+
+	/* no state change callback may still be looking at the probe */
+	synchronize_rcu();
+	for (i = 0; i < probe->nr; i++)
+		kref_put(&probe->s[i].path->path.kref, drbd_destroy_path);
+	kfree(probe);
+
+	return err;
+}
+
 static int dtt_send_first_packet(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
 			     enum drbd_packet cmd, enum drbd_stream stream)
 {
@@ -882,6 +1059,7 @@ static int dtt_connect(struct drbd_transport *transport)
 	struct dtt_path *connect_to_path, *first_path = NULL;
 	struct socket *dsocket, *csocket;
 	struct net_conf *nc;
+	unsigned long first_jif = 0;
 	int timeout, err;
 	bool ok;
 
@@ -929,7 +1107,11 @@ static int dtt_connect(struct drbd_transport *transport)
 	do {
 		struct socket *s = NULL;
 
-		err = dtt_try_connect(transport, connect_to_path, &s);
+		/* the second socket goes to the path of the first */
+		if (first_path)
+			err = dtt_try_connect(transport, connect_to_path, &s, NULL);
+		else
+			err = dtt_probe_paths(transport, &connect_to_path, &s);
 		if (err < 0 && err != -EAGAIN)
 			goto out;
 
@@ -942,6 +1124,8 @@ static int dtt_connect(struct drbd_transport *transport)
 				dtt_socket_free(&csocket);
 			}
 
+			if (first_path != connect_to_path)
+				first_jif = jiffies;
 			first_path = connect_to_path;
 
 			if (!dsocket && !csocket) {
@@ -985,6 +1169,8 @@ retry:
 				dtt_socket_free(&csocket);
 			}
 
+			if (first_path != connect_to_path)
+				first_jif = jiffies;
 			first_path = connect_to_path;
 
 			dtt_socket_ok_or_free(&dsocket);
@@ -1028,6 +1214,8 @@ randomize:
 	} while (!ok);
 
 	TR_ASSERT(transport, first_path == connect_to_path);
+	connect_to_path->connects++;
+	connect_to_path->handshake_ms = jiffies_to_msecs(jiffies - first_jif);
 	connect_to_path->path.established = true;
 	drbd_path_event(transport, &connect_to_path->path);
 	dtt_put_listeners(transport);
@@ -1066,6 +1254,10 @@ randomize:
 
 	sock_set_keepalive(dsocket->sk);
 
+	mutex_lock(&dtt_established_mutex);
+	list_add_tail(&tcp_transport->established, &dtt_established);
+	mutex_unlock(&dtt_established_mutex);
+
 	return 0;
 
 out_eagain:
@@ -1130,6 +1322,90 @@ static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport)
 	sock = socket->sk;
 	if (sock->sk_wmem_queued > sock->sk_sndbuf * 4 / 5)
 		set_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+
+	dtt_autotune(tcp_transport);
+}
+
+/* A buffer twice the bandwidth delay product keeps the pipe full, half of
+ * it goes to skb overhead.  A buffer that is the limit itself hides the
+ * bandwidth behind it, so a full one is doubled instead. */
+static unsigned int dtt_autotune_size(u64 bdp, unsigned int cur, bool full,
+				      unsigned int floor, unsigned int max)
+{
+	u64 size = 2 * bdp;
+
+	if (full)
+		size = max_t(u64, size, 2ULL * cur);
+	floor = min(max_t(unsigned int, floor, SOCK_MIN_SNDBUF), max);
+	return clamp_t(u64, size, floor, max);
+}
+
+/**
+ * dtt_autotune() - Size the data socket buffers from RTT and bandwidth
+ * @tcp_transport:	TCP transport.
+ *
+ * Called from the send and receive paths, does its work at most four times
+ * a second.  The send buffer follows the delivery rate and smoothed RTT of
+ * the sender, the receive buffer what the receiver copied out per RTT.
+ */
+static void dtt_autotune(struct drbd_tcp_transport *tcp_transport)
+{
+	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	unsigned long next = READ_ONCE(tcp_transport->autotune_jif);
+	unsigned int max = dtt_autotune_max_kb << 10;
+	unsigned int snd_floor, rcv_floor, snd, rcv;
+	struct net_conf *nc;
+	struct tcp_sock *tp;
+	struct sock *sk;
+	u64 rate = 0, bdp;
+	u32 rtt_us;
+
+	if (!max || !socket || time_before(jiffies, next) ||
+	    cmpxchg(&tcp_transport->autotune_jif, next, jiffies + HZ / 4) != next)
+		return;
+
+	rcu_read_lock();
+	nc = rcu_dereference(tcp_transport->transport.net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return;
+	}
+	snd_floor = nc->sndbuf_size;
+	rcv_floor = nc->rcvbuf_size;
+	rcu_read_unlock();
+
+	sk = socket->sk;
+	tp = tcp_sk(sk);
+	lock_sock(sk);
+	rtt_us = tp->srtt_us >> 3;
+	if (tp->rate_interval_us)
+		rate = div_u64((u64)tp->rate_delivered * tp->mss_cache * USEC_PER_SEC,
+			       tp->rate_interval_us);
+	bdp = max_t(u64, div_u64(rate * rtt_us, USEC_PER_SEC), (u64)tp->snd_cwnd * tp->mss_cache);
+	snd = dtt_autotune_size(bdp, sk->sk_sndbuf,
+				sk->sk_wmem_queued > sk->sk_sndbuf * 4 / 5, snd_floor, max);
+
+	/* bytes the receiver copied out in its last RTT measurement interval */
+	bdp = tp->rcvq_space.space;
+	rcv = dtt_autotune_size(bdp, sk->sk_rcvbuf,
+				tp->rcv_nxt - tp->copied_seq > sk->sk_rcvbuf / 2, rcv_floor, max);
+
+	if (snd != sk->sk_sndbuf) {
+		WRITE_ONCE(sk->sk_sndbuf, snd);
+		sk->sk_userlocks |= SOCK_SNDBUF_LOCK;
+		sk->sk_write_space(sk);
+	}
+	if (rcv != sk->sk_rcvbuf) {
+		WRITE_ONCE(sk->sk_rcvbuf, rcv);
+		sk->sk_userlocks |= SOCK_RCVBUF_LOCK;
+		/* As tcp_rcv_space_adjust() does, which the lock turns off;
+		 * the advertised window never exceeds window_clamp. */
+		WRITE_ONCE(tp->window_clamp, tcp_win_from_space(sk, rcv));
+	}
+	release_sock(sk);
+
+	tcp_transport->autotune_rtt_us = rtt_us;
+	tcp_transport->autotune_rate = rate;
 }
 
 static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
@@ -1245,16 +1521,37 @@ static void dtt_debugfs_show_stream(struct seq_file *m, struct socket *socket)
 		   tp->write_seq - tp->snd_una);
 	seq_printf(m, "send buffer size: %u Byte\n", sk->sk_sndbuf);
 	seq_printf(m, "send buffer used: %u Byte\n", sk->sk_wmem_queued);
+	seq_printf(m, "receive buffer size: %u Byte\n", sk->sk_rcvbuf);
 }
 
 static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
 {
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
+	struct drbd_path *drbd_path;
 	enum drbd_stream i;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 2);
+
+	spin_lock(&tcp_transport->paths_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		struct dtt_path *path = container_of(drbd_path, struct dtt_path, path);
+
+		seq_printf(m, "path %pISpc -> %pISpc%s\n", &drbd_path->my_addr, &drbd_path->peer_addr,
+			   drbd_path->established ? " established" : "");
+		seq_printf(m, "connects: %u failed: %u last connect: %u ms handshake: %u ms\n",
+			   path->connects, path->connect_failures,
+			   path->connect_ms, path->handshake_ms);
+	}
+	spin_unlock(&tcp_transport->paths_lock);
+	seq_putc(m, '\n');
+
+	if (dtt_autotune_max_kb)
+		seq_printf(m, "autotune: rtt %u us, rate %llu Byte/s, max %u KiB\n\n",
+			   tcp_transport->autotune_rtt_us,
+			   (unsigned long long)tcp_transport->autotune_rate,
+			   dtt_autotune_max_kb);
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
 		struct socket *socket = tcp_transport->stream[i];
@@ -1315,16 +1612,80 @@ static int dtt_remove_path(struct drbd_transport *transport, struct drbd_path *d
 	return 0;
 }
 
+static bool dtt_stream_uses_dev(struct socket *socket, struct net_device *dev)
+{
+	struct dst_entry *dst;
+	bool rv;
+
+	if (!socket)
+		return false;
+	dst = sk_dst_get(socket->sk);
+	rv = dst && dst->dev == dev;
+	dst_release(dst);
+	return rv;
+}
+
+/* A connection over a device that lost its link or went down fails right
+ * away, instead of after the ping timeout, if it can reconnect over another
+ * path.  dtt_probe_paths() finds the one still working. */
+static int dtt_netdev_event(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+	struct drbd_tcp_transport *tcp_transport;
+
+	if (!(event == NETDEV_DOWN || (event == NETDEV_CHANGE && !netif_carrier_ok(dev))))
+		return NOTIFY_DONE;
+
+	mutex_lock(&dtt_established_mutex);
+	list_for_each_entry(tcp_transport, &dtt_established, established) {
+		struct drbd_transport *transport = &tcp_transport->transport;
+		bool other_path;
+		enum drbd_stream i;
+
+		spin_lock(&tcp_transport->paths_lock);
+		other_path = !list_is_singular(&transport->paths);
+		spin_unlock(&tcp_transport->paths_lock);
+
+		if (!other_path ||
+		    !(dtt_stream_uses_dev(tcp_transport->stream[DATA_STREAM], dev) ||
+		      dtt_stream_uses_dev(tcp_transport->stream[CONTROL_STREAM], dev)))
+			continue;
+
+		tr_warn(transport, "%s lost its link, reconnecting over another path\n", dev->name);
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+			if (tcp_transport->stream[i])
+				kernel_sock_shutdown(tcp_transport->stream[i], SHUT_RDWR);
+		}
+	}
+	mutex_unlock(&dtt_established_mutex);
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block dtt_netdev_notifier = {
+	.notifier_call = dtt_netdev_event,
+};
+
 static int __init dtt_initialize(void)
 {
-	return drbd_register_transport_class(&tcp_transport_class,
-					     DRBD_TRANSPORT_API_VERSION,
-					     sizeof(struct drbd_transport));
+	int err;
+
+	err = register_netdevice_notifier(&dtt_netdev_notifier);
+	if (err)
+		return err;
+
+	err = drbd_register_transport_class(&tcp_transport_class,
+					    DRBD_TRANSPORT_API_VERSION,
+					    sizeof(struct drbd_transport));
+	if (err)
+		unregister_netdevice_notifier(&dtt_netdev_notifier);
+	return err;
 }
 
 static void __exit dtt_cleanup(void)
 {
 	drbd_unregister_transport_class(&tcp_transport_class);
+	unregister_netdevice_notifier(&dtt_netdev_notifier);
 }
 
 module_init(dtt_initialize)
@@ -124,15 +124,17 @@ write intent log information, three of which are mentioned here.
  * region number (label) easily.  To do the label -> object lookup without a
  * full list walk, we use a simple hash table.
  *
- * .list is on one of three lists:
+ * .list is on one of four lists:
  *  in_use: currently in use (refcnt > 0, lc_number != LC_FREE)
  *     lru: unused but ready to be reused or recycled
  *          (lc_refcnt == 0, lc_number != LC_FREE),
+ *  lru_protected: like lru, but only used with LC_SEGMENTED_LRU,
+ *          for elements that have been re-referenced (lc_protected),
  *    free: unused but ready to be recycled
  *          (lc_refcnt == 0, lc_number == LC_FREE),
  *
  * an element is said to be "in the active set",
- * if either on "in_use" or "lru", i.e. lc_number != LC_FREE.
+ * if either on "in_use", "lru" or "lru_protected", i.e. lc_number != LC_FREE.
  *
  * DRBD currently (May 2009) only uses 61 elements on the resync lru_cache
  * (total memory usage 2 pages), and up to 3833 elements on the act_log
@@ -159,11 +161,28 @@ struct lc_element {
 
 	/* for pending changes */
 	unsigned lc_new_number;
+
+	/* LC_SEGMENTED_LRU only: lc->misses at the time of the last reference,
+	 * and whether this element made it into the protected segment */
+	unsigned long lc_last_ref;
+	bool lc_protected;
+};
+
+/* replacement policy of an lru_cache, see lc_set_policy() */
+enum lc_policy {
+	/* plain LRU, evict the least recently used unused element */
+	LC_LRU,
+	/* segmented LRU: elements only referenced in one burst are evicted
+	 * before elements that have been referenced again after other misses
+	 * happened in between.  Keeps hot elements in the active set while
+	 * one-pass scans stream through it. */
+	LC_SEGMENTED_LRU,
 };
 
 struct lru_cache {
 	/* the least recently used item is kept at lru->prev */
 	struct list_head lru;
+	struct list_head lru_protected;
 	struct list_head free;
 	struct list_head in_use;
 	struct list_head to_be_changed;
@@ -191,9 +210,19 @@ struct lru_cache {
 	/* number of elements currently on to_be_changed list */
 	unsigned int pending_changes;
 
+	enum lc_policy policy;
+	/* number of elements with lc_protected set */
+	unsigned int nr_protected;
+
+	/* number of elements not on the free list */
+	unsigned int active;
+	/* soft limit for "active", see lc_set_active_limit() */
+	unsigned int active_limit;
+
 	/* statistics */
 	unsigned used; /* number of elements currently on in_use list */
 	unsigned long hits, misses, starving, locked, changed;
+	unsigned long promoted, trimmed;
 
 	/* see below: flag-bits for lru_cache */
 	unsigned long flags;
@@ -243,6 +272,9 @@ extern void lc_reset(struct lru_cache *lc);
 extern void lc_destroy(struct lru_cache *lc);
 extern void lc_set(struct lru_cache *lc, unsigned int enr, int index);
 extern void lc_del(struct lru_cache *lc, struct lc_element *element);
+extern void lc_set_policy(struct lru_cache *lc, enum lc_policy policy);
+extern void lc_set_active_limit(struct lru_cache *lc, unsigned int limit);
+extern unsigned int lc_trim(struct lru_cache *lc, unsigned int nr);
 
 extern struct lc_element *lc_get_cumulative(struct lru_cache *lc, unsigned int enr);
 extern struct lc_element *lc_try_get(struct lru_cache *lc, unsigned int enr);
@@ -98,6 +98,7 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 
 	INIT_LIST_HEAD(&lc->in_use);
 	INIT_LIST_HEAD(&lc->lru);
+	INIT_LIST_HEAD(&lc->lru_protected);
 	INIT_LIST_HEAD(&lc->free);
 	INIT_LIST_HEAD(&lc->to_be_changed);
 
@@ -105,6 +106,7 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	lc->element_size = e_size;
 	lc->element_off = e_off;
 	lc->nr_elements = e_count;
+	lc->active_limit = e_count;
 	lc->max_pending_changes = max_pending_changes;
 	lc->lc_cache = cache;
 	lc->lc_element = element;
@@ -177,6 +179,7 @@ void lc_reset(struct lru_cache *lc)
 
 	INIT_LIST_HEAD(&lc->in_use);
 	INIT_LIST_HEAD(&lc->lru);
+	INIT_LIST_HEAD(&lc->lru_protected);
 	INIT_LIST_HEAD(&lc->free);
 	INIT_LIST_HEAD(&lc->to_be_changed);
 	lc->used = 0;
@@ -185,7 +188,11 @@ void lc_reset(struct lru_cache *lc)
 	lc->starving = 0;
 	lc->locked = 0;
 	lc->changed = 0;
+	lc->promoted = 0;
+	lc->trimmed = 0;
 	lc->pending_changes = 0;
+	lc->nr_protected = 0;
+	lc->active = 0;
 	lc->flags = 0;
 	memset(lc->lc_slot, 0, sizeof(struct hlist_head) * lc->nr_elements);
 
@@ -216,9 +223,14 @@ void lc_seq_printf_stats(struct seq_file *seq, struct lru_cache *lc)
 	 * progress) and "changed", when this in fact lead to an successful
 	 * update of the cache.
 	 */
-	seq_printf(seq, "\t%s: used:%u/%u hits:%lu misses:%lu starving:%lu locked:%lu changed:%lu\n",
+	seq_printf(seq, "\t%s: used:%u/%u hits:%lu misses:%lu starving:%lu locked:%lu changed:%lu",
 		   lc->name, lc->used, lc->nr_elements,
 		   lc->hits, lc->misses, lc->starving, lc->locked, lc->changed);
+	if (lc->policy != LC_LRU || lc->active_limit != lc->nr_elements)
+		seq_printf(seq, " active:%u/%u protected:%u promoted:%lu trimmed:%lu",
+			   lc->active, lc->active_limit, lc->nr_protected,
+			   lc->promoted, lc->trimmed);
+	seq_putc(seq, '\n');
 }
 
 static struct hlist_head *lc_hash_slot(struct lru_cache *lc, unsigned int enr)
@@ -279,6 +291,35 @@ bool lc_is_used(struct lru_cache *lc, unsigned int enr)
 	return e && e->refcnt;
 }
 
+/* the protected segment may use up to 3/4 of the active set,
+ * so there is always some room for new elements to prove themselves */
+static unsigned int lc_max_protected(struct lru_cache *lc)
+{
+	return lc->active_limit - lc->active_limit / 4;
+}
+
+static void lc_unprotect(struct lru_cache *lc, struct lc_element *e)
+{
+	if (e->lc_protected) {
+		e->lc_protected = false;
+		lc->nr_protected--;
+	}
+}
+
+/* Keep the protected segment within its bounds.  Unused elements falling
+ * off its end get another chance at the front of the probationary segment. */
+static void lc_demote_protected(struct lru_cache *lc)
+{
+	struct lc_element *e;
+
+	while (lc->nr_protected > lc_max_protected(lc) &&
+	       !list_empty(&lc->lru_protected)) {
+		e = list_entry(lc->lru_protected.prev, struct lc_element, list);
+		lc_unprotect(lc, e);
+		list_move(&e->list, &lc->lru);
+	}
+}
+
 /**
  * lc_del - removes an element from the cache
  * @lc: The lru_cache object
@@ -293,27 +334,77 @@ void lc_del(struct lru_cache *lc, struct lc_element *e)
 	PARANOIA_LC_ELEMENT(lc, e);
 	BUG_ON(e->refcnt);
 
+	if (e->lc_number != LC_FREE)
+		lc->active--;
+	lc_unprotect(lc, e);
 	e->lc_number = e->lc_new_number = LC_FREE;
 	hlist_del_init(&e->colision);
 	list_move(&e->list, &lc->free);
 	RETURN();
 }
 
+/**
+ * lc_set_policy - choose the replacement policy of @lc
+ * @lc: The lru_cache object
+ * @policy: %LC_LRU or %LC_SEGMENTED_LRU
+ *
+ * Only allowed while nothing is in the active set, i.e. right after
+ * lc_create() or lc_reset().
+ */
+void lc_set_policy(struct lru_cache *lc, enum lc_policy policy)
+{
+	WARN_ON(lc->active);
+	lc->policy = policy;
+}
+
+/**
+ * lc_set_active_limit - set a soft limit for the size of the active set
+ * @lc: The lru_cache object
+ * @limit: number of elements, clamped to [1, nr_elements]
+ *
+ * Once the active set reached @limit elements, changes recycle unused
+ * elements from the lru lists instead of pulling in free ones.  Only if
+ * there is nothing to recycle, the active set grows beyond @limit, so
+ * the limit never causes starvation.  Use lc_trim() to actually shrink the
+ * active set down to a lowered limit.
+ */
+void lc_set_active_limit(struct lru_cache *lc, unsigned int limit)
+{
+	lc->active_limit = clamp(limit, 1U, lc->nr_elements);
+}
+
+/* Pick an element to be recycled.  Free elements first, as long as the
+ * active set is below its limit.  Then the least recently used element of
+ * the probationary segment, then that of the protected segment. */
+static struct list_head *lc_pick_victim(struct lru_cache *lc)
+{
+	if (!list_empty(&lc->free) && lc->active < lc->active_limit)
+		return lc->free.next;
+	if (!list_empty(&lc->lru))
+		return lc->lru.prev;
+	if (!list_empty(&lc->lru_protected))
+		return lc->lru_protected.prev;
+	if (!list_empty(&lc->free))
+		return lc->free.next;
+	return NULL;
+}
+
 static struct lc_element *lc_prepare_for_change(struct lru_cache *lc, unsigned new_number)
 {
 	struct list_head *n;
 	struct lc_element *e;
 
-	if (!list_empty(&lc->free))
-		n = lc->free.next;
-	else if (!list_empty(&lc->lru))
-		n = lc->lru.prev;
-	else
+	n = lc_pick_victim(lc);
+	if (!n)
 		return NULL;
 
 	e = list_entry(n, struct lc_element, list);
 	PARANOIA_LC_ELEMENT(lc, e);
 
+	if (e->lc_number == LC_FREE)
+		lc->active++;
+	lc_unprotect(lc, e);
+	e->lc_last_ref = lc->misses;
 	e->lc_new_number = new_number;
 	if (!hlist_unhashed(&e->colision))
 		__hlist_del(&e->colision);
@@ -327,7 +418,7 @@ static int lc_unused_element_available(struct lru_cache *lc)
 {
 	if (!list_empty(&lc->free))
 		return 1; /* something on the free list */
-	if (!list_empty(&lc->lru))
+	if (!list_empty(&lc->lru) || !list_empty(&lc->lru_protected))
 		return 1;  /* something to evict */
 
 	return 0;
@@ -370,6 +461,16 @@ static struct lc_element *__lc_get(struct lru_cache *lc, unsigned int enr, unsig
 		}
 		/* else: lc_new_number == lc_number; a real hit. */
 		++lc->hits;
+		/* Referenced again, after other elements have been pulled in
+		 * since its last reference: more than a single burst of
+		 * activity, protect it from being evicted by a scan. */
+		if (lc->policy == LC_SEGMENTED_LRU && !e->lc_protected &&
+		    e->lc_last_ref != lc->misses) {
+			e->lc_protected = true;
+			lc->nr_protected++;
+			lc->promoted++;
+		}
+		e->lc_last_ref = lc->misses;
 		if (e->refcnt++ == 0)
 			lc->used++;
 		list_move(&e->list, &lc->in_use); /* Not evictable... */
@@ -521,6 +622,12 @@ void lc_committed(struct lru_cache *lc)
 		/* count number of changes, not number of transactions */
 		++lc->changed;
 		e->lc_number = e->lc_new_number;
+		if (e->lc_number == LC_FREE) {
+			/* trimmed, see lc_trim() */
+			list_move(&e->list, &lc->free);
+			lc->active--;
+			continue;
+		}
 		list_move(&e->list, &lc->in_use);
 	}
 	lc->pending_changes = 0;
@@ -545,13 +652,60 @@ unsigned int lc_put(struct lru_cache *lc, struct lc_element *e)
 	BUG_ON(e->lc_number != e->lc_new_number);
 	if (--e->refcnt == 0) {
 		/* move it to the front of LRU. */
-		list_move(&e->list, &lc->lru);
+		if (e->lc_protected) {
+			list_move(&e->list, &lc->lru_protected);
+			lc_demote_protected(lc);
+		} else
+			list_move(&e->list, &lc->lru);
 		lc->used--;
 		clear_bit_unlock(__LC_STARVING, &lc->flags);
 	}
 	RETURN(e->refcnt);
 }
 
+/**
+ * lc_trim - shrink the active set towards its soft limit
+ * @lc: the lru cache to operate on
+ * @nr: maximum number of elements to remove from the active set
+ *
+ * Queues up to @nr unused elements, least recently used first, on the
+ * "to_be_changed" list with a new label of %LC_FREE.  They are moved to the
+ * free list by the next lc_committed(), so the removal is recorded by the
+ * same transaction as the other pending changes.  Bounded by
+ * max_pending_changes.  Caller must hold the transaction lock, see
+ * lc_try_lock_for_transaction().
+ * Returns the number of elements queued for removal.
+ */
+unsigned int lc_trim(struct lru_cache *lc, unsigned int nr)
+{
+	struct list_head *n;
+	struct lc_element *e;
+	unsigned int i = 0;
+
+	PARANOIA_ENTRY();
+	BUG_ON(!test_bit(__LC_LOCKED, &lc->flags));
+	while (i < nr && lc->pending_changes < lc->max_pending_changes) {
+		if (!list_empty(&lc->lru))
+			n = lc->lru.prev;
+		else if (!list_empty(&lc->lru_protected))
+			n = lc->lru_protected.prev;
+		else
+			break;
+
+		e = list_entry(n, struct lc_element, list);
+		lc_unprotect(lc, e);
+		/* not found by lookups anymore; a lc_get() for its old label
+		 * is a miss, which cannot proceed while we are locked. */
+		hlist_del_init(&e->colision);
+		e->lc_new_number = LC_FREE;
+		list_move(&e->list, &lc->to_be_changed);
+		lc->pending_changes++;
+		lc->trimmed++;
+		i++;
+	}
+	RETURN(i);
+}
+
 /**
  * lc_element_by_index
  * @lc: the lru cache to operate on
@@ -596,6 +750,11 @@ void lc_set(struct lru_cache *lc, unsigned int enr, int index)
 	BUG_ON(e->lc_number != e->lc_new_number);
 	BUG_ON(e->refcnt != 0);
 
+	if (e->lc_number == LC_FREE && enr != LC_FREE)
+		lc->active++;
+	else if (e->lc_number != LC_FREE && enr == LC_FREE)
+		lc->active--;
+	lc_unprotect(lc, e);
 	e->lc_number = e->lc_new_number = enr;
 	hlist_del_init(&e->colision);
 	if (enr == LC_FREE)